@@ -0,0 +1,109 @@
+// ================================================================
+// SAMPLE AGGREGATOR
+// ================================================================
+// Folds raw readings into fixed windows between the sampler and the
+// ring, so the sensor can be polled every second while the uplink and
+// the SD log only see one record per window. Each record carries the
+// last value of every field plus min / max / mean, the number of
+// readings and, for fields holding alarm statuses, how often the
+// alarm changed state.
+//
+// Report-by-exception: a closed window is only queued if some field
+// left its deadband around the mean last reported, an alarm changed,
+// the set of fields changed, or the heartbeat expired. A deadband of
+// 0 reports that field every window.
+//
+// JSON form (BLE "agg" key, NVS app_conf/agg):
+//   {"w":60,"hb":900,"db":[0.5,0,0,0,0,0],"al":[5,6]}
+//   w  window in s (0 = off, every reading is uploaded)
+//   hb heartbeat in s: report at least this often (0 = never forced)
+//   db deadband per field in engineering units (field1 first)
+//   al alarm status fields (1-based)
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#include "payload_builder.h"
+#include "sample.h"
+
+const uint16_t AGG_MAX_WINDOW = 3600;
+const uint16_t AGG_MAX_HEARTBEAT = 43200;
+
+struct AggregateSettings {
+    uint16_t windowS;
+    uint16_t heartbeatS;
+    float    deadband[SAMPLE_MAX_FIELDS];
+    uint8_t  alarmMask;     // Bit i set: field i is an alarm status
+
+    // Aggregation off
+    void setDefault();
+
+    // On failure the settings are unchanged and `error` says why
+    bool fromJson(JsonObjectConst obj, String& error);
+    void toJson(JsonObject obj) const;
+};
+
+// How appendWindowStats() renders the window part of a record
+enum StatsFormat {
+    STATS_QUERY,   // &n=60&w=60&min1=..&max1=..&avg1=..&al5=2
+    STATS_CSV,     // ,n=60,w=60,min1=.. (after the CSV fields)
+    STATS_JSON     // ,"n":60,"w":60,"min1":.. (inside an object)
+};
+
+// Appends the statistics of an aggregate record; does nothing for a
+// plain reading. Alarm counts are only written when non-zero.
+void appendWindowStats(PayloadBuilder& out, const Sample& sample, StatsFormat format);
+
+// Appends "ev=1" and the milliseconds of an alarm event record; does
+// nothing for a reading taken on the sample grid
+void appendEventInfo(PayloadBuilder& out, const Sample& sample, StatsFormat format);
+
+class Aggregator {
+public:
+    // Drops any open window; call flush() first to keep it
+    void configure(const AggregateSettings& settings);
+    bool enabled() const { return cfg.windowS > 0; }
+
+    // Folds one reading in. When `reading` lands past the end of the
+    // open window, that window is closed first; returns true if it is
+    // to be reported, with the record in `out`. The reading then
+    // starts the next window.
+    bool add(const Sample& reading, uint32_t nowMs, Sample& out);
+
+    // Closes the open window early, bypassing the deadband. Returns
+    // false if it held no readings.
+    bool flush(uint32_t nowMs, Sample& out);
+
+    // Back-dates an open window that started before the clock was set
+    void backdate(uint32_t bootEpoch) { if (active) sampleBackdate(acc, bootEpoch); }
+
+    uint32_t suppressedCount() const { return suppressed; }
+
+private:
+    void open(const Sample& reading, uint32_t nowMs);
+    void fold(const Sample& reading);
+    void close(uint32_t nowMs, Sample& out);
+    bool worthReporting(const Sample& rec, uint32_t nowMs) const;
+    void markReported(const Sample& rec, uint32_t nowMs);
+
+    AggregateSettings cfg = {};
+
+    // Open window
+    bool active = false;
+    uint32_t startMs = 0;
+    Sample acc = {};                     // Last values, timestamp and flags
+    uint32_t sum[SAMPLE_MAX_FIELDS];
+    uint16_t seen[SAMPLE_MAX_FIELDS];    // Readings per field
+
+    // Carried across windows
+    uint8_t alarmState = 0;              // Bit i: field i was non-zero
+    uint8_t alarmKnown = 0;              // Bit i: alarmState bit is valid
+    bool reportedOnce = false;
+    uint32_t reportedMs = 0;
+    uint8_t reportedMask = 0;
+    uint16_t reportedMean[SAMPLE_MAX_FIELDS];
+
+    uint32_t suppressed = 0;
+};
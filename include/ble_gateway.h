@@ -0,0 +1,101 @@
+// ================================================================
+// BLE SENSOR GATEWAY
+// ================================================================
+// Picks readings out of BLE sensor advertisements (thermometers,
+// vibration beacons) next to the Modbus controller, with no
+// connections. NimBLE scans passively in the central role alongside
+// the phone-facing peripheral. The sampler merges the latest value of
+// each sensor into fields the Modbus poll table leaves empty, so BLE
+// readings go through the same ring, batching and SD log.
+//
+// Scanning shares the radio with Wi-Fi, so it only runs for
+// BLE_GW_LEAD_MS before each sample slot (beacons advertise every
+// second or so). With short intervals it runs all the time.
+//
+// JSON form (BLE "ble" key, NVS app_conf/ble):
+//   [{"m":"a4:c1:38:12:34:56","t":0,"o":2,"f":7,"dp":2}, ...]
+//   m  MAC filter (omit for any sender)
+//   t  0 = BTHome v2 (service data FCD2, `o` is the object id)
+//      1 = service data of UUID `u`, uint16 LE at byte `o`
+//      2 = manufacturer data of company `u`, uint16 LE at byte `o`
+//   u  16-bit service UUID or company id, hex ("181a")
+//   f  uplink field (1-based)     dp decimal places (value = raw / 10^dp)
+//
+// Values are 16-bit registers like the Modbus ones, so negative
+// readings arrive as two's complement. Encrypted BTHome packets are
+// skipped.
+//
+// Entries are read by the NimBLE host task and the sampler and
+// replaced by the config task; a spinlock guards them.
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <NimBLEDevice.h>
+
+#include "sample.h"
+
+const uint8_t BLE_GW_MAX_SENSORS = 4;
+const uint32_t BLE_GW_LEAD_MS = 4000;        // Scan this long before each slot
+const uint16_t BLE_GW_SCAN_INTERVAL = 160;   // 100 ms, in 0.625 ms units
+const uint16_t BLE_GW_SCAN_WINDOW = 48;      // 30 ms of each interval
+
+enum BleSensorFormat : uint8_t {
+    BLE_FMT_BTHOME,
+    BLE_FMT_SERVICE,
+    BLE_FMT_MANUFACTURER
+};
+
+struct BleSensorEntry {
+    uint8_t  mac[6];      // As written ("a4:..." is mac[0])
+    bool     anyMac;
+    uint8_t  format;
+    uint16_t uuid;        // Service UUID or company id
+    uint8_t  offset;      // BTHome object id, or data byte offset
+    uint8_t  field;       // 0-based
+    uint8_t  decimals;
+};
+
+class BleGateway : public NimBLEAdvertisedDeviceCallbacks {
+public:
+    // Empty table: no scanning
+    void setDefault();
+
+    // Replaces the table from JSON. On failure the table is unchanged
+    // and `error` says why.
+    bool fromJson(JsonArrayConst arr, String& error);
+    void toJson(JsonArray arr);
+
+    // Hooks into the NimBLE scanner; BLE must be initialised
+    void begin();
+
+    // Config task tick: starts and stops the scan around the sample
+    // slot due at `nextSlotMs` (millis() time)
+    void service(uint32_t nowMs, uint32_t nextSlotMs, uint32_t intervalMs);
+
+    // Sampler: sets fields the sample does not have yet from readings
+    // at most `maxAgeMs` old. True if any field was set.
+    bool merge(Sample& sample, uint32_t nowMs, uint32_t maxAgeMs);
+
+    uint8_t size() const { return count; }
+    uint32_t advertCount() const { return adverts; }
+
+    void onResult(NimBLEAdvertisedDevice* device) override;
+
+    // One value out of a raw advertising payload (AD structures)
+    static bool parseAdvert(const BleSensorEntry& e, const uint8_t* adv, size_t len, uint16_t& value);
+
+private:
+    BleSensorEntry entries[BLE_GW_MAX_SENSORS];
+    uint8_t count = 0;
+
+    uint16_t latest[BLE_GW_MAX_SENSORS];
+    uint32_t seenAt[BLE_GW_MAX_SENSORS];
+    uint8_t seenMask = 0;
+    uint32_t adverts = 0;   // Matching adverts decoded
+
+    bool started = false;
+    bool scanning = false;
+    portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
@@ -0,0 +1,117 @@
+// ================================================================
+// BLE BINARY PROTOCOL
+// ================================================================
+// Compact command/response framing for the binary characteristic,
+// used alongside the JSON characteristic by newer apps.
+//
+// Request:  op, seq, body
+// Response: op | BP_RESPONSE, seq, status, body
+//
+// Bodies are TLV lists (tag, len, value...) with little-endian
+// integers, except GET_CONF whose request body is a bare list of the
+// tags wanted (empty = all). A response that does not fit the MTU
+// carries what fits and BP_STATUS_PARTIAL; the app asks again for the
+// missing tags.
+
+#pragma once
+
+#include <Arduino.h>
+
+// Opcodes
+const uint8_t BP_OP_PING     = 0x01;  // Answered on the host task, no body
+const uint8_t BP_OP_GET_CONF = 0x02;
+const uint8_t BP_OP_SET      = 0x03;  // Body: config TLVs
+const uint8_t BP_OP_STATUS   = 0x04;
+const uint8_t BP_OP_LIVE     = 0x05;  // Latest reading
+const uint8_t BP_OP_STREAM   = 0x06;  // Body: BP_TAG_DECIMATION
+const uint8_t BP_OP_SCAN     = 0x07;  // Wi-Fi scan; answered by PARTIAL frames, then OK
+const uint8_t BP_RESPONSE    = 0x80;
+
+// Status codes
+const uint8_t BP_STATUS_OK         = 0x00;
+const uint8_t BP_STATUS_BAD_OP     = 0x01;
+const uint8_t BP_STATUS_BAD_FRAME  = 0x02;
+const uint8_t BP_STATUS_BAD_VALUE  = 0x03;  // Body: the offending tag (u8)
+const uint8_t BP_STATUS_PARTIAL    = 0x04;
+const uint8_t BP_STATUS_NO_DATA    = 0x05;
+const uint8_t BP_STATUS_FAILED     = 0x06;
+
+// Config tags (GET_CONF / SET)
+const uint8_t BP_TAG_ID   = 0x01;  // str
+const uint8_t BP_TAG_URL  = 0x02;  // str
+const uint8_t BP_TAG_NTP  = 0x03;  // str
+const uint8_t BP_TAG_INT  = 0x04;  // u32, seconds
+const uint8_t BP_TAG_MODE = 0x05;  // u8
+const uint8_t BP_TAG_SP1  = 0x06;  // f32
+const uint8_t BP_TAG_SP2  = 0x07;  // f32
+const uint8_t BP_TAG_BULK = 0x08;  // u8
+const uint8_t BP_TAG_BMAX = 0x09;  // u16
+const uint8_t BP_TAG_TX   = 0x0A;  // u8, 0 = HTTP, 1 = MQTT
+const uint8_t BP_TAG_MQH  = 0x0B;  // str, broker URL
+const uint8_t BP_TAG_MQU  = 0x0C;  // str
+const uint8_t BP_TAG_MQK  = 0x0D;  // str, SET only
+const uint8_t BP_TAG_MQT  = 0x0E;  // str, topic prefix
+const uint8_t BP_TAG_BENC = 0x0F;  // u8, 0 = CSV, 1 = x-sample-delta batches
+
+// Status tags
+const uint8_t BP_TAG_WIFI       = 0x20;  // u8, 1 = connected
+const uint8_t BP_TAG_RSSI       = 0x21;  // i8, dBm
+const uint8_t BP_TAG_IP         = 0x22;  // u32, network order bytes
+const uint8_t BP_TAG_RING       = 0x23;  // u32, readings held in RAM
+const uint8_t BP_TAG_SD_PENDING = 0x24;  // u32, readings in the SD log
+const uint8_t BP_TAG_UPTIME     = 0x25;  // u32, seconds
+
+// Live tags
+const uint8_t BP_TAG_SAMPLE = 0x30;  // u32 timestamp, u8 field mask, u16 decimals,
+                                     // then a u16 per set field, lowest first
+
+// Scan tags
+const uint8_t BP_TAG_AP = 0x40;  // i8 rssi, u8 channel, u8 auth, ssid bytes
+
+// Stream tags
+const uint8_t BP_TAG_DECIMATION = 0x31;  // u8, keep every Nth poll (0 = stop)
+
+const size_t BP_HEADER_LEN = 3;      // Response op, seq, status
+
+class TlvWriter {
+public:
+    TlvWriter(uint8_t* buf, size_t cap) : buf(buf), cap(cap) {}
+
+    // Each put returns false (and writes nothing) if the TLV does not
+    // fit; overflowed() then reports that something was left out.
+    bool put(uint8_t tag, const void* value, uint8_t len);
+    bool putU8(uint8_t tag, uint8_t v) { return put(tag, &v, 1); }
+    bool putU16(uint8_t tag, uint16_t v);
+    bool putU32(uint8_t tag, uint32_t v);
+    bool putF32(uint8_t tag, float v);
+    bool putStr(uint8_t tag, const String& s);
+
+    size_t length() const { return len; }
+    bool overflowed() const { return overflow; }
+
+private:
+    uint8_t* buf;
+    size_t cap;
+    size_t len = 0;
+    bool overflow = false;
+};
+
+class TlvReader {
+public:
+    TlvReader(const uint8_t* data, size_t len) : data(data), end(data + len) {}
+
+    // Next TLV, or false at the end of the body (or on a truncated
+    // TLV, which malformed() then reports).
+    bool next(uint8_t& tag, const uint8_t*& value, uint8_t& len);
+    bool malformed() const { return bad; }
+
+    static bool asU8(const uint8_t* v, uint8_t len, uint8_t& out);
+    static bool asU16(const uint8_t* v, uint8_t len, uint16_t& out);
+    static bool asU32(const uint8_t* v, uint8_t len, uint32_t& out);
+    static bool asF32(const uint8_t* v, uint8_t len, float& out);
+
+private:
+    const uint8_t* data;
+    const uint8_t* end;
+    bool bad = false;
+};
@@ -0,0 +1,72 @@
+// ================================================================
+// BLE LIVE STREAM
+// ================================================================
+// Packs live readings into notifications on the stream
+// characteristic for commissioning. Readings are offered by the
+// sampler at its stream poll rate; every Nth one is kept
+// (decimation) and appended to the pending frame, which goes out once
+// it fills the MTU or has waited STREAM_FLUSH_MS.
+//
+// Frame: StreamHeader, then records of
+//   u16 offset in ms from baseMs, u16 raw value per field in fieldMask
+//
+// Backpressure: a frame is only handed to NimBLE while it has at least
+// STREAM_MIN_FREE_MBUFS outgoing buffers free. When it does not, the
+// readings in the held frame are replaced by newer ones and counted in
+// the next header's `dropped`, since a live view wants fresh values
+// more than complete ones.
+
+#pragma once
+
+#include <Arduino.h>
+#include <NimBLEDevice.h>
+
+#include "sample.h"
+
+const uint32_t STREAM_FLUSH_MS = 200;
+const int STREAM_MIN_FREE_MBUFS = 4;
+const size_t STREAM_FRAME_MAX = 247;   // ATT payload at the 250-byte MTU we request
+
+struct __attribute__((packed)) StreamHeader {
+    uint8_t  seq;
+    uint8_t  dropped;     // Readings lost since the previous frame (saturates)
+    uint8_t  fieldMask;
+    uint16_t decimals;    // As in Sample
+    uint32_t baseMs;      // millis() of the first record
+};
+
+class BleStreamer {
+public:
+    void begin(NimBLECharacteristic* characteristic) { chr = characteristic; }
+
+    // 0 stops the stream and discards the pending frame
+    void setDecimation(uint8_t every);
+    uint8_t decimation() const { return every; }
+    bool active() const { return every > 0; }
+
+    // `payloadMax` is the current MTU minus the ATT header
+    void offer(const Sample& sample, uint32_t nowMs, size_t payloadMax);
+
+    // Sends the pending frame once it is old enough
+    void service(uint32_t nowMs);
+
+    uint32_t framesSent() const { return frames; }
+    uint32_t readingsDropped() const { return droppedTotal; }
+
+private:
+    bool flush();
+    void discard();
+
+    NimBLECharacteristic* chr = nullptr;
+    uint8_t every = 0;
+    uint8_t skip = 0;
+
+    uint8_t buf[STREAM_FRAME_MAX];
+    size_t len = 0;
+    size_t records = 0;
+    StreamHeader hdr = {};
+    uint32_t dropped = 0;
+
+    uint32_t frames = 0;
+    uint32_t droppedTotal = 0;
+};
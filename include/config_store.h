@@ -0,0 +1,75 @@
+// ================================================================
+// CONFIG STORE
+// ================================================================
+// Typed settings records in NVS. A record is a plain struct stored as
+// one blob behind a small header:
+//
+//   magic u16 'CF' | version u8 | reserved u8 | length u16 | crc u32
+//
+// Loading is a read and a CRC check, not a JSON parse. A blob with the
+// wrong version, length or CRC is rejected as a whole, and the caller
+// falls back to its defaults.
+//
+// Each record keeps the image last read from or written to flash, and
+// store() only writes when the value differs from it. Settings split
+// into several records therefore only rewrite the parts that changed.
+// Comparison is bytewise, so records should not carry uninitialised
+// padding.
+//
+// Not thread-safe: load and store from one task (the config task,
+// and setup() before it starts).
+
+#pragma once
+
+#include <Arduino.h>
+
+const size_t CONFIG_BLOB_MAX = 1024;   // Header + largest record
+
+struct __attribute__((packed)) ConfigBlobHeader {
+    uint16_t magic;
+    uint8_t  version;
+    uint8_t  reserved;
+    uint16_t length;    // sizeof the record
+    uint32_t crc;       // Over the record
+};
+
+class ConfigBlob {
+public:
+    ConfigBlob(const char* ns, const char* key, uint8_t version, void* image, size_t size);
+
+    // Copies the stored record into `out`. False if it is missing or
+    // does not check out; `out` is then untouched.
+    bool load(void* out);
+
+    // Writes `value` unless it equals the stored image. True if the
+    // flash copy matches `value` afterwards.
+    bool store(const void* value);
+
+    // Forgets the image, e.g. after the namespace has been erased, so
+    // the next store() writes unconditionally
+    void invalidate() { cached = false; }
+
+    uint32_t writeCount() const { return writes; }
+
+private:
+    const char* ns;
+    const char* key;
+    uint8_t version;
+    void* image;
+    size_t size;
+    bool cached = false;
+    uint32_t writes = 0;
+};
+
+template <typename T>
+class ConfigRecord : public ConfigBlob {
+public:
+    ConfigRecord(const char* ns, const char* key, uint8_t version)
+        : ConfigBlob(ns, key, version, &image, sizeof(T)) {}
+
+    bool load(T& out) { return ConfigBlob::load(&out); }
+    bool store(const T& value) { return ConfigBlob::store(&value); }
+
+private:
+    T image;
+};
@@ -0,0 +1,55 @@
+// ================================================================
+// JSON ARENA
+// ================================================================
+// Bump allocator for ArduinoJson documents, so BLE commands and the
+// config paths stop carving the internal heap that TLS needs. One
+// block is taken at boot (from PSRAM when there is some) and handed
+// out front to back. Freeing the newest allocation gives its space
+// back; anything else is only counted, and once no allocation is live
+// the arena starts over from the front. A command's documents are all
+// gone when it has been handled, so in practice it resets per request.
+//
+// A request that does not fit spills to the heap (spills()); the
+// high-water mark says how much of the arena has ever been in use.
+//
+// Not thread-safe: only the config task (and setup() before it
+// starts) builds documents on it.
+//
+//   JsonDocument doc(&jsonArena);
+
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+class JsonArena : public ArduinoJson::Allocator {
+public:
+    // `size` bytes of PSRAM, or `fallbackSize` of internal RAM if the
+    // board has none. Until then every allocation spills.
+    bool begin(size_t size, size_t fallbackSize);
+
+    void* allocate(size_t size) override;
+    void deallocate(void* ptr) override;
+    void* reallocate(void* ptr, size_t newSize) override;
+
+    size_t capacity() const { return cap; }
+    size_t used() const { return offset; }
+    size_t highWater() const { return peak; }
+    uint32_t spills() const { return spilled; }
+    bool inPsram() const { return psram; }
+
+private:
+    bool owns(const void* ptr) const;
+    size_t blockSize(const void* ptr) const;
+
+    uint8_t* base = nullptr;
+    size_t cap = 0;
+    size_t offset = 0;         // Next free byte
+    uint8_t* last = nullptr;   // Newest allocation, if it can still be rolled back
+    uint32_t live = 0;         // Arena allocations not yet freed
+    size_t peak = 0;
+    uint32_t spilled = 0;
+    bool psram = false;
+};
+
+extern JsonArena jsonArena;
@@ -0,0 +1,82 @@
+// ================================================================
+// LOGGER
+// ================================================================
+// Leveled logging that never blocks the caller. A log line is
+// formatted straight into a slot of a lock-free ring and printed
+// later by a low-priority task, so a slow or absent USB CDC host (or
+// the optional SD log file) only ever stalls that task. When the ring
+// is full the line is dropped and counted instead of waiting.
+//
+// Levels are filtered at compile time: build with -D LOG_LEVEL=n in
+// platformio.ini build_flags (0 none, 1 error, 2 warn, 3 info,
+// 4 debug). Calls above the level compile to nothing, arguments
+// included. -D LOG_TO_SD=1 additionally mirrors the log to a file on
+// the SD card once it is mounted.
+//
+//   LOG_I("HTTP", "Status %d", code);   // ">> HTTP: Status 200"
+
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_TO_SD
+#define LOG_TO_SD 0
+#endif
+
+const size_t LOG_LINE_MAX = 128;   // Longer lines are cut
+const uint32_t LOG_SLOTS = 32;     // Power of two
+
+// Formats one line into the ring. Use the LOG_* macros instead.
+void logWrite(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+// Starts the drain task. Lines logged before this are kept (up to
+// LOG_SLOTS) and printed once it runs.
+void loggerBegin();
+
+// Mirrors the log to `path` on `fs` (rotated to <path>.old past
+// LOG_FILE_MAX); loggerDetachFile() stops it before an unmount.
+void loggerAttachFile(fs::FS& fs, const char* path);
+void loggerDetachFile();
+
+// Waits until every line logged so far has been printed, e.g. before
+// deep sleep. Gives up after `timeoutMs`.
+void loggerFlush(unsigned long timeoutMs);
+
+uint32_t loggerDropped();
+
+#define LOG_LINE(tag, fmt, ...) logWrite(">> " tag ": " fmt "\n", ##__VA_ARGS__)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_E(tag, fmt, ...) LOG_LINE(tag, fmt, ##__VA_ARGS__)
+#else
+#define LOG_E(tag, fmt, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_W(tag, fmt, ...) LOG_LINE(tag, fmt, ##__VA_ARGS__)
+#else
+#define LOG_W(tag, fmt, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_I(tag, fmt, ...) LOG_LINE(tag, fmt, ##__VA_ARGS__)
+#else
+#define LOG_I(tag, fmt, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_D(tag, fmt, ...) LOG_LINE(tag, fmt, ##__VA_ARGS__)
+#else
+#define LOG_D(tag, fmt, ...) do {} while (0)
+#endif
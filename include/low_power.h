@@ -0,0 +1,90 @@
+// ================================================================
+// LOW POWER
+// ================================================================
+// Deep-sleep duty cycle for battery and solar sites (build with
+// -D LOW_POWER=1). A timer wake takes one reading, appends it to a
+// ring in RTC slow memory and sleeps again. Only every few readings
+// is Wi-Fi brought up to upload the ring. Everything that has to
+// survive a sleep lives here; the rest is set up again on each wake.
+//
+// Time: the system clock keeps running through deep sleep, so once
+// NTP has synced every wake stamps readings normally. Before that,
+// uptimeSeconds() counts from the cold boot across sleeps, so
+// readings taken several wakes before the first sync can still be
+// back-dated (sampleBackdate()) with the stored bootEpoch().
+//
+// RTC memory is lost on power-off and on any reset other than a
+// deep-sleep wake; the ring then starts empty.
+
+#pragma once
+
+#include <Arduino.h>
+
+#include "sample.h"
+
+#ifndef LOW_POWER
+#define LOW_POWER 0
+#endif
+
+const uint16_t RTC_RING_SLOTS = 192;         // 20 bytes each, of 8 KB RTC slow memory
+const uint32_t LOW_POWER_MIN_SLEEP_MS = 100; // Sleep at least this long, even when late
+
+enum WakeReason : uint8_t {
+    WAKE_COLD,     // Power-on or reset: RTC state was reset
+    WAKE_TIMER,    // Next reading due
+    WAKE_BUTTON    // Wake pin pulled low
+};
+
+// A plain reading without the window part, so the ring holds more.
+// Low-power builds do not aggregate (a window would span sleeps).
+struct __attribute__((packed)) RtcReading {
+    uint32_t timestamp;
+    uint16_t regs[SAMPLE_MAX_FIELDS];
+    uint8_t  fieldMask;
+    uint8_t  flags;
+    uint16_t decimals;
+};
+
+class LowPower {
+public:
+    // Call first thing on every boot. `buttonPin` (active low, an RTC
+    // GPIO) also wakes the chip; -1 for none.
+    WakeReason begin(int8_t buttonPin);
+
+    WakeReason wakeReason() const { return reason; }
+
+    // Seconds since the cold boot, sleeps included
+    uint32_t uptimeSeconds() const;
+
+    // Unix time of the cold boot (0 while unknown), kept for the next wake
+    uint32_t bootEpoch() const;
+    void setBootEpoch(uint32_t epoch);
+
+    // RTC ring, oldest first. push() drops the oldest reading to make
+    // room and then returns false.
+    bool push(const Sample& sample);
+    size_t size() const;
+    size_t peek(Sample* out, size_t max) const;
+    void pop(size_t n);
+
+    // Readings pushed since the last Wi-Fi session ended
+    uint16_t sinceUplink() const;
+    void uplinkAttempted();
+
+    // True if the alarm fields (bits of `alarmMask`) went from zero to
+    // non-zero or back since the previous reading
+    bool alarmChanged(const Sample& sample, uint8_t alarmMask);
+
+    // System time (us) the next reading is due at
+    int64_t nextSampleUs() const;
+    void setNextSample(int64_t wallUs);
+
+    static int64_t wallUs();
+
+    // Sleeps until the next reading or the button. Does not return.
+    void sleep();
+
+private:
+    int8_t button = -1;
+    WakeReason reason = WAKE_COLD;
+};
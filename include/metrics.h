@@ -0,0 +1,81 @@
+// ================================================================
+// METRICS
+// ================================================================
+// Fixed-bucket latency histograms and event counters for the stages
+// a reading goes through (Modbus, SD, TLS, HTTP, BLE), so a site that
+// misses its sample budget can be diagnosed from the phone instead of
+// from a serial console. Recording is a few instructions under a
+// spinlock, so any task on either core may record, and nothing is
+// printed on the hot path.
+//
+// Bucket bounds are in microseconds, on a 1-2.5-5 scale from 100 us
+// to 2.5 s; the last bucket takes everything slower.
+
+#pragma once
+
+#include <Arduino.h>
+
+enum MetricHistogram : uint8_t {
+    METRIC_MODBUS,        // Submit to completion, retries included
+    METRIC_TLS_CONNECT,   // TCP connect + TLS handshake (HTTPS and MQTTS)
+    METRIC_HTTP,          // One request/response round trip
+    METRIC_SD_WRITE,      // One block append incl. flush
+    METRIC_SD_OPEN,       // Opening a log segment or the index
+    METRIC_BLE_WRITE,     // NimBLE onWrite callback
+    METRIC_SAMPLE_JITTER, // Sample slot deadline to start of the read
+    METRIC_HISTOGRAMS
+};
+
+enum MetricCounter : uint8_t {
+    COUNT_MODBUS_TIMEOUT,
+    COUNT_MODBUS_BAD_CRC,
+    COUNT_MODBUS_EXCEPTION,   // Slave answered with an exception code
+    COUNT_MODBUS_RETRY,       // Transactions that needed more than one attempt
+    COUNT_MODBUS_QUEUE_FULL,
+    COUNT_HTTP_ERROR,         // Failed before a status line (connect, send, timeout)
+    COUNT_HTTP_STATUS,        // Answered with a non-2xx status
+    COUNT_SD_FALLBACK,        // Readings spilled from the RAM ring to SD
+    COUNT_SD_ERROR,           // Appends or index writes that failed
+    COUNT_RING_DROP,          // Readings lost to a full ring
+    COUNT_SAMPLE_SKIPPED,     // Sample slots dropped because the sampler was late
+    COUNT_TLS_PIN_FAIL,       // TLS servers whose key matched no pin
+    COUNT_MQTT_DROP,          // Readings too big for one PUBLISH, skipped
+    METRIC_COUNTERS
+};
+
+const uint8_t METRIC_BUCKETS = 15;
+
+struct HistogramSnapshot {
+    uint32_t count;
+    uint32_t maxUs;
+    uint64_t sumUs;
+    uint32_t buckets[METRIC_BUCKETS];
+};
+
+// Upper bound (exclusive) of bucket `i`; UINT32_MAX for the last
+uint32_t metricBucketBound(uint8_t i);
+
+void metricRecord(MetricHistogram h, uint32_t us);
+void metricCount(MetricCounter c, uint32_t n = 1);
+
+// Records the time since `startUs` (an esp_timer_get_time() value)
+void metricSince(MetricHistogram h, int64_t startUs);
+
+// Records the lifetime of the scope, for functions with early returns
+class MetricTimer {
+public:
+    explicit MetricTimer(MetricHistogram h);
+    ~MetricTimer() { metricSince(hist, start); }
+
+private:
+    MetricHistogram hist;
+    int64_t start;
+};
+
+void metricSnapshot(MetricHistogram h, HistogramSnapshot& out);
+uint32_t metricCounter(MetricCounter c);
+void metricsReset();
+
+// Short keys used in the BLE snapshot
+const char* metricName(MetricHistogram h);
+const char* metricName(MetricCounter c);
@@ -0,0 +1,109 @@
+// ================================================================
+// MODBUS POLL TABLE
+// ================================================================
+// Configurable list of registers to poll: slave, function code,
+// register range, poll period, and which uplink field the values land
+// in. plan() merges due entries with contiguous or overlapping ranges
+// on the same slave and function code into one read, saving a request
+// frame and turnaround on a 9600-baud bus. Ranges with registers
+// between them are never merged: a slave answers a read across a hole
+// in its register map with exception 0x02, which would cost every
+// field behind that read on every cycle.
+//
+// JSON form (BLE "poll" key, NVS app_conf/poll):
+//   [{"s":1,"fc":3,"r":0,"n":1,"p":0,"f":1,"dp":1,"to":200,"rt":1}, ...]
+//   s  slave id (1-247)          fc 3 = holding, 4 = input registers
+//   r  first register            n  register count
+//   p  poll period in s (0 = on every sample)
+//   f  first uplink field (1-based), registers map to f..f+n-1
+//   dp decimal places (value = raw / 10^dp)
+//   to response timeout in ms    rt retries after a timeout/bad CRC
+//      (per slave: the last entry for a slave sets them)
+//
+// The JSON form is only built on target; planning and the latest
+// values have no Arduino dependencies.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#endif
+
+#include "modbus_types.h"
+#include "sample.h"
+
+const uint8_t POLL_MAX_ENTRIES = 8;
+const uint16_t POLL_MAX_READ = MODBUS_MAX_REGS;
+
+struct PollEntry {
+    uint8_t  slave;
+    uint8_t  fc;
+    uint16_t start;
+    uint8_t  count;
+    uint8_t  field;      // 0-based
+    uint8_t  decimals;
+    uint32_t periodMs;   // 0 = on every sample
+    uint16_t timeoutMs;
+    uint8_t  retries;
+};
+
+struct PollRead {
+    uint8_t  slave;
+    uint8_t  fc;
+    uint16_t start;
+    uint16_t count;
+};
+
+class ModbusPollTable {
+public:
+    // Single PV register on slave 1, as the firmware always polled
+    void setDefault();
+
+    // Replaces the table with `n` entries that have already been
+    // checked (fromJson() does). False, table unchanged, if `n` is 0
+    // or more than POLL_MAX_ENTRIES.
+    bool setEntries(const PollEntry* list, uint8_t n);
+
+#ifdef ARDUINO
+    // Replaces the table from JSON. On failure the table is unchanged
+    // and `error` says why.
+    bool fromJson(JsonArrayConst arr, String& error);
+    void toJson(JsonArray arr) const;
+#endif
+
+    // Coalesced reads for entries due at `nowMs`. Entries with period
+    // 0 are only due when `sampleTick` is set.
+    size_t plan(uint32_t nowMs, bool sampleTick, PollRead* out, size_t maxReads);
+
+    // Coalesced reads for every entry that covers a field in
+    // `fieldMask`, due or not, for the alarm fast path. Leaves the
+    // entries' due times alone.
+    size_t planFields(uint8_t fieldMask, PollRead* out, size_t maxReads) const;
+
+    // Feeds a finished read back. Every entry the read covers takes
+    // its values from `regs` (or is marked missing if !ok).
+    void complete(const PollRead& read, const uint16_t* regs, bool ok);
+
+    // Latest value of every field into `sample`. Returns false if no
+    // field has a reading.
+    bool snapshot(Sample& sample) const;
+
+    uint8_t size() const { return count; }
+    const PollEntry& entry(uint8_t i) const { return entries[i]; }
+
+private:
+    void insertOrdered(uint8_t* order, uint8_t& n, uint8_t entry) const;
+    size_t coalesce(const uint8_t* order, uint8_t n, PollRead* out, size_t maxReads) const;
+
+    PollEntry entries[POLL_MAX_ENTRIES];
+    uint32_t nextDue[POLL_MAX_ENTRIES];
+    uint8_t count = 0;
+
+    uint16_t latest[SAMPLE_MAX_FIELDS];
+    uint8_t latestDecimals[SAMPLE_MAX_FIELDS];
+    uint8_t latestMask = 0;
+};
@@ -0,0 +1,73 @@
+// ================================================================
+// MODBUS RTU MASTER
+// ================================================================
+// Asynchronous RTU master running on its own task. The UART's RX
+// timeout is set to the t3.5 inter-frame gap and the receive callback
+// only fires when it expires, so the engine sleeps until a whole
+// response frame has arrived instead of polling the port. Requests
+// are queued with submit() and complete through a callback on the
+// engine task; transact() wraps that for callers that just want to
+// wait while the CPU does other work.
+//
+// Status codes and the request/result records are in modbus_types.h.
+
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "modbus_types.h"
+
+typedef void (*ModbusCallback)(const ModbusResult& result, void* ctx);
+
+class ModbusRtu {
+public:
+    bool begin(HardwareSerial& port, uint32_t baud, int rxPin, int txPin);
+
+    // Per-slave response timeout and retry count
+    void setSlaveTimeout(uint8_t slave, uint16_t timeoutMs, uint8_t retries);
+
+    // Queues a transaction. `cb` runs on the engine task when it
+    // finishes (successfully or not). Returns false if the queue is full.
+    bool submit(const ModbusRequest& req, ModbusCallback cb, void* ctx);
+
+    // Submits and sleeps until the result is in. Copies up to
+    // `maxRegs` registers to `out`. Returns the status code. Waits on
+    // a semaphore of its own, so the caller's task notification stays
+    // free for other wake-ups.
+    uint8_t transact(const ModbusRequest& req, uint16_t* out, uint16_t maxRegs);
+
+    uint8_t readRegisters(uint8_t slave, uint8_t fc, uint16_t addr, uint16_t count, uint16_t* out) {
+        ModbusRequest req = { slave, fc, addr, count };
+        return transact(req, out, count);
+    }
+
+    uint8_t writeSingleRegister(uint8_t slave, uint16_t addr, uint16_t value) {
+        ModbusRequest req = { slave, 6, addr, value };
+        return transact(req, nullptr, 0);
+    }
+
+private:
+    struct Job {
+        ModbusRequest req;
+        ModbusCallback cb;
+        void* ctx;
+        int64_t submittedUs;
+    };
+
+    static void engineTask(void* param);
+    void run(const Job& job, ModbusResult& result);
+    void record(const ModbusResult& result);
+    uint8_t attempt(const ModbusRequest& req, uint16_t timeoutMs, ModbusResult& result);
+    size_t expectedLength(const uint8_t* frame, size_t len, uint8_t fc);
+
+    HardwareSerial* port = nullptr;
+    QueueHandle_t jobs = nullptr;
+    TaskHandle_t task = nullptr;
+    uint32_t gapUs = 0;           // t3.5 at the configured baud
+    int64_t lastActivityUs = 0;
+
+    uint16_t slaveTimeoutMs[248];
+    uint8_t slaveRetries[248];
+};
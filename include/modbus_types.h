@@ -0,0 +1,41 @@
+// ================================================================
+// MODBUS TYPES
+// ================================================================
+// Status codes, limits and the request/result records shared by the
+// RTU master, the poll table and anything standing in for a slave.
+// No Arduino or IDF dependencies.
+//
+// Status codes match ModbusMaster's so existing error logs still
+// read the same (0x00 ok, 0x01-0x0B exceptions, 0xE0-0xE5 local).
+
+#pragma once
+
+#include <stdint.h>
+
+const uint8_t MODBUS_OK = 0x00;
+const uint8_t MODBUS_BAD_SLAVE = 0xE0;     // Reply from a different slave
+const uint8_t MODBUS_BAD_FUNCTION = 0xE1;  // Reply to a different function
+const uint8_t MODBUS_TIMEOUT = 0xE2;
+const uint8_t MODBUS_BAD_CRC = 0xE3;
+const uint8_t MODBUS_QUEUE_FULL = 0xE4;
+const uint8_t MODBUS_BAD_LENGTH = 0xE5;    // Register count differs from the request
+
+const uint16_t MODBUS_MAX_REGS = 125;
+const uint16_t MODBUS_DEFAULT_TIMEOUT_MS = 200;
+const uint8_t MODBUS_DEFAULT_RETRIES = 1;
+
+struct ModbusRequest {
+    uint8_t  slave;
+    uint8_t  fc;       // 3, 4 or 6
+    uint16_t addr;
+    uint16_t value;    // Register count (3/4) or value to write (6)
+};
+
+struct ModbusResult {
+    ModbusRequest req;
+    uint8_t  status;
+    uint8_t  attempts;
+    uint16_t count;                  // Registers in `regs`
+    uint16_t regs[MODBUS_MAX_REGS];
+    uint32_t latencyUs;              // Submit to completion
+};
@@ -0,0 +1,84 @@
+// ================================================================
+// MQTT TRANSPORT
+// ================================================================
+// Minimal MQTT 3.1.1 client, publish-only, over one long-lived
+// (optionally TLS) socket. Every reading is a QoS1 PUBLISH to
+// <topic>/<client id>; a reading counts as delivered once the broker
+// PUBACKs it. Up to MQTT_INFLIGHT_MAX publishes are outstanding at a
+// time, so a batch costs a round trip per window rather than per
+// reading.
+//
+// The session is opened with Clean Session off, so the broker keeps
+// our session across reconnects. Readings whose PUBACK never arrived
+// stay in the ring / SD log and are published again (at-least-once).
+//
+// Payload: {"ts":<unix s>,"tv":0|1,"f1":<value>,...}, followed for
+// aggregate windows by "n","w","min1","max1","avg1",... as in the
+// HTTP query.
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+
+#include "tls_pin.h"
+#include "transport.h"
+
+const size_t MQTT_INFLIGHT_MAX = 8;
+const size_t MQTT_BATCH_MAX = 64;
+const uint16_t MQTT_KEEPALIVE_S = 60;
+const size_t MQTT_PACKET_MAX = 512;
+const size_t MQTT_BODY_MAX = 448;
+// Fixed header (type, 4-byte length), topic length and packet id
+const size_t MQTT_TOPIC_MAX = MQTT_PACKET_MAX - MQTT_BODY_MAX - 9;
+
+struct MqttSettings {
+    char url[96];        // mqtt://host[:port] or mqtts://host[:port]
+    char user[48];
+    char pass[64];
+    char clientId[48];
+    char topic[64];      // Prefix; the client id is appended
+    TlsPins pins;        // mqtts:// server keys (tls_pin.h)
+};
+
+class MqttTransport : public Transport {
+public:
+    explicit MqttTransport(unsigned long timeoutMs);
+
+    // Takes effect on the next connect; a changed broker drops the
+    // current session. A <topic>/<client id> longer than MQTT_TOPIC_MAX
+    // is refused: nothing is published (readings stay queued) until
+    // the settings are fixed.
+    void configure(const MqttSettings& settings);
+
+    size_t upload(const Sample* samples, size_t n) override;
+    size_t batchLimit() const override { return MQTT_BATCH_MAX; }
+    void service() override;
+    void stop() override;
+    const char* name() const override { return "mqtt"; }
+
+    bool isConnected();
+    unsigned long connectCount() const { return connects; }
+
+private:
+    bool ensureConnected();
+    bool writePacket(const uint8_t* data, size_t len);
+    int  readPacket(uint8_t* buf, size_t cap, size_t& len, unsigned long deadline);
+    int  readByte(unsigned long deadline);
+    uint16_t nextPacketId();
+    size_t buildPublish(uint8_t* out, size_t cap, const Sample& sample, uint16_t id);
+
+    MqttSettings cfg = {};
+    char topic[sizeof(MqttSettings::topic) + sizeof(MqttSettings::clientId) + 1] = "";
+
+    WiFiClient plainClient;
+    WiFiClientSecure secureClient;
+    WiFiClient* client = nullptr;
+
+    unsigned long timeout;
+    unsigned long lastTx = 0;
+    unsigned long pingSentAt = 0;   // 0 = no PINGREQ outstanding
+    uint16_t packetId = 0;
+    unsigned long connects = 0;
+};
@@ -0,0 +1,194 @@
+// ================================================================
+// OTA UPDATE
+// ================================================================
+// Firmware updates pulled over the uplink's HTTP(S) connection and
+// written into the inactive app partition as they arrive; the image
+// is never held in RAM. The download goes in Range requests of
+// OTA_RANGE_BYTES, one per uplink pass, so a dropped connection
+// resumes where it stopped and the uplink task keeps the SD card
+// going in between. Uploads pause meanwhile: readings wait in the
+// sample ring and spill to SD past its high-water mark as usual.
+//
+// The file is a plain ESP image (first byte 0xE9) or a container:
+//
+//   magic "EOTA" | version u8 | flags u8 | reserved u16 |
+//   image size u32 | base u8[8]                (little-endian, 20 B)
+//
+// followed by the payload, zlib-compressed with OTA_FLAG_DEFLATE
+// (inflated by the ROM's tinfl into a 32 KB window in PSRAM). With
+// OTA_FLAG_DELTA the payload is a patch against the running firmware,
+// whose ELF SHA-256 must start with `base`:
+//
+//   0x01 offset len   copy `len` bytes of the running image at `offset`
+//   0x02 len data     `len` new bytes
+//   0x00              end
+//
+// (offset and len are LEB128 varints). Any copy/insert diff of the
+// two images will do; compressed, unchanged code costs a few bytes.
+//
+// The new image boots on trial (NVS ota/trial, through its own
+// Preferences handle since it is written from the uplink task). It is kept once an
+// upload goes through on it; the previous one boots again if that has
+// not happened after OTA_HEALTH_TIMEOUT_S of uptime, or after
+// OTA_TRIAL_BOOTS resets (a crash loop). Arduino's mark-valid at
+// start-up is turned off, so a bootloader built with rollback support
+// also reverts an image that never gets as far as setup().
+//
+// esp_ota_end() checks the image's own SHA-256 but not who built it,
+// so the image is only as trusted as the server it came from. Only
+// https:// URLs are taken, and only while server pins are set
+// (tls_pin.h); without pins the connection is not verified and
+// anyone on the path could hand over firmware. Each range is checked
+// again, so clearing the pins stops a download that is under way.
+//
+// request() may be called from any task; everything else runs on the
+// uplink task, bootCheck() in setup() before it starts.
+
+#pragma once
+
+#include <Arduino.h>
+#include <Preferences.h>
+#include <esp_ota_ops.h>
+
+#include "uplink.h"
+
+const size_t OTA_URL_MAX = 161;
+const uint32_t OTA_RANGE_BYTES = 64 * 1024;    // Per uplink pass
+const uint8_t OTA_MAX_RETRIES = 10;            // Failed ranges in a row before giving up
+const uint8_t OTA_TRIAL_BOOTS = 3;
+const uint32_t OTA_HEALTH_TIMEOUT_S = 1800;
+const size_t OTA_WRITE_BYTES = 4096;           // Flash write block, one sector
+
+const uint8_t OTA_FLAG_DEFLATE = 0x01;
+const uint8_t OTA_FLAG_DELTA   = 0x02;
+
+enum OtaState : uint8_t {
+    OTA_IDLE,
+    OTA_RUNNING,
+    OTA_READY,     // Boot partition switched; restart to run it
+    OTA_FAILED
+};
+
+enum OtaError : uint8_t {
+    OTA_ERR_NONE,
+    OTA_ERR_HTTP,        // Error status, or a server that ignores Range mid-file
+    OTA_ERR_NETWORK,     // OTA_MAX_RETRIES failed ranges in a row
+    OTA_ERR_FORMAT,      // Not an image or container, or a bad patch
+    OTA_ERR_BASE,        // Delta for other firmware than the running one
+    OTA_ERR_INFLATE,
+    OTA_ERR_FLASH,
+    OTA_ERR_NO_MEMORY,
+    OTA_ERR_VERIFY,      // esp_ota_end() rejected the image
+    OTA_ERR_INSECURE     // Not https://, or no server pins set
+};
+
+struct __attribute__((packed)) OtaHeader {
+    char     magic[4];   // "EOTA"
+    uint8_t  version;    // 1
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t imageSize;
+    uint8_t  base[8];
+};
+
+struct __attribute__((packed)) OtaTrial {
+    uint8_t active;
+    uint8_t boots;          // Resets seen on trial
+    char    previous[17];   // Partition label to go back to
+};
+
+struct tinfl_decompressor_tag;
+
+class OtaUpdate : public UplinkBodySink {
+public:
+    // Queues a download of `url` for the uplink task; "" cancels one
+    void request(const char* url);
+
+    // Uplink task: takes a queued request and fetches the next range.
+    // False if the range failed to download and the caller should back
+    // off. A cancelled or failed update leaves the running firmware as
+    // is.
+    bool service(Uplink& uplink);
+
+    // A download is queued or running (uploads pause)
+    bool active() const { return pending || state == OTA_RUNNING; }
+    bool ready() const { return state == OTA_READY; }
+
+    OtaState status() const { return state; }
+    OtaError error() const { return lastError; }
+    uint32_t received() const { return fetched; }
+    long fileSize() const { return total; }
+
+    // setup(): counts a trial boot and goes back to the previous image
+    // after OTA_TRIAL_BOOTS. Deep-sleep wakes do not count.
+    void bootCheck();
+
+    bool onTrial() const { return trial.active != 0; }
+
+    // An upload went through: the running image is kept
+    void confirm();
+
+    // True once the trial has run out (the caller saves what it has,
+    // then calls rollback())
+    bool trialExpired(uint32_t uptimeS) const;
+    void rollback();
+
+    bool write(const uint8_t* data, size_t len) override;
+
+private:
+    bool begin();
+    void finish();
+    bool fail(OtaError err);
+    void release();
+    void storeTrial();
+
+    bool checkHeader();
+    bool inflate(const uint8_t* data, size_t len);
+    bool decode(const uint8_t* data, size_t len);
+    bool patch(const uint8_t* data, size_t len);
+    bool copyFromBase(uint32_t offset, uint32_t len);
+    bool emit(const uint8_t* data, size_t len);
+    bool flush();
+
+    // Request from other tasks
+    portMUX_TYPE requestLock = portMUX_INITIALIZER_UNLOCKED;
+    char requestUrl[OTA_URL_MAX] = "";
+    volatile bool pending = false;
+
+    char url[OTA_URL_MAX] = "";
+    volatile OtaState state = OTA_IDLE;
+    OtaError lastError = OTA_ERR_NONE;
+    volatile uint32_t fetched = 0;   // File bytes taken
+    long total = -1;
+    uint8_t retries = 0;
+
+    const esp_partition_t* target = nullptr;
+    esp_ota_handle_t handle = 0;
+    bool flashOpen = false;
+
+    OtaHeader header;
+    size_t headerLen = 0;
+    bool headerDone = false;
+    uint8_t flags = 0;
+    uint32_t written = 0;            // Image bytes produced
+
+    tinfl_decompressor_tag* inflator = nullptr;
+    uint8_t* window = nullptr;       // TINFL_LZ_DICT_SIZE, wraps
+    size_t windowPos = 0;
+    bool inflated = false;
+
+    // Patch parser
+    uint8_t op = 0;
+    uint8_t argCount = 0;
+    uint8_t argShift = 0;
+    uint32_t args[2] = {};
+    uint32_t literal = 0;            // DATA bytes still to come
+    bool patched = false;
+
+    uint8_t* out = nullptr;          // OTA_WRITE_BYTES
+    size_t outLen = 0;
+
+    Preferences nvs;
+    OtaTrial trial = {};
+    bool confirmed = false;
+};
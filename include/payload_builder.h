@@ -0,0 +1,67 @@
+// ================================================================
+// PAYLOAD BUILDER
+// ================================================================
+// Fixed-capacity text builder for URLs, request headers and CSV
+// bodies. Writes into a caller-owned buffer (or FixedPayload's own
+// array) and never touches the heap. Numbers are formatted from
+// integers, so register values scaled by 10^dp print exactly without
+// going through float.
+//
+// An append that does not fit is cut short and sets overflowed(); the
+// buffer stays NUL-terminated. Callers check it once at the end.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class PayloadBuilder {
+public:
+    PayloadBuilder(char* buf, size_t cap);   // `cap` includes the NUL
+
+    void clear();
+    void truncate(size_t len);               // Back to an earlier length()
+
+    PayloadBuilder& append(const char* s);
+    PayloadBuilder& append(const char* s, size_t n);
+    PayloadBuilder& append(char c);
+
+    // Percent-encodes everything but RFC 3986 unreserved characters,
+    // for use inside a query component.
+    PayloadBuilder& appendEncoded(const char* s);
+
+    // Quoted JSON string with the necessary escapes
+    PayloadBuilder& appendJsonString(const char* s);
+
+    PayloadBuilder& appendUInt(uint32_t v);
+    PayloadBuilder& appendInt(int32_t v);
+
+    // raw / 10^decimals, printed with at least `minDecimals` places
+    PayloadBuilder& appendFixed(int32_t raw, uint8_t decimals, uint8_t minDecimals = 0);
+
+    // Rounded to `decimals` places (at most 6)
+    PayloadBuilder& appendFloat(float v, uint8_t decimals);
+
+    const char* c_str() const { return buf; }
+    const uint8_t* bytes() const { return (const uint8_t*)buf; }
+    size_t length() const { return len; }
+    size_t capacity() const { return cap - 1; }
+    bool overflowed() const { return overflow; }
+
+private:
+    void appendDigits(uint64_t v, uint8_t minDigits);
+
+    char* buf;
+    size_t cap;
+    size_t len = 0;
+    bool overflow = false;
+};
+
+template <size_t N>
+class FixedPayload : public PayloadBuilder {
+public:
+    FixedPayload() : PayloadBuilder(storage, N) {}
+
+private:
+    char storage[N];
+};
@@ -0,0 +1,79 @@
+// ================================================================
+// SAMPLE RECORD
+// ================================================================
+// Fixed-size reading passed from the sampler to the uplink. Each slot
+// of `regs` is one uplink field (field1..fieldN); which Modbus
+// register feeds which field is decided by the poll table.
+//
+// With aggregation on (see aggregator.h) a record stands for a whole
+// window of readings instead: `regs` then holds the last value of
+// each field and `window` the statistics. window.count == 0 marks a
+// plain reading.
+
+#pragma once
+
+#include <stdint.h>
+
+const uint8_t SAMPLE_MAX_FIELDS = 6;
+
+// Sample::flags
+const uint8_t SAMPLE_TIME_VALID = 0x01;  // timestamp came from a synced clock
+const uint8_t SAMPLE_TIME_UPTIME = 0x02; // timestamp is seconds since boot, not yet back-dated
+const uint8_t SAMPLE_ALARM_EVENT = 0x04; // Off-grid record of an alarm change (sampler fast path)
+
+struct SampleWindow {
+    uint16_t count;                           // Readings folded in
+    uint16_t seconds;                         // Span of the window
+    uint16_t min[SAMPLE_MAX_FIELDS];          // Raw, same scale as regs
+    uint16_t max[SAMPLE_MAX_FIELDS];
+    uint16_t mean[SAMPLE_MAX_FIELDS];
+    uint8_t  transitions[SAMPLE_MAX_FIELDS];  // Alarm fields: zero <-> non-zero changes
+};
+
+struct Sample {
+    uint32_t timestamp;                 // Unix time (s); window start for aggregates
+    uint16_t regs[SAMPLE_MAX_FIELDS];   // Raw register value per field
+    uint8_t  fieldMask;                 // Bit i set: regs[i] holds a reading
+    uint8_t  flags;
+    uint16_t decimals;                  // 2 bits per field: value = reg / 10^dp
+    SampleWindow window;
+    uint16_t ms;                        // Sub-second part of timestamp (alarm events)
+};
+
+inline bool sampleHasField(const Sample& sample, uint8_t i) {
+    return (sample.fieldMask >> i) & 1;
+}
+
+inline bool sampleIsWindow(const Sample& sample) {
+    return sample.window.count > 0;
+}
+
+inline uint8_t sampleDecimals(const Sample& sample, uint8_t i) {
+    return (sample.decimals >> (2 * i)) & 0x3;
+}
+
+inline void sampleSetField(Sample& sample, uint8_t i, uint16_t raw, uint8_t decimals) {
+    sample.regs[i] = raw;
+    sample.fieldMask |= 1 << i;
+    sample.decimals = (sample.decimals & ~(0x3 << (2 * i))) | ((decimals & 0x3) << (2 * i));
+}
+
+// Turns a seconds-since-boot timestamp into Unix time, given the Unix
+// time of this boot (0 while unknown). Returns false if nothing changed.
+inline bool sampleBackdate(Sample& sample, uint32_t bootEpoch) {
+    if (!(sample.flags & SAMPLE_TIME_UPTIME) || bootEpoch == 0) return false;
+    sample.timestamp += bootEpoch;
+    sample.flags = (sample.flags & ~SAMPLE_TIME_UPTIME) | SAMPLE_TIME_VALID;
+    return true;
+}
+
+// Field value in engineering units
+inline float sampleField(const Sample& sample, uint8_t i) {
+    static const float SCALE[4] = { 1.0f, 10.0f, 100.0f, 1000.0f };
+    return float(sample.regs[i]) / SCALE[sampleDecimals(sample, i)];
+}
+
+// Process value (field1)
+inline float sampleValue(const Sample& sample) {
+    return sampleField(sample, 0);
+}
@@ -0,0 +1,69 @@
+// ================================================================
+// SAMPLE BLOCK CODEC
+// ================================================================
+// Compact binary form of a run of readings, used for the SD log
+// segments and, optionally, as the Content-Encoding of batch uploads
+// ("x-sample-delta"). A block is a fixed header followed by the
+// encoded records:
+//
+//   header   magic u16 'SB' | count u8 | version u8 | first u32 |
+//            length u16 (payload bytes) | crc u32 (header + payload)
+//   record   tag u8 (SAMPLE_TAG_*)
+//            timestamp: zig-zag varint of the delta-of-delta (the
+//              first record's delta is from 0, the second's from the
+//              first's, so a steady interval costs one byte)
+//            [META]   flags u8, fieldMask u8, decimals varint
+//            regs: zig-zag varint delta from the previous value of
+//              the same field, for each field in fieldMask
+//            [WINDOW] count, seconds varints; per field: zig-zag
+//              min / max / mean relative to regs, transitions varint
+//            [MS]     ms varint, sub-second part of the timestamp
+//
+// All multi-byte header fields are little-endian. Every block decodes
+// on its own: the delta state starts from zero at each header. An
+// encoded batch is one or more blocks back to back; decoded, it
+// carries the same rows as the CSV body, so the batch POST keeps
+// Content-Type text/csv and only adds the Content-Encoding.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sample.h"
+
+const uint16_t SAMPLE_BLOCK_MAGIC = 0x4253;   // "SB"
+const uint8_t SAMPLE_BLOCK_VERSION = 1;
+const uint8_t SAMPLE_BLOCK_MAX = 64;           // Records per block
+
+// Record tag bits
+const uint8_t SAMPLE_TAG_META = 0x01;    // flags / fieldMask / decimals changed
+const uint8_t SAMPLE_TAG_WINDOW = 0x02;  // Aggregate window stats follow
+const uint8_t SAMPLE_TAG_MS = 0x04;      // Milliseconds follow (alarm events)
+
+struct __attribute__((packed)) SampleBlockHeader {
+    uint16_t magic;
+    uint8_t  count;
+    uint8_t  version;
+    uint32_t first;      // Caller's index of the first record
+    uint16_t length;     // Payload bytes after the header
+    uint32_t crc;        // Over the header up to here, then the payload
+};
+
+// Standard CRC-32 (IEEE 802.3); pass the previous result to continue
+uint32_t blockCrc32(const void* data, size_t len, uint32_t crc = 0);
+
+// Encodes as many of the `n` samples as fit in `cap` bytes of `out`
+// (and at most SAMPLE_BLOCK_MAX) as one block. Returns the block size
+// including its header, or 0 if not even one record fits; `taken` is
+// the number of samples encoded.
+size_t encodeSampleBlock(const Sample* samples, size_t n, uint32_t first,
+                         uint8_t* out, size_t cap, size_t& taken);
+
+// Checks magic, version, length against `maxPayload` and, if
+// `payload` is given, the CRC.
+bool checkSampleBlock(const SampleBlockHeader& hdr, const uint8_t* payload, size_t maxPayload);
+
+// Decodes a checked block's payload into hdr.count samples. Returns
+// false if the payload is malformed.
+bool decodeSampleBlock(const SampleBlockHeader& hdr, const uint8_t* payload, Sample* out);
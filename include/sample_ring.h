@@ -0,0 +1,102 @@
+// ================================================================
+// SPSC SAMPLE RING
+// ================================================================
+// Lock-free single-producer/single-consumer ring of fixed-size
+// records. The producer only writes `head`, the consumer only writes
+// `tail`; both are free-running counters so size() is head - tail and
+// the slot is counter & mask. Storage is taken from PSRAM when the
+// board has it, so the ring can hold hours of readings. Off target
+// (host builds) it is plain malloc. Until begin() succeeds the ring
+// has no storage: push() fails and peek() returns nothing.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <esp_heap_caps.h>
+#else
+#include <stdlib.h>
+#endif
+
+template <typename T>
+class SpscRing {
+public:
+    // `capacity` must be a power of two. Falls back to internal RAM
+    // with `fallbackCapacity` slots if PSRAM is missing or exhausted.
+    bool begin(uint32_t capacity, uint32_t fallbackCapacity) {
+#ifdef ARDUINO
+        if (psramFound()) {
+            slots = (T*)heap_caps_malloc(capacity * sizeof(T), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        }
+        if (slots != nullptr) {
+            psram = true;
+        } else {
+            capacity = fallbackCapacity;
+            slots = (T*)heap_caps_malloc(capacity * sizeof(T), MALLOC_CAP_8BIT);
+            if (slots == nullptr) return false;
+        }
+#else
+        (void)fallbackCapacity;
+        slots = (T*)malloc(capacity * sizeof(T));
+        if (slots == nullptr) return false;
+#endif
+        mask = capacity - 1;
+        head.store(0);
+        tail.store(0);
+        return true;
+    }
+
+    // Producer side. Fails (and counts an overrun) when full or never
+    // allocated.
+    bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (slots == nullptr || h - tail.load(std::memory_order_acquire) > mask) {
+            overruns++;
+            return false;
+        }
+        slots[h & mask] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side: copies up to `max` of the oldest records without
+    // removing them, so a failed upload leaves them in place.
+    size_t peek(T* out, size_t max) const {
+        if (slots == nullptr) return 0;
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t n = head.load(std::memory_order_acquire) - t;
+        if (n > max) n = max;
+        for (uint32_t i = 0; i < n; i++) {
+            out[i] = slots[(t + i) & mask];
+        }
+        return n;
+    }
+
+    // Consumer side: releases `n` records after peek().
+    void pop(size_t n) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        uint32_t avail = head.load(std::memory_order_acquire) - t;
+        if (n > avail) n = avail;
+        tail.store(t + n, std::memory_order_release);
+    }
+
+    uint32_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+    uint32_t capacity() const { return slots != nullptr ? mask + 1 : 0; }
+    bool ready() const { return slots != nullptr; }
+    uint32_t overrunCount() const { return overruns; }
+    bool inPsram() const { return psram; }
+
+private:
+    T* slots = nullptr;
+    uint32_t mask = 0;
+    bool psram = false;
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    uint32_t overruns = 0; // Written by the producer only
+};
@@ -0,0 +1,82 @@
+// ================================================================
+// SAMPLE SCHEDULE
+// ================================================================
+// When the next reading is due. Slots are absolute deadlines on the
+// esp_timer clock (microseconds, monotonic) and move on by exactly one
+// interval each, so the time a reading or an upload takes never
+// pushes the grid back.
+//
+//   SCHEDULE_INTERVAL  every interval, counted from configure()
+//   SCHEDULE_ALIGNED   on multiples of the interval since local
+//                      midnight (15 min: :00 :15 :30 :45; 10 s: :00
+//                      :10 ...). Each slot is placed from the wall
+//                      clock, so an NTP correction moves the next one.
+//                      Until the clock is set, slots are spaced as in
+//                      INTERVAL mode; once it is, the next slot moves
+//                      onto the grid.
+//
+// A slot noticed one or more whole intervals late means slots were
+// missed. SCHEDULE_SKIP drops them and takes the latest only.
+// SCHEDULE_CATCH_UP takes them back to back, up to maxCatchUp, and
+// skips the rest. After each due() slot, lateUs() and skipped()
+// describe it, for jitter metrics.
+//
+// slotTime() is the Unix time of the last slot (whole seconds,
+// rounded), or 0 while the clock is not set. Readings are stamped with
+// it so they land on the grid rather than when the read happened.
+
+#pragma once
+
+#include <stdint.h>
+
+enum ScheduleMode : uint8_t {
+    SCHEDULE_INTERVAL,
+    SCHEDULE_ALIGNED
+};
+
+enum SchedulePolicy : uint8_t {
+    SCHEDULE_SKIP,
+    SCHEDULE_CATCH_UP
+};
+
+class SampleSchedule {
+public:
+    // Starts a new grid; the first slot is one interval (or the next
+    // aligned time) from `nowUs`. `utcOffsetS` is the local time zone.
+    void configure(ScheduleMode mode, uint32_t intervalMs, int32_t utcOffsetS,
+                   SchedulePolicy policy, uint8_t maxCatchUp, int64_t nowUs);
+
+    // True if a slot is due at `nowUs`, which is then taken
+    bool due(int64_t nowUs);
+
+    int64_t deadlineUs() const { return next; }   // esp_timer time of the next slot
+    uint32_t slotTime() const { return slotUnix; }
+    uint32_t lateUs() const { return late; }
+    uint32_t skipped() const { return missed; }
+
+    ScheduleMode mode() const { return schedMode; }
+    uint32_t intervalMs() const { return (uint32_t)(step / 1000); }
+
+    // First multiple of `stepUs` after `wallUs` (Unix us), counted from
+    // local midnight. The grid restarts at midnight for intervals that
+    // do not divide a day.
+    static int64_t alignedAfter(int64_t wallUs, int64_t stepUs, int32_t utcOffsetS);
+
+    // Unix time in us, or 0 while the clock is not set
+    static int64_t wallNowUs();
+
+private:
+    void place(int64_t slotUs, int64_t slotWallUs);
+
+    ScheduleMode schedMode = SCHEDULE_INTERVAL;
+    SchedulePolicy policy = SCHEDULE_SKIP;
+    uint8_t maxCatchUp = 0;
+    int32_t utcOffset = 0;
+    int64_t step = 1000000;
+    int64_t next = 0;
+    bool onWall = false;     // Aligned mode: `next` was placed from the wall clock
+
+    uint32_t slotUnix = 0;
+    uint32_t late = 0;
+    uint32_t missed = 0;
+};
@@ -0,0 +1,94 @@
+// ================================================================
+// SD CARD
+// ================================================================
+// Mounts the card at the fastest bus clock that passes a write/read
+// verify probe, and notices when it stops answering so the caller can
+// unmount and try again later.
+//
+// mount() walks down a list of clocks (SD_SPI_CLOCKS_KHZ, or
+// SD_MMC_CLOCKS_KHZ on the SDMMC peripheral). At each step it writes
+// SD_PROBE_SECTORS sectors of a pattern to SD_PROBE_PATH, reads them
+// back and compares. The first clock that passes is kept. After a
+// runtime failure the next mount starts one step lower, so a marginal
+// clock is not negotiated again and again.
+//
+// check() reopens the probe file and compares its first sector, which
+// always goes to the card: FatFS gives every open file its own sector
+// buffer. It is cheap enough to call every few seconds.
+//
+// benchmark() is the commissioning test: a sequential write and read
+// of SD_BENCH_PATH in SD_BENCH_CHUNK pieces, verified and removed.
+//
+// SPI goes through the Arduino SD driver, which has no DMA option.
+// Build with -D SD_USE_SDMMC=1 (1-bit) or 4 (4-bit) to use the SDMMC
+// host instead, which moves every sector by DMA.
+
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SPI.h>
+
+const char* const SD_PROBE_PATH = "/probe.bin";
+const uint8_t SD_PROBE_SECTORS = 16;   // 8 KB per clock step
+const size_t SD_SECTOR_BYTES = 512;
+const char* const SD_BENCH_PATH = "/bench.bin";
+const size_t SD_BENCH_CHUNK = 8 * SD_SECTOR_BYTES;
+
+enum SdBus : uint8_t {
+    SD_BUS_SPI,
+    SD_BUS_SDMMC_1BIT,
+    SD_BUS_SDMMC_4BIT
+};
+
+class SdCard {
+public:
+    // SPI wiring. For SDMMC 1-bit the same pins double as CLK (sck),
+    // CMD (mosi), D0 (miso) and D3 (cs, held high).
+    SdCard(SPIClass& spi, int8_t sck, int8_t miso, int8_t mosi, int8_t cs);
+
+    // Switches to the SDMMC host. D1/D2 are only used in 4-bit mode.
+    void useSdmmc(bool fourBit, int8_t d1 = -1, int8_t d2 = -1);
+
+    bool mount();
+
+    // `degrade`: the card failed at runtime, renegotiate one clock lower
+    void unmount(bool degrade = false);
+
+    // Returns false if the card no longer reads back the probe sector
+    bool check();
+
+    // Writes `kb` KB, reads it back and compares. False on an I/O error
+    // or a mismatch; the rates are then 0.
+    bool benchmark(uint32_t kb, uint32_t& writeKBps, uint32_t& readKBps);
+
+    bool mounted() const { return isMounted; }
+    fs::FS& fs();
+
+    SdBus bus() const { return busMode; }
+    const char* busName() const;
+    uint32_t clockKHz() const { return clockK; }
+    uint32_t probeKBps() const { return probeRate; }   // Write + read, at the kept clock
+    uint32_t mountCount() const { return mounts; }
+
+private:
+    bool begin(uint32_t khz);
+    void end();
+    bool probe(uint32_t seed);
+    static void fillPattern(uint8_t* buf, uint32_t seed, uint32_t sector);
+
+    SPIClass& spi;
+    int8_t sckPin, misoPin, mosiPin, csPin;
+    int8_t d1Pin = -1, d2Pin = -1;
+
+    SdBus busMode = SD_BUS_SPI;
+    bool isMounted = false;
+    uint8_t firstStep = 0;     // Index into the clock list mount() starts at
+    uint8_t step = 0;          // Index of the clock in use
+    uint32_t clockK = 0;
+    uint32_t probeRate = 0;
+    uint32_t probeSeed = 0;    // Pattern of the probe file on the card
+    uint32_t mounts = 0;
+
+    uint8_t sector[SD_SECTOR_BYTES];
+};
@@ -0,0 +1,129 @@
+// ================================================================
+// SD SEGMENTED RING LOG
+// ================================================================
+// Append-only store for readings that could not be uploaded. The log
+// is a ring of SDLOG_SEGMENTS segment files under /log, each holding
+// SDLOG_SEGMENT_RECORDS readings. Cursors are plain record counters
+// (readIdx <= writeIdx), so the segment is derived arithmetically and
+// appends never touch the directory.
+//
+// Readings are stored as delta/varint blocks (sample_codec.h), one
+// block per append() call of up to SAMPLE_BLOCK_MAX readings, which
+// brings a steady 1-field reading down to a few bytes. Within a
+// segment a record is found by walking block headers; the position of
+// the last block read is cached, so draining the log in order never
+// rescans.
+//
+// Crash safety:
+//  - every block carries a CRC and its first record index, so a torn
+//    append is detected and overwritten on resume;
+//  - every segment starts with a header naming which lap of the ring
+//    it belongs to, so stale data from an earlier lap is not replayed;
+//  - the index keeps two alternating slots with a generation counter,
+//    so a torn index write falls back to the previous cursor pair.
+
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+
+#include "sample.h"
+#include "sample_codec.h"
+
+const uint32_t SDLOG_SEGMENTS = 256;
+const uint32_t SDLOG_SEGMENT_RECORDS = 4096;
+const uint32_t SDLOG_CAPACITY = SDLOG_SEGMENTS * SDLOG_SEGMENT_RECORDS;
+const size_t SDLOG_BLOCK_BYTES = 2048;   // Largest block written, header included
+
+// A decoded reading as handed out by read(). Not the on-card format.
+struct __attribute__((packed)) SdLogRecord {
+    Sample   sample;
+    uint16_t reserved;
+    uint16_t crc;
+};
+
+class SdLog {
+public:
+    bool begin(fs::FS& fs);
+    void end();
+
+    bool append(const Sample& sample);
+
+    // Stores `n` readings as few blocks as possible. Returns how many
+    // were stored, in order.
+    size_t append(const Sample* samples, size_t n);
+
+    // Reads up to `max` records, starting `skip` records past the read
+    // cursor, without consuming them. Records failing their CRC are
+    // still returned so the caller can consume() across them; check
+    // them with valid().
+    size_t read(SdLogRecord* out, size_t max, uint32_t skip = 0);
+
+    // Copies whole blocks as stored on the card, starting `skip`
+    // records past the read cursor, into `buf` while they fit in `cap`
+    // (at least SDLOG_BLOCK_BYTES). Nothing is decoded, except a block
+    // the read cursor is part-way through, which is re-encoded from
+    // the cursor on. Returns the bytes written and sets `records` to
+    // the records they cover; a damaged segment tail is skipped by
+    // returning 0 bytes covering it. `records` is 0 at the end of the
+    // log or when `cap` is exhausted.
+    size_t readBlocks(uint32_t skip, uint8_t* buf, size_t cap, uint32_t& records);
+
+    // Advances the read cursor past `count` records once they have
+    // been acknowledged by the server.
+    bool consume(size_t count);
+
+    static bool valid(const SdLogRecord& rec);
+
+    uint32_t pending() const { return writeIdx - readIdx; }
+    uint32_t dropped() const { return droppedRecords; }
+    bool isOpen() const { return fs != nullptr; }
+
+private:
+    struct __attribute__((packed)) SegmentHeader {
+        uint32_t magic;
+        uint32_t lap;       // writeIdx / SDLOG_SEGMENT_RECORDS at creation
+        uint32_t crc;
+    };
+
+    struct __attribute__((packed)) IndexSlot {
+        uint32_t magic;
+        uint32_t generation;
+        uint32_t readIdx;
+        uint32_t writeIdx;
+        uint32_t crc;
+    };
+
+    File openFile(const String& path, const char* mode);
+    static String segmentPath(uint32_t lap);
+    bool loadIndex();
+    bool saveIndex();
+    bool openWriteSegment(bool create);
+    bool segmentMatches(File& file, uint32_t lap);
+    bool readBlockHeader(File& file, uint32_t pos, uint32_t first, SampleBlockHeader& hdr);
+    File* acquireSegment(uint32_t lap, File& own);
+    void releaseSegment(File* file);
+    bool findBlock(File& file, uint32_t idx, uint32_t& pos, SampleBlockHeader& hdr);
+    bool loadBlock(uint32_t idx);
+
+    fs::FS* fs = nullptr;
+    File writeFile;
+    uint32_t writeLap = 0;     // Lap writeFile belongs to
+    size_t writeEnd = 0;       // Append position while writeFile is read from
+    uint32_t readIdx = 0;
+    uint32_t writeIdx = 0;
+    uint32_t generation = 0;
+    uint32_t droppedRecords = 0;
+
+    // Where the last block read() decoded starts, to resume the walk
+    uint32_t scanLap = UINT32_MAX;
+    uint32_t scanPos = 0;
+    uint32_t scanFirst = 0;
+
+    // That block, decoded
+    Sample cached[SAMPLE_BLOCK_MAX];
+    uint32_t cachedFirst = 0;
+    uint8_t cachedCount = 0;
+
+    uint8_t blockBuf[SDLOG_BLOCK_BYTES];
+};
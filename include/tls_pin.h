@@ -0,0 +1,44 @@
+// ================================================================
+// TLS PINNING
+// ================================================================
+// Server check for the HTTPS and MQTTS uplinks without a CA bundle:
+// the SHA-256 of the server's SubjectPublicKeyInfo must match one of
+// up to TLS_PIN_MAX pins. That is one hash per handshake instead of a
+// chain validation, and it survives certificate renewals that keep
+// the key. Set a second pin ahead of a key rotation.
+//
+// Pins are base64, as in HPKP and curl --pinnedpubkey:
+//   openssl x509 -in cert.pem -pubkey -noout |
+//     openssl pkey -pubin -outform der | openssl dgst -sha256 -binary | base64
+//
+// With no pins set the connection is not verified, as before.
+//
+// tlsUsePsram() moves mbedTLS's large allocations (record buffers,
+// certificate copies) to PSRAM, keeping 30+ KB of internal RAM free
+// for each open TLS connection.
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFiClientSecure.h>
+
+const uint8_t TLS_PIN_MAX = 2;      // Current key and the next one
+const size_t TLS_PIN_BYTES = 32;    // SHA-256
+const size_t TLS_PSRAM_MIN_BYTES = 2048;  // Smaller (bignum) allocations stay internal
+
+struct TlsPins {
+    uint8_t count;
+    uint8_t sha256[TLS_PIN_MAX][TLS_PIN_BYTES];
+};
+
+// Comma-separated base64 pins; "" clears them. On failure `out` is
+// unchanged.
+bool tlsParsePins(const char* text, TlsPins& out);
+
+// After connect(): true if no pins are set or the server's key
+// matches one of them
+bool tlsCheckPins(WiFiClientSecure& client, const TlsPins& pins);
+
+// Call once at boot, before the first connection. False if there is
+// no PSRAM or mbedTLS was built without a settable allocator.
+bool tlsUsePsram();
@@ -0,0 +1,32 @@
+// ================================================================
+// UPLINK TRANSPORT
+// ================================================================
+// What the uplink task sends readings through. Backends decide the
+// wire format and what counts as "delivered"; the task only pops from
+// the ring / consumes from the SD log what upload() reports as
+// acknowledged, so anything in flight when a link drops is simply
+// sent again.
+
+#pragma once
+
+#include <stddef.h>
+
+#include "sample.h"
+
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    // Sends `n` readings in order. Returns how many were acknowledged,
+    // counted from the first.
+    virtual size_t upload(const Sample* samples, size_t n) = 0;
+
+    // Most readings worth handing to one upload() call
+    virtual size_t batchLimit() const = 0;
+
+    // Housekeeping between uploads (keep-alive pings and the like)
+    virtual void service() {}
+
+    virtual void stop() = 0;
+    virtual const char* name() const = 0;
+};
@@ -0,0 +1,167 @@
+// ================================================================
+// UPLINK CONNECTION
+// ================================================================
+// Long-lived HTTP(S) connection shared by the live upload path and
+// the SD backlog drain. Requests go out as HTTP/1.1 keep-alive, so
+// the TLS handshake is only paid when the socket has to be
+// (re)opened, not once per reading.
+//
+// WiFiClientSecure does not expose mbedTLS session save/restore, so
+// a socket the server has dropped still costs a full handshake. HTTPS
+// servers are checked against the pins of setPins() (tls_pin.h).
+//
+// URLs, headers and response bodies live in fixed buffers; a request
+// makes no heap allocations of its own. Streamed bodies go out with
+// chunked transfer encoding through one DMA-capable buffer, allocated
+// on first use, which the body source fills directly (e.g. from SD).
+// Large downloads (OTA images) go the other way through a body sink,
+// a block at a time, optionally as a Range request.
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <WiFiClientSecure.h>
+
+#include "tls_pin.h"
+
+// Negative return codes of Uplink::get()/post(). Positive values are
+// HTTP status codes.
+enum UplinkError {
+    UPLINK_ERR_NO_WIFI  = -1,
+    UPLINK_ERR_BAD_URL  = -2,
+    UPLINK_ERR_CONNECT  = -3,
+    UPLINK_ERR_SEND     = -4,
+    UPLINK_ERR_TIMEOUT  = -5,
+    UPLINK_ERR_CLOSED   = -6,
+    UPLINK_ERR_PROTOCOL = -7,
+    UPLINK_ERR_NO_MEMORY = -8
+};
+
+const size_t UPLINK_MAX_BODY = 512;   // Suggested response buffer size
+const size_t UPLINK_HOST_MAX = 64;
+const size_t UPLINK_CHUNK_BYTES = 8 * 512;   // Streamed body chunk, a whole number of SD sectors
+
+// Produces a request body for Uplink::postStream(), one chunk at a time.
+class UplinkBodySource {
+public:
+    virtual ~UplinkBodySource() {}
+
+    // Starts the body from the beginning. Called before each attempt,
+    // so the source must be able to replay what it produced before.
+    virtual bool rewind() = 0;
+
+    // Writes up to `cap` bytes of body into `buf` (4-byte aligned,
+    // DMA-capable). Returns how many; 0 ends the body.
+    virtual size_t read(uint8_t* buf, size_t cap) = 0;
+};
+
+// Takes a response body from Uplink::getStream() as it arrives. Only
+// 2xx bodies are passed on.
+class UplinkBodySink {
+public:
+    virtual ~UplinkBodySink() {}
+
+    // Returns false to abandon the response (and the connection)
+    virtual bool write(const uint8_t* data, size_t len) = 0;
+};
+
+class Uplink {
+public:
+    explicit Uplink(unsigned long timeoutMs);
+
+    // GET `url` over the persistent connection. Up to bodyCap - 1
+    // bytes of the response body land NUL-terminated in `body`.
+    int get(const char* url, char* body, size_t bodyCap);
+
+    // POST `len` bytes of `payload` to `url` in a single request, with
+    // a Content-Encoding header if `contentEncoding` is set.
+    int post(const char* url, const char* contentType,
+             const uint8_t* payload, size_t len, char* body, size_t bodyCap,
+             const char* contentEncoding = nullptr);
+
+    // POST a body of unknown length from `source`, sent as chunks of
+    // up to UPLINK_CHUNK_BYTES.
+    int postStream(const char* url, const char* contentType, UplinkBodySource& source,
+                   char* body, size_t bodyCap, const char* contentEncoding = nullptr);
+
+    // GET bytes `from`..`to` (inclusive) of `url` into `sink`. The
+    // server answers 206, or 200 with the whole body if it ignores the
+    // Range header. The timeout applies between blocks, not to the
+    // whole body.
+    int getStream(const char* url, UplinkBodySink& sink, uint32_t from, uint32_t to);
+
+    // Full size of the resource in the latest response (Content-Range
+    // total, or Content-Length of a 200); -1 if not known
+    long contentTotal() const { return total; }
+
+    // HEAD `url`, for reachability and round-trip tests. The response
+    // carries no body, whatever its headers say.
+    int head(const char* url);
+
+    void stop();
+    bool isConnected();
+
+    // Takes effect on the next connect; the current one is dropped
+    void setPins(const TlsPins& serverPins);
+    bool pinned() const { return pins.count > 0; }
+
+    // Connect time of the latest (re)connection, TLS handshake included
+    uint32_t connectUs() const { return lastConnectUs; }
+
+    unsigned long handshakeCount() const { return handshakes; }
+    unsigned long requestCount() const { return requests; }
+
+private:
+    struct UrlParts {
+        bool secure;
+        char host[UPLINK_HOST_MAX];
+        uint16_t port;
+        const char* path;   // Points into the URL; may start with '?' or be empty
+    };
+
+    static bool parseUrl(const char* url, UrlParts& parts);
+    bool ensureConnected(const UrlParts& parts);
+    int  request(const char* method, const char* url, const char* contentType,
+                 const char* contentEncoding, const uint8_t* payload, size_t len,
+                 UplinkBodySource* source, char* out, size_t outCap);
+    int  sendRequest(const char* method, const char* path, const char* contentType,
+                     const char* contentEncoding, const uint8_t* payload, size_t len,
+                     UplinkBodySource* source);
+    int  sendChunks(UplinkBodySource& source);
+    int  readResponse();
+    int  readByte(unsigned long deadline);
+    bool readLine(char* buf, size_t cap, unsigned long deadline);
+    bool readBody(size_t len, unsigned long& deadline);
+    bool sinkBody(size_t len, unsigned long& deadline);
+    void keepBody(char c);
+
+    WiFiClient plainClient;
+    WiFiClientSecure secureClient;
+    WiFiClient* client = nullptr;
+
+    char curHost[UPLINK_HOST_MAX] = "";
+    uint16_t curPort = 0;
+    bool curSecure = false;
+    bool keepAlive = false;
+    bool headRequest = false;   // Request in flight is a HEAD
+    bool requestSent = false;   // Some of it reached the socket
+    long total = -1;
+
+    UplinkBodySink* bodySink = nullptr;   // getStream() in flight
+    bool sinking = false;                 // Its response is a 2xx
+    uint32_t rangeFrom = 0;
+    uint32_t rangeTo = 0;
+
+    char* bodyBuf = nullptr;   // Caller's response buffer for the request in flight
+    size_t bodyCap = 0;
+    size_t bodyLen = 0;
+
+    uint8_t* chunkBuf = nullptr;   // Size line + UPLINK_CHUNK_BYTES + CRLF
+
+    unsigned long timeout;
+    unsigned long handshakes = 0;
+    unsigned long requests = 0;
+    uint32_t lastConnectUs = 0;
+    TlsPins pins = {};
+};
@@ -0,0 +1,122 @@
+// ================================================================
+// WI-FI CONNECTION MANAGER
+// ================================================================
+// Non-blocking station manager driven by WiFi.onEvent. The event
+// callbacks only record what happened; loop() runs the state machine
+// from the config task and never waits on the radio.
+//
+// Saved networks (wifi_db/nets) carry the BSSID and channel of their
+// last good association. A reconnect first goes straight to that AP
+// on that channel, skipping the all-channel scan, and only then falls
+// back to a normal connect. Networks are tried in order of most recent
+// success, then last seen RSSI. When every candidate fails the
+// manager backs off exponentially before trying the list again.
+//
+// The list is loaded once in begin() and kept in RAM; NVS is only
+// written when an entry actually changes. It is stored as a
+// WifiNetList record (config_store.h) under wifi_db/list. A JSON list
+// left by older firmware in wifi_db/nets is imported once and removed:
+//   [{"s":ssid,"p":pass,"b":"aabbccddeeff","c":6,"r":-61,"n":12}, ...]
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+const uint8_t WIFI_MAX_SAVED = 5;
+const unsigned long WIFI_FAST_TIMEOUT_MS = 3000;    // Cached BSSID/channel attempt
+const unsigned long WIFI_FULL_TIMEOUT_MS = 10000;   // Attempt with a channel scan
+const unsigned long WIFI_BACKOFF_MIN_MS = 1000;
+const unsigned long WIFI_BACKOFF_MAX_MS = 60000;
+
+struct WifiNetwork {
+    char ssid[33];
+    char pass[65];
+    uint8_t bssid[6];
+    uint8_t channel;        // 0 = nothing cached
+    int8_t rssi;            // 0 = unknown
+    uint32_t lastSuccess;   // 0 = never; success sequence number, higher = more recent
+};
+
+// NVS record of the saved networks
+struct WifiNetList {
+    uint32_t count;
+    WifiNetwork nets[WIFI_MAX_SAVED];
+};
+
+class WifiManager {
+public:
+    typedef void (*ConnectedCallback)();
+    typedef void (*ResultCallback)(bool ok);
+
+    // Loads wifi_db and hooks the Wi-Fi events. `onConnected` runs on
+    // every association (from loop()).
+    void begin(ConnectedCallback onConnected);
+
+    // Call regularly from one task
+    void loop();
+
+    // Connects to new credentials ahead of the saved ones. They are
+    // only saved if the connection succeeds. `onResult` fires once.
+    void connectTo(const String& ssid, const String& pass, ResultCallback onResult);
+
+    // Erases wifi_db and drops the link
+    void forget();
+
+    // Seen in a scan; feeds ranking for saved networks
+    void noteRssi(const char* ssid, int8_t rssi);
+
+    // While held, no new attempt is started (a scan is sharing the
+    // radio); events are kept and handled once released.
+    void hold(bool on) { held = on; }
+    bool isConnecting() const { return state == WM_CONNECTING; }
+
+    bool isConnected() const { return state == WM_CONNECTED; }
+    uint8_t savedCount() const { return count; }
+
+private:
+    enum State { WM_IDLE, WM_CONNECTING, WM_CONNECTED, WM_BACKOFF };
+
+    struct Attempt {
+        int8_t net;    // Index into nets, -1 = the explicit request
+        bool fast;     // Use the cached BSSID/channel
+    };
+
+    void onEvent(arduino_event_id_t event, arduino_event_info_t info);
+    void load();
+    bool loadLegacy();
+    void save();
+    void buildPlan();
+    void startNext();
+    void succeeded();
+    void finishRequest(bool ok);
+    WifiNetwork& attemptNet(const Attempt& a) { return a.net < 0 ? request : nets[a.net]; }
+
+    WifiNetwork nets[WIFI_MAX_SAVED];
+    uint8_t count = 0;
+    uint32_t successSeq = 0;
+
+    WifiNetwork request = {};
+    bool hasRequest = false;
+    ResultCallback requestCb = nullptr;
+    ConnectedCallback connectedCb = nullptr;
+
+    Attempt plan[2 * WIFI_MAX_SAVED + 2];
+    uint8_t planLen = 0;
+    uint8_t planPos = 0;
+    Attempt current = {};
+
+    State state = WM_IDLE;
+    unsigned long attemptStart = 0;
+    unsigned long backoffUntil = 0;
+    uint8_t failures = 0;
+    bool held = false;
+
+    // Written by the Wi-Fi event task, consumed by loop()
+    volatile bool evGotIp = false;
+    volatile bool evDisconnected = false;
+    volatile unsigned long evDisconnectAt = 0;
+    volatile uint8_t evReason = 0;
+    uint8_t evBssid[6] = {};
+    volatile uint8_t evChannel = 0;
+};
@@ -0,0 +1,49 @@
+// ================================================================
+// WI-FI SCAN
+// ================================================================
+// Asynchronous scan that leaves the station associated: the driver
+// hops off-channel between beacons, so the uplink keeps running. The
+// results are deduplicated by SSID (strongest AP wins), sorted by
+// RSSI and capped, ready to be streamed to the phone record by record.
+
+#pragma once
+
+#include <Arduino.h>
+#include <WiFi.h>
+
+const uint8_t WIFI_SCAN_MAX = 32;
+const uint32_t WIFI_SCAN_DWELL_MS = 120;   // Per channel; keeps the gaps short
+
+struct ScanRecord {
+    char ssid[33];
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t auth;       // wifi_auth_mode_t
+};
+
+class WifiScan {
+public:
+    // Starts a scan unless one is running. Returns false if the driver
+    // refused (e.g. while it is associating).
+    bool start();
+
+    // True once, when a started scan has finished (successfully or
+    // not); the results are then in record().
+    bool poll();
+
+    bool running() const { return busy; }
+    bool failed() const { return error; }
+    uint8_t count() const { return n; }
+    const ScanRecord& record(uint8_t i) const { return records[i]; }
+
+    void setLimit(uint8_t limit) { cap = min(limit, WIFI_SCAN_MAX); }
+
+private:
+    void collect(int16_t found);
+
+    ScanRecord records[WIFI_SCAN_MAX];
+    uint8_t n = 0;
+    uint8_t cap = WIFI_SCAN_MAX;
+    bool busy = false;
+    bool error = false;
+};
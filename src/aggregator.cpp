@@ -0,0 +1,219 @@
+// ================================================================
+// SAMPLE AGGREGATOR
+// ================================================================
+
+#include "aggregator.h"
+
+static const float DECIMAL_SCALE[4] = { 1.0f, 10.0f, 100.0f, 1000.0f };
+
+void AggregateSettings::setDefault() {
+    windowS = 0;
+    heartbeatS = 0;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) deadband[i] = 0.0f;
+    alarmMask = 0;
+}
+
+bool AggregateSettings::fromJson(JsonObjectConst obj, String& error) {
+    AggregateSettings parsed;
+    parsed.setDefault();
+
+    long window = obj["w"] | 0L;
+    long heartbeat = obj["hb"] | 0L;
+    if (window < 0 || window > AGG_MAX_WINDOW) {
+        error = "w must be 0-" + String(AGG_MAX_WINDOW);
+        return false;
+    }
+    if (heartbeat < 0 || heartbeat > AGG_MAX_HEARTBEAT) {
+        error = "hb must be 0-" + String(AGG_MAX_HEARTBEAT);
+        return false;
+    }
+    parsed.windowS = window;
+    parsed.heartbeatS = heartbeat;
+
+    JsonArrayConst db = obj["db"].as<JsonArrayConst>();
+    if (db.size() > SAMPLE_MAX_FIELDS) {
+        error = "db has more than " + String(SAMPLE_MAX_FIELDS) + " fields";
+        return false;
+    }
+    uint8_t i = 0;
+    for (JsonVariantConst v : db) {
+        float band = v.as<float>();
+        if (!(band >= 0.0f && band <= 9999.0f)) { error = "bad deadband"; return false; }
+        parsed.deadband[i++] = band;
+    }
+
+    for (JsonVariantConst v : obj["al"].as<JsonArrayConst>()) {
+        int field = v.as<int>();
+        if (field < 1 || field > SAMPLE_MAX_FIELDS) {
+            error = "al fields must be within 1-" + String(SAMPLE_MAX_FIELDS);
+            return false;
+        }
+        parsed.alarmMask |= 1 << (field - 1);
+    }
+
+    *this = parsed;
+    return true;
+}
+
+void AggregateSettings::toJson(JsonObject obj) const {
+    obj["w"] = windowS;
+    obj["hb"] = heartbeatS;
+    JsonArray db = obj["db"].to<JsonArray>();
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) db.add(deadband[i]);
+    JsonArray al = obj["al"].to<JsonArray>();
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if ((alarmMask >> i) & 1) al.add(i + 1);
+    }
+}
+
+static void appendStatKey(PayloadBuilder& out, StatsFormat format, const char* name, uint8_t field) {
+    out.append(format == STATS_QUERY ? '&' : ',');
+    if (format == STATS_JSON) out.append('"');
+    out.append(name);
+    if (field > 0) out.appendUInt(field);
+    out.append(format == STATS_JSON ? "\":" : "=");
+}
+
+void appendWindowStats(PayloadBuilder& out, const Sample& sample, StatsFormat format) {
+    if (!sampleIsWindow(sample)) return;
+    const SampleWindow& w = sample.window;
+    uint8_t minDecimals = format == STATS_JSON ? 0 : 2;
+
+    appendStatKey(out, format, "n", 0);
+    out.appendUInt(w.count);
+    appendStatKey(out, format, "w", 0);
+    out.appendUInt(w.seconds);
+
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(sample, i)) continue;
+        uint8_t dp = sampleDecimals(sample, i);
+        appendStatKey(out, format, "min", i + 1);
+        out.appendFixed(w.min[i], dp, minDecimals);
+        appendStatKey(out, format, "max", i + 1);
+        out.appendFixed(w.max[i], dp, minDecimals);
+        appendStatKey(out, format, "avg", i + 1);
+        out.appendFixed(w.mean[i], dp, minDecimals);
+        if (w.transitions[i] > 0) {
+            appendStatKey(out, format, "al", i + 1);
+            out.appendUInt(w.transitions[i]);
+        }
+    }
+}
+
+void appendEventInfo(PayloadBuilder& out, const Sample& sample, StatsFormat format) {
+    if (!(sample.flags & SAMPLE_ALARM_EVENT)) return;
+    appendStatKey(out, format, "ev", 0);
+    out.appendUInt(1);
+    appendStatKey(out, format, "ms", 0);
+    out.appendUInt(sample.ms);
+}
+
+void Aggregator::configure(const AggregateSettings& settings) {
+    cfg = settings;
+    active = false;
+    alarmKnown = 0;
+    reportedOnce = false;
+}
+
+void Aggregator::open(const Sample& reading, uint32_t nowMs) {
+    active = true;
+    startMs = nowMs;
+    acc = {};
+    acc.timestamp = reading.timestamp;
+    acc.flags = reading.flags;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        sum[i] = 0;
+        seen[i] = 0;
+        acc.window.min[i] = 0xFFFF;
+        acc.window.max[i] = 0;
+    }
+}
+
+void Aggregator::fold(const Sample& reading) {
+    SampleWindow& w = acc.window;
+    if (w.count < 0xFFFF) w.count++;
+    // A window is only as trustworthy as its worst timestamp
+    acc.flags &= reading.flags;
+
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(reading, i)) continue;
+        uint16_t v = reading.regs[i];
+        sampleSetField(acc, i, v, sampleDecimals(reading, i));
+        sum[i] += v;
+        seen[i]++;
+        if (v < w.min[i]) w.min[i] = v;
+        if (v > w.max[i]) w.max[i] = v;
+
+        if ((cfg.alarmMask >> i) & 1) {
+            uint8_t bit = 1 << i;
+            bool on = v != 0;
+            if ((alarmKnown & bit) && on != ((alarmState & bit) != 0) && w.transitions[i] < 0xFF) {
+                w.transitions[i]++;
+            }
+            alarmKnown |= bit;
+            alarmState = on ? (alarmState | bit) : (alarmState & ~bit);
+        }
+    }
+}
+
+void Aggregator::close(uint32_t nowMs, Sample& out) {
+    out = acc;
+    out.window.seconds = min((nowMs - startMs + 500) / 1000, (uint32_t)0xFFFF);
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (seen[i] == 0) {
+            out.window.min[i] = out.window.max[i] = out.window.mean[i] = 0;
+        } else {
+            out.window.mean[i] = (sum[i] + seen[i] / 2) / seen[i];
+        }
+    }
+    active = false;
+}
+
+bool Aggregator::worthReporting(const Sample& rec, uint32_t nowMs) const {
+    if (!reportedOnce || rec.fieldMask != reportedMask) return true;
+    if (cfg.heartbeatS > 0 && nowMs - reportedMs >= cfg.heartbeatS * 1000UL) return true;
+
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(rec, i)) continue;
+        if (rec.window.transitions[i] > 0) return true;
+        if (cfg.deadband[i] <= 0.0f) return true;
+
+        // Any excursion out of the band counts, not just the mean
+        float band = cfg.deadband[i] * DECIMAL_SCALE[sampleDecimals(rec, i)];
+        float ref = reportedMean[i];
+        if (rec.window.max[i] - ref > band || ref - rec.window.min[i] > band) return true;
+    }
+    return false;
+}
+
+void Aggregator::markReported(const Sample& rec, uint32_t nowMs) {
+    reportedOnce = true;
+    reportedMs = nowMs;
+    reportedMask = rec.fieldMask;
+    memcpy(reportedMean, rec.window.mean, sizeof(reportedMean));
+}
+
+bool Aggregator::add(const Sample& reading, uint32_t nowMs, Sample& out) {
+    bool report = false;
+
+    if (active && nowMs - startMs >= cfg.windowS * 1000UL) {
+        close(nowMs, out);
+        report = worthReporting(out, nowMs);
+        if (report) {
+            markReported(out, nowMs);
+        } else {
+            suppressed++;
+        }
+    }
+
+    if (!active) open(reading, nowMs);
+    fold(reading);
+    return report;
+}
+
+bool Aggregator::flush(uint32_t nowMs, Sample& out) {
+    if (!active || acc.window.count == 0) return false;
+    close(nowMs, out);
+    markReported(out, nowMs);
+    return true;
+}
@@ -0,0 +1,235 @@
+// ================================================================
+// BLE SENSOR GATEWAY
+// ================================================================
+
+#include "ble_gateway.h"
+
+static const uint16_t BTHOME_UUID = 0xFCD2;
+static const uint8_t AD_SERVICE_DATA_16 = 0x16;
+static const uint8_t AD_MANUFACTURER = 0xFF;
+
+// Size of a BTHome v2 object value, or 0 for an id we cannot skip
+static uint8_t bthomeSize(uint8_t id) {
+    if (id >= 0x15 && id <= 0x2D) return 1;   // Binary sensors
+    switch (id) {
+    case 0x00: case 0x01: case 0x09: case 0x0F: case 0x10: case 0x11:
+    case 0x2E: case 0x2F: case 0x3A: case 0x46:
+        return 1;
+    case 0x02: case 0x03: case 0x06: case 0x07: case 0x08: case 0x0C:
+    case 0x0D: case 0x0E: case 0x12: case 0x13: case 0x14: case 0x3C:
+    case 0x3D: case 0x3F: case 0x40: case 0x41: case 0x43: case 0x44:
+    case 0x45: case 0x47: case 0x48: case 0x49: case 0x4A: case 0x51:
+    case 0x52:
+        return 2;
+    case 0x04: case 0x05: case 0x0A: case 0x0B: case 0x42: case 0x4B:
+        return 3;
+    case 0x3E: case 0x4C: case 0x4D: case 0x4E: case 0x4F: case 0x50:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+// Little-endian value of `size` bytes; wider than 16 bits saturates
+static uint16_t readLe(const uint8_t* p, uint8_t size) {
+    uint32_t v = 0;
+    for (uint8_t i = 0; i < size; i++) v |= (uint32_t)p[i] << (8 * i);
+    return size > 2 && v > 0xFFFF ? 0xFFFF : (uint16_t)v;
+}
+
+static bool parseBthome(const uint8_t* data, size_t len, uint8_t objectId, uint16_t& value) {
+    // Device info: bit 0 encryption, bits 5-7 version
+    if (len < 1 || (data[0] & 0x01) || (data[0] >> 5) != 2) return false;
+
+    size_t i = 1;
+    while (i < len) {
+        uint8_t id = data[i];
+        uint8_t size = bthomeSize(id);
+        if (size == 0 || i + 1 + size > len) return false;
+        if (id == objectId) {
+            value = readLe(data + i + 1, size);
+            return true;
+        }
+        i += 1 + size;
+    }
+    return false;
+}
+
+bool BleGateway::parseAdvert(const BleSensorEntry& e, const uint8_t* adv, size_t len, uint16_t& value) {
+    uint8_t type = e.format == BLE_FMT_MANUFACTURER ? AD_MANUFACTURER : AD_SERVICE_DATA_16;
+    uint16_t uuid = e.format == BLE_FMT_BTHOME ? BTHOME_UUID : e.uuid;
+
+    // AD structures: length (type + data), type, data
+    size_t i = 0;
+    while (i + 1 < len) {
+        uint8_t adLen = adv[i];
+        if (adLen == 0 || i + 1 + adLen > len) break;
+        const uint8_t* ad = adv + i + 1;
+        if (ad[0] == type && adLen >= 3 && (uint16_t)(ad[1] | ad[2] << 8) == uuid) {
+            const uint8_t* data = ad + 3;
+            size_t n = adLen - 3;
+            if (e.format == BLE_FMT_BTHOME) return parseBthome(data, n, e.offset, value);
+            if ((size_t)e.offset + 2 > n) return false;
+            value = readLe(data + e.offset, 2);
+            return true;
+        }
+        i += 1 + adLen;
+    }
+    return false;
+}
+
+void BleGateway::setDefault() {
+    portENTER_CRITICAL(&lock);
+    count = 0;
+    seenMask = 0;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool BleGateway::fromJson(JsonArrayConst arr, String& error) {
+    BleSensorEntry parsed[BLE_GW_MAX_SENSORS];
+    uint8_t n = 0;
+
+    for (JsonObjectConst obj : arr) {
+        if (n >= BLE_GW_MAX_SENSORS) {
+            error = "too many sensors (max " + String(BLE_GW_MAX_SENSORS) + ")";
+            return false;
+        }
+
+        BleSensorEntry& e = parsed[n];
+        memset(&e, 0, sizeof(e));
+        const char* mac = obj["m"] | "";
+        int format = obj["t"] | 0;
+        const char* uuid = obj["u"] | "";
+        int offset = obj["o"] | 0;
+        int field = obj["f"] | 0;
+        int dp = obj["dp"] | 0;
+
+        e.anyMac = mac[0] == '\0';
+        if (!e.anyMac && sscanf(mac, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx",
+                                &e.mac[0], &e.mac[1], &e.mac[2], &e.mac[3], &e.mac[4], &e.mac[5]) != 6) {
+            error = "bad MAC";
+            return false;
+        }
+        if (format < BLE_FMT_BTHOME || format > BLE_FMT_MANUFACTURER) { error = "t must be 0-2"; return false; }
+        if (format != BLE_FMT_BTHOME) {
+            char* end;
+            unsigned long u = strtoul(uuid, &end, 16);
+            if (uuid[0] == '\0' || *end != '\0' || u > 0xFFFF) { error = "bad u"; return false; }
+            e.uuid = u;
+        }
+        if (offset < 0 || offset > 255) { error = "bad o"; return false; }
+        if (field < 1 || field > SAMPLE_MAX_FIELDS) {
+            error = "fields must be within 1-" + String(SAMPLE_MAX_FIELDS);
+            return false;
+        }
+        if (dp < 0 || dp > 3) { error = "dp must be 0-3"; return false; }
+
+        for (uint8_t i = 0; i < n; i++) {
+            if (parsed[i].field == field - 1) { error = "fields overlap"; return false; }
+        }
+
+        e.format = format;
+        e.offset = offset;
+        e.field = field - 1;
+        e.decimals = dp;
+        n++;
+    }
+
+    portENTER_CRITICAL(&lock);
+    memcpy(entries, parsed, sizeof(BleSensorEntry) * n);
+    count = n;
+    seenMask = 0;
+    portEXIT_CRITICAL(&lock);
+    return true;
+}
+
+void BleGateway::toJson(JsonArray arr) {
+    BleSensorEntry copy[BLE_GW_MAX_SENSORS];
+    portENTER_CRITICAL(&lock);
+    uint8_t n = count;
+    memcpy(copy, entries, sizeof(BleSensorEntry) * n);
+    portEXIT_CRITICAL(&lock);
+
+    for (uint8_t i = 0; i < n; i++) {
+        const BleSensorEntry& e = copy[i];
+        JsonObject obj = arr.add<JsonObject>();
+        if (!e.anyMac) {
+            char mac[18];
+            snprintf(mac, sizeof(mac), "%02x:%02x:%02x:%02x:%02x:%02x",
+                     e.mac[0], e.mac[1], e.mac[2], e.mac[3], e.mac[4], e.mac[5]);
+            obj["m"] = mac;
+        }
+        obj["t"] = e.format;
+        if (e.format != BLE_FMT_BTHOME) {
+            char uuid[5];
+            snprintf(uuid, sizeof(uuid), "%04x", e.uuid);
+            obj["u"] = uuid;
+        }
+        obj["o"] = e.offset;
+        obj["f"] = e.field + 1;
+        obj["dp"] = e.decimals;
+    }
+}
+
+void BleGateway::begin() {
+    NimBLEScan* scan = NimBLEDevice::getScan();
+    scan->setAdvertisedDeviceCallbacks(this, true);   // Every advert, not just new senders
+    scan->setActiveScan(false);
+    scan->setInterval(BLE_GW_SCAN_INTERVAL);
+    scan->setWindow(BLE_GW_SCAN_WINDOW);
+    scan->setMaxResults(0);                           // Results are not kept
+    started = true;
+}
+
+void BleGateway::service(uint32_t nowMs, uint32_t nextSlotMs, uint32_t intervalMs) {
+    if (!started) return;
+
+    bool always = intervalMs <= 2 * BLE_GW_LEAD_MS;
+    bool want = count > 0 && (always || (int32_t)(nextSlotMs - nowMs) <= (int32_t)BLE_GW_LEAD_MS);
+    NimBLEScan* scan = NimBLEDevice::getScan();
+    if (want && !scanning) {
+        scanning = scan->start(0, nullptr, false);
+    } else if (!want && scanning) {
+        scan->stop();
+        scanning = false;
+    }
+}
+
+void BleGateway::onResult(NimBLEAdvertisedDevice* device) {
+    const uint8_t* adv = device->getPayload();
+    size_t len = device->getPayloadLength();
+    NimBLEAddress addr = device->getAddress();
+    const uint8_t* native = addr.getNative();   // Least significant byte first
+    uint32_t now = millis();
+
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; i < count; i++) {
+        const BleSensorEntry& e = entries[i];
+        if (!e.anyMac) {
+            bool match = true;
+            for (uint8_t k = 0; k < 6 && match; k++) match = e.mac[k] == native[5 - k];
+            if (!match) continue;
+        }
+        uint16_t value;
+        if (!parseAdvert(e, adv, len, value)) continue;
+        latest[i] = value;
+        seenAt[i] = now;
+        seenMask |= 1 << i;
+        adverts++;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+bool BleGateway::merge(Sample& sample, uint32_t nowMs, uint32_t maxAgeMs) {
+    bool any = false;
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; i < count; i++) {
+        const BleSensorEntry& e = entries[i];
+        if (!((seenMask >> i) & 1) || nowMs - seenAt[i] > maxAgeMs) continue;
+        if (sampleHasField(sample, e.field)) continue;   // Modbus wins
+        sampleSetField(sample, e.field, latest[i], e.decimals);
+        any = true;
+    }
+    portEXIT_CRITICAL(&lock);
+    return any;
+}
@@ -0,0 +1,79 @@
+// ================================================================
+// BLE BINARY PROTOCOL
+// ================================================================
+
+#include "ble_proto.h"
+
+bool TlvWriter::put(uint8_t tag, const void* value, uint8_t valueLen) {
+    if (len + 2 + valueLen > cap) {
+        overflow = true;
+        return false;
+    }
+    buf[len++] = tag;
+    buf[len++] = valueLen;
+    memcpy(buf + len, value, valueLen);
+    len += valueLen;
+    return true;
+}
+
+bool TlvWriter::putU16(uint8_t tag, uint16_t v) {
+    uint8_t b[2] = { (uint8_t)v, (uint8_t)(v >> 8) };
+    return put(tag, b, sizeof(b));
+}
+
+bool TlvWriter::putU32(uint8_t tag, uint32_t v) {
+    uint8_t b[4] = { (uint8_t)v, (uint8_t)(v >> 8), (uint8_t)(v >> 16), (uint8_t)(v >> 24) };
+    return put(tag, b, sizeof(b));
+}
+
+bool TlvWriter::putF32(uint8_t tag, float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return putU32(tag, bits);
+}
+
+bool TlvWriter::putStr(uint8_t tag, const String& s) {
+    if (s.length() > 255) {
+        overflow = true;
+        return false;
+    }
+    return put(tag, s.c_str(), s.length());
+}
+
+bool TlvReader::next(uint8_t& tag, const uint8_t*& value, uint8_t& len) {
+    if (data >= end) return false;
+    if (end - data < 2 || end - data - 2 < data[1]) {
+        bad = true;
+        return false;
+    }
+    tag = data[0];
+    len = data[1];
+    value = data + 2;
+    data += 2 + len;
+    return true;
+}
+
+bool TlvReader::asU8(const uint8_t* v, uint8_t len, uint8_t& out) {
+    if (len != 1) return false;
+    out = v[0];
+    return true;
+}
+
+bool TlvReader::asU16(const uint8_t* v, uint8_t len, uint16_t& out) {
+    if (len != 2) return false;
+    out = v[0] | (v[1] << 8);
+    return true;
+}
+
+bool TlvReader::asU32(const uint8_t* v, uint8_t len, uint32_t& out) {
+    if (len != 4) return false;
+    out = v[0] | (v[1] << 8) | ((uint32_t)v[2] << 16) | ((uint32_t)v[3] << 24);
+    return true;
+}
+
+bool TlvReader::asF32(const uint8_t* v, uint8_t len, float& out) {
+    uint32_t bits;
+    if (!asU32(v, len, bits)) return false;
+    memcpy(&out, &bits, sizeof(out));
+    return true;
+}
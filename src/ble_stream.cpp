@@ -0,0 +1,77 @@
+// ================================================================
+// BLE LIVE STREAM
+// ================================================================
+
+#include "ble_stream.h"
+
+void BleStreamer::setDecimation(uint8_t n) {
+    every = n;
+    skip = 0;
+    len = 0;
+    records = 0;
+    dropped = 0;
+}
+
+void BleStreamer::discard() {
+    dropped += records;
+    droppedTotal += records;
+    len = 0;
+    records = 0;
+}
+
+bool BleStreamer::flush() {
+    if (len == 0) return true;
+    if (chr == nullptr || os_msys_num_free() < STREAM_MIN_FREE_MBUFS) return false;
+
+    hdr.dropped = min(dropped, (uint32_t)255);
+    memcpy(buf, &hdr, sizeof(hdr));
+    chr->setValue(buf, len);
+    chr->notify();
+
+    hdr.seq++;
+    frames++;
+    dropped = 0;
+    len = 0;
+    records = 0;
+    return true;
+}
+
+void BleStreamer::offer(const Sample& sample, uint32_t nowMs, size_t payloadMax) {
+    if (!active() || sample.fieldMask == 0) return;
+    if (++skip < every) return;
+    skip = 0;
+
+    payloadMax = min(payloadMax, sizeof(buf));
+    size_t recordLen = 2 + 2 * __builtin_popcount(sample.fieldMask);
+    if (sizeof(StreamHeader) + recordLen > payloadMax) return;
+
+    // A record has to share the frame's layout and fit its u16 offset
+    if (len > 0 && (sample.fieldMask != hdr.fieldMask || sample.decimals != hdr.decimals ||
+                    nowMs - hdr.baseMs > 0xFFFF || len + recordLen > payloadMax)) {
+        if (!flush()) discard();
+    }
+
+    if (len == 0) {
+        hdr.fieldMask = sample.fieldMask;
+        hdr.decimals = sample.decimals;
+        hdr.baseMs = nowMs;
+        len = sizeof(StreamHeader);
+    }
+
+    uint16_t offset = nowMs - hdr.baseMs;
+    buf[len++] = offset & 0xFF;
+    buf[len++] = offset >> 8;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(sample, i)) continue;
+        buf[len++] = sample.regs[i] & 0xFF;
+        buf[len++] = sample.regs[i] >> 8;
+    }
+    records++;
+
+    // Full: send now rather than on the next service() pass
+    if (len + recordLen > payloadMax) flush();
+}
+
+void BleStreamer::service(uint32_t nowMs) {
+    if (len > 0 && nowMs - hdr.baseMs >= STREAM_FLUSH_MS) flush();
+}
@@ -0,0 +1,67 @@
+// ================================================================
+// CONFIG STORE
+// ================================================================
+
+#include "config_store.h"
+
+#include <Preferences.h>
+
+#include "sample_codec.h"   // blockCrc32
+
+static const uint16_t CONFIG_MAGIC = 0x4643;   // "CF"
+
+static Preferences nvs;
+static uint8_t scratch[CONFIG_BLOB_MAX];
+
+ConfigBlob::ConfigBlob(const char* ns, const char* key, uint8_t version, void* image, size_t size)
+    : ns(ns), key(key), version(version), image(image), size(size) {}
+
+bool ConfigBlob::load(void* out) {
+    size_t want = sizeof(ConfigBlobHeader) + size;
+    if (want > sizeof(scratch)) return false;
+
+    nvs.begin(ns, true);
+    // A blob longer than `want` is not read at all
+    size_t got = nvs.isKey(key) ? nvs.getBytes(key, scratch, want) : 0;
+    nvs.end();
+    if (got != want) return false;
+
+    ConfigBlobHeader hdr;
+    memcpy(&hdr, scratch, sizeof(hdr));
+    const uint8_t* payload = scratch + sizeof(hdr);
+    if (hdr.magic != CONFIG_MAGIC || hdr.version != version || hdr.length != size ||
+        hdr.crc != blockCrc32(payload, size)) {
+        return false;
+    }
+
+    memcpy(image, payload, size);
+    memcpy(out, payload, size);
+    cached = true;
+    return true;
+}
+
+bool ConfigBlob::store(const void* value) {
+    if (cached && memcmp(image, value, size) == 0) return true;
+
+    size_t len = sizeof(ConfigBlobHeader) + size;
+    if (len > sizeof(scratch)) return false;
+
+    ConfigBlobHeader hdr;
+    hdr.magic = CONFIG_MAGIC;
+    hdr.version = version;
+    hdr.reserved = 0;
+    hdr.length = size;
+    hdr.crc = blockCrc32(value, size);
+    memcpy(scratch, &hdr, sizeof(hdr));
+    memcpy(scratch + sizeof(hdr), value, size);
+
+    nvs.begin(ns, false);
+    bool ok = nvs.putBytes(key, scratch, len) == len;
+    nvs.end();
+    if (!ok) return false;
+
+    memcpy(image, value, size);
+    cached = true;
+    writes++;
+    return true;
+}
@@ -0,0 +1,99 @@
+// ================================================================
+// JSON ARENA
+// ================================================================
+
+#include "json_arena.h"
+
+#include <esp_heap_caps.h>
+
+// Each allocation is preceded by its rounded-up size
+static const size_t ARENA_ALIGN = 8;
+static const size_t ARENA_HEADER = ARENA_ALIGN;
+
+static size_t alignUp(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+JsonArena jsonArena;
+
+bool JsonArena::begin(size_t size, size_t fallbackSize) {
+    if (psramFound()) {
+        base = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    }
+    if (base != nullptr) {
+        psram = true;
+    } else {
+        size = fallbackSize;
+        base = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+        if (base == nullptr) return false;
+    }
+    cap = size;
+    offset = 0;
+    last = nullptr;
+    live = 0;
+    return true;
+}
+
+bool JsonArena::owns(const void* ptr) const {
+    const uint8_t* p = (const uint8_t*)ptr;
+    return base != nullptr && p >= base && p < base + cap;
+}
+
+size_t JsonArena::blockSize(const void* ptr) const {
+    const uint32_t* hdr = (const uint32_t*)((const uint8_t*)ptr - ARENA_HEADER);
+    return *hdr;
+}
+
+void* JsonArena::allocate(size_t size) {
+    size_t n = alignUp(size);
+    if (base == nullptr || offset + ARENA_HEADER + n > cap) {
+        spilled++;
+        return malloc(size);
+    }
+
+    uint8_t* p = base + offset + ARENA_HEADER;
+    *(uint32_t*)(p - ARENA_HEADER) = n;
+    offset += ARENA_HEADER + n;
+    last = p;
+    live++;
+    peak = max(peak, offset);
+    return p;
+}
+
+void JsonArena::deallocate(void* ptr) {
+    if (ptr == nullptr) return;
+    if (!owns(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    if (ptr == last) {
+        offset = (uint8_t*)ptr - ARENA_HEADER - base;
+        last = nullptr;
+    }
+    if (--live == 0) {
+        offset = 0;
+        last = nullptr;
+    }
+}
+
+void* JsonArena::reallocate(void* ptr, size_t newSize) {
+    if (ptr == nullptr) return allocate(newSize);
+    if (!owns(ptr)) return realloc(ptr, newSize);
+
+    // The newest block grows or shrinks in place
+    size_t n = alignUp(newSize);
+    size_t at = (uint8_t*)ptr - base;
+    if (ptr == last && at + n <= cap) {
+        *(uint32_t*)((uint8_t*)ptr - ARENA_HEADER) = n;
+        offset = at + n;
+        peak = max(peak, offset);
+        return ptr;
+    }
+
+    void* moved = allocate(newSize);
+    if (moved == nullptr) return nullptr;
+    memcpy(moved, ptr, min(blockSize(ptr), newSize));
+    deallocate(ptr);
+    return moved;
+}
@@ -0,0 +1,158 @@
+// ================================================================
+// LOGGER
+// ================================================================
+
+#include "logger.h"
+
+#include <atomic>
+#include <stdarg.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+const BaseType_t LOG_CORE = 0;
+const UBaseType_t LOG_PRIORITY = tskIDLE_PRIORITY + 1;
+const uint32_t LOG_STACK = 4096;
+const unsigned long LOG_DRAIN_MS = 20;
+const unsigned long LOG_FILE_FLUSH_MS = 2000;  // Batches SD writes into few sectors
+const size_t LOG_FILE_MAX = 256 * 1024;
+const size_t LOG_PATH_MAX = 32;
+
+// Multi-producer ring: a writer claims slot `h` by moving head from h
+// to h + 1 (only while the ring has room), formats into it, then
+// publishes it by storing h + 1 in the slot's seq. The drain task
+// prints slots in order and stops at the first one not yet published.
+struct LogSlot {
+    std::atomic<uint32_t> seq;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+};
+
+static LogSlot slots[LOG_SLOTS];
+static std::atomic<uint32_t> head{0};
+static std::atomic<uint32_t> tail{0};
+static std::atomic<uint32_t> dropped{0};
+
+static std::atomic<fs::FS*> wantedFs{nullptr};
+static std::atomic<bool> fileOpen{false};
+static char wantedPath[LOG_PATH_MAX];
+
+void logWrite(const char* fmt, ...) {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    do {
+        if (h - tail.load(std::memory_order_acquire) >= LOG_SLOTS) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!head.compare_exchange_weak(h, h + 1, std::memory_order_acq_rel,
+                                         std::memory_order_relaxed));
+
+    LogSlot& slot = slots[h & (LOG_SLOTS - 1)];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(slot.text, sizeof(slot.text), fmt, args);
+    va_end(args);
+
+    if (n < 0) n = 0;
+    if ((size_t)n >= sizeof(slot.text)) {
+        // Cut short: keep the line ending
+        n = sizeof(slot.text) - 1;
+        slot.text[n - 1] = '\n';
+    }
+    slot.len = n;
+    slot.seq.store(h + 1, std::memory_order_release);
+}
+
+uint32_t loggerDropped() {
+    return dropped.load(std::memory_order_relaxed);
+}
+
+void loggerFlush(unsigned long timeoutMs) {
+    unsigned long start = millis();
+    while (tail.load(std::memory_order_acquire) != head.load(std::memory_order_relaxed) &&
+           millis() - start < timeoutMs) {
+        delay(LOG_DRAIN_MS);
+    }
+    Serial.flush();
+}
+
+void loggerAttachFile(fs::FS& fs, const char* path) {
+    strlcpy(wantedPath, path, sizeof(wantedPath));
+    wantedFs.store(&fs, std::memory_order_release);
+}
+
+void loggerDetachFile() {
+    wantedFs.store(nullptr, std::memory_order_release);
+    // The card may be unmounted next: wait briefly for the close
+    for (int i = 0; i < 10 && fileOpen.load(); i++) delay(LOG_DRAIN_MS);
+}
+
+// Reopens, rotates and closes the mirror file as requested
+static void serviceFile(File& file, fs::FS*& openFs, size_t& fileBytes) {
+    fs::FS* want = wantedFs.load(std::memory_order_acquire);
+
+    if (file && (want != openFs || fileBytes >= LOG_FILE_MAX)) {
+        file.close();
+        fileOpen.store(false);
+        if (want == openFs && want != nullptr) {
+            char old[LOG_PATH_MAX + 4];
+            snprintf(old, sizeof(old), "%s.old", wantedPath);
+            want->remove(old);
+            want->rename(wantedPath, old);
+        }
+        openFs = nullptr;
+    }
+
+    if (!file && want != nullptr) {
+        file = want->open(wantedPath, FILE_APPEND);
+        if (file) {
+            openFs = want;
+            fileBytes = file.size();
+            fileOpen.store(true);
+        } else {
+            // Stop retrying until attached again
+            wantedFs.store(nullptr);
+        }
+    }
+}
+
+static void loggerTask(void* param) {
+    File file;
+    fs::FS* openFs = nullptr;
+    size_t fileBytes = 0;
+    unsigned long lastFlush = millis();
+    uint32_t reportedDrops = 0;
+
+    for (;;) {
+        serviceFile(file, openFs, fileBytes);
+
+        uint32_t drops = loggerDropped();
+        if (drops != reportedDrops) {
+            char note[48];
+            int n = snprintf(note, sizeof(note), ">> LOG: %lu lines dropped\n",
+                             (unsigned long)(drops - reportedDrops));
+            Serial.write((const uint8_t*)note, n);
+            reportedDrops = drops;
+        }
+
+        for (;;) {
+            uint32_t t = tail.load(std::memory_order_relaxed);
+            LogSlot& slot = slots[t & (LOG_SLOTS - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != t + 1) break;
+
+            Serial.write((const uint8_t*)slot.text, slot.len);
+            if (file) fileBytes += file.write((const uint8_t*)slot.text, slot.len);
+            tail.store(t + 1, std::memory_order_release);
+        }
+
+        if (file && millis() - lastFlush >= LOG_FILE_FLUSH_MS) {
+            file.flush();
+            lastFlush = millis();
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
+    }
+}
+
+void loggerBegin() {
+    xTaskCreatePinnedToCore(loggerTask, "logger", LOG_STACK, nullptr, LOG_PRIORITY, nullptr, LOG_CORE);
+}
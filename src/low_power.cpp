@@ -0,0 +1,159 @@
+// ================================================================
+// LOW POWER
+// ================================================================
+
+#include "low_power.h"
+
+#if LOW_POWER
+
+#include <sys/time.h>
+#include <driver/rtc_io.h>
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <esp_timer.h>
+
+static const uint32_t RTC_STATE_MAGIC = 0x4C505231;   // "LPR1"
+
+struct RtcState {
+    uint32_t magic;
+    int64_t baseUs;        // Uptime at this run's esp_timer zero
+    int64_t sleepAtUs;     // System time when the last sleep started
+    int64_t nextSampleUs;
+    uint32_t bootEpoch;
+    uint16_t head;         // Oldest reading
+    uint16_t count;
+    uint16_t sinceUplink;  // Readings pushed since the last Wi-Fi session
+    uint8_t alarmBits;     // Alarm fields non-zero at the previous reading
+    RtcReading ring[RTC_RING_SLOTS];
+};
+
+static RTC_DATA_ATTR RtcState rtc;
+
+int64_t LowPower::wallUs() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+WakeReason LowPower::begin(int8_t buttonPin) {
+    button = buttonPin;
+
+    esp_sleep_wakeup_cause_t cause = esp_sleep_get_wakeup_cause();
+    if (rtc.magic != RTC_STATE_MAGIC || cause == ESP_SLEEP_WAKEUP_UNDEFINED) {
+        memset(&rtc, 0, sizeof(rtc));
+        rtc.magic = RTC_STATE_MAGIC;
+        rtc.nextSampleUs = wallUs();
+        reason = WAKE_COLD;
+        return reason;
+    }
+
+    // The system clock ran through the sleep; esp_timer started again
+    // at zero part way through this boot
+    rtc.baseUs += wallUs() - rtc.sleepAtUs - esp_timer_get_time();
+    reason = cause == ESP_SLEEP_WAKEUP_EXT0 ? WAKE_BUTTON : WAKE_TIMER;
+    return reason;
+}
+
+uint32_t LowPower::uptimeSeconds() const {
+    return (uint32_t)((rtc.baseUs + esp_timer_get_time()) / 1000000);
+}
+
+uint32_t LowPower::bootEpoch() const {
+    return rtc.bootEpoch;
+}
+
+void LowPower::setBootEpoch(uint32_t epoch) {
+    rtc.bootEpoch = epoch;
+}
+
+bool LowPower::push(const Sample& sample) {
+    bool room = rtc.count < RTC_RING_SLOTS;
+    if (!room) {
+        rtc.head = (rtc.head + 1) % RTC_RING_SLOTS;
+        rtc.count--;
+    }
+
+    RtcReading& r = rtc.ring[(rtc.head + rtc.count) % RTC_RING_SLOTS];
+    r.timestamp = sample.timestamp;
+    memcpy(r.regs, sample.regs, sizeof(r.regs));
+    r.fieldMask = sample.fieldMask;
+    r.flags = sample.flags;
+    r.decimals = sample.decimals;
+    rtc.count++;
+    rtc.sinceUplink++;
+    return room;
+}
+
+size_t LowPower::size() const {
+    return rtc.count;
+}
+
+size_t LowPower::peek(Sample* out, size_t max) const {
+    size_t n = min((size_t)rtc.count, max);
+    for (size_t i = 0; i < n; i++) {
+        const RtcReading& r = rtc.ring[(rtc.head + i) % RTC_RING_SLOTS];
+        Sample& s = out[i];
+        memset(&s, 0, sizeof(s));
+        s.timestamp = r.timestamp;
+        memcpy(s.regs, r.regs, sizeof(s.regs));
+        s.fieldMask = r.fieldMask;
+        s.flags = r.flags;
+        s.decimals = r.decimals;
+    }
+    return n;
+}
+
+void LowPower::pop(size_t n) {
+    n = min((size_t)rtc.count, n);
+    rtc.head = (rtc.head + n) % RTC_RING_SLOTS;
+    rtc.count -= n;
+}
+
+uint16_t LowPower::sinceUplink() const {
+    return rtc.sinceUplink;
+}
+
+void LowPower::uplinkAttempted() {
+    rtc.sinceUplink = 0;
+}
+
+bool LowPower::alarmChanged(const Sample& sample, uint8_t alarmMask) {
+    uint8_t bits = 0;
+    uint8_t known = alarmMask & sample.fieldMask;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (((known >> i) & 1) && sample.regs[i] != 0) bits |= 1 << i;
+    }
+
+    // Fields missing from this reading keep their previous state
+    bits |= rtc.alarmBits & ~known;
+    bool changed = bits != rtc.alarmBits;
+    rtc.alarmBits = bits;
+    return changed;
+}
+
+int64_t LowPower::nextSampleUs() const {
+    return rtc.nextSampleUs;
+}
+
+void LowPower::setNextSample(int64_t wallUs) {
+    rtc.nextSampleUs = wallUs;
+}
+
+void LowPower::sleep() {
+    int64_t us = rtc.nextSampleUs - wallUs();
+    if (us < (int64_t)LOW_POWER_MIN_SLEEP_MS * 1000) us = LOW_POWER_MIN_SLEEP_MS * 1000;
+    esp_sleep_enable_timer_wakeup(us);
+
+    if (button >= 0) {
+        gpio_num_t pin = (gpio_num_t)button;
+        rtc_gpio_pullup_en(pin);
+        rtc_gpio_pulldown_dis(pin);
+        esp_sleep_enable_ext0_wakeup(pin, 0);
+    }
+
+    rtc.baseUs += esp_timer_get_time();
+    rtc.sleepAtUs = wallUs();
+    esp_deep_sleep_start();
+}
+
+#endif // LOW_POWER
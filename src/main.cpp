@@ -7,13 +7,41 @@
 #include <WiFi.h>
 #include <ArduinoJson.h>
 #include <Preferences.h>
-#include <HTTPClient.h>
-#include <WiFiClientSecure.h>
 #include <time.h>
-#include <ModbusMaster.h>
-#include <SD.h>
 #include <SPI.h>
 #include <FS.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_heap_caps.h>
+#include <esp_sntp.h>
+#include <esp_timer.h>
+
+#include "aggregator.h"
+#include "ble_gateway.h"
+#include "ble_proto.h"
+#include "ble_stream.h"
+#include "config_store.h"
+#include "json_arena.h"
+#include "logger.h"
+#include "low_power.h"
+#include "metrics.h"
+#include "modbus_poll.h"
+#include "modbus_rtu.h"
+#include "mqtt_transport.h"
+#include "ota_update.h"
+#include "payload_builder.h"
+#include "sample.h"
+#include "sample_codec.h"
+#include "sample_ring.h"
+#include "sample_schedule.h"
+#include "sd_card.h"
+#include "sd_log.h"
+#include "tls_pin.h"
+#include "transport.h"
+#include "uplink.h"
+#include "wifi_manager.h"
+#include "wifi_scan.h"
 
 // ================================================================
 // CONSTANTS & CONFIGURATION
@@ -21,6 +49,8 @@
 #define SERVICE_UUID        "204fefb3-3d9b-4e3f-8f76-8245e29ac6e9"
 #define CHAR_UUID_WRITE     "c639bc5a-c5fa-48e4-814b-257a2cfc425e"
 #define CHAR_UUID_NOTIFY    "63b05182-23a1-43e7-855b-a85cf8f7b7fb"
+#define CHAR_UUID_BINARY    "8e3f6b2d-51c7-4a09-b6e4-d2a91c07f5e3"
+#define CHAR_UUID_STREAM    "b1d4e7a0-93c2-4f5e-8a67-0c2e9f4d8b15"
 
 #define RX1_PIN 18
 #define TX1_PIN 17
@@ -29,49 +59,234 @@
 #define SD_SCK_PIN  12   // GP12
 #define SD_MISO_PIN 13   // GP13
 
+// 0 = SPI, 1 = SDMMC 1-bit on the SPI wiring, 4 = SDMMC 4-bit (set
+// SD_D1_PIN / SD_D2_PIN to the extra data lines)
+#ifndef SD_USE_SDMMC
+#define SD_USE_SDMMC 0
+#endif
+#ifndef SD_D1_PIN
+#define SD_D1_PIN -1
+#endif
+#ifndef SD_D2_PIN
+#define SD_D2_PIN -1
+#endif
+#if SD_USE_SDMMC == 4 && (SD_D1_PIN < 0 || SD_D2_PIN < 0)
+#error "SDMMC 4-bit needs SD_D1_PIN and SD_D2_PIN"
+#endif
+
+// Low-power builds (LOW_POWER=1, see low_power.h) deep-sleep between
+// readings and bring Wi-Fi up every LOW_POWER_UPLINK_EVERY readings.
+// BLE only comes up at power-on and when WAKE_BUTTON_PIN (active low,
+// an RTC GPIO; -1 for none) wakes the board.
+#ifndef LOW_POWER_UPLINK_EVERY
+#define LOW_POWER_UPLINK_EVERY 10
+#endif
+#ifndef WAKE_BUTTON_PIN
+#define WAKE_BUTTON_PIN 0   // BOOT button
+#endif
+
+// Controller relay / alarm output wired to a GPIO (either edge queues
+// an alarm event at once); -1 to rely on polling the "al" fields only
+#ifndef ALARM_GPIO_PIN
+#define ALARM_GPIO_PIN -1
+#endif
+
 // Timing Constants
 const unsigned long WATCHDOG_TIMEOUT = 60000; // 1 minute
 const unsigned long FILE_CHECK_INTERVAL = 900000; // 15 minutes
-const unsigned long WIFI_RECONNECT_INTERVAL = 60000; // 1 minute
 const unsigned long SD_OPERATION_TIMEOUT = 5000; // 5 seconds
+const unsigned long SD_HEALTH_INTERVAL = 10000;  // Probe read while mounted
+const unsigned long SD_REMOUNT_INTERVAL = 30000; // Mount attempts while not
+const unsigned long TIME_SYNC_WAIT = 30000;      // Hold readings for NTP after Wi-Fi comes up
 const unsigned long HTTP_TIMEOUT = 5000; // 5 seconds
-const int WIFI_CONNECT_ATTEMPTS = 20; 
-const int MAX_WIFI_NETWORKS_SAVED = 5;
 const int MAX_SCAN_RESULTS = 15;
+const long GMT_OFFSET_SEC = 19800; // IST
+const size_t BULK_MAX_BYTES = 8192; // POST body cap per backlog batch
+const size_t URL_MAX = 640;         // Upload URL incl. query string and window stats
+const uint32_t BACKLOG_STREAM_MAX = 4096; // Backlog records per streamed POST (one SD segment)
+const char* const LOG_FILE_PATH = "/system.log"; // Mirror of the serial log (LOG_TO_SD)
+const unsigned long LOW_POWER_UPLINK_WINDOW = 60000;  // Longest a Wi-Fi session stays up
+const unsigned long LOW_POWER_AWAKE_WINDOW = 300000;  // BLE stays up this long after the last activity
+const unsigned long LOW_POWER_PARK_TIMEOUT = 5000;    // Wait for the tasks to stop before sleeping
+const unsigned long LOG_FLUSH_TIMEOUT = 200;          // Print pending log lines before sleeping
+const uint16_t SELF_TEST_DEFAULT_READS = 20;   // Modbus transactions per self-test
+const uint16_t SELF_TEST_MAX_READS = 200;
+const uint32_t SELF_TEST_SD_KB = 256;          // Written and read back
+const unsigned long SELF_TEST_TIMEOUT = 60000; // Report whatever finished by then
+
+// Task Layout (Wi-Fi and NimBLE host run on core 0)
+const BaseType_t SAMPLER_CORE = 1;
+const BaseType_t UPLINK_CORE = 0;
+const BaseType_t CONFIG_CORE = 0;
+const UBaseType_t SAMPLER_PRIORITY = 3;
+const UBaseType_t UPLINK_PRIORITY = 2;
+const UBaseType_t CONFIG_PRIORITY = 1;
+const uint32_t SAMPLER_STACK = 4096;
+const uint32_t UPLINK_STACK = 12288; // mbedTLS handshake runs on this stack
+const uint32_t CONFIG_STACK = 8192;
+const int COMMAND_QUEUE_LEN = 4;
+const int MODBUS_WRITE_QUEUE_LEN = 4;
+const uint8_t CONTROLLER_SLAVE = 1;     // Setpoint writes go to this slave
+const size_t BLE_COMMAND_MAX = 512;
+const uint16_t BLE_DEFAULT_MTU = 23;
+const uint16_t BLE_ATT_OVERHEAD = 3;    // Notify opcode + handle
+const unsigned long SAMPLER_TICK_MS = 10;
+// Sampler wake-ups, as task notification bits (eSetBits). Only the
+// sampler loop waits on them; Modbus transactions wait on their own
+// semaphore.
+const uint32_t SAMPLER_WAKE_SLOT = 0x01;    // Slot timer
+const uint32_t SAMPLER_WAKE_ALARM = 0x02;   // Alarm GPIO edge
+const SchedulePolicy SAMPLE_LATE_POLICY = SCHEDULE_SKIP;  // Missed slots: take only the latest
+const uint8_t SAMPLE_MAX_CATCH_UP = 3;                    // Back-to-back slots with SCHEDULE_CATCH_UP
+const unsigned long ALARM_POLL_MS = 200;  // Alarm fields between samples (one short frame)
+const unsigned long UPLINK_IDLE_MS = 250;
+const unsigned long CONFIG_TICK_MS = 100;
+const unsigned long CONFIG_COMMIT_DELAY = 2000;   // Quiet time before settings go to NVS
+const unsigned long CONFIG_COMMIT_MAX = 10000;    // Longest a change waits during a burst
+const unsigned long STREAM_POLL_MS = 20;   // 50 Hz before decimation
+const int MAX_STREAM_DECIMATION = 50;
+
+// Sample Ring (PSRAM). 8192 slots is ~2.3 h of raw 1 s readings, or
+// ~5.7 days of 60 s aggregate windows.
+const uint32_t SAMPLE_RING_CAPACITY = 8192;
+const uint32_t SAMPLE_RING_FALLBACK = 256;   // Internal RAM if no PSRAM
+const uint32_t SAMPLE_RING_MIN = 16;         // Smallest fallback tried before restarting
+const uint32_t SAMPLE_RING_HIGH_WATER_PCT = 75; // Spill to SD above this fill
+const size_t SAMPLE_SPILL_CHUNK = 64;
+const uint32_t ALARM_RING_CAPACITY = 16;     // Alarm events, sent ahead of the sample ring
+const size_t JSON_ARENA_SIZE = 16384;        // BLE / config JSON documents (PSRAM)
+const size_t JSON_ARENA_FALLBACK = 6144;     // Internal RAM if no PSRAM
+const uint32_t BLE_SENSOR_MAX_AGE = 120000;  // Older BLE sensor readings are left out
+const size_t UPLINK_SINGLE_BATCH = 16;       // GETs per pass when not in bulk mode
+const unsigned long UPLINK_RETRY_INTERVAL = 30000; // Back-off after a failed upload
+const unsigned long OTA_RESTART_WAIT = 60000; // Without SD, time to send readings before an OTA restart
 
 // Validation Constants
 const int MIN_UPDATE_INTERVAL = 1;
 const int MAX_UPDATE_INTERVAL = 86400; // 24 hours
 const float MIN_SETPOINT = -9999.0;
 const float MAX_SETPOINT = 9999.0;
+const int MIN_BULK_RECORDS = 1;
+const int MAX_BULK_RECORDS = 500;
+const int TRANSPORT_HTTP = 0;
+const int TRANSPORT_MQTT = 1;
+const int BATCH_ENCODING_CSV = 0;
+const int BATCH_ENCODING_DELTA = 1;   // sample_codec.h blocks, "x-sample-delta"
 
 // ================================================================
 // GLOBAL OBJECTS
 // ================================================================
 Preferences preferences;
 NimBLECharacteristic* pNotifyCharacteristic = nullptr;
-ModbusMaster modbus;
+NimBLECharacteristic* pBinaryCharacteristic = nullptr;
+BleStreamer bleStreamer;   // Owned by the sampler
+BleGateway bleGateway;     // BLE sensor adverts -> sampler
+ModbusRtu modbus;
+Uplink uplink(HTTP_TIMEOUT);
+SpscRing<Sample> sampleRing;
+SpscRing<Sample> alarmRing;   // Sampler -> uplink, drained first
+FixedPayload<BULK_MAX_BYTES + 1> batchBody;  // Uplink task only
+uint8_t batchBlocks[BULK_MAX_BYTES];         // Likewise, encoded batches
+MqttTransport mqttTransport(HTTP_TIMEOUT);
+OtaUpdate otaUpdate;       // Uplink task; request() from the config task
+WifiManager wifiManager;   // Config task only
+WifiScan wifiScan;         // Config task only
 
 SPIClass sdSPI(HSPI);
+SdCard sdCard(sdSPI, SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+SdLog sdLog;
 bool sdReady = false;
+bool sdCheckNow = false;      // Check (or mount) the card on the next uplink pass
+
+#if LOW_POWER
+LowPower lowPower;
+#endif
+
+// BLE -> config task commands, config task -> sampler register
+// writes (the sampler owns the bus). Readings go through sampleRing.
+TaskHandle_t uplinkTaskHandle = nullptr;
+TaskHandle_t samplerTaskHandle = nullptr;   // Woken by the alarm GPIO
+QueueHandle_t commandQueue = nullptr;
+QueueHandle_t modbusWriteQueue = nullptr;
+QueueHandle_t pollTableQueue = nullptr;  // Config task -> sampler, latest table wins
+QueueHandle_t aggQueue = nullptr;        // Config task -> sampler, latest settings win
+QueueHandle_t latestSampleQueue = nullptr; // Sampler -> BLE live reads, latest wins
+SemaphoreHandle_t configMutex = nullptr; // Guards the String config variables
+
+ModbusPollTable pollTable; // Config task's copy; the sampler keeps its own
+AggregateSettings aggSettings; // Likewise
+volatile uint32_t nextSlotMs = 0;  // Sampler -> BLE scan window, millis() time
+
+// NVS records of app_conf (config_store.h). Strings are NUL-padded to
+// a fixed size and there is no padding, so equal settings compare
+// equal and an unchanged record is never rewritten.
+struct __attribute__((packed)) CoreConfig {
+    char id[33];
+    char url[161];
+    char ntp[65];
+    int32_t interval;
+    uint8_t mode;
+    uint8_t bulk;
+    uint8_t encoding;
+    uint8_t transport;
+    uint16_t bulkMax;
+    float sp1;
+    float sp2;
+};
+
+struct __attribute__((packed)) MqttConfig {
+    char url[129];
+    char user[65];
+    char pass[65];
+    char topic[129];
+};
+
+struct __attribute__((packed)) TlsConfig {
+    char pins[97];       // Two base64 pins and a comma
+};
+
+ConfigRecord<CoreConfig> coreRecord("app_conf", "core", 1);
+ConfigRecord<MqttConfig> mqttRecord("app_conf", "mqtt", 1);
+ConfigRecord<TlsConfig> tlsRecord("app_conf", "tls", 1);
+ConfigRecord<AggregateSettings> aggRecord("app_conf", "aggs", 1);
+
+// Settings changed but not yet in NVS. Set and committed by the config
+// task only (markConfigDirty / commitConfig).
+enum ConfigPart : uint8_t {
+    CONFIG_PART_CORE = 0x01,   // Core and MQTT records
+    CONFIG_PART_POLL = 0x02,
+    CONFIG_PART_AGG  = 0x04,
+    CONFIG_PART_BLE  = 0x08
+};
+uint8_t configDirty = 0;
+unsigned long configDirtyFirst = 0;
+unsigned long configDirtyLast = 0;
 
 // ================================================================
 // STATE VARIABLES
 // ================================================================
-bool deviceConnected = false;
+volatile bool deviceConnected = false;
+volatile uint16_t bleMtu = BLE_DEFAULT_MTU;
+volatile uint8_t streamDecimation = 0;  // Requested by the app, applied by the sampler
 bool triggerWifiScan = false;
+bool scanBinary = false;      // Results go to the binary characteristic
+uint8_t scanSeq = 0;          // Binary request to answer
+bool scanStreaming = false;
+uint8_t scanSent = 0;         // Records already notified
 bool wifiConfigReceived = false;
-bool watchdogPaused = false;
-bool forceHttpNow = false;
+volatile bool watchdogPaused = false;
+volatile bool forceHttpNow = false;
+bool backlogPending = false;  // Drain again next pass instead of waiting FILE_CHECK_INTERVAL
 
 float setPoint1 = 0.0;
 float setPoint2 = 0.0;
 
 unsigned long lastFileCheckTime = 0;
-unsigned long lastHttpTime = 0;
-unsigned long lastWatchdogTime = 0;
-unsigned long lastWifiCheck = 0;
-int lastClockMinute = -1;
+unsigned long lastSdCheckTime = 0;
+volatile unsigned long linkUpTime = 0;
+volatile uint32_t bootEpoch = 0;   // Unix time at boot, once NTP has synced
+volatile unsigned long lastWatchdogTime = 0;
+unsigned long uplinkRetryAt = 0;
 
 String targetSSID = "";
 String targetPass = "";
@@ -82,6 +297,28 @@ String API_URL = "https://cloudbases.in/iot_demo24/Api";
 String NTP_SERVER = "1.in.pool.ntp.org";
 int UPDATE_INTERVAL = 60;
 int UPDATE_MODE = 0;
+bool BULK_UPLOAD = false;     // Drain SD backlog as one POST per batch
+int BULK_MAX_RECORDS = 100;
+int BATCH_ENCODING = BATCH_ENCODING_CSV;
+int UPLINK_TRANSPORT = TRANSPORT_HTTP;
+String MQTT_URL = "";        // mqtts://broker:8883
+String MQTT_USER = "";
+String MQTT_PASS = "";
+String MQTT_TOPIC = "telemetry";
+String TLS_PINS = "";        // Base64 SPKI SHA-256 pins, comma-separated (tls_pin.h)
+volatile bool transportConfigChanged = true;  // Uplink re-reads the MQTT settings and pins
+
+// What this wake is for (low-power builds); set in setup()
+enum PowerSession : uint8_t {
+    SESSION_ALWAYS_ON,   // Normal build: never sleeps
+    SESSION_UPLINK,      // Wi-Fi only, until the readings are sent
+    SESSION_AWAKE        // BLE and Wi-Fi, until the app has gone quiet
+};
+PowerSession powerSession = SESSION_ALWAYS_ON;
+volatile bool sleepRequested = false;   // Sampler and uplink park, then deep sleep
+volatile bool samplerParked = false;
+volatile bool uplinkParked = false;
+volatile unsigned long lastBleActivity = 0;
 
 // ================================================================
 // MODBUS ADDRESS ENUM
@@ -95,10 +332,35 @@ typedef enum {
     HIGH_ALARM_STATUS = 5
 } SensorAddress;
 
+// Uplink task working buffers, shared by the ring and backlog paths
+Sample uplinkBatch[MAX_BULK_RECORDS];
+SdLogRecord backlogRecs[MAX_BULK_RECORDS];
+
+// ================================================================
+// TASK MESSAGES
+// ================================================================
+struct BleCommand {
+    bool binary;         // From the binary characteristic
+    uint16_t len;
+    char data[BLE_COMMAND_MAX];
+};
+
+struct ModbusWrite {
+    uint16_t reg;
+    uint16_t value;
+};
+
 // ================================================================
 // HELPER FUNCTIONS
 // ================================================================
 
+void safeNotify(const PayloadBuilder& message) {
+    if (deviceConnected && pNotifyCharacteristic != nullptr) {
+        pNotifyCharacteristic->setValue(message.bytes(), message.length());
+        pNotifyCharacteristic->notify();
+    }
+}
+
 void safeNotify(const String& message) {
     if (deviceConnected && pNotifyCharacteristic != nullptr) {
         pNotifyCharacteristic->setValue(message);
@@ -106,6 +368,23 @@ void safeNotify(const String& message) {
     }
 }
 
+// Serialises straight into the notification, without a String
+void notifyJson(const JsonDocument& doc) {
+    static char out[BLE_COMMAND_MAX];   // Config task only
+    size_t len = serializeJson(doc, out, sizeof(out));
+    if (deviceConnected && pNotifyCharacteristic != nullptr) {
+        pNotifyCharacteristic->setValue((const uint8_t*)out, len);
+        pNotifyCharacteristic->notify();
+    }
+}
+
+void binaryNotify(const uint8_t* data, size_t len) {
+    if (deviceConnected && pBinaryCharacteristic != nullptr) {
+        pBinaryCharacteristic->setValue(data, len);
+        pBinaryCharacteristic->notify();
+    }
+}
+
 bool validateInterval(int interval) {
     return (interval >= MIN_UPDATE_INTERVAL && interval <= MAX_UPDATE_INTERVAL);
 }
@@ -114,144 +393,568 @@ bool validateSetpoint(float value) {
     return (value >= MIN_SETPOINT && value <= MAX_SETPOINT);
 }
 
-void setupSD() {
-    Serial.print(">> SD: Initializing... ");
+bool validateBulkRecords(int records) {
+    return (records >= MIN_BULK_RECORDS && records <= MAX_BULK_RECORDS);
+}
+
+void formatTimestamp(time_t ts, char* buf, size_t len) {
+    struct tm timeinfo;
+    localtime_r(&ts, &timeinfo);
+    strftime(buf, len, "%Y-%m-%d %H:%M:%S", &timeinfo);
+}
+
+// Unix time of a calendar date and time, read as UTC. Does not go
+// through mktime(), whose result depends on the TZ configTime() sets.
+uint32_t civilToUnix(int year, int month, int day, int hour, int minute, int second) {
+    // Days from civil (proleptic Gregorian, years starting in March)
+    year -= month <= 2;
+    int era = year / 400;
+    int yoe = year - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int32_t days = era * 146097 + doe - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+// Moves readings left behind by the old one-file-per-reading format
+// into the segmented log. Their timestamps are IST, removed by hand.
+void importLegacyFiles() {
+    fs::FS& card = sdCard.fs();
+    File root = card.open("/");
+    if (!root) return;
 
-    sdSPI.begin(SD_SCK_PIN, SD_MISO_PIN, SD_MOSI_PIN, SD_CS_PIN);
+    int imported = 0;
+    while (true) {
+        File file = root.openNextFile();
+        if (!file) break;
 
-    if (!SD.begin(SD_CS_PIN, sdSPI, 1000000)) { // 4 MHz = stable
-        Serial.println("Failed");
-        sdReady = false;
-        return;
+        String path = file.path();
+        if (file.isDirectory() || !path.endsWith(".txt")) {
+            file.close();
+            continue;
+        }
+
+        String content = file.readStringUntil('\n');
+        file.close();
+
+        int y, mo, d, h, mi, sec;
+        float value;
+        if (sscanf(content.c_str(), "%d-%d-%d %d:%d:%d,%f",
+                   &y, &mo, &d, &h, &mi, &sec, &value) == 7) {
+            Sample sample = {};
+            sample.timestamp = civilToUnix(y, mo, d, h, mi, sec) - GMT_OFFSET_SEC;
+            sample.flags = SAMPLE_TIME_VALID;
+            sampleSetField(sample, 0, (uint16_t)lroundf(value * 10.0f), 1);
+            sdLog.append(sample);
+            imported++;
+        }
+        card.remove(path);
     }
+    root.close();
 
-    if (SD.cardType() == CARD_NONE) {
-        Serial.println("No card");
-        sdReady = false;
-        return;
+    if (imported > 0) LOG_I("SD", "Imported %d legacy files", imported);
+}
+
+// Mounts the card at the fastest clock that verifies and opens the log.
+bool mountSD() {
+    if (!sdCard.mount()) {
+        LOG_E("SD", "No card or mount failed");
+        return false;
+    }
+
+    if (!sdLog.begin(sdCard.fs())) {
+        LOG_E("SD", "Log open failed");
+        sdCard.unmount();
+        return false;
     }
 
     sdReady = true;
-    Serial.println("OK");
+    sdCheckNow = false;
+#if LOG_TO_SD
+    loggerAttachFile(sdCard.fs(), LOG_FILE_PATH);
+#endif
+    return true;
+}
+
+// `degrade`: the card failed, mount it one clock lower next time
+void unmountSD(bool degrade = true) {
+    sdReady = false;
+#if LOG_TO_SD
+    loggerDetachFile();
+#endif
+    sdLog.end();
+    sdCard.unmount(degrade);
 }
 
+// Runs on the uplink task, which owns the card, and also does the
+// first mount there so boot does not wait for the clock probe. Probes
+// the card every SD_HEALTH_INTERVAL (at once after a failed write) and
+// unmounts it if it stops answering; while unmounted, tries to mount
+// it again every SD_REMOUNT_INTERVAL, e.g. after it has been reseated.
+void serviceSD() {
+    unsigned long interval = sdReady ? SD_HEALTH_INTERVAL : SD_REMOUNT_INTERVAL;
+    if (!sdCheckNow && millis() - lastSdCheckTime < interval) return;
+    lastSdCheckTime = millis();
+    sdCheckNow = false;
 
-bool saveDataOffline(const String& timestamp, const String& sensorData) {
     if (!sdReady) {
-        Serial.println(">> SD: Not ready");
-        return false;
+        if (!mountSD()) return;
+        if (sdCard.mountCount() == 1) {
+            importLegacyFiles();
+        } else {
+            LOG_I("SD", "Remounted (%lu pending)", (unsigned long)sdLog.pending());
+        }
+        return;
+    }
+
+    if (!sdCard.check()) {
+        LOG_E("SD", "Card stopped answering, unmounted");
+        metricCount(COUNT_SD_ERROR);
+        unmountSD();
+    }
+}
+
+
+// Appends `n` readings to the SD log as compressed blocks. Returns
+// how many were saved, in order.
+size_t saveDataOffline(const Sample* samples, size_t n) {
+    if (!sdReady) {
+        LOG_E("SD", "Not ready");
+        return 0;
     }
 
     unsigned long start = millis();
+    size_t saved = sdLog.append(samples, n);
+
+    if (saved < n) {
+        LOG_E("SD", "Append failed");
+        sdCheckNow = true;
+    } else if (millis() - start > SD_OPERATION_TIMEOUT) {
+        LOG_W("SD", "Write timeout");
+    }
+
+    LOG_D("SD", "Saved %u (%lu pending)", (unsigned)saved, (unsigned long)sdLog.pending());
+    return saved;
+}
+
+// "timestamp,field1,field2,..." up to the last field present; fields
+// without a reading are left empty. Aggregate windows continue with
+// ",n=..,w=..,min1=..,max1=..,avg1=.." (see appendWindowStats()), and
+// alarm events with ",ev=1,ms=.." (appendEventInfo()).
+void formatCsvLine(PayloadBuilder& out, const Sample& sample) {
+    char timeStr[25];
+    formatTimestamp(sample.timestamp, timeStr, sizeof(timeStr));
+    out.append(timeStr);
+
+    int last = SAMPLE_MAX_FIELDS - 1;
+    while (last > 0 && !sampleHasField(sample, last)) last--;
+
+    for (int i = 0; i <= last; i++) {
+        out.append(',');
+        if (sampleHasField(sample, i)) {
+            out.appendFixed(sample.regs[i], sampleDecimals(sample, i), 2);
+        }
+    }
+    appendWindowStats(out, sample, STATS_CSV);
+    appendEventInfo(out, sample, STATS_CSV);
+    out.append('\n');
+}
+
+// API_URL?device_code=<id>, copied under the config lock.
+void buildApiUrl(PayloadBuilder& url) {
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    url.append(API_URL.c_str());
+    url.append("?device_code=").appendEncoded(DEVICE_ID.c_str());
+    xSemaphoreGive(configMutex);
+}
 
-    String filename = "/" + timestamp;
-    filename.replace(" ", "");
-    filename.replace("-", "");
-    filename.replace(":", "");
-    filename += ".txt";
+// One reading per GET over the shared keep-alive connection.
+bool uploadReading(const Sample& sample) {
+    char timeStr[25];
+    formatTimestamp(sample.timestamp, timeStr, sizeof(timeStr));
+
+    // Build URL
+    FixedPayload<URL_MAX> url;
+    buildApiUrl(url);
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(sample, i)) continue;
+        url.append("&field").appendUInt(i + 1).append('=');
+        url.appendFixed(sample.regs[i], sampleDecimals(sample, i), 2);
+    }
+    url.append("&timestamp=").appendEncoded(timeStr);
+    appendWindowStats(url, sample, STATS_QUERY);
+    appendEventInfo(url, sample, STATS_QUERY);
 
-    File file = SD.open(filename, FILE_WRITE);
-    if (!file) {
-        Serial.println(">> SD: Open failed");
+    if (url.overflowed()) {
+        LOG_E("HTTP", "URL too long");
         return false;
     }
 
-    file.print(timestamp);
-    file.print(",");
-    file.print(sensorData);
-    file.print("\n");
-    file.close();
+    char response[UPLINK_MAX_BODY];
+    int httpResponseCode = uplink.get(url.c_str(), response, sizeof(response));
 
-    if (millis() - start > SD_OPERATION_TIMEOUT) {
-        Serial.println(">> SD: Write timeout");
+    LOG_D("HTTP", "Status %d", httpResponseCode);
+    LOG_D("HTTP", "Body: %s", response);
+
+    return httpResponseCode == 200 && strstr(response, "true") != nullptr;
+}
+
+// One CSV batch (formatCsvLine() per reading) per POST.
+bool postBatch(const PayloadBuilder& body, size_t records) {
+    FixedPayload<URL_MAX> url;
+    buildApiUrl(url);
+    url.append("&batch=1");
+    if (url.overflowed()) return false;
+
+    char resp[UPLINK_MAX_BODY];
+    int code = uplink.post(url.c_str(), "text/csv", body.bytes(), body.length(),
+                           resp, sizeof(resp));
+
+    if (code != 200 || strstr(resp, "true") == nullptr) {
+        LOG_E("HTTP", "Batch of %u failed (%d)", (unsigned)records, code);
         return false;
     }
+    return true;
+}
 
-    Serial.println(">> SD: Saved -> " + filename);
+// Appends one CSV line to the batch body, or leaves the body as it
+// was if the line does not fit.
+bool appendBatchLine(PayloadBuilder& body, const Sample& sample) {
+    size_t before = body.length();
+    formatCsvLine(body, sample);
+    if (body.overflowed()) {
+        body.truncate(before);
+        return false;
+    }
     return true;
 }
 
-void processOfflineFiles() {
-    if (!sdReady || WiFi.status() != WL_CONNECTED) return;
+// Encodes as many of the `n` readings as fit in BULK_MAX_BYTES as
+// sample blocks and POSTs them in one request. Returns how many were
+// acknowledged (all of those encoded, or none).
+size_t postEncodedBatch(const Sample* samples, size_t n) {
+    size_t len = 0;
+    size_t taken = 0;
+    while (taken < n) {
+        size_t t;
+        size_t blockLen = encodeSampleBlock(samples + taken, n - taken, taken,
+                                            batchBlocks + len, sizeof(batchBlocks) - len, t);
+        if (blockLen == 0) break;
+        len += blockLen;
+        taken += t;
+    }
+    if (taken == 0) return 0;
 
-    unsigned long start = millis();
+    FixedPayload<URL_MAX> url;
+    buildApiUrl(url);
+    url.append("&batch=1");
+    if (url.overflowed()) return 0;
 
-    File root = SD.open("/");
-    if (!root) return;
+    char resp[UPLINK_MAX_BODY];
+    int code = uplink.post(url.c_str(), "text/csv", batchBlocks, len,
+                           resp, sizeof(resp), "x-sample-delta");
 
-    int processed = 0;
-    const int MAX_FILES = 5;
+    if (code != 200 || strstr(resp, "true") == nullptr) {
+        LOG_E("HTTP", "Encoded batch of %u failed (%d)", (unsigned)taken, code);
+        return 0;
+    }
+    LOG_D("HTTP", "Encoded batch of %u in %u bytes", (unsigned)taken, (unsigned)len);
+    return taken;
+}
 
-    while (processed < MAX_FILES) {
-        File file = root.openNextFile();
-        if (!file) break;
+// Uploads readings taken from the ring. Returns how many were
+// acknowledged, in order, so the caller pops exactly those.
+size_t uploadSamples(const Sample* samples, size_t n) {
+    if (BULK_UPLOAD && n > 1 && BATCH_ENCODING == BATCH_ENCODING_DELTA) {
+        return postEncodedBatch(samples, n);
+    }
+    if (BULK_UPLOAD && n > 1) {
+        batchBody.clear();
+        size_t taken = 0;
+        while (taken < n && appendBatchLine(batchBody, samples[taken])) taken++;
+
+        return postBatch(batchBody, taken) ? taken : 0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (!uploadReading(samples[i])) return i;
+    }
+    return n;
+}
+
+// The original HTTP(S) upload path behind the Transport interface
+class HttpTransport : public Transport {
+public:
+    size_t upload(const Sample* samples, size_t n) override { return uploadSamples(samples, n); }
+    size_t batchLimit() const override { return BULK_UPLOAD ? BULK_MAX_RECORDS : UPLINK_SINGLE_BATCH; }
+    void stop() override { uplink.stop(); }
+    const char* name() const override { return "http"; }
+};
+
+HttpTransport httpTransport;
+
+// Uploads one record per GET. Returns true if more records are waiting.
+bool uploadOfflineSingles() {
+    unsigned long start = millis();
+    const int MAX_RECORDS = 5;
 
+    for (int processed = 0; processed < MAX_RECORDS; ) {
         if (millis() - start > SD_OPERATION_TIMEOUT) {
-            Serial.println(">> SD: Processing timeout");
-            file.close();
+            LOG_W("SD", "Processing timeout");
             break;
         }
 
-        String filename = file.name();
-        if (!filename.endsWith(".txt")) {
-            file.close();
+        SdLogRecord rec;
+        if (sdLog.read(&rec, 1) == 0) return false;
+
+        if (!SdLog::valid(rec)) {
+            sdLog.consume(1);
             continue;
         }
 
-        String content = file.readStringUntil('\n');
-        file.close();
-
-        int comma = content.indexOf(',');
-        if (comma < 0) {
-            SD.remove(filename);
-            continue;
+        if (uploadReading(rec.sample)) {
+            sdLog.consume(1);
+            processed++;
+        } else {
+            LOG_E("SD", "Upload failed, retry later");
+            return false;
         }
 
-        String ts  = content.substring(0, comma);
-        String val = content.substring(comma + 1);
+        yield();
+    }
 
-        String url = API_URL +
-            "?device_code=" + DEVICE_ID +
-            "&field1=" + val +
-            "&timestamp=" + ts;
+    LOG_D("SD", "%lu records pending", (unsigned long)sdLog.pending());
+    return sdLog.pending() > 0;
+}
 
-        url.replace(" ", "%20");
+// Streams the backlog from the read cursor into a chunked POST body,
+// filling the uplink's DMA buffer straight from the card: whole stored
+// blocks when batches are encoded, CSV lines (formatCsvLine()) when
+// not. Nothing is consumed until the server acknowledges the request.
+class BacklogBody : public UplinkBodySource {
+public:
+    void begin(bool encode) { encoded = encode; }
+
+    bool rewind() override {
+        covered = sent = 0;
+        next = count = 0;
+        return true;
+    }
 
-        WiFiClientSecure client;
-        client.setInsecure();
+    size_t read(uint8_t* buf, size_t cap) override {
+        return encoded ? readBlocks(buf, cap) : readCsv(buf, cap);
+    }
 
-        HTTPClient http;
-        http.begin(client, url);
-        http.setTimeout(HTTP_TIMEOUT);
+    uint32_t coveredRecords() const { return covered; }   // Damaged ones included
+    uint32_t sentRecords() const { return sent; }
+
+private:
+    size_t readBlocks(uint8_t* buf, size_t cap) {
+        size_t len = 0;
+        while (covered < BACKLOG_STREAM_MAX) {
+            uint32_t records;
+            size_t got = sdLog.readBlocks(covered, buf + len, cap - len, records);
+            if (records == 0) break;
+            if (got > 0) sent += records;
+            len += got;
+            covered += records;
+        }
+        return len;
+    }
 
-        int code = http.GET();
-        String resp = http.getString();
-        http.end();
+    size_t readCsv(uint8_t* buf, size_t cap) {
+        PayloadBuilder out((char*)buf, cap);
+        while (covered < BACKLOG_STREAM_MAX) {
+            if (next == count) {
+                size_t want = min((uint32_t)SAMPLE_BLOCK_MAX, BACKLOG_STREAM_MAX - covered);
+                count = sdLog.read(window, want, covered);
+                next = 0;
+                if (count == 0) break;
+            }
 
-        if (code == 200 && resp.indexOf("true") >= 0) {
-            SD.remove(filename);
-            Serial.println(">> SD: Uploaded & deleted " + filename);
-            processed++;
-        } else {
-            Serial.println(">> SD: Upload failed, retry later");
-            break;
+            const SdLogRecord& rec = window[next];
+            if (SdLog::valid(rec)) {
+                size_t before = out.length();
+                formatCsvLine(out, rec.sample);
+                if (out.overflowed()) {
+                    // Goes first in the next chunk
+                    out.truncate(before);
+                    break;
+                }
+                sent++;
+            }
+            next++;
+            covered++;
         }
+        return out.length();
+    }
 
-        yield();
+    bool encoded = false;
+    uint32_t covered = 0;
+    uint32_t sent = 0;
+
+    // Decoded records [covered - next, covered - next + count) of the backlog
+    SdLogRecord window[SAMPLE_BLOCK_MAX];
+    size_t next = 0;
+    size_t count = 0;
+};
+
+static_assert(UPLINK_CHUNK_BYTES >= SDLOG_BLOCK_BYTES, "a stored block must fit in one chunk");
+
+BacklogBody backlogBody;
+
+// Sends up to BACKLOG_STREAM_MAX backlog records in one chunked POST,
+// consuming them once acknowledged. Memory use does not depend on the
+// batch size. Returns true if more records are waiting.
+bool uploadOfflineStream() {
+    if (sdLog.pending() == 0) return false;
+
+    FixedPayload<URL_MAX> url;
+    buildApiUrl(url);
+    url.append("&batch=1");
+    if (url.overflowed()) return false;
+
+    bool encoded = BATCH_ENCODING == BATCH_ENCODING_DELTA;
+    backlogBody.begin(encoded);
+
+    char resp[UPLINK_MAX_BODY];
+    int code = uplink.postStream(url.c_str(), "text/csv", backlogBody, resp, sizeof(resp),
+                                 encoded ? "x-sample-delta" : nullptr);
+
+    if (code != 200 || strstr(resp, "true") == nullptr) {
+        LOG_E("SD", "Streamed batch failed (%d), retry later", code);
+        return false;
     }
 
-    root.close();
+    sdLog.consume(backlogBody.coveredRecords());
+    LOG_D("SD", "Streamed %lu records, %lu pending",
+          (unsigned long)backlogBody.sentRecords(), (unsigned long)sdLog.pending());
+    return sdLog.pending() > 0;
+}
+
+// Backlog drain for transports with their own acknowledgement (MQTT).
+// Sends the valid records of one read and consumes the log up to the
+// last one acknowledged, so unacked in-flight readings stay queued.
+// Returns true if more records are waiting.
+bool uploadOfflineVia(Transport& transport) {
+    size_t n = sdLog.read(backlogRecs, min((size_t)MAX_BULK_RECORDS, transport.batchLimit()));
+    if (n == 0) return false;
+
+    static uint16_t slot[MAX_BULK_RECORDS];  // Log position of uplinkBatch[i]
+    size_t valid = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!SdLog::valid(backlogRecs[i])) continue;
+        uplinkBatch[valid] = backlogRecs[i].sample;
+        slot[valid++] = i;
+    }
+
+    size_t acked = valid > 0 ? transport.upload(uplinkBatch, valid) : 0;
+    size_t consumed = acked == valid ? n : slot[acked];
+    if (consumed > 0) sdLog.consume(consumed);
+
+    if (acked < valid) {
+        LOG_W("SD", "%s acked %u of %u, retry later",
+              transport.name(), (unsigned)acked, (unsigned)valid);
+        return false;
+    }
+    LOG_D("SD", "%u records sent via %s, %lu pending",
+          (unsigned)acked, transport.name(), (unsigned long)sdLog.pending());
+    return sdLog.pending() > 0;
 }
 
+// Returns true if the drain should run again straight away.
+bool processOfflineFiles() {
+    if (!sdReady || WiFi.status() != WL_CONNECTED) return false;
+    if (UPLINK_TRANSPORT == TRANSPORT_MQTT) return uploadOfflineVia(mqttTransport);
+    if (!BULK_UPLOAD) return uploadOfflineSingles();
+    return uploadOfflineStream();
+}
 
-void loadConfig() {
+
+// Copies `src` into a fixed record field, NUL-padded
+void packString(char* dst, size_t cap, const String& src) {
+    memset(dst, 0, cap);
+    if (src.length() >= cap) LOG_W("CONFIG", "Value cut to %u chars", (unsigned)(cap - 1));
+    strlcpy(dst, src.c_str(), cap);
+}
+
+void packConfig(CoreConfig& core, MqttConfig& mqtt, TlsConfig& tls) {
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    packString(core.id, sizeof(core.id), DEVICE_ID);
+    packString(core.url, sizeof(core.url), API_URL);
+    packString(core.ntp, sizeof(core.ntp), NTP_SERVER);
+    core.interval = UPDATE_INTERVAL;
+    core.mode = UPDATE_MODE;
+    core.bulk = BULK_UPLOAD ? 1 : 0;
+    core.encoding = BATCH_ENCODING;
+    core.transport = UPLINK_TRANSPORT;
+    core.bulkMax = BULK_MAX_RECORDS;
+    core.sp1 = setPoint1;
+    core.sp2 = setPoint2;
+
+    packString(mqtt.url, sizeof(mqtt.url), MQTT_URL);
+    packString(mqtt.user, sizeof(mqtt.user), MQTT_USER);
+    packString(mqtt.pass, sizeof(mqtt.pass), MQTT_PASS);
+    packString(mqtt.topic, sizeof(mqtt.topic), MQTT_TOPIC);
+    packString(tls.pins, sizeof(tls.pins), TLS_PINS);
+    xSemaphoreGive(configMutex);
+}
+
+// Same checks as the JSON import: a record from older firmware may
+// carry values this one no longer accepts
+void applyCoreConfig(const CoreConfig& core) {
+    DEVICE_ID = core.id;
+    API_URL = core.url;
+    NTP_SERVER = core.ntp;
+    UPDATE_INTERVAL = validateInterval(core.interval) ? core.interval : 60;
+    UPDATE_MODE = core.mode == 1 ? 1 : 0;
+    setPoint1 = validateSetpoint(core.sp1) ? core.sp1 : 0.0;
+    setPoint2 = validateSetpoint(core.sp2) ? core.sp2 : 0.0;
+    BULK_UPLOAD = core.bulk == 1;
+    BULK_MAX_RECORDS = validateBulkRecords(core.bulkMax) ? core.bulkMax : 100;
+    BATCH_ENCODING = core.encoding == BATCH_ENCODING_DELTA ? BATCH_ENCODING_DELTA : BATCH_ENCODING_CSV;
+    UPLINK_TRANSPORT = core.transport == TRANSPORT_MQTT ? TRANSPORT_MQTT : TRANSPORT_HTTP;
+}
+
+void applyMqttConfig(const MqttConfig& mqtt) {
+    MQTT_URL = mqtt.url;
+    MQTT_USER = mqtt.user;
+    MQTT_PASS = mqtt.pass;
+    MQTT_TOPIC = mqtt.topic;
+}
+
+void applyTlsConfig(const TlsConfig& tls) {
+    TlsPins pins;
+    TLS_PINS = tlsParsePins(tls.pins, pins) ? tls.pins : "";
+}
+
+// Writes the core, MQTT and TLS records; each is only rewritten if it changed
+void writeConfig() {
+    CoreConfig core;
+    MqttConfig mqtt;
+    TlsConfig tls;
+    packConfig(core, mqtt, tls);
+
+    uint32_t before = coreRecord.writeCount() + mqttRecord.writeCount() + tlsRecord.writeCount();
+    if (!coreRecord.store(core) || !mqttRecord.store(mqtt) || !tlsRecord.store(tls)) {
+        LOG_E("NVS", "Failed to save config.");
+    } else if (coreRecord.writeCount() + mqttRecord.writeCount() + tlsRecord.writeCount() != before) {
+        LOG_I("CONFIG", "Saved to NVS.");
+    }
+}
+
+// The JSON document of older firmware under app_conf/data. Returns
+// false if there is none.
+bool loadLegacyConfig() {
+    bool found = false;
     preferences.begin("app_conf", true);
     if (preferences.isKey("data")) {
         String json = preferences.getString("data", "{}");
-        JsonDocument doc;
+        JsonDocument doc(&jsonArena);
         DeserializationError error = deserializeJson(doc, json);
 
         if (!error) {
+            found = true;
             if (doc.containsKey("id")) DEVICE_ID = doc["id"].as<String>();
             if (doc.containsKey("url")) API_URL = doc["url"].as<String>();
             if (doc.containsKey("ntp")) NTP_SERVER = doc["ntp"].as<String>();
@@ -276,418 +979,1817 @@ void loadConfig() {
                 setPoint2 = validateSetpoint(sp2) ? sp2 : 0.0;
             }
 
-            Serial.println(">> CONFIG: Loaded and validated.");
+            if (doc.containsKey("bulk")) BULK_UPLOAD = doc["bulk"].as<int>() == 1;
+
+            if (doc.containsKey("bmax")) {
+                int bmax = doc["bmax"].as<int>();
+                BULK_MAX_RECORDS = validateBulkRecords(bmax) ? bmax : 100;
+            }
+
+            if (doc.containsKey("benc")) {
+                BATCH_ENCODING = doc["benc"].as<int>() == BATCH_ENCODING_DELTA ? BATCH_ENCODING_DELTA
+                                                                               : BATCH_ENCODING_CSV;
+            }
+
+            if (doc.containsKey("tx")) {
+                UPLINK_TRANSPORT = doc["tx"].as<int>() == TRANSPORT_MQTT ? TRANSPORT_MQTT : TRANSPORT_HTTP;
+            }
+            if (doc.containsKey("mqh")) MQTT_URL = doc["mqh"].as<String>();
+            if (doc.containsKey("mqu")) MQTT_USER = doc["mqu"].as<String>();
+            if (doc.containsKey("mqk")) MQTT_PASS = doc["mqk"].as<String>();
+            if (doc.containsKey("mqt")) MQTT_TOPIC = doc["mqt"].as<String>();
+
+            LOG_I("CONFIG", "Loaded JSON config.");
         } else {
-            Serial.println(">> CONFIG: JSON parse error");
+            LOG_E("CONFIG", "JSON parse error");
         }
     }
     preferences.end();
+    return found;
 }
 
-void saveConfig() {
-    preferences.begin("app_conf", false);
-    JsonDocument doc;
-    doc["id"] = DEVICE_ID;
-    doc["url"] = API_URL;
-    doc["ntp"] = NTP_SERVER;
-    doc["int"] = UPDATE_INTERVAL;
-    doc["mode"] = UPDATE_MODE;
-    doc["sp1"] = setPoint1;
-    doc["sp2"] = setPoint2;
+void loadConfig() {
+    CoreConfig core;
+    MqttConfig mqtt;
+    TlsConfig tls;
+    if (coreRecord.load(core)) {
+        applyCoreConfig(core);
+        if (mqttRecord.load(mqtt)) applyMqttConfig(mqtt);
+        if (tlsRecord.load(tls)) applyTlsConfig(tls);
+        LOG_I("CONFIG", "Loaded and validated.");
+        return;
+    }
 
-    String output;
-    serializeJson(doc, output);
-    preferences.putString("data", output);
-    preferences.end();
-    Serial.println(">> CONFIG: Saved to NVS.");
+    // One-time import: written back as records, JSON removed
+    if (loadLegacyConfig()) {
+        writeConfig();
+        preferences.begin("app_conf", false);
+        preferences.remove("data");
+        preferences.end();
+    }
 }
 
-void saveNetworkToMemory(const String& ssid, const String& pass) {
-    if (ssid.length() == 0) return;
+// The poll table lives under its own key so the main config document
+// stays small.
+void loadPollTable() {
+    pollTable.setDefault();
 
-    preferences.begin("wifi_db", false);
-    String currentData = preferences.getString("nets", "[]");
-    JsonDocument doc;
-    deserializeJson(doc, currentData);
-    JsonArray array = doc.as<JsonArray>();
-
-    bool found = false;
-    for (JsonObject obj : array) {
-        if (obj["s"] == ssid) {
-            obj["p"] = pass;
-            found = true;
-            break;
+    preferences.begin("app_conf", true);
+    if (preferences.isKey("poll")) {
+        JsonDocument doc(&jsonArena);
+        String err;
+        if (deserializeJson(doc, preferences.getString("poll", "[]")) ||
+            !pollTable.fromJson(doc.as<JsonArrayConst>(), err)) {
+            LOG_E("CONFIG", "Bad poll table, using default");
+            pollTable.setDefault();
         }
     }
+    preferences.end();
 
-    if (!found) {
-        while (array.size() >= MAX_WIFI_NETWORKS_SAVED) {
-            array.remove(0);
-        }
-        JsonObject newObj = array.add<JsonObject>();
-        newObj["s"] = ssid;
-        newObj["p"] = pass;
-    }
+    LOG_I("CONFIG", "Poll table has %u entries", pollTable.size());
+}
+
+// The table stays JSON (its size varies); an unchanged one is not
+// rewritten
+void writePollTable() {
+    JsonDocument doc(&jsonArena);
+    pollTable.toJson(doc.to<JsonArray>());
 
     String output;
     serializeJson(doc, output);
-    preferences.putString("nets", output);
+    preferences.begin("app_conf", false);
+    bool same = preferences.getString("poll", "") == output;
+    if (!same) preferences.putString("poll", output);
     preferences.end();
+    if (!same) LOG_I("CONFIG", "Poll table saved to NVS.");
 }
 
-bool tryAutoConnect() {
-    // 1. Load saved networks
-    preferences.begin("wifi_db", true);
-    String savedData = preferences.getString("nets", "[]");
-    preferences.end();
-
-    if (savedData == "[]") {
-        Serial.println(">> AUTO: No saved networks.");
-        return false;
-    }
+// BLE sensors: JSON like the poll table
+void loadBleGateway() {
+    bleGateway.setDefault();
 
-    JsonDocument doc;
-    deserializeJson(doc, savedData);
-    JsonArray savedNets = doc.as<JsonArray>();
-
-    // 2. Iterate and Try Connecting BLINDLY (NO SCANNING HERE)
-    for (JsonObject obj : savedNets) {
-        String ssid = obj["s"].as<String>();
-        String pass = obj["p"].as<String>();
-        
-        Serial.printf(">> AUTO: Trying to connect to [%s]...\n", ssid.c_str());
-        
-        WiFi.disconnect();
-        WiFi.begin(ssid.c_str(), pass.c_str());
-        
-        // Wait up to 4 seconds for connection
-        int attempts = 0;
-        while (WiFi.status() != WL_CONNECTED && attempts < 8) { 
-            delay(500);
-            Serial.print(".");
-            attempts++;
-        }
-        Serial.println();
-        
-        if (WiFi.status() == WL_CONNECTED) {
-            Serial.println(">> AUTO: Success! Connected.");
-            return true;
-        } else {
-            Serial.println(">> AUTO: Failed. Trying next...");
+    preferences.begin("app_conf", true);
+    if (preferences.isKey("ble")) {
+        JsonDocument doc(&jsonArena);
+        String err;
+        if (deserializeJson(doc, preferences.getString("ble", "[]")) ||
+            !bleGateway.fromJson(doc.as<JsonArrayConst>(), err)) {
+            LOG_E("CONFIG", "Bad BLE sensor table, none used");
+            bleGateway.setDefault();
         }
     }
-    
-    Serial.println(">> AUTO: Could not connect to any saved network.");
-    return false;
-}
+    preferences.end();
 
-void setupTime() {
-    configTime(19800, 0, NTP_SERVER.c_str()); // IST
-    Serial.println(">> TIME: Syncing (IST)...");
+    if (bleGateway.size() > 0) LOG_I("CONFIG", "%u BLE sensors", bleGateway.size());
 }
 
-void setupModbus() {
-    Serial1.begin(9600, SERIAL_8N1, RX1_PIN, TX1_PIN);
-    modbus.begin(1, Serial1);
-    
-    // --- FIX: LOWER TIMEOUT ---
-    // Default is 2000ms. Set to 200ms. 
-    // If sensor doesn't reply in 200ms, it probably won't reply at all.
-    // modbus.setTimeOut(200); 
-    
-    Serial.println(">> MODBUS: Initialized (9600 baud, 200ms timeout)");
+void writeBleGateway() {
+    JsonDocument doc(&jsonArena);
+    bleGateway.toJson(doc.to<JsonArray>());
+
+    String output;
+    serializeJson(doc, output);
+    preferences.begin("app_conf", false);
+    bool same = preferences.getString("ble", "") == output;
+    if (!same) preferences.putString("ble", output);
+    preferences.end();
+    if (!same) LOG_I("CONFIG", "BLE sensors saved to NVS.");
 }
 
-uint8_t writeModbusRegister(uint16_t reg, uint16_t value) {
-    uint8_t wResult = modbus.writeSingleRegister(reg, value);
-    if (wResult == modbus.ku8MBSuccess) {
-        Serial.println(">> MODBUS: Write OK");
-        return 1;
-    } else {
-        Serial.printf(">> MODBUS: Write error: %02X\n", wResult);
-        return 0;
+void writeAggregation() {
+    // Field by field into zeroed memory, so struct padding compares equal
+    AggregateSettings rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.windowS = aggSettings.windowS;
+    rec.heartbeatS = aggSettings.heartbeatS;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) rec.deadband[i] = aggSettings.deadband[i];
+    rec.alarmMask = aggSettings.alarmMask;
+
+    uint32_t before = aggRecord.writeCount();
+    if (!aggRecord.store(rec)) {
+        LOG_E("NVS", "Failed to save aggregation.");
+    } else if (aggRecord.writeCount() != before) {
+        LOG_I("CONFIG", "Aggregation saved to NVS.");
     }
 }
 
-void sendSensorData() {
-    // if (WiFi.status() != WL_CONNECTED) {
-    //     Serial.println(">> SKIP: WiFi not connected");
-    //     return;
-    // }
+// Aggregation settings: a record, or JSON from older firmware
+void loadAggregation() {
+    aggSettings.setDefault();
 
-    // Read sensor via Modbus
-    String sensorData = "";
-    uint8_t result = modbus.readHoldingRegisters(PROCESS_VALUE, 2);
-
-    if (result == modbus.ku8MBSuccess) {
-        uint16_t sensorValue = modbus.getResponseBuffer(0);
-        // uint16_t decimalpoint = modbus.getResponseBuffer(1);
-        sensorData = String(float(sensorValue)/10.0);
-        Serial.println(">> SENSOR: " + sensorData + " (Modbus)");
-        // Serial.println(">> DECIMAL: " + String(decimalpoint) + " (Modbus)");
+    AggregateSettings stored;
+    if (aggRecord.load(stored)) {
+        aggSettings = stored;
     } else {
-        Serial.printf(">> MODBUS: Read error: %02X\n", result);
-    }
-
-    // Validate sensor data
-    if (sensorData.isEmpty()) {
-        Serial.println(">> SKIP: No valid sensor data");
-
-        // UNCOMMENT FOR TESTING WITH DUMMY DATA:
-        // sensorData = "99.9";
-        // Serial.println(">> TEST MODE: Using dummy data");
+        preferences.begin("app_conf", true);
+        bool legacy = preferences.isKey("agg");
+        if (legacy) {
+            JsonDocument doc(&jsonArena);
+            String err;
+            if (deserializeJson(doc, preferences.getString("agg", "{}")) ||
+                !aggSettings.fromJson(doc.as<JsonObjectConst>(), err)) {
+                LOG_E("CONFIG", "Bad aggregation settings, aggregation off");
+                aggSettings.setDefault();
+            }
+        }
+        preferences.end();
 
-        if (sensorData.isEmpty()) {
-            return; // Exit if no valid data
+        if (legacy) {
+            writeAggregation();
+            preferences.begin("app_conf", false);
+            preferences.remove("agg");
+            preferences.end();
         }
     }
 
-    lastWatchdogTime = millis();
-
-    // Get timestamp
-    time_t now;
-    time(&now);
-    struct tm timeinfo;
-    localtime_r(&now, &timeinfo);
-    char timeStr[25];
-    strftime(timeStr, sizeof(timeStr), "%Y-%m-%d %H:%M:%S", &timeinfo);
+    if (aggSettings.windowS > 0) {
+        LOG_I("CONFIG", "Aggregating %us windows", aggSettings.windowS);
+    }
+}
 
-    // Build URL
-    String fullUrl = API_URL + "?device_code=" + DEVICE_ID + 
-                    "&field1=" + sensorData + "&timestamp=" + String(timeStr);
-    fullUrl.replace(" ", "%20");
+// Settings changes only mark their part dirty; commitConfig() writes
+// them out once the burst is over, so several BLE writes in a row cost
+// one NVS write per changed record
+void markConfigDirty(uint8_t parts) {
+    unsigned long now = millis();
+    if (configDirty == 0) configDirtyFirst = now;
+    configDirty |= parts;
+    configDirtyLast = now;
+}
 
-    // Send HTTP request
-    WiFiClientSecure client;
-    client.setInsecure();
-    client.setTimeout(HTTP_TIMEOUT / 1000);
+void saveConfig() {
+    markConfigDirty(CONFIG_PART_CORE);
+    transportConfigChanged = true;
+}
 
-    HTTPClient http;
-    http.begin(client, fullUrl);
-    http.setTimeout(HTTP_TIMEOUT);
+void savePollTable() {
+    markConfigDirty(CONFIG_PART_POLL);
+}
 
-    int httpResponseCode = http.GET();
-    String response = http.getString();
-    http.end();
+void saveAggregation() {
+    markConfigDirty(CONFIG_PART_AGG);
+}
 
-    Serial.printf(">> HTTP: Status %d\n", httpResponseCode);
-    Serial.println(">> HTTP: Body: " + response);
+void saveBleGateway() {
+    markConfigDirty(CONFIG_PART_BLE);
+}
 
-    // Check success and fallback to SD if failed
-    if (httpResponseCode == 200 && response.indexOf("true") >= 0) {
-        Serial.println(">> HTTP: Success");
-    } else {
-        Serial.println(">> HTTP: Failed. Saving to SD...");
-        saveDataOffline(String(timeStr), sensorData);
+// Config task loop: writes dirty parts CONFIG_COMMIT_DELAY after the
+// last change, or CONFIG_COMMIT_MAX after the first (`now`: at once)
+void commitConfig(bool now = false) {
+    if (configDirty == 0) return;
+    unsigned long t = millis();
+    if (!now && t - configDirtyLast < CONFIG_COMMIT_DELAY &&
+        t - configDirtyFirst < CONFIG_COMMIT_MAX) {
+        return;
     }
+
+    uint8_t parts = configDirty;
+    configDirty = 0;
+    if (parts & CONFIG_PART_CORE) writeConfig();
+    if (parts & CONFIG_PART_POLL) writePollTable();
+    if (parts & CONFIG_PART_AGG) writeAggregation();
+    if (parts & CONFIG_PART_BLE) writeBleGateway();
 }
 
-void clearSavedWifi() {
-    preferences.begin("wifi_db", false);
-    if (preferences.clear()) {
-        Serial.println(">> NVS: Wi-Fi credentials cleared.");
-    } else {
-        Serial.println(">> NVS: Failed to clear Wi-Fi.");
-    }
-    preferences.end();
-    
-    // Also clear standard ESP32 WiFi NVS (just in case)
-    WiFi.disconnect(true, true); 
+uint32_t uptimeSeconds() {
+#if LOW_POWER
+    return lowPower.uptimeSeconds();   // Since the cold boot, across sleeps
+#else
+    return (uint32_t)(esp_timer_get_time() / 1000000);
+#endif
+}
+
+// SNTP callback (lwIP task). Fixes the boot time that readings taken
+// before the first sync are back-dated with; later syncs refine it.
+void onTimeSynced(struct timeval* tv) {
+    bool first = bootEpoch == 0;
+    bootEpoch = (uint32_t)tv->tv_sec - uptimeSeconds();
+    if (first) LOG_I("TIME", "Synced, boot was at %lu", (unsigned long)bootEpoch);
+}
+
+void setupTime() {
+    sntp_set_time_sync_notification_cb(onTimeSynced);
+    configTime(GMT_OFFSET_SEC, 0, NTP_SERVER.c_str()); // IST
+    LOG_I("TIME", "Syncing (IST)...");
+}
+
+// WifiManager callbacks, both run on the config task
+void onWifiConnected() {
+    linkUpTime = millis();
+    setupTime();
+    forceHttpNow = true;
+    xTaskNotifyGive(uplinkTaskHandle);
+}
+
+void onWifiRequestResult(bool ok) {
+    if (ok) {
+        String msg = "Connected! SSID: " + WiFi.SSID() + " | IP: " + WiFi.localIP().toString();
+        LOG_I("WIFI", "%s", msg.c_str());
+        safeNotify(msg);
+    } else {
+        LOG_E("WIFI", "Connection failed");
+        safeNotify("Connection Failed.");
+    }
+    watchdogPaused = false;
+    lastWatchdogTime = millis();
+}
+
+void setupModbus() {
+    const uint32_t baud = 9600;
+    if (!modbus.begin(Serial1, baud, RX1_PIN, TX1_PIN)) {
+        LOG_E("MODBUS", "Engine start failed");
+        return;
+    }
+    // Timeouts and retries are per slave (poll table, applySlaveTimeouts)
+    LOG_I("MODBUS", "Initialized (%lu baud, per-slave timeouts, default %ums, %u retries)",
+          (unsigned long)baud, MODBUS_DEFAULT_TIMEOUT_MS, MODBUS_DEFAULT_RETRIES);
+}
+
+// Pushes each slave's timeout and retry count into the RTU engine.
+void applySlaveTimeouts(const ModbusPollTable& table) {
+    for (uint8_t i = 0; i < table.size(); i++) {
+        const PollEntry& e = table.entry(i);
+        modbus.setSlaveTimeout(e.slave, e.timeoutMs, e.retries);
+    }
+}
+
+uint8_t writeModbusRegister(uint16_t reg, uint16_t value) {
+    uint8_t wResult = modbus.writeSingleRegister(CONTROLLER_SLAVE, reg, value);
+    if (wResult == MODBUS_OK) {
+        LOG_D("MODBUS", "Write OK");
+        return 1;
+    } else {
+        LOG_E("MODBUS", "Write error: %02X", wResult);
+        return 0;
+    }
+}
+
+// Queues a register write for the sampler task, which owns the bus.
+void requestModbusWrite(uint16_t reg, uint16_t value) {
+    ModbusWrite w = { reg, value };
+    if (xQueueSend(modbusWriteQueue, &w, 0) != pdTRUE) {
+        LOG_W("MODBUS", "Write queue full");
+    }
+}
+
+// Runs planned reads and feeds the results back to the table.
+void runPollReads(ModbusPollTable& table, const PollRead* reads, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const PollRead& r = reads[i];
+        uint16_t regs[POLL_MAX_READ];
+        // Sleeps on the engine while the frame is on the wire
+        uint8_t result = modbus.readRegisters(r.slave, r.fc, r.start, r.count, regs);
+
+        bool ok = result == MODBUS_OK;
+        if (!ok) {
+            LOG_E("MODBUS", "Read error: %02X (slave %u, %u x%u)",
+                  result, r.slave, r.start, r.count);
+        }
+        table.complete(r, regs, ok);
+    }
+}
+
+// Runs the coalesced reads the poll table has due.
+void pollModbus(ModbusPollTable& table, bool sampleTick) {
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.plan(millis(), sampleTick, reads, POLL_MAX_ENTRIES);
+    runPollReads(table, reads, n);
+}
+
+// `slotTime`: Unix time of the schedule slot the reading is for (0 for
+// an off-grid reading), stamped instead of the time of the read
+bool readSensor(ModbusPollTable& table, Sample& sample, uint32_t slotTime) {
+    pollModbus(table, true);
+
+    // Validate sensor data. BLE sensors fill fields Modbus leaves empty.
+    bool modbusOk = table.snapshot(sample);
+    bool bleOk = !LOW_POWER && bleGateway.merge(sample, millis(), BLE_SENSOR_MAX_AGE);
+    if (!modbusOk && !bleOk) {
+        LOG_W("SKIP", "No valid sensor data");
+        return false;
+    }
+
+    FixedPayload<96> sensorData;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(sample, i)) continue;
+        if (sensorData.length() > 0) sensorData.append(", ");
+        sensorData.appendFixed(sample.regs[i], sampleDecimals(sample, i), 2);
+    }
+    LOG_D("SENSOR", "%s (%s)", sensorData.c_str(),
+          bleOk ? (modbusOk ? "Modbus+BLE" : "BLE") : "Modbus");
+
+    lastWatchdogTime = millis();
+
+    // Until NTP has synced, readings carry seconds since boot and are
+    // back-dated later (backdateSamples())
+    time_t now;
+    time(&now);
+    if (now > 1600000000) {
+        sample.timestamp = slotTime != 0 ? slotTime : now;
+        sample.flags = SAMPLE_TIME_VALID;
+    } else {
+        sample.timestamp = uptimeSeconds();
+        sample.flags = SAMPLE_TIME_UPTIME;
+    }
+    return true;
+}
+
+// Copies the MQTT settings and TLS pins out of the config Strings for
+// the uplink task.
+void applyTransportConfig() {
+    MqttSettings mq = {};
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    tlsParsePins(TLS_PINS.c_str(), mq.pins);
+    strlcpy(mq.url, MQTT_URL.c_str(), sizeof(mq.url));
+    strlcpy(mq.user, MQTT_USER.c_str(), sizeof(mq.user));
+    strlcpy(mq.pass, MQTT_PASS.c_str(), sizeof(mq.pass));
+    strlcpy(mq.clientId, DEVICE_ID.c_str(), sizeof(mq.clientId));
+    strlcpy(mq.topic, MQTT_TOPIC.c_str(), sizeof(mq.topic));
+    xSemaphoreGive(configMutex);
+    uplink.setPins(mq.pins);
+    mqttTransport.configure(mq);
 }
 
 // ================================================================
-// BLE CALLBACKS
-// ================================================================
+// SELF TEST
+// ================================================================
+// BLE "self_test" action. Each part runs on the task that owns the
+// hardware: the Modbus burst on the sampler (one transaction per
+// pass, so the sample grid holds), the SD and uplink tests on the
+// uplink task. The config task reports once all three are done.
+struct SelfTest {
+    volatile bool running;
+    volatile bool modbusPending;
+    volatile bool storagePending;   // SD and uplink parts
+    unsigned long startedAt;
+
+    uint16_t modbusReads;           // Requested
+    uint16_t modbusDone;
+    uint16_t modbusOk;
+    uint64_t modbusSumUs;
+    uint32_t modbusMaxUs;
+
+    bool sdOk;
+    uint32_t sdWriteKBps;
+    uint32_t sdReadKBps;
+
+    int httpStatus;                 // Of the first HEAD; < 0 is an UplinkError
+    uint32_t connectUs;             // TCP connect + TLS handshake
+    uint32_t rttUs;                 // HEAD over the open connection
+};
+SelfTest selfTest = {};
+
+// Sampler task: one read of the burst, cycling through the poll table.
+void selfTestModbusStep(ModbusPollTable& table) {
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.planFields(0xFF, reads, POLL_MAX_ENTRIES);
+    if (n == 0) {
+        selfTest.modbusPending = false;
+        return;
+    }
+
+    const PollRead& r = reads[selfTest.modbusDone % n];
+    uint16_t regs[POLL_MAX_READ];
+    int64_t start = esp_timer_get_time();
+    uint8_t result = modbus.readRegisters(r.slave, r.fc, r.start, r.count, regs);
+    uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+
+    bool ok = result == MODBUS_OK;
+    table.complete(r, regs, ok);
+    if (ok) {
+        selfTest.modbusOk++;
+        selfTest.modbusSumUs += us;
+        selfTest.modbusMaxUs = max(selfTest.modbusMaxUs, us);
+    }
+    if (++selfTest.modbusDone >= selfTest.modbusReads) selfTest.modbusPending = false;
+}
+
+// Uplink task: SD throughput, then a cold and a warm HEAD to API_URL.
+void selfTestStorage() {
+    if (sdReady) {
+        selfTest.sdOk = sdCard.benchmark(SELF_TEST_SD_KB, selfTest.sdWriteKBps, selfTest.sdReadKBps);
+    }
+
+    FixedPayload<URL_MAX> url;
+    buildApiUrl(url);
+    uplink.stop();   // Time a fresh handshake
+    selfTest.httpStatus = uplink.head(url.c_str());
+    if (selfTest.httpStatus > 0) {
+        selfTest.connectUs = uplink.connectUs();
+        int64_t start = esp_timer_get_time();
+        if (uplink.head(url.c_str()) > 0) selfTest.rttUs = (uint32_t)(esp_timer_get_time() - start);
+    }
+    selfTest.storagePending = false;
+}
+
+void startSelfTest(uint16_t reads) {
+    // A timed-out uplink part may still be writing its results
+    if (selfTest.running || selfTest.storagePending) {
+        safeNotify("Error: Self-test running");
+        return;
+    }
+    memset((void*)&selfTest, 0, sizeof(selfTest));
+    selfTest.modbusReads = reads;
+    selfTest.startedAt = millis();
+    selfTest.running = true;
+    selfTest.storagePending = true;
+    selfTest.modbusPending = true;
+    watchdogPaused = true;
+    xTaskNotifyGive(uplinkTaskHandle);
+    LOG_I("TEST", "Self-test, %u Modbus reads", reads);
+    safeNotify("Self-test running...");
+}
+
+// Config task: the summary, once every part is done (or timed out).
+//   {"st":{"mb":[ok,n,avg_us,max_us],"sd":[ok,write_kbps,read_kbps],
+//          "net":[status,connect_us,rtt_us]}}
+void serviceSelfTest() {
+    bool done = !selfTest.modbusPending && !selfTest.storagePending;
+    if (!done && millis() - selfTest.startedAt < SELF_TEST_TIMEOUT) return;
+
+    FixedPayload<BLE_COMMAND_MAX> msg;
+    msg.append("{\"st\":{\"mb\":[").appendUInt(selfTest.modbusOk);
+    msg.append(',').appendUInt(selfTest.modbusDone);
+    msg.append(',').appendUInt(selfTest.modbusOk ? (uint32_t)(selfTest.modbusSumUs / selfTest.modbusOk) : 0);
+    msg.append(',').appendUInt(selfTest.modbusMaxUs);
+    msg.append("],\"sd\":[").appendUInt(selfTest.sdOk ? 1 : 0);
+    msg.append(',').appendUInt(selfTest.sdWriteKBps);
+    msg.append(',').appendUInt(selfTest.sdReadKBps);
+    msg.append("],\"net\":[").appendInt(selfTest.httpStatus);
+    msg.append(',').appendUInt(selfTest.connectUs);
+    msg.append(',').appendUInt(selfTest.rttUs);
+    msg.append("]}}");
+    safeNotify(msg);
+
+    LOG_I("TEST", "Modbus %u/%u, SD %lu/%lu KB/s, HTTP %d", selfTest.modbusOk, selfTest.modbusDone,
+          (unsigned long)selfTest.sdWriteKBps, (unsigned long)selfTest.sdReadKBps, selfTest.httpStatus);
+    if (!done) LOG_W("TEST", "Self-test timed out");
+
+    selfTest.modbusPending = false;
+    selfTest.running = false;
+    watchdogPaused = false;
+    lastWatchdogTime = millis();
+}
+
+// ================================================================
+// COMMAND HANDLING
+// ================================================================
+// Metrics snapshot as a handful of notifications, each within one MTU:
+//   {"h":"mb","n":120,"avg":8400,"max":41230,"b":[0,0,3,...]}  per histogram, us
+//   {"c":{"mb_to":2,...}}                                       counters
+//   {"heap":..,"heap_min":..,"heap_blk":..,"psram":..,"up":..}   bytes, s
+// Bucket bounds are metricBucketBound(); trailing empty buckets are cut.
+void notifyMetrics() {
+    FixedPayload<BLE_COMMAND_MAX> msg;
+
+    for (uint8_t h = 0; h < METRIC_HISTOGRAMS; h++) {
+        HistogramSnapshot snap;
+        metricSnapshot((MetricHistogram)h, snap);
+
+        msg.clear();
+        msg.append("{\"h\":").appendJsonString(metricName((MetricHistogram)h));
+        msg.append(",\"n\":").appendUInt(snap.count);
+        msg.append(",\"avg\":").appendUInt(snap.count ? (uint32_t)(snap.sumUs / snap.count) : 0);
+        msg.append(",\"max\":").appendUInt(snap.maxUs);
+        msg.append(",\"b\":[");
+        uint8_t last = METRIC_BUCKETS;
+        while (last > 0 && snap.buckets[last - 1] == 0) last--;
+        for (uint8_t b = 0; b < last; b++) {
+            if (b > 0) msg.append(',');
+            msg.appendUInt(snap.buckets[b]);
+        }
+        msg.append("]}");
+        safeNotify(msg);
+    }
+
+    msg.clear();
+    msg.append("{\"c\":{");
+    for (uint8_t c = 0; c < METRIC_COUNTERS; c++) {
+        if (c > 0) msg.append(',');
+        msg.appendJsonString(metricName((MetricCounter)c)).append(':');
+        msg.appendUInt(metricCounter((MetricCounter)c));
+    }
+    msg.append("}}");
+    safeNotify(msg);
+
+    msg.clear();
+    msg.append("{\"heap\":").appendUInt(heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    msg.append(",\"heap_min\":").appendUInt(heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL));
+    msg.append(",\"heap_blk\":").appendUInt(heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    msg.append(",\"psram\":").appendUInt(heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    msg.append(",\"json_hw\":").appendUInt(jsonArena.highWater());
+    msg.append(",\"json_sp\":").appendUInt(jsonArena.spills());
+    msg.append(",\"up\":").appendUInt(millis() / 1000);
+    msg.append('}');
+    safeNotify(msg);
+}
+
+// Runs on the config task; MyCallbacks::onWrite only queues the raw
+// write so the NimBLE host task never parses JSON.
+void handleCommand(const char* data, size_t len) {
+    JsonDocument doc(&jsonArena);
+    DeserializationError error = deserializeJson(doc, data, len);
+
+    if (error) {
+        LOG_E("BLE", "JSON parse error");
+        return;
+    }
+
+    // Handle actions
+    if (doc.containsKey("action")) {
+        const char* act = doc["action"];
+
+        if (strcmp(act, "scan") == 0) {
+            triggerWifiScan = true;
+            scanBinary = false;
+        }
+        else if (strcmp(act, "get_conf") == 0) {
+            JsonDocument resp(&jsonArena);
+            resp["id"] = DEVICE_ID;
+            resp["url"] = API_URL;
+            resp["ntp"] = NTP_SERVER;
+            resp["int"] = UPDATE_INTERVAL;
+            resp["mode"] = UPDATE_MODE;
+            resp["sp1"] = setPoint1;
+            resp["sp2"] = setPoint2;
+            resp["bulk"] = BULK_UPLOAD ? 1 : 0;
+            resp["bmax"] = BULK_MAX_RECORDS;
+            resp["benc"] = BATCH_ENCODING;
+            resp["tx"] = UPLINK_TRANSPORT;
+            resp["mqh"] = MQTT_URL;
+            resp["mqu"] = MQTT_USER;
+            resp["mqt"] = MQTT_TOPIC;   // The password is write-only
+            resp["pin"] = TLS_PINS;
+
+            notifyJson(resp);
+        }
+        else if (strcmp(act, "get_poll") == 0) {
+            JsonDocument resp(&jsonArena);
+            pollTable.toJson(resp["poll"].to<JsonArray>());
+
+            notifyJson(resp);
+        }
+        else if (strcmp(act, "get_ble") == 0) {
+            JsonDocument resp(&jsonArena);
+            bleGateway.toJson(resp["ble"].to<JsonArray>());
+            resp["adv"] = bleGateway.advertCount();
+
+            notifyJson(resp);
+        }
+        else if (strcmp(act, "get_agg") == 0) {
+            JsonDocument resp(&jsonArena);
+            aggSettings.toJson(resp["agg"].to<JsonObject>());
+
+            notifyJson(resp);
+        }
+        else if (strcmp(act, "get_metrics") == 0) {
+            notifyMetrics();
+            if (doc["reset"] | false) metricsReset();
+        }
+        else if (strcmp(act, "get_status") == 0) {
+            String statusMsg = WiFi.status() == WL_CONNECTED 
+                ? "Connected! SSID: " + WiFi.SSID() + " | IP: " + WiFi.localIP().toString()
+                : "Status: Not Connected";
+            safeNotify(statusMsg);
+        }
+        else if (strcmp(act, "forget_wifi") == 0) {
+            LOG_I("CMD", "Forget Wi-Fi requested.");
+            
+            // 1. Clear Memory and disconnect
+            wifiManager.forget();
+            
+            // 2. Notify Phone
+            if(deviceConnected) {
+                safeNotify("Wi-Fi credentials erased.");
+            }
+        }
+        else if (strcmp(act, "self_test") == 0) {
+            int reads = doc["n"] | (int)SELF_TEST_DEFAULT_READS;
+            startSelfTest(constrain(reads, 1, (int)SELF_TEST_MAX_READS));
+        }
+        else if (strcmp(act, "ota") == 0) {
+            const char* url = doc["url"] | "";
+            bool cancel = url[0] == '\0';
+            if (!cancel && (strncmp(url, "https://", 8) != 0 || strlen(url) >= OTA_URL_MAX)) {
+                safeNotify("Error: Invalid OTA URL (https only)");
+            } else if (!cancel && TLS_PINS.length() == 0) {
+                safeNotify("Error: OTA needs a server pin (\"pin\")");
+            } else {
+                otaUpdate.request(url);
+                xTaskNotifyGive(uplinkTaskHandle);
+                safeNotify(cancel ? "OTA cancelled." : "OTA queued.");
+            }
+        }
+        else if (strcmp(act, "get_ota") == 0) {
+            JsonDocument resp(&jsonArena);
+            JsonObject ota = resp["ota"].to<JsonObject>();
+            ota["st"] = otaUpdate.status();
+            ota["err"] = otaUpdate.error();
+            ota["rx"] = otaUpdate.received();
+            ota["sz"] = otaUpdate.fileSize();
+            ota["trial"] = otaUpdate.onTrial();
+
+            notifyJson(resp);
+        }
+        else if (strcmp(act, "ping") == 0) {
+            LOG_D("BLE", "Ping");
+        }
+    }
+    // Handle poll table updates
+    else if (doc.containsKey("poll")) {
+        String err;
+        if (pollTable.fromJson(doc["poll"].as<JsonArrayConst>(), err)) {
+            savePollTable();
+            xQueueOverwrite(pollTableQueue, &pollTable);
+            forceHttpNow = true;
+            safeNotify("Poll table saved.");
+        } else {
+            safeNotify("Error: Poll table " + err);
+        }
+    }
+    // Handle BLE sensor table updates
+    else if (doc.containsKey("ble")) {
+        String err;
+        if (bleGateway.fromJson(doc["ble"].as<JsonArrayConst>(), err)) {
+            saveBleGateway();
+            safeNotify("BLE sensors saved.");
+        } else {
+            safeNotify("Error: BLE sensors " + err);
+        }
+    }
+    // Handle aggregation updates
+    else if (doc.containsKey("agg")) {
+        String err;
+        if (aggSettings.fromJson(doc["agg"].as<JsonObjectConst>(), err)) {
+            saveAggregation();
+            xQueueOverwrite(aggQueue, &aggSettings);
+            safeNotify("Aggregation saved.");
+        } else {
+            safeNotify("Error: Aggregation " + err);
+        }
+    }
+    // Handle config updates
+    else if (doc.containsKey("id") || doc.containsKey("url") || 
+             doc.containsKey("ntp") || doc.containsKey("int") || 
+             doc.containsKey("mode") || doc.containsKey("sp1") || 
+             doc.containsKey("sp2") || doc.containsKey("bulk") ||
+             doc.containsKey("bmax") || doc.containsKey("benc") ||
+             doc.containsKey("tx") ||
+             doc.containsKey("mqh") || doc.containsKey("mqu") ||
+             doc.containsKey("mqk") || doc.containsKey("mqt") ||
+             doc.containsKey("pin")) {
+
+        bool changed = false;
+        xSemaphoreTake(configMutex, portMAX_DELAY);
+
+        if (doc.containsKey("id")) {
+            DEVICE_ID = doc["id"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("url")) {
+            API_URL = doc["url"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("ntp")) {
+            NTP_SERVER = doc["ntp"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("int")) {
+            int interval = doc["int"].as<int>();
+            if (validateInterval(interval)) {
+                UPDATE_INTERVAL = interval;
+                changed = true;
+            } else {
+                safeNotify("Error: Invalid interval (1-86400)");
+            }
+        }
+        if (doc.containsKey("mode")) {
+            int mode = doc["mode"].as<int>();
+            if (mode == 0 || mode == 1) {
+                UPDATE_MODE = mode;
+                changed = true;
+            }
+        }
+        if (doc.containsKey("sp1")) {
+            float sp1 = doc["sp1"].as<float>();
+            if (validateSetpoint(sp1)) {
+                setPoint1 = sp1;
+                changed = true;
+                requestModbusWrite(SET_POINT_1, uint16_t(sp1));
+            } else {
+                safeNotify("Error: Invalid setpoint 1");
+            }
+        }
+        if (doc.containsKey("sp2")) {
+            float sp2 = doc["sp2"].as<float>();
+            if (validateSetpoint(sp2)) {
+                setPoint2 = sp2;
+                changed = true;
+                requestModbusWrite(SET_POINT_2, uint16_t(sp2));
+            } else {
+                safeNotify("Error: Invalid setpoint 2");
+            }
+        }
+        if (doc.containsKey("bulk")) {
+            int bulk = doc["bulk"].as<int>();
+            if (bulk == 0 || bulk == 1) {
+                BULK_UPLOAD = bulk == 1;
+                changed = true;
+            }
+        }
+        if (doc.containsKey("bmax")) {
+            int bmax = doc["bmax"].as<int>();
+            if (validateBulkRecords(bmax)) {
+                BULK_MAX_RECORDS = bmax;
+                changed = true;
+            } else {
+                safeNotify("Error: Invalid bmax (1-500)");
+            }
+        }
+        if (doc.containsKey("benc")) {
+            int benc = doc["benc"].as<int>();
+            if (benc == BATCH_ENCODING_CSV || benc == BATCH_ENCODING_DELTA) {
+                BATCH_ENCODING = benc;
+                changed = true;
+            }
+        }
+        if (doc.containsKey("tx")) {
+            int tx = doc["tx"].as<int>();
+            if (tx == TRANSPORT_HTTP || tx == TRANSPORT_MQTT) {
+                UPLINK_TRANSPORT = tx;
+                changed = true;
+            }
+        }
+        if (doc.containsKey("mqh")) {
+            MQTT_URL = doc["mqh"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("mqu")) {
+            MQTT_USER = doc["mqu"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("mqk")) {
+            MQTT_PASS = doc["mqk"].as<String>();
+            changed = true;
+        }
+        if (doc.containsKey("mqt")) {
+            MQTT_TOPIC = doc["mqt"].as<String>();
+            changed = true;
+        }
+        bool badPin = false;
+        if (doc.containsKey("pin")) {
+            const char* pin = doc["pin"] | "";
+            TlsPins pins;
+            if (tlsParsePins(pin, pins)) {
+                TLS_PINS = pin;
+                changed = true;
+            } else {
+                badPin = true;
+            }
+        }
+
+        xSemaphoreGive(configMutex);
+
+        if (badPin) safeNotify("Error: Invalid pin (base64 SHA-256, max 2)");
+
+        if (changed) {
+            saveConfig();
+            forceHttpNow = true;
+            safeNotify("Settings Saved.");
+        }
+    }
+    // Handle WiFi credentials
+    else if (doc.containsKey("ssid")) {
+        targetSSID = String((const char*)doc["ssid"]);
+        targetPass = doc.containsKey("pass") ? String((const char*)doc["pass"]) : "";
+        targetSSID.trim();
+        targetPass.trim();
+
+        if (targetSSID.length() > 0) {
+            wifiConfigReceived = true;
+        }
+    }
+}
+
+static String tlvString(const uint8_t* v, uint8_t len) {
+    char buf[256];
+    memcpy(buf, v, len);
+    buf[len] = '\0';
+    return String(buf);
+}
+
+// Binary counterpart of handleCommand() (see ble_proto.h). PING never
+// gets here; BinaryCallbacks answers it on the host task.
+void handleBinaryCommand(const uint8_t* data, size_t len) {
+    if (len < 2) return;
+
+    uint8_t op = data[0];
+    TlvReader reader(data + 2, len - 2);
+
+    uint8_t resp[BLE_COMMAND_MAX];
+    size_t cap = min((size_t)(bleMtu - BLE_ATT_OVERHEAD), sizeof(resp));
+    resp[0] = op | BP_RESPONSE;
+    resp[1] = data[1];
+    resp[2] = BP_STATUS_OK;
+    TlvWriter out(resp + BP_HEADER_LEN, cap - BP_HEADER_LEN);
+
+    if (op == BP_OP_SCAN) {
+        // Answered from the config task as results stream out
+        triggerWifiScan = true;
+        scanBinary = true;
+        scanSeq = data[1];
+        return;
+    }
+
+    if (op == BP_OP_GET_CONF) {
+        static const uint8_t allTags[] = {
+            BP_TAG_ID, BP_TAG_URL, BP_TAG_NTP, BP_TAG_INT, BP_TAG_MODE,
+            BP_TAG_SP1, BP_TAG_SP2, BP_TAG_BULK, BP_TAG_BMAX,
+            BP_TAG_TX, BP_TAG_MQH, BP_TAG_MQU, BP_TAG_MQT, BP_TAG_BENC
+        };
+        const uint8_t* tags = len > 2 ? data + 2 : allTags;
+        size_t nTags = len > 2 ? len - 2 : sizeof(allTags);
+
+        for (size_t i = 0; i < nTags; i++) {
+            switch (tags[i]) {
+                case BP_TAG_ID:   out.putStr(BP_TAG_ID, DEVICE_ID); break;
+                case BP_TAG_URL:  out.putStr(BP_TAG_URL, API_URL); break;
+                case BP_TAG_NTP:  out.putStr(BP_TAG_NTP, NTP_SERVER); break;
+                case BP_TAG_INT:  out.putU32(BP_TAG_INT, UPDATE_INTERVAL); break;
+                case BP_TAG_MODE: out.putU8(BP_TAG_MODE, UPDATE_MODE); break;
+                case BP_TAG_SP1:  out.putF32(BP_TAG_SP1, setPoint1); break;
+                case BP_TAG_SP2:  out.putF32(BP_TAG_SP2, setPoint2); break;
+                case BP_TAG_BULK: out.putU8(BP_TAG_BULK, BULK_UPLOAD ? 1 : 0); break;
+                case BP_TAG_BMAX: out.putU16(BP_TAG_BMAX, BULK_MAX_RECORDS); break;
+                case BP_TAG_TX:   out.putU8(BP_TAG_TX, UPLINK_TRANSPORT); break;
+                case BP_TAG_MQH:  out.putStr(BP_TAG_MQH, MQTT_URL); break;
+                case BP_TAG_MQU:  out.putStr(BP_TAG_MQU, MQTT_USER); break;
+                case BP_TAG_MQT:  out.putStr(BP_TAG_MQT, MQTT_TOPIC); break;
+                case BP_TAG_BENC: out.putU8(BP_TAG_BENC, BATCH_ENCODING); break;
+            }
+        }
+        if (out.overflowed()) resp[2] = BP_STATUS_PARTIAL;
+    }
+    else if (op == BP_OP_SET) {
+        // Validate everything before applying anything, so a bad field
+        // leaves the config untouched.
+        uint8_t tag, vlen;
+        const uint8_t* v;
+        uint8_t badTag = 0;
+
+        while (badTag == 0 && reader.next(tag, v, vlen)) {
+            uint8_t u8; uint16_t u16; uint32_t u32; float f;
+            bool ok;
+            switch (tag) {
+                case BP_TAG_ID: case BP_TAG_URL: case BP_TAG_NTP: case BP_TAG_MQT:
+                    ok = vlen > 0; break;
+                case BP_TAG_MQH: case BP_TAG_MQU: case BP_TAG_MQK:
+                    ok = true; break;   // Empty clears
+                case BP_TAG_TX:
+                    ok = TlvReader::asU8(v, vlen, u8) && u8 <= TRANSPORT_MQTT; break;
+                case BP_TAG_INT:
+                    ok = TlvReader::asU32(v, vlen, u32) && validateInterval(u32); break;
+                case BP_TAG_MODE: case BP_TAG_BULK: case BP_TAG_BENC:
+                    ok = TlvReader::asU8(v, vlen, u8) && u8 <= 1; break;
+                case BP_TAG_SP1: case BP_TAG_SP2:
+                    ok = TlvReader::asF32(v, vlen, f) && validateSetpoint(f); break;
+                case BP_TAG_BMAX:
+                    ok = TlvReader::asU16(v, vlen, u16) && validateBulkRecords(u16); break;
+                default:
+                    ok = false;
+            }
+            if (!ok) badTag = tag;
+        }
+
+        if (reader.malformed()) {
+            resp[2] = BP_STATUS_BAD_FRAME;
+        } else if (badTag != 0) {
+            resp[2] = BP_STATUS_BAD_VALUE;
+            out.putU8(0, badTag);
+        } else {
+            TlvReader apply(data + 2, len - 2);
+            xSemaphoreTake(configMutex, portMAX_DELAY);
+            while (apply.next(tag, v, vlen)) {
+                uint8_t u8; uint16_t u16; uint32_t u32; float f;
+                switch (tag) {
+                    case BP_TAG_ID:  DEVICE_ID = tlvString(v, vlen); break;
+                    case BP_TAG_URL: API_URL = tlvString(v, vlen); break;
+                    case BP_TAG_NTP: NTP_SERVER = tlvString(v, vlen); break;
+                    case BP_TAG_MQH: MQTT_URL = tlvString(v, vlen); break;
+                    case BP_TAG_MQU: MQTT_USER = tlvString(v, vlen); break;
+                    case BP_TAG_MQK: MQTT_PASS = tlvString(v, vlen); break;
+                    case BP_TAG_MQT: MQTT_TOPIC = tlvString(v, vlen); break;
+                    case BP_TAG_TX:
+                        TlvReader::asU8(v, vlen, u8); UPLINK_TRANSPORT = u8; break;
+                    case BP_TAG_INT:
+                        TlvReader::asU32(v, vlen, u32); UPDATE_INTERVAL = u32; break;
+                    case BP_TAG_MODE:
+                        TlvReader::asU8(v, vlen, u8); UPDATE_MODE = u8; break;
+                    case BP_TAG_BULK:
+                        TlvReader::asU8(v, vlen, u8); BULK_UPLOAD = u8 == 1; break;
+                    case BP_TAG_BENC:
+                        TlvReader::asU8(v, vlen, u8); BATCH_ENCODING = u8; break;
+                    case BP_TAG_BMAX:
+                        TlvReader::asU16(v, vlen, u16); BULK_MAX_RECORDS = u16; break;
+                    case BP_TAG_SP1:
+                        TlvReader::asF32(v, vlen, f); setPoint1 = f;
+                        requestModbusWrite(SET_POINT_1, uint16_t(f));
+                        break;
+                    case BP_TAG_SP2:
+                        TlvReader::asF32(v, vlen, f); setPoint2 = f;
+                        requestModbusWrite(SET_POINT_2, uint16_t(f));
+                        break;
+                }
+            }
+            xSemaphoreGive(configMutex);
+            saveConfig();
+            forceHttpNow = true;
+        }
+    }
+    else if (op == BP_OP_STATUS) {
+        bool up = WiFi.status() == WL_CONNECTED;
+        out.putU8(BP_TAG_WIFI, up ? 1 : 0);
+        if (up) {
+            IPAddress ip = WiFi.localIP();
+            uint8_t ipBytes[4] = { ip[0], ip[1], ip[2], ip[3] };
+            out.putU8(BP_TAG_RSSI, (uint8_t)(int8_t)WiFi.RSSI());
+            out.put(BP_TAG_IP, ipBytes, sizeof(ipBytes));
+        }
+        out.putU32(BP_TAG_RING, sampleRing.size());
+        out.putU32(BP_TAG_SD_PENDING, sdReady ? sdLog.pending() : 0);
+        out.putU32(BP_TAG_UPTIME, millis() / 1000);
+    }
+    else if (op == BP_OP_STREAM) {
+        uint8_t tag, vlen, every;
+        const uint8_t* v;
+        if (!reader.next(tag, v, vlen) || tag != BP_TAG_DECIMATION) {
+            resp[2] = BP_STATUS_BAD_FRAME;
+        } else if (!TlvReader::asU8(v, vlen, every) || every > MAX_STREAM_DECIMATION) {
+            resp[2] = BP_STATUS_BAD_VALUE;
+            out.putU8(0, BP_TAG_DECIMATION);
+        } else {
+            streamDecimation = every;
+            LOG_I("STREAM", "%s", every > 0 ? "started" : "stopped");
+        }
+    }
+    else if (op == BP_OP_LIVE) {
+        Sample latest;
+        if (xQueuePeek(latestSampleQueue, &latest, 0) == pdTRUE) {
+            // Fields past what the MTU holds are left out of the mask
+            // and the reply is PARTIAL
+            uint8_t v[7 + 2 * SAMPLE_MAX_FIELDS];
+            size_t room = min(sizeof(v), cap - BP_HEADER_LEN - 2);
+            size_t n = 7;
+            uint8_t mask = 0;
+            for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+                if (!sampleHasField(latest, i)) continue;
+                if (n + 2 > room) {
+                    resp[2] = BP_STATUS_PARTIAL;
+                    break;
+                }
+                v[n++] = (uint8_t)latest.regs[i];
+                v[n++] = (uint8_t)(latest.regs[i] >> 8);
+                mask |= 1 << i;
+            }
+            v[0] = (uint8_t)latest.timestamp;
+            v[1] = (uint8_t)(latest.timestamp >> 8);
+            v[2] = (uint8_t)(latest.timestamp >> 16);
+            v[3] = (uint8_t)(latest.timestamp >> 24);
+            v[4] = mask;
+            v[5] = (uint8_t)latest.decimals;
+            v[6] = (uint8_t)(latest.decimals >> 8);
+            if (!out.put(BP_TAG_SAMPLE, v, n)) resp[2] = BP_STATUS_FAILED;
+        } else {
+            resp[2] = BP_STATUS_NO_DATA;
+        }
+    }
+    else {
+        resp[2] = BP_STATUS_BAD_OP;
+    }
+
+    binaryNotify(resp, BP_HEADER_LEN + out.length());
+}
+
+// Sends the next MTU-sized chunk of scan results to whichever channel
+// asked. Returns true once the last one is out.
+//   JSON:   {"w":[["ssid",rssi,channel,auth],...]} ... {"scan_done":n}
+//   binary: BP_TAG_AP records, status PARTIAL until the final frame
+bool streamScanChunk() {
+    size_t cap = min((size_t)(bleMtu - BLE_ATT_OVERHEAD), BLE_COMMAND_MAX);
+    uint8_t total = wifiScan.count();
+
+    if (scanBinary) {
+        uint8_t frame[BLE_COMMAND_MAX];
+        TlvWriter out(frame + BP_HEADER_LEN, cap - BP_HEADER_LEN);
+        while (scanSent < total) {
+            const ScanRecord& r = wifiScan.record(scanSent);
+            uint8_t v[3 + sizeof(r.ssid)];
+            size_t ssidLen = strlen(r.ssid);
+            v[0] = (uint8_t)r.rssi;
+            v[1] = r.channel;
+            v[2] = r.auth;
+            memcpy(v + 3, r.ssid, ssidLen);
+            if (!out.put(BP_TAG_AP, v, 3 + ssidLen)) break;
+            scanSent++;
+        }
+        bool last = scanSent >= total;
+        frame[0] = BP_OP_SCAN | BP_RESPONSE;
+        frame[1] = scanSeq;
+        frame[2] = last ? BP_STATUS_OK : BP_STATUS_PARTIAL;
+        binaryNotify(frame, BP_HEADER_LEN + out.length());
+        return last;
+    }
+
+    FixedPayload<BLE_COMMAND_MAX> out;
+    if (scanSent >= total) {
+        out.append("{\"scan_done\":").appendUInt(total).append('}');
+        safeNotify(out);
+        return true;
+    }
+
+    out.append("{\"w\":[");
+    uint8_t first = scanSent;
+    while (scanSent < total) {
+        const ScanRecord& r = wifiScan.record(scanSent);
+        size_t before = out.length();
+        if (scanSent > first) out.append(',');
+        out.append('[').appendJsonString(r.ssid).append(',').appendInt(r.rssi);
+        out.append(',').appendUInt(r.channel).append(',').appendUInt(r.auth).append(']');
+
+        // A record that does not fit waits for the next chunk (a lone
+        // one goes anyway; the MTU clips it)
+        if ((out.overflowed() || out.length() + 2 > cap) && scanSent > first) {
+            out.truncate(before);
+            break;
+        }
+        scanSent++;
+    }
+    out.append("]}");
+    safeNotify(out);
+    return false;
+}
+
+void finishScan() {
+    scanStreaming = false;
+    watchdogPaused = false;
+    lastWatchdogTime = millis();
+}
+
+// ================================================================
+// BLE CALLBACKS
+// ================================================================
 class MyServerCallbacks: public NimBLEServerCallbacks {
     void onConnect(NimBLEServer* pServer) {
         deviceConnected = true;
         lastWatchdogTime = millis();
-        Serial.println(">> EVENT: Phone Connected");
+        lastBleActivity = millis();
+        LOG_I("EVENT", "Phone Connected");
     }
 
     void onDisconnect(NimBLEServer* pServer) {
         deviceConnected = false;
-        Serial.println(">> EVENT: Phone Disconnected");
+        lastBleActivity = millis();
+        bleMtu = BLE_DEFAULT_MTU;
+        streamDecimation = 0;
+        LOG_I("EVENT", "Phone Disconnected");
         delay(100); 
         NimBLEDevice::startAdvertising();
-        Serial.println(">> BLE: Advertising Restarted");
+        LOG_I("BLE", "Advertising Restarted");
+    }
+
+    void onMTUChange(uint16_t MTU, ble_gap_conn_desc* desc) {
+        bleMtu = MTU;
+        LOG_D("BLE", "MTU %u", MTU);
     }
 };
 
 class MyCallbacks: public NimBLECharacteristicCallbacks {
     void onWrite(NimBLECharacteristic *pCharacteristic) {
+        MetricTimer timer(METRIC_BLE_WRITE);
         std::string value = pCharacteristic->getValue();
         if (value.length() == 0) return;
 
         lastWatchdogTime = millis();
+        lastBleActivity = millis();
         // Serial.print(">> RAW BLE: ");
         // Serial.println(value.c_str());
 
-        JsonDocument doc;
-        DeserializationError error = deserializeJson(doc, value);
+        // The heartbeat only needs to feed the watchdog above
+        static const char PING[] = "{\"action\":\"ping\"}";
+        if (value.length() == sizeof(PING) - 1 && memcmp(value.data(), PING, sizeof(PING) - 1) == 0) {
+            return;
+        }
 
-        if (error) {
-            Serial.println(">> BLE: JSON parse error");
+        BleCommand cmd;
+        cmd.binary = false;
+        cmd.len = min(value.length(), sizeof(cmd.data));
+        memcpy(cmd.data, value.data(), cmd.len);
+        if (xQueueSend(commandQueue, &cmd, 0) != pdTRUE) {
+            LOG_W("BLE", "Command queue full");
+        }
+    }
+};
+
+class BinaryCallbacks: public NimBLECharacteristicCallbacks {
+    void onWrite(NimBLECharacteristic *pCharacteristic) {
+        MetricTimer timer(METRIC_BLE_WRITE);
+        std::string value = pCharacteristic->getValue();
+        if (value.length() < 2) return;
+
+        lastWatchdogTime = millis();
+        lastBleActivity = millis();
+
+        const uint8_t* data = (const uint8_t*)value.data();
+        if (data[0] == BP_OP_PING) {
+            uint8_t resp[BP_HEADER_LEN] = { BP_OP_PING | BP_RESPONSE, data[1], BP_STATUS_OK };
+            binaryNotify(resp, sizeof(resp));
             return;
         }
 
-        // Handle actions
-        if (doc.containsKey("action")) {
-            const char* act = doc["action"];
-
-            if (strcmp(act, "scan") == 0) {
-                triggerWifiScan = true;
-            }
-            else if (strcmp(act, "get_conf") == 0) {
-                JsonDocument resp;
-                resp["id"] = DEVICE_ID;
-                resp["url"] = API_URL;
-                resp["ntp"] = NTP_SERVER;
-                resp["int"] = UPDATE_INTERVAL;
-                resp["mode"] = UPDATE_MODE;
-                resp["sp1"] = setPoint1;
-                resp["sp2"] = setPoint2;
-
-                String out;
-                serializeJson(resp, out);
-                safeNotify(out);
-            }
-            else if (strcmp(act, "get_status") == 0) {
-                String statusMsg = WiFi.status() == WL_CONNECTED 
-                    ? "Connected! SSID: " + WiFi.SSID() + " | IP: " + WiFi.localIP().toString()
-                    : "Status: Not Connected";
-                safeNotify(statusMsg);
-            }
-            else if (strcmp(act, "forget_wifi") == 0) {
-                Serial.println(">> CMD: Forget Wi-Fi requested.");
-                
-                // 1. Clear Memory
-                clearSavedWifi();
-                
-                // 2. Notify Phone
-                if(deviceConnected) {
-                    safeNotify("Wi-Fi credentials erased.");
-                }
-                
-                // 3. Disconnect WiFi immediately
-                WiFi.disconnect();
-            }
-            else if (strcmp(act, "ping") == 0) {
-                // UNCOMMENT THIS TO SEE IF HEARTBEAT IS ARRIVING
-                Serial.print("."); 
+        BleCommand cmd;
+        cmd.binary = true;
+        cmd.len = min(value.length(), sizeof(cmd.data));
+        memcpy(cmd.data, data, cmd.len);
+        if (xQueueSend(commandQueue, &cmd, 0) != pdTRUE) {
+            LOG_W("BLE", "Command queue full");
+        }
+    }
+};
+
+// ================================================================
+// TASKS
+// ================================================================
+
+// Hands a reading or window record to the uplink task.
+void queueRecord(const Sample& record) {
+    if (sampleRing.push(record)) {
+        xTaskNotifyGive(uplinkTaskHandle);
+    } else {
+        metricCount(COUNT_RING_DROP);
+        LOG_W("SAMPLER", "Ring full, reading dropped");
+    }
+}
+
+// esp_timer task: the sampler's next slot is due
+void onSampleSlot(void* arg) {
+    xTaskNotify((TaskHandle_t)arg, SAMPLER_WAKE_SLOT, eSetBits);
+}
+
+// Alarm GPIO edges, for the sampler
+portMUX_TYPE alarmEdgeLock = portMUX_INITIALIZER_UNLOCKED;
+uint32_t alarmEdges = 0;
+int64_t alarmEdgeUs = 0;    // esp_timer time of the latest edge
+
+void IRAM_ATTR onAlarmPin() {
+    portENTER_CRITICAL_ISR(&alarmEdgeLock);
+    alarmEdges++;
+    alarmEdgeUs = esp_timer_get_time();
+    portEXIT_CRITICAL_ISR(&alarmEdgeLock);
+
+    BaseType_t woken = pdFALSE;
+    xTaskNotifyFromISR(samplerTaskHandle, SAMPLER_WAKE_ALARM, eSetBits, &woken);
+    portYIELD_FROM_ISR(woken);
+}
+
+// Alarm fast path. Reads only the poll entries behind `alarmFields`
+// and, when one of those values changed (or the alarm GPIO fired),
+// queues an event with every field's latest value, stamped to the
+// millisecond at `atUs` (esp_timer time of the read or the edge).
+// Events go to alarmRing, which the uplink empties before the sample
+// ring; the regular grid readings are not affected.
+void checkAlarms(ModbusPollTable& table, uint8_t alarmFields, bool edge, int64_t atUs) {
+    static uint8_t known = 0;                   // Alarm fields with a previous value
+    static uint16_t last[SAMPLE_MAX_FIELDS];
+
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.planFields(alarmFields, reads, POLL_MAX_ENTRIES);
+    runPollReads(table, reads, n);
+    if (!edge) atUs = esp_timer_get_time();
+
+    Sample event = {};
+    table.snapshot(event);
+    uint8_t present = event.fieldMask & alarmFields;
+    uint8_t changed = 0;
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!((present >> i) & 1)) continue;
+        if (((known >> i) & 1) && event.regs[i] != last[i]) changed |= 1 << i;
+        last[i] = event.regs[i];
+    }
+    // A field that failed to read keeps its value, so a change over
+    // the gap still shows
+    known = (known | present) & alarmFields;
+    if (!changed && !edge) return;
+
+    int64_t wall = SampleSchedule::wallNowUs();
+    if (wall != 0) {
+        wall -= esp_timer_get_time() - atUs;
+        event.timestamp = (uint32_t)(wall / 1000000);
+        event.ms = (uint16_t)(wall / 1000 % 1000);
+        event.flags = SAMPLE_TIME_VALID | SAMPLE_ALARM_EVENT;
+    } else {
+        event.timestamp = uptimeSeconds();
+        event.flags = SAMPLE_TIME_UPTIME | SAMPLE_ALARM_EVENT;
+    }
+    LOG_I("ALARM", "%s (fields %02X)", changed ? "Changed" : "Input edge", changed);
+
+    if (alarmRing.push(event)) {
+        xTaskNotifyGive(uplinkTaskHandle);
+    } else {
+        queueRecord(event);   // Still sent, behind the readings
+    }
+}
+
+// Core 1: owns the Modbus bus and the sampling schedule. Never waits
+// on the network, so the cadence holds while the uplink is stuck.
+void samplerTask(void* param) {
+    static ModbusPollTable table = pollTable;
+    static Aggregator aggregator;
+    static SampleSchedule schedule;
+    unsigned long lastStreamPoll = 0;
+    applySlaveTimeouts(table);
+    // A window cannot span deep sleep: low-power builds send plain readings
+    if (!LOW_POWER) aggregator.configure(aggSettings);
+
+    // Wakes the task at the slot deadline rather than at its next tick
+    esp_timer_handle_t slotTimer = nullptr;
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = onSampleSlot;
+    timerArgs.arg = xTaskGetCurrentTaskHandle();
+    timerArgs.name = "sample_slot";
+    esp_timer_create(&timerArgs, &slotTimer);
+    int64_t armedFor = 0;
+
+    uint8_t alarmFields = aggSettings.alarmMask;
+    unsigned long lastAlarmPoll = 0;
+    uint32_t seenEdges = 0;
+    samplerTaskHandle = xTaskGetCurrentTaskHandle();
+    if (ALARM_GPIO_PIN >= 0) {
+        pinMode(ALARM_GPIO_PIN, INPUT_PULLUP);
+        attachInterrupt(ALARM_GPIO_PIN, onAlarmPin, CHANGE);
+    }
+    schedule.configure(UPDATE_MODE == 1 ? SCHEDULE_ALIGNED : SCHEDULE_INTERVAL, UPDATE_INTERVAL * 1000UL,
+                       GMT_OFFSET_SEC, SAMPLE_LATE_POLICY, SAMPLE_MAX_CATCH_UP, esp_timer_get_time());
+
+    for (;;) {
+        if (sleepRequested) {
+            samplerParked = true;
+            vTaskSuspend(nullptr);
+        }
+
+        if (xQueueReceive(pollTableQueue, &table, 0) == pdTRUE) {
+            applySlaveTimeouts(table);
+        }
+        AggregateSettings agg;
+        if (xQueueReceive(aggQueue, &agg, 0) == pdTRUE) {
+            alarmFields = agg.alarmMask;
+            if (!LOW_POWER) {
+                // Keep the partial window rather than losing its readings
+                Sample record;
+                if (aggregator.flush(millis(), record)) queueRecord(record);
+                aggregator.configure(agg);
             }
         }
-        // Handle config updates
-        else if (doc.containsKey("id") || doc.containsKey("url") || 
-                 doc.containsKey("ntp") || doc.containsKey("int") || 
-                 doc.containsKey("mode") || doc.containsKey("sp1") || 
-                 doc.containsKey("sp2")) {
+        if (streamDecimation != bleStreamer.decimation()) {
+            bleStreamer.setDecimation(streamDecimation);
+        }
 
-            bool changed = false;
+        ModbusWrite w;
+        while (xQueueReceive(modbusWriteQueue, &w, 0) == pdTRUE) {
+            writeModbusRegister(w.reg, w.value);
+        }
 
-            if (doc.containsKey("id")) {
-                DEVICE_ID = doc["id"].as<String>();
-                changed = true;
+        // Self-test burst, one transaction per pass
+        if (selfTest.modbusPending) selfTestModbusStep(table);
+
+        // Alarm fast path: on an input edge, else every ALARM_POLL_MS
+        portENTER_CRITICAL(&alarmEdgeLock);
+        bool edge = alarmEdges != seenEdges;
+        seenEdges = alarmEdges;
+        int64_t edgeUs = alarmEdgeUs;
+        portEXIT_CRITICAL(&alarmEdgeLock);
+        if (edge || (alarmFields != 0 && millis() - lastAlarmPoll >= ALARM_POLL_MS)) {
+            lastAlarmPoll = millis();
+            checkAlarms(table, alarmFields, edge, edgeUs);
+        }
+
+        // Interval or clock-aligned grid; follows settings changes
+        ScheduleMode mode = UPDATE_MODE == 1 ? SCHEDULE_ALIGNED : SCHEDULE_INTERVAL;
+        uint32_t intervalMs = UPDATE_INTERVAL * 1000UL;
+        if (mode != schedule.mode() || intervalMs != schedule.intervalMs()) {
+            schedule.configure(mode, intervalMs, GMT_OFFSET_SEC, SAMPLE_LATE_POLICY,
+                               SAMPLE_MAX_CATCH_UP, esp_timer_get_time());
+        }
+
+        bool shouldTrigger = schedule.due(esp_timer_get_time());
+        uint32_t slotTime = 0;
+        if (shouldTrigger) {
+            slotTime = schedule.slotTime();
+            metricRecord(METRIC_SAMPLE_JITTER, schedule.lateUs());
+            if (schedule.skipped() > 0) {
+                metricCount(COUNT_SAMPLE_SKIPPED, schedule.skipped());
+                LOG_W("SAMPLER", "%lu slots missed", (unsigned long)schedule.skipped());
             }
-            if (doc.containsKey("url")) {
-                API_URL = doc["url"].as<String>();
-                changed = true;
+        }
+
+        if (schedule.deadlineUs() != armedFor) {
+            armedFor = schedule.deadlineUs();
+            int64_t wait = armedFor - esp_timer_get_time();
+            nextSlotMs = millis() + (uint32_t)(max(wait, (int64_t)0) / 1000);
+            esp_timer_stop(slotTimer);
+            esp_timer_start_once(slotTimer, wait > 0 ? wait : 1);
+        }
+
+        if (forceHttpNow) {
+            shouldTrigger = true;
+            forceHttpNow = false;
+        }
+
+        Sample sample = {};
+        size_t streamPayload = bleMtu - BLE_ATT_OVERHEAD;
+        if (!shouldTrigger && bleStreamer.active() && millis() - lastStreamPoll >= STREAM_POLL_MS) {
+            // Commissioning: poll every sample entry at the stream rate
+            lastStreamPoll = millis();
+            pollModbus(table, true);
+            if (table.snapshot(sample)) bleStreamer.offer(sample, millis(), streamPayload);
+        } else if (!shouldTrigger) {
+            // Entries with their own period refresh between samples
+            pollModbus(table, false);
+        } else if (readSensor(table, sample, slotTime)) {
+            bleStreamer.offer(sample, millis(), streamPayload);
+            xQueueOverwrite(latestSampleQueue, &sample);
+
+            Sample record;
+            if (!aggregator.enabled()) {
+                queueRecord(sample);
+            } else {
+                // A window opened on the uptime clock keeps its start
+                // time when the first synced reading folds in
+                aggregator.backdate(bootEpoch);
+                if (aggregator.add(sample, millis(), record)) queueRecord(record);
             }
-            if (doc.containsKey("ntp")) {
-                NTP_SERVER = doc["ntp"].as<String>();
-                changed = true;
+        }
+
+        bleStreamer.service(millis());
+        // Either wake bit just ends the sleep early; slots and edges
+        // are picked up from the schedule and alarmEdges
+        xTaskNotifyWait(0, SAMPLER_WAKE_SLOT | SAMPLER_WAKE_ALARM, nullptr,
+                        pdMS_TO_TICKS(SAMPLER_TICK_MS));
+    }
+}
+
+// Back-dates readings taken before the first NTP sync. Uptime stamps
+// only mean something within this boot, so with `final` (the readings
+// are about to outlive it on SD) ones that cannot be fixed yet are
+// stored as plain invalid-time readings.
+void backdateSamples(Sample* samples, size_t n, bool final) {
+    uint32_t epoch = bootEpoch;
+    for (size_t i = 0; i < n; i++) {
+        if (!sampleBackdate(samples[i], epoch) && final) samples[i].flags &= ~SAMPLE_TIME_UPTIME;
+    }
+}
+
+// Moves the oldest readings of `ring` to the SD log until `keep` are
+// left
+void spillToSD(SpscRing<Sample>& ring, uint32_t keep) {
+    static Sample chunk[SAMPLE_SPILL_CHUNK];  // Too big for the uplink stack
+
+    while (sdReady && ring.size() > keep) {
+        size_t n = ring.peek(chunk, min((size_t)SAMPLE_SPILL_CHUNK, (size_t)(ring.size() - keep)));
+        backdateSamples(chunk, n, true);
+        size_t saved = saveDataOffline(chunk, n);
+        ring.pop(saved);
+        metricCount(COUNT_SD_FALLBACK, saved);
+        if (saved < n) break;
+    }
+}
+
+// Only once the ring is past its high-water mark, so short outages
+// never touch the card
+void spillRingToSD() {
+    spillToSD(sampleRing, sampleRing.capacity() * SAMPLE_RING_HIGH_WATER_PCT / 100);
+}
+
+// Before an OTA restart or rollback: readings in RAM would not survive
+// it. With a card they go to SD; without one the restart waits up to
+// OTA_RESTART_WAIT for the uplink to send them.
+bool readyForRestart(unsigned long since) {
+    spillToSD(alarmRing, 0);
+    spillToSD(sampleRing, 0);
+    bool empty = sampleRing.size() == 0 && alarmRing.size() == 0;
+    return empty || millis() - since > OTA_RESTART_WAIT;
+}
+
+// Core 0: drains the sample ring to the server in batches, spills to
+// SD past the high-water mark, and works off the SD backlog whenever
+// the ring is empty.
+void uplinkTask(void* param) {
+    Sample* batch = uplinkBatch;
+    Transport* transport = &httpTransport;
+    unsigned long restartSince = 0;   // OTA restart pending since
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(UPLINK_IDLE_MS));
+
+        if (sleepRequested) {
+            transport->stop();
+            uplinkParked = true;
+            vTaskSuspend(nullptr);
+        }
+
+        if (transportConfigChanged) {
+            transportConfigChanged = false;
+            applyTransportConfig();
+            Transport* next = UPLINK_TRANSPORT == TRANSPORT_MQTT ? (Transport*)&mqttTransport
+                                                                 : (Transport*)&httpTransport;
+            if (next != transport) {
+                transport->stop();
+                transport = next;
+                LOG_I("UPLINK", "Transport %s", transport->name());
             }
-            if (doc.containsKey("int")) {
-                int interval = doc["int"].as<int>();
-                if (validateInterval(interval)) {
-                    UPDATE_INTERVAL = interval;
-                    changed = true;
-                } else {
-                    safeNotify("Error: Invalid interval (1-86400)");
-                }
+        }
+
+        bool linkUp = WiFi.status() == WL_CONNECTED &&
+                      (long)(millis() - uplinkRetryAt) >= 0;
+
+        if (selfTest.storagePending) selfTestStorage();
+
+        // OTA download in place of uploads, one range per pass. The
+        // sampler carries on; the card takes the overflow.
+        if (otaUpdate.active()) {
+            if (linkUp && !otaUpdate.service(uplink)) {
+                uplinkRetryAt = millis() + UPLINK_RETRY_INTERVAL;
             }
-            if (doc.containsKey("mode")) {
-                int mode = doc["mode"].as<int>();
-                if (mode == 0 || mode == 1) {
-                    UPDATE_MODE = mode;
-                    changed = true;
-                }
+            serviceSD();
+            spillRingToSD();
+            transport->service();
+            if (otaUpdate.active() && (long)(millis() - uplinkRetryAt) >= 0) {
+                xTaskNotifyGive(xTaskGetCurrentTaskHandle());
             }
-            if (doc.containsKey("sp1")) {
-                float sp1 = doc["sp1"].as<float>();
-                if (validateSetpoint(sp1)) {
-                    setPoint1 = sp1;
-                    changed = true;
-                    writeModbusRegister(SET_POINT_1, uint16_t(sp1));
-                } else {
-                    safeNotify("Error: Invalid setpoint 1");
-                }
+            continue;
+        }
+
+        // New firmware written, or the trial of this one has run out
+        bool expired = otaUpdate.trialExpired(uptimeSeconds());
+        if (otaUpdate.ready() || expired) {
+            if (restartSince == 0) {
+                restartSince = millis() | 1;
+                if (expired) LOG_E("OTA", "No upload in %lus on the new firmware", (unsigned long)OTA_HEALTH_TIMEOUT_S);
             }
-            if (doc.containsKey("sp2")) {
-                float sp2 = doc["sp2"].as<float>();
-                if (validateSetpoint(sp2)) {
-                    setPoint2 = sp2;
-                    changed = true;
-                    writeModbusRegister(SET_POINT_2, uint16_t(sp2));
+            if (readyForRestart(restartSince)) {
+                transport->stop();
+                if (expired) {
+                    otaUpdate.rollback();   // Only returns if there is nothing to go back to
+                    restartSince = 0;
                 } else {
-                    safeNotify("Error: Invalid setpoint 2");
+                    LOG_I("OTA", "Restarting into the new firmware");
+                    loggerFlush(LOG_FLUSH_TIMEOUT);
+                    ESP.restart();
                 }
             }
+        }
 
-            if (changed) {
-                saveConfig();
-                forceHttpNow = true;
-                safeNotify("Settings Saved.");
+        // 0. Alarm events, ahead of everything and without waiting for
+        //    NTP (an uptime stamp is still back-dated when it can be)
+        if (linkUp && alarmRing.size() > 0) {
+            size_t n = alarmRing.peek(batch, transport->batchLimit());
+            backdateSamples(batch, n, false);
+            size_t acked = transport->upload(batch, n);
+            alarmRing.pop(acked);
+            if (acked > 0) otaUpdate.confirm();
+            if (acked < n) {
+                LOG_W("UPLINK", "%lu alarm events held, retry in %lus",
+                      (unsigned long)alarmRing.size(), UPLINK_RETRY_INTERVAL / 1000);
+                uplinkRetryAt = millis() + UPLINK_RETRY_INTERVAL;
+                linkUp = false;
             }
         }
-        // Handle WiFi credentials
-        else if (doc.containsKey("ssid")) {
-            targetSSID = String((const char*)doc["ssid"]);
-            targetPass = doc.containsKey("pass") ? String((const char*)doc["pass"]) : "";
-            targetSSID.trim();
-            targetPass.trim();
 
-            if (targetSSID.length() > 0) {
-                wifiConfigReceived = true;
+        // 1. Fresh readings. Ones still on the uptime clock wait up to
+        //    TIME_SYNC_WAIT after the link came up for NTP to date them.
+        if (linkUp && sampleRing.size() > 0) {
+            size_t n = sampleRing.peek(batch, transport->batchLimit());
+            backdateSamples(batch, n, false);
+            bool waitForClock = (batch[0].flags & SAMPLE_TIME_UPTIME) &&
+                                millis() - linkUpTime < TIME_SYNC_WAIT;
+            size_t acked = waitForClock ? 0 : transport->upload(batch, n);
+            sampleRing.pop(acked);
+            if (acked > 0) otaUpdate.confirm();
+
+            if (waitForClock) {
+                linkUp = false;   // Check again next tick, backlog stays put
+            } else if (acked < n) {
+                LOG_W("UPLINK", "%lu readings held in RAM, retry in %lus",
+                      (unsigned long)sampleRing.size(), UPLINK_RETRY_INTERVAL / 1000);
+                uplinkRetryAt = millis() + UPLINK_RETRY_INTERVAL;
+                linkUp = false;
+            } else if (sdReady && sdLog.pending() > 0) {
+                // Link is healthy again: start draining any backlog right away
+                backlogPending = true;
             }
         }
+
+        // 2. Card health / mount, then spill to SD past the high-water mark
+        serviceSD();
+        spillRingToSD();
+
+        // 3. Process offline files (ONLY if connected and caught up).
+        //    While batches keep succeeding the drain runs back to back.
+        if (linkUp && sampleRing.size() == 0 &&
+            (backlogPending || millis() - lastFileCheckTime > FILE_CHECK_INTERVAL)) {
+            lastFileCheckTime = millis();
+            backlogPending = processOfflineFiles();
+        }
+
+        transport->service();
+
+        if ((sampleRing.size() > 0 || alarmRing.size() > 0) && linkUp) {
+            xTaskNotifyGive(xTaskGetCurrentTaskHandle());
+        }
     }
-};
+}
 
 // ================================================================
-// SETUP
+// LOW POWER
 // ================================================================
-void setup() {
-    Serial.begin(115200);
-    Serial.setTimeout(50);
+#if LOW_POWER
+static Sample lowPowerChunk[SAMPLE_SPILL_CHUNK];   // Too big for the setup/config stacks
+
+// System time (us) of the reading after the one due at `dueUs`, on
+// the same grid as SampleSchedule. UPDATE_MODE 0 stays on the
+// UPDATE_INTERVAL grid and skips slots that were missed; mode 1 is
+// aligned to local midnight once the clock is set.
+int64_t nextSampleDue(int64_t dueUs, int64_t nowUs) {
+    int64_t step = (int64_t)UPDATE_INTERVAL * 1000000;
+    if (UPDATE_MODE == 1 && SampleSchedule::wallNowUs() != 0) {
+        // From half a step on, so an early timer wake keeps its slot
+        return SampleSchedule::alignedAfter(max(dueUs + step / 2, nowUs), step, GMT_OFFSET_SEC);
+    }
 
-    setupSD();
+    int64_t next = dueUs + step;
+    if (next <= nowUs) next += ((nowUs - next) / step + 1) * step;
+    return next;
+}
 
-    if (sdReady) {
-        Serial.println("Card type: " + String(SD.cardType()));
-        Serial.println("Card size: " + String(SD.cardSize() / (1024 * 1024)) + " MB");
+// Runs in setup() before any task starts. Takes the reading that is
+// due, then either sleeps again or returns to start a session: Wi-Fi
+// every LOW_POWER_UPLINK_EVERY readings or when an alarm field
+// changes, BLE and Wi-Fi at power-on and on a button wake.
+void lowPowerWake() {
+    WakeReason reason = lowPower.begin(WAKE_BUTTON_PIN);
+    bootEpoch = lowPower.bootEpoch();
+
+    bool alarm = false;
+    if (reason != WAKE_BUTTON) {
+        int64_t now = LowPower::wallUs();
+        int64_t due = lowPower.nextSampleUs();
+        // The RTC timer runs a few percent off: sleep off an early wake
+        if (reason == WAKE_TIMER && now < due - 1000000) lowPower.sleep();
+
+        applySlaveTimeouts(pollTable);
+        Sample sample = {};
+        uint32_t slotTime = SampleSchedule::wallNowUs() != 0 ? (uint32_t)((due + 500000) / 1000000) : 0;
+        if (readSensor(pollTable, sample, slotTime)) {
+            alarm = lowPower.alarmChanged(sample, aggSettings.alarmMask);
+            if (!lowPower.push(sample)) {
+                metricCount(COUNT_RING_DROP);
+                LOG_W("POWER", "RTC ring full, oldest reading dropped");
+            }
+        }
+        lowPower.setNextSample(nextSampleDue(due, now));
     }
 
-    delay(500);
+    if (reason == WAKE_TIMER && !alarm && lowPower.sinceUplink() < LOW_POWER_UPLINK_EVERY) {
+        LOG_D("POWER", "%u readings in RTC memory", (unsigned)lowPower.size());
+        loggerFlush(LOG_FLUSH_TIMEOUT);
+        lowPower.sleep();
+    }
 
-    Serial.println("\n--- FIRMWARE STARTED (v1.1) ---");
+    powerSession = reason == WAKE_TIMER ? SESSION_UPLINK : SESSION_AWAKE;
+    LOG_I("POWER", "%s wake, %u readings to send",
+          reason == WAKE_BUTTON ? "Button" : reason == WAKE_COLD ? "Power-on" : alarm ? "Alarm" : "Upload",
+          (unsigned)lowPower.size());
+
+    // The uplink task sends them from the sample ring; lowPowerSleep()
+    // puts back what it could not
+    while (lowPower.size() > 0) {
+        size_t n = lowPower.peek(lowPowerChunk, SAMPLE_SPILL_CHUNK);
+        for (size_t i = 0; i < n; i++) sampleRing.push(lowPowerChunk[i]);
+        lowPower.pop(n);
+    }
+}
 
-    // Initialize preferences
-    preferences.begin("wifi_db", false);
-    if (!preferences.isKey("nets")) {
-        preferences.putString("nets", "[]");
+// Config task. An upload session is over once the readings and the SD
+// backlog are sent, or after LOW_POWER_UPLINK_WINDOW; a BLE session
+// once the app has been gone for LOW_POWER_AWAKE_WINDOW.
+bool lowPowerSessionOver() {
+    if (otaUpdate.active() || otaUpdate.ready()) return false;
+    if (powerSession == SESSION_AWAKE) {
+        return !deviceConnected && millis() - lastBleActivity > LOW_POWER_AWAKE_WINDOW;
     }
-    preferences.end();
 
-    loadConfig();
-    setupModbus();
+    bool sent = WiFi.status() == WL_CONNECTED && sampleRing.size() == 0 &&
+                alarmRing.size() == 0 && !backlogPending &&
+                !sdCheckNow && (!sdReady || sdLog.pending() == 0);
+    return sent || millis() > LOW_POWER_UPLINK_WINDOW;
+}
+
+// Config task. Parks the sampler and uplink, saves pending settings,
+// puts unsent readings back in RTC memory (the oldest go to SD if they
+// do not fit) and sleeps until the next reading.
+void lowPowerSleep() {
+    LOG_I("POWER", "Session over after %lus, %lu readings unsent",
+          millis() / 1000, (unsigned long)sampleRing.size());
+
+    sleepRequested = true;
+    xTaskNotifyGive(uplinkTaskHandle);
+    unsigned long start = millis();
+    while (!(samplerParked && uplinkParked) && millis() - start < LOW_POWER_PARK_TIMEOUT) {
+        delay(10);
+    }
+
+    commitConfig(true);
+
+    // With the uplink task parked the ring and the card are ours
+    uint32_t room = RTC_RING_SLOTS - lowPower.size();
+    while (sdReady && sampleRing.size() > room) {
+        size_t n = sampleRing.peek(lowPowerChunk, min((size_t)SAMPLE_SPILL_CHUNK,
+                                                      (size_t)(sampleRing.size() - room)));
+        backdateSamples(lowPowerChunk, n, true);
+        size_t saved = saveDataOffline(lowPowerChunk, n);
+        sampleRing.pop(saved);
+        metricCount(COUNT_SD_FALLBACK, saved);
+        if (saved < n) break;
+    }
+    while (sampleRing.size() > 0) {
+        size_t n = sampleRing.peek(lowPowerChunk, SAMPLE_SPILL_CHUNK);
+        backdateSamples(lowPowerChunk, n, false);
+        for (size_t i = 0; i < n; i++) {
+            if (!lowPower.push(lowPowerChunk[i])) metricCount(COUNT_RING_DROP);
+        }
+        sampleRing.pop(n);
+    }
+    while (alarmRing.size() > 0) {
+        size_t n = alarmRing.peek(lowPowerChunk, SAMPLE_SPILL_CHUNK);
+        backdateSamples(lowPowerChunk, n, false);
+        for (size_t i = 0; i < n; i++) {
+            if (!lowPower.push(lowPowerChunk[i])) metricCount(COUNT_RING_DROP);
+        }
+        alarmRing.pop(n);
+    }
+    if (sdReady) unmountSD(false);
+
+    // Unsent readings wait for the next LOW_POWER_UPLINK_EVERY, not
+    // the next wake
+    lowPower.uplinkAttempted();
+    lowPower.setBootEpoch(bootEpoch);
+    loggerFlush(LOG_FLUSH_TIMEOUT);
+    lowPower.sleep();
+}
+#endif // LOW_POWER
+
+// Core 0, lowest priority: BLE commands, app watchdog, Wi-Fi scan
+// streaming and the Wi-Fi connection manager. Nothing here blocks.
+void configTask(void* param) {
+    // Wi-Fi comes up here, off the boot path
+    WiFi.mode(WIFI_STA);
+    WiFi.disconnect();
+    wifiManager.begin(onWifiConnected);
+
+    if (wifiManager.savedCount() == 0) {
+        LOG_I("BOOT", "No saved networks found");
+    }
+
+    for (;;) {
+        BleCommand cmd;
+        if (xQueueReceive(commandQueue, &cmd, pdMS_TO_TICKS(CONFIG_TICK_MS)) == pdTRUE) {
+            if (cmd.binary) {
+                handleBinaryCommand((const uint8_t*)cmd.data, cmd.len);
+            } else {
+                handleCommand(cmd.data, cmd.len);
+            }
+        }
+
+        // 1. Watchdog
+        if (deviceConnected && !watchdogPaused && 
+            (millis() - lastWatchdogTime > WATCHDOG_TIMEOUT)) {
+            LOG_W("WATCHDOG", "App timeout. Force disconnect.");
+            NimBLEDevice::getServer()->disconnect(0);
+        }
+
+        // 2. WiFi scan request: async and still associated, so the
+        //    uplink keeps going. Waits out a connect attempt in progress.
+        if (triggerWifiScan && !wifiScan.running() && !scanStreaming &&
+            !wifiManager.isConnecting()) {
+            triggerWifiScan = false;
+            watchdogPaused = true;
+            wifiScan.setLimit(MAX_SCAN_RESULTS);
+            if (wifiScan.start()) {
+                wifiManager.hold(true);
+                if (!scanBinary) safeNotify("Scanning...");
+            } else {
+                LOG_E("SCAN", "Could not start");
+                if (scanBinary) {
+                    uint8_t frame[BP_HEADER_LEN] = { BP_OP_SCAN | BP_RESPONSE, scanSeq, BP_STATUS_FAILED };
+                    binaryNotify(frame, sizeof(frame));
+                } else {
+                    safeNotify("Scan failed.");
+                }
+                finishScan();
+            }
+        }
+        if (wifiScan.poll()) {
+            wifiManager.hold(false);
+            for (uint8_t i = 0; i < wifiScan.count(); i++) {
+                wifiManager.noteRssi(wifiScan.record(i).ssid, wifiScan.record(i).rssi);
+            }
+            LOG_I("SCAN", "%u networks", wifiScan.count());
+            // A failed scan streams as an empty result
+            scanSent = 0;
+            scanStreaming = true;
+        }
+        // One notification per tick keeps the host's buffers free
+        if (scanStreaming && streamScanChunk()) {
+            finishScan();
+        }
+
+        // 3. WiFi connection request (result in onWifiRequestResult)
+        if (wifiConfigReceived) {
+            wifiConfigReceived = false;
+            watchdogPaused = true;
+            safeNotify("Connecting...");
+            wifiManager.connectTo(targetSSID, targetPass, onWifiRequestResult);
+        }
+
+        // 4. Connection manager: reconnects, backoff (never blocks)
+        wifiManager.loop();
+
+        // 5. Settings changes, debounced into NVS
+        commitConfig();
+
+        // 6. Self-test summary
+        if (selfTest.running) serviceSelfTest();
+
+        // 7. BLE sensor scan around the next sample slot
+        bleGateway.service(millis(), nextSlotMs, UPDATE_INTERVAL * 1000UL);
+
+#if LOW_POWER
+        // 8. Back to deep sleep once this wake's work is done
+        if (lowPowerSessionOver()) lowPowerSleep();
+#endif
+    }
+}
 
+// ================================================================
+// SETUP
+// ================================================================
+void setupBle() {
     // Generate unique device name
     uint64_t mac = ESP.getEfuseMac();
     uint32_t lowBytes = (uint32_t)mac;
     String devName = "ESP_Setup_" + String(lowBytes, HEX);
     devName.toUpperCase();
-    Serial.println(">> Device Name: " + devName);
+    LOG_I("BLE", "Device name: %s", devName.c_str());
 
     // Initialize BLE
     NimBLEDevice::init(devName.c_str());
@@ -710,6 +2812,18 @@ void setup() {
         NIMBLE_PROPERTY::READ | NIMBLE_PROPERTY::NOTIFY
     );
 
+    pBinaryCharacteristic = pService->createCharacteristic(
+        CHAR_UUID_BINARY,
+        NIMBLE_PROPERTY::WRITE | NIMBLE_PROPERTY::WRITE_NR | NIMBLE_PROPERTY::NOTIFY
+    );
+    pBinaryCharacteristic->setCallbacks(new BinaryCallbacks());
+
+    NimBLECharacteristic* pStreamCharacteristic = pService->createCharacteristic(
+        CHAR_UUID_STREAM,
+        NIMBLE_PROPERTY::NOTIFY
+    );
+    bleStreamer.begin(pStreamCharacteristic);
+
     pService->start();
 
     NimBLEAdvertising *pAdvertising = NimBLEDevice::getAdvertising();
@@ -720,137 +2834,89 @@ void setup() {
     pAdvertising->setScanResponseData(scanResp);
     pAdvertising->start();
 
-    lastWatchdogTime = millis();
-
-    // WiFi setup
-    WiFi.mode(WIFI_STA);
-    WiFi.disconnect();
-    delay(100);
-
-    if (tryAutoConnect()) {
-        Serial.println(">> BOOT: Connected to WiFi");
-        setupTime();
-    } else {
-        Serial.println(">> BOOT: No saved networks found");
-    }
+    // Sensor scanning would keep the radio up between low-power wakes
+    if (!LOW_POWER) bleGateway.begin();
 }
 
-// ================================================================
-// MAIN LOOP
-// ================================================================
-void loop() {
-    // 1. Watchdog
-    if (deviceConnected && !watchdogPaused && 
-        (millis() - lastWatchdogTime > WATCHDOG_TIMEOUT)) {
-        Serial.println(">> WATCHDOG: App timeout. Force disconnect.");
-        NimBLEDevice::getServer()->disconnect(0);
-    }
-
-    // 2. Process offline files (ONLY if connected)
-    if (WiFi.status() == WL_CONNECTED && 
-        (millis() - lastFileCheckTime > FILE_CHECK_INTERVAL)) {
-        lastFileCheckTime = millis();
-        watchdogPaused = true;
-        processOfflineFiles();
-        watchdogPaused = false;
-        lastWatchdogTime = millis();
-    }
-
-    // ============================================================
-    // 3. SENSOR DATA LOGIC (MOVED OUTSIDE WIFI CHECK)
-    // ============================================================
-    bool shouldTrigger = false;
-
-    // MODE 0: Interval (Timer)
-    if (UPDATE_MODE == 0) {
-        if (millis() - lastHttpTime > (UPDATE_INTERVAL * 1000UL)) {
-            shouldTrigger = true;
-            lastHttpTime = millis();
-        }
-    }
-    // MODE 1: Clock Aligned (Cron)
-    else if (UPDATE_MODE == 1) {
-        struct tm timeinfo;
-        if (getLocalTime(&timeinfo)) {
-            int minInterval = UPDATE_INTERVAL / 60;
-            if (minInterval < 1) minInterval = 1;
-
-            if (timeinfo.tm_min % minInterval == 0 && 
-                timeinfo.tm_min != lastClockMinute) {
-                shouldTrigger = true;
-                lastClockMinute = timeinfo.tm_min;
-            }
-        }
+void setup() {
+    Serial.begin(115200);
+    Serial.setTimeout(50);
+    loggerBegin();
+
+    LOG_I("BOOT", "Firmware started (v1.1)");
+    otaUpdate.bootCheck();   // May roll back to the previous firmware
+
+    // Staged boot: only what the sampler needs runs before it starts.
+    // The SD mount (uplink task) then runs alongside BLE init here and
+    // Wi-Fi / NTP (config task); readings taken before NTP syncs are
+    // back-dated.
+
+    // Short of internal RAM: halve the fallback down to SAMPLE_RING_MIN.
+    // Without a ring the sampler has nowhere to put readings, so a boot
+    // that cannot get one restarts rather than run without it.
+    bool ringOk = false;
+    for (uint32_t n = SAMPLE_RING_FALLBACK; !ringOk && n >= SAMPLE_RING_MIN; n /= 2) {
+        ringOk = sampleRing.begin(SAMPLE_RING_CAPACITY, n);
     }
-
-    if (forceHttpNow) {
-        shouldTrigger = true;
-        forceHttpNow = false;
+    ringOk = ringOk && alarmRing.begin(ALARM_RING_CAPACITY, ALARM_RING_CAPACITY);
+    if (!ringOk) {
+        LOG_E("RING", "Allocation failed, restarting");
+        delay(1000);
+        ESP.restart();
     }
-
-    if (shouldTrigger) {
-        // sendSensorData handles the "If No Wifi -> Save to SD" logic internally
-        sendSensorData();
+    LOG_I("RING", "%lu samples in %s", (unsigned long)sampleRing.capacity(),
+          sampleRing.inPsram() ? "PSRAM" : "internal RAM");
+    if (!jsonArena.begin(JSON_ARENA_SIZE, JSON_ARENA_FALLBACK)) {
+        LOG_E("JSON", "Arena allocation failed");
     }
-    // ============================================================
+    if (tlsUsePsram()) LOG_I("TLS", "mbedTLS buffers in PSRAM");
+    commandQueue = xQueueCreate(COMMAND_QUEUE_LEN, sizeof(BleCommand));
+    modbusWriteQueue = xQueueCreate(MODBUS_WRITE_QUEUE_LEN, sizeof(ModbusWrite));
+    pollTableQueue = xQueueCreate(1, sizeof(ModbusPollTable));
+    aggQueue = xQueueCreate(1, sizeof(AggregateSettings));
+    latestSampleQueue = xQueueCreate(1, sizeof(Sample));
+    configMutex = xSemaphoreCreateMutex();
 
-    // 4. WiFi scan request
-    if (triggerWifiScan) {
-        triggerWifiScan = false;
-        watchdogPaused = true;
-        safeNotify("Scanning...");
-        WiFi.disconnect();
-        // ... (Keep existing scan logic) ...
-        int n = WiFi.scanNetworks();
-        JsonDocument scanDoc;
-        JsonArray array = scanDoc.to<JsonArray>();
-        for (int i = 0; i < n && i < MAX_SCAN_RESULTS; ++i) {
-            if (WiFi.SSID(i).length() > 0) array.add(WiFi.SSID(i));
-        }
-        String output;
-        serializeJson(scanDoc, output);
-        safeNotify(output);
-        WiFi.scanDelete();
-        watchdogPaused = false;
-        lastWatchdogTime = millis();
-    }
+    loadConfig();
+    loadPollTable();
+    loadAggregation();
+    loadBleGateway();
+    setupModbus();
 
-    // 5. WiFi connection request
-    if (wifiConfigReceived) {
-        // ... (Keep existing connect logic) ...
-        wifiConfigReceived = false;
-        watchdogPaused = true;
-        safeNotify("Connecting...");
-        WiFi.disconnect();
-        WiFi.begin(targetSSID.c_str(), targetPass.c_str());
-        int attempts = 0;
-        while (WiFi.status() != WL_CONNECTED && attempts < WIFI_CONNECT_ATTEMPTS) {
-            delay(500); Serial.print("."); attempts++;
-        }
-        Serial.println();
-        if (WiFi.status() == WL_CONNECTED) {
-            String msg = "Connected! SSID: " + WiFi.SSID() + " | IP: " + WiFi.localIP().toString();
-            Serial.println(">> " + msg);
-            safeNotify(msg);
-            saveNetworkToMemory(targetSSID, targetPass);
-            setupTime();
-            forceHttpNow = true;
-        } else {
-            Serial.println(">> ERROR: WiFi connection failed");
-            safeNotify("Connection Failed.");
-        }
-        watchdogPaused = false;
-        lastWatchdogTime = millis();
-    }
+#if LOW_POWER
+    // Sleeps again unless this wake needs the tasks
+    lowPowerWake();
+#endif
+
+#if SD_USE_SDMMC
+    sdCard.useSdmmc(SD_USE_SDMMC == 4, SD_D1_PIN, SD_D2_PIN);
+#endif
+    sdCheckNow = true;   // Mounted by the uplink task, on core 0
+
+    // Uplink first: the sampler notifies it through uplinkTaskHandle
+    xTaskCreatePinnedToCore(uplinkTask, "uplink", UPLINK_STACK, nullptr,
+                            UPLINK_PRIORITY, &uplinkTaskHandle, UPLINK_CORE);
+    // First reading straight away rather than one interval after boot
+    // (a low-power wake has taken it already)
+    forceHttpNow = !LOW_POWER;
+    xTaskCreatePinnedToCore(samplerTask, "sampler", SAMPLER_STACK, nullptr,
+                            SAMPLER_PRIORITY, nullptr, SAMPLER_CORE);
+
+    if (powerSession != SESSION_UPLINK) setupBle();
+    lastWatchdogTime = millis();
 
-    // 6. Auto-reconnect (Background)
-    if (WiFi.status() != WL_CONNECTED && !deviceConnected && 
-        (millis() - lastWifiCheck > WIFI_RECONNECT_INTERVAL)) {
-        lastWifiCheck = millis();
-        tryAutoConnect();
-    }
+    // Wi-Fi starts on the config task, after the BLE controller is up
+    xTaskCreatePinnedToCore(configTask, "config", CONFIG_STACK, nullptr,
+                            CONFIG_PRIORITY, nullptr, CONFIG_CORE);
+    LOG_I("BOOT", "Up in %lums", millis());
+}
 
-    delay(10);
+// ================================================================
+// MAIN LOOP
+// ================================================================
+void loop() {
+    // All work happens on the tasks started in setup()
+    vTaskDelete(NULL);
 }
 
 // #include <Arduino.h>
@@ -0,0 +1,86 @@
+// ================================================================
+// METRICS
+// ================================================================
+
+#include "metrics.h"
+
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+static const uint32_t BUCKET_BOUND_US[METRIC_BUCKETS - 1] = {
+    100, 250, 500,
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000
+};
+
+static const char* const HISTOGRAM_NAMES[METRIC_HISTOGRAMS] = {
+    "mb", "tls", "http", "sdw", "sdo", "ble", "jit"
+};
+
+static const char* const COUNTER_NAMES[METRIC_COUNTERS] = {
+    "mb_to", "mb_crc", "mb_exc", "mb_rty", "mb_qf",
+    "http_err", "http_st", "sd_fb", "sd_err", "ring_drop", "skip",
+    "pin", "mqtt_drop"
+};
+
+static HistogramSnapshot histograms[METRIC_HISTOGRAMS];
+static uint32_t counters[METRIC_COUNTERS];
+static portMUX_TYPE metricsLock = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t metricBucketBound(uint8_t i) {
+    return i < METRIC_BUCKETS - 1 ? BUCKET_BOUND_US[i] : UINT32_MAX;
+}
+
+void metricRecord(MetricHistogram h, uint32_t us) {
+    // Short linear search: most samples land in the first few buckets
+    uint8_t b = 0;
+    while (b < METRIC_BUCKETS - 1 && us >= BUCKET_BOUND_US[b]) b++;
+
+    portENTER_CRITICAL(&metricsLock);
+    HistogramSnapshot& hist = histograms[h];
+    hist.count++;
+    hist.sumUs += us;
+    if (us > hist.maxUs) hist.maxUs = us;
+    hist.buckets[b]++;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+void metricSince(MetricHistogram h, int64_t startUs) {
+    int64_t elapsed = esp_timer_get_time() - startUs;
+    metricRecord(h, elapsed > (int64_t)UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed);
+}
+
+MetricTimer::MetricTimer(MetricHistogram h) : hist(h), start(esp_timer_get_time()) {}
+
+void metricCount(MetricCounter c, uint32_t n) {
+    portENTER_CRITICAL(&metricsLock);
+    counters[c] += n;
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+void metricSnapshot(MetricHistogram h, HistogramSnapshot& out) {
+    portENTER_CRITICAL(&metricsLock);
+    out = histograms[h];
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+uint32_t metricCounter(MetricCounter c) {
+    return counters[c];
+}
+
+void metricsReset() {
+    portENTER_CRITICAL(&metricsLock);
+    memset(histograms, 0, sizeof(histograms));
+    memset(counters, 0, sizeof(counters));
+    portEXIT_CRITICAL(&metricsLock);
+}
+
+const char* metricName(MetricHistogram h) {
+    return h < METRIC_HISTOGRAMS ? HISTOGRAM_NAMES[h] : "";
+}
+
+const char* metricName(MetricCounter c) {
+    return c < METRIC_COUNTERS ? COUNTER_NAMES[c] : "";
+}
@@ -0,0 +1,206 @@
+// ================================================================
+// MODBUS POLL TABLE
+// ================================================================
+
+#include "modbus_poll.h"
+
+#include <string.h>
+#include <algorithm>
+
+void ModbusPollTable::setDefault() {
+    PollEntry pv = { 1, 3, 0, 1, 0, 1, 0,      // PROCESS_VALUE, tenths
+                     MODBUS_DEFAULT_TIMEOUT_MS, MODBUS_DEFAULT_RETRIES };
+    entries[0] = pv;
+    nextDue[0] = 0;
+    count = 1;
+    latestMask = 0;
+}
+
+bool ModbusPollTable::setEntries(const PollEntry* list, uint8_t n) {
+    if (n == 0 || n > POLL_MAX_ENTRIES) return false;
+    memcpy(entries, list, sizeof(PollEntry) * n);
+    memset(nextDue, 0, sizeof(nextDue));
+    count = n;
+    latestMask = 0;
+    return true;
+}
+
+#ifdef ARDUINO
+bool ModbusPollTable::fromJson(JsonArrayConst arr, String& error) {
+    PollEntry parsed[POLL_MAX_ENTRIES];
+    uint8_t n = 0;
+
+    for (JsonObjectConst obj : arr) {
+        if (n >= POLL_MAX_ENTRIES) {
+            error = "too many entries (max " + String(POLL_MAX_ENTRIES) + ")";
+            return false;
+        }
+
+        int slave = obj["s"] | 1;
+        int fc = obj["fc"] | 3;
+        long start = obj["r"] | -1;
+        int regs = obj["n"] | 1;
+        long period = obj["p"] | 0;
+        int field = obj["f"] | 1;
+        int dp = obj["dp"] | 0;
+        int timeoutMs = obj["to"] | (int)MODBUS_DEFAULT_TIMEOUT_MS;
+        int retries = obj["rt"] | (int)MODBUS_DEFAULT_RETRIES;
+
+        if (slave < 1 || slave > 247) { error = "bad slave"; return false; }
+        if (fc != 3 && fc != 4) { error = "fc must be 3 or 4"; return false; }
+        if (start < 0 || start > 0xFFFF) { error = "bad register"; return false; }
+        if (regs < 1 || field < 1 || field + regs - 1 > SAMPLE_MAX_FIELDS) {
+            error = "fields must be within 1-" + String(SAMPLE_MAX_FIELDS);
+            return false;
+        }
+        if (start + regs - 1 > 0xFFFF) { error = "bad register"; return false; }
+        if (period < 0 || period > 86400) { error = "bad period"; return false; }
+        if (dp < 0 || dp > 3) { error = "dp must be 0-3"; return false; }
+        if (timeoutMs < 20 || timeoutMs > 2000) { error = "to must be 20-2000"; return false; }
+        if (retries < 0 || retries > 5) { error = "rt must be 0-5"; return false; }
+
+        for (uint8_t i = 0; i < n; i++) {
+            int a = parsed[i].field, b = a + parsed[i].count;
+            if (field - 1 < b && field - 1 + regs > a) { error = "fields overlap"; return false; }
+        }
+
+        parsed[n].slave = slave;
+        parsed[n].fc = fc;
+        parsed[n].start = start;
+        parsed[n].count = regs;
+        parsed[n].field = field - 1;
+        parsed[n].decimals = dp;
+        parsed[n].periodMs = period * 1000UL;
+        parsed[n].timeoutMs = timeoutMs;
+        parsed[n].retries = retries;
+        n++;
+    }
+
+    if (n == 0) {
+        error = "empty table";
+        return false;
+    }
+    return setEntries(parsed, n);
+}
+
+void ModbusPollTable::toJson(JsonArray arr) const {
+    for (uint8_t i = 0; i < count; i++) {
+        const PollEntry& e = entries[i];
+        JsonObject obj = arr.add<JsonObject>();
+        obj["s"] = e.slave;
+        obj["fc"] = e.fc;
+        obj["r"] = e.start;
+        obj["n"] = e.count;
+        obj["p"] = e.periodMs / 1000;
+        obj["f"] = e.field + 1;
+        obj["dp"] = e.decimals;
+        obj["to"] = e.timeoutMs;
+        obj["rt"] = e.retries;
+    }
+}
+#endif
+
+// Keeps `order` sorted by (slave, fc, start) so neighbours merge
+void ModbusPollTable::insertOrdered(uint8_t* order, uint8_t& n, uint8_t entry) const {
+    const PollEntry& e = entries[entry];
+    uint8_t pos = n++;
+    while (pos > 0) {
+        const PollEntry& p = entries[order[pos - 1]];
+        bool before = e.slave < p.slave ||
+                      (e.slave == p.slave && (e.fc < p.fc ||
+                      (e.fc == p.fc && e.start < p.start)));
+        if (!before) break;
+        order[pos] = order[pos - 1];
+        pos--;
+    }
+    order[pos] = entry;
+}
+
+size_t ModbusPollTable::coalesce(const uint8_t* order, uint8_t nOrder,
+                                 PollRead* out, size_t maxReads) const {
+    size_t n = 0;
+    for (uint8_t k = 0; k < nOrder; k++) {
+        const PollEntry& e = entries[order[k]];
+        uint32_t end = (uint32_t)e.start + e.count;
+
+        if (n > 0) {
+            PollRead& cur = out[n - 1];
+            uint32_t curEnd = (uint32_t)cur.start + cur.count;
+            uint32_t merged = std::max(curEnd, end) - cur.start;
+            if (cur.slave == e.slave && cur.fc == e.fc &&
+                e.start <= curEnd && merged <= POLL_MAX_READ) {
+                cur.count = merged;
+                continue;
+            }
+        }
+
+        if (n >= maxReads) break;
+        out[n].slave = e.slave;
+        out[n].fc = e.fc;
+        out[n].start = e.start;
+        out[n].count = e.count;
+        n++;
+    }
+    return n;
+}
+
+size_t ModbusPollTable::plan(uint32_t nowMs, bool sampleTick, PollRead* out, size_t maxReads) {
+    uint8_t due[POLL_MAX_ENTRIES];
+    uint8_t nDue = 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+        const PollEntry& e = entries[i];
+        bool isDue = e.periodMs == 0 ? sampleTick
+                                     : (int32_t)(nowMs - nextDue[i]) >= 0;
+        if (!isDue) continue;
+        if (e.periodMs > 0) nextDue[i] = nowMs + e.periodMs;
+        insertOrdered(due, nDue, i);
+    }
+    return coalesce(due, nDue, out, maxReads);
+}
+
+size_t ModbusPollTable::planFields(uint8_t fieldMask, PollRead* out, size_t maxReads) const {
+    uint8_t hit[POLL_MAX_ENTRIES];
+    uint8_t nHit = 0;
+
+    for (uint8_t i = 0; i < count; i++) {
+        const PollEntry& e = entries[i];
+        uint8_t covers = (uint8_t)(((1u << e.count) - 1) << e.field);
+        if (covers & fieldMask) insertOrdered(hit, nHit, i);
+    }
+    return coalesce(hit, nHit, out, maxReads);
+}
+
+void ModbusPollTable::complete(const PollRead& read, const uint16_t* regs, bool ok) {
+    uint32_t readEnd = (uint32_t)read.start + read.count;
+
+    for (uint8_t i = 0; i < count; i++) {
+        const PollEntry& e = entries[i];
+        if (e.slave != read.slave || e.fc != read.fc) continue;
+        if (e.start < read.start || (uint32_t)e.start + e.count > readEnd) continue;
+
+        for (uint8_t j = 0; j < e.count; j++) {
+            uint8_t f = e.field + j;
+            if (ok) {
+                latest[f] = regs[e.start - read.start + j];
+                latestDecimals[f] = e.decimals;
+                latestMask |= 1 << f;
+            } else {
+                latestMask &= ~(1 << f);
+            }
+        }
+    }
+}
+
+bool ModbusPollTable::snapshot(Sample& sample) const {
+    sample.fieldMask = 0;
+    sample.decimals = 0;
+    for (uint8_t f = 0; f < SAMPLE_MAX_FIELDS; f++) {
+        if ((latestMask >> f) & 1) {
+            sampleSetField(sample, f, latest[f], latestDecimals[f]);
+        } else {
+            sample.regs[f] = 0;
+        }
+    }
+    return sample.fieldMask != 0;
+}
@@ -0,0 +1,218 @@
+// ================================================================
+// MODBUS RTU MASTER
+// ================================================================
+
+#include "modbus_rtu.h"
+
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+
+#include "metrics.h"
+
+const int MODBUS_JOB_QUEUE_LEN = 8;
+const uint32_t MODBUS_TASK_STACK = 3072;
+const UBaseType_t MODBUS_TASK_PRIORITY = 4;   // Above the sampler
+const BaseType_t MODBUS_TASK_CORE = 1;
+const size_t MODBUS_FRAME_MAX = 5 + 2 * MODBUS_MAX_REGS;
+
+static uint16_t crc16(const uint8_t* data, size_t len) {
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+bool ModbusRtu::begin(HardwareSerial& serial, uint32_t baud, int rxPin, int txPin) {
+    for (int i = 0; i < 248; i++) {
+        slaveTimeoutMs[i] = MODBUS_DEFAULT_TIMEOUT_MS;
+        slaveRetries[i] = MODBUS_DEFAULT_RETRIES;
+    }
+
+    port = &serial;
+    port->setRxBufferSize(MODBUS_FRAME_MAX + 16);
+    port->begin(baud, SERIAL_8N1, rxPin, txPin);
+
+    // 11 bits per character (start + 8 data + parity/stop + stop).
+    // Frames are separated by at least 3.5 characters of silence; the
+    // spec fixes it at 1750 us above 19200 baud.
+    gapUs = baud > 19200 ? 1750 : (uint32_t)(3.5 * 11 * 1000000UL / baud);
+    port->setRxTimeout(4);  // In character times: rounds t3.5 up
+
+    jobs = xQueueCreate(MODBUS_JOB_QUEUE_LEN, sizeof(Job));
+    if (jobs == nullptr) return false;
+
+    if (xTaskCreatePinnedToCore(engineTask, "modbus", MODBUS_TASK_STACK, this,
+                                MODBUS_TASK_PRIORITY, &task, MODBUS_TASK_CORE) != pdPASS) {
+        return false;
+    }
+
+    // Only the RX timeout (frame gap) wakes the engine, not every byte
+    port->onReceive([this]() { xTaskNotifyGive(task); }, true);
+    return true;
+}
+
+void ModbusRtu::setSlaveTimeout(uint8_t slave, uint16_t timeoutMs, uint8_t retries) {
+    if (slave == 0 || slave > 247) return;
+    slaveTimeoutMs[slave] = timeoutMs;
+    slaveRetries[slave] = retries;
+}
+
+bool ModbusRtu::submit(const ModbusRequest& req, ModbusCallback cb, void* ctx) {
+    Job job = { req, cb, ctx, esp_timer_get_time() };
+    if (xQueueSend(jobs, &job, 0) == pdTRUE) return true;
+    metricCount(COUNT_MODBUS_QUEUE_FULL);
+    return false;
+}
+
+// The caller's task notification is not used: the sampler is also
+// woken by its slot timer and the alarm GPIO, and one of those would
+// end the wait while the job is still queued
+struct SyncWait {
+    StaticSemaphore_t doneBuf;
+    SemaphoreHandle_t done;
+    uint16_t* out;
+    uint16_t maxRegs;
+    uint8_t status;
+};
+
+static void syncDone(const ModbusResult& result, void* ctx) {
+    SyncWait* wait = (SyncWait*)ctx;
+    if (wait->out != nullptr) {
+        memcpy(wait->out, result.regs, min(result.count, wait->maxRegs) * sizeof(uint16_t));
+    }
+    wait->status = result.status;
+    xSemaphoreGive(wait->done);
+}
+
+uint8_t ModbusRtu::transact(const ModbusRequest& req, uint16_t* out, uint16_t maxRegs) {
+    SyncWait wait;
+    wait.done = xSemaphoreCreateBinaryStatic(&wait.doneBuf);
+    wait.out = out;
+    wait.maxRegs = maxRegs;
+    wait.status = MODBUS_TIMEOUT;
+    if (!submit(req, syncDone, &wait)) return MODBUS_QUEUE_FULL;
+
+    // Only syncDone() gives the semaphore, and the engine always
+    // completes a job, so `wait` outlives the callback
+    while (xSemaphoreTake(wait.done, portMAX_DELAY) != pdTRUE) {}
+    return wait.status;
+}
+
+void ModbusRtu::engineTask(void* param) {
+    ModbusRtu* self = (ModbusRtu*)param;
+    static ModbusResult result;
+    Job job;
+
+    for (;;) {
+        if (xQueueReceive(self->jobs, &job, portMAX_DELAY) != pdTRUE) continue;
+        self->run(job, result);
+        result.latencyUs = esp_timer_get_time() - job.submittedUs;
+        self->record(result);
+        if (job.cb != nullptr) job.cb(result, job.ctx);
+    }
+}
+
+void ModbusRtu::record(const ModbusResult& result) {
+    metricRecord(METRIC_MODBUS, result.latencyUs);
+    if (result.attempts > 1) metricCount(COUNT_MODBUS_RETRY);
+    switch (result.status) {
+        case MODBUS_OK:      break;
+        case MODBUS_TIMEOUT: metricCount(COUNT_MODBUS_TIMEOUT); break;
+        case MODBUS_BAD_CRC: metricCount(COUNT_MODBUS_BAD_CRC); break;
+        default:
+            if (result.status < MODBUS_BAD_SLAVE) metricCount(COUNT_MODBUS_EXCEPTION);
+    }
+}
+
+void ModbusRtu::run(const Job& job, ModbusResult& result) {
+    const ModbusRequest& req = job.req;
+    result.req = req;
+    result.count = 0;
+
+    uint8_t slave = req.slave <= 247 ? req.slave : 0;
+    uint16_t timeoutMs = slaveTimeoutMs[slave];
+    uint8_t retries = slaveRetries[slave];
+
+    for (result.attempts = 1; ; result.attempts++) {
+        result.status = attempt(req, timeoutMs, result);
+        // Exceptions are real answers; only transport errors are retried
+        bool transportError = result.status >= MODBUS_BAD_SLAVE;
+        if (!transportError || result.attempts > retries) break;
+    }
+}
+
+size_t ModbusRtu::expectedLength(const uint8_t* frame, size_t len, uint8_t fc) {
+    if (len < 3) return 0;
+    if (frame[1] & 0x80) return 5;            // slave, fc|0x80, code, crc
+    if (fc == 3 || fc == 4) return 5 + frame[2];
+    return 8;                                 // FC6 echoes the request
+}
+
+uint8_t ModbusRtu::attempt(const ModbusRequest& req, uint16_t timeoutMs, ModbusResult& result) {
+    uint8_t frame[MODBUS_FRAME_MAX];
+
+    // Request: slave, fc, addr, count/value, crc (lo first)
+    uint8_t tx[8] = {
+        req.slave, req.fc,
+        (uint8_t)(req.addr >> 8), (uint8_t)req.addr,
+        (uint8_t)(req.value >> 8), (uint8_t)req.value
+    };
+    uint16_t crc = crc16(tx, 6);
+    tx[6] = crc & 0xFF;
+    tx[7] = crc >> 8;
+
+    // Respect the inter-frame gap since the bus last went quiet
+    int64_t quietUs = esp_timer_get_time() - lastActivityUs;
+    if (quietUs < gapUs) delayMicroseconds(gapUs - quietUs);
+
+    while (port->available()) port->read();
+    ulTaskNotifyTake(pdTRUE, 0);
+
+    port->write(tx, sizeof(tx));
+    port->flush();  // Waits for the TX FIFO to drain
+    lastActivityUs = esp_timer_get_time();
+
+    size_t len = 0;
+    TickType_t start = xTaskGetTickCount();
+    TickType_t limit = pdMS_TO_TICKS(timeoutMs);
+
+    while (true) {
+        TickType_t elapsed = xTaskGetTickCount() - start;
+        if (elapsed >= limit) {
+            lastActivityUs = esp_timer_get_time();
+            return len > 0 ? MODBUS_BAD_CRC : MODBUS_TIMEOUT;
+        }
+
+        // Sleep until the UART reports a t3.5 gap after received data
+        ulTaskNotifyTake(pdTRUE, limit - elapsed);
+
+        while (port->available() && len < sizeof(frame)) {
+            frame[len++] = port->read();
+        }
+        lastActivityUs = esp_timer_get_time();
+
+        size_t want = expectedLength(frame, len, req.fc);
+        if (want == 0 || len < want) continue;   // Partial frame: keep waiting
+
+        if (crc16(frame, want - 2) != (uint16_t)(frame[want - 2] | (frame[want - 1] << 8))) {
+            return MODBUS_BAD_CRC;
+        }
+        if (frame[0] != req.slave) return MODBUS_BAD_SLAVE;
+        if ((frame[1] & 0x7F) != req.fc) return MODBUS_BAD_FUNCTION;
+        if (frame[1] & 0x80) return frame[2];
+
+        if (req.fc == 3 || req.fc == 4) {
+            // A short (or long) reply would leave registers unset
+            if (req.value > MODBUS_MAX_REGS || frame[2] != 2 * req.value) return MODBUS_BAD_LENGTH;
+            result.count = req.value;
+            for (uint16_t i = 0; i < result.count; i++) {
+                result.regs[i] = (frame[3 + 2 * i] << 8) | frame[4 + 2 * i];
+            }
+        }
+        return MODBUS_OK;
+    }
+}
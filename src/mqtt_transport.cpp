@@ -0,0 +1,316 @@
+// ================================================================
+// MQTT TRANSPORT
+// ================================================================
+
+#include "mqtt_transport.h"
+
+#include <esp_timer.h>
+
+#include "aggregator.h"
+#include "logger.h"
+#include "metrics.h"
+#include "payload_builder.h"
+
+// Control packet types (high nibble of the fixed header)
+const uint8_t MQTT_CONNECT    = 0x10;
+const uint8_t MQTT_CONNACK    = 0x20;
+const uint8_t MQTT_PUBLISH    = 0x30;
+const uint8_t MQTT_PUBACK     = 0x40;
+const uint8_t MQTT_PINGREQ    = 0xC0;
+const uint8_t MQTT_PINGRESP   = 0xD0;
+const uint8_t MQTT_DISCONNECT = 0xE0;
+
+const uint8_t MQTT_QOS1 = 0x02;
+
+static size_t putLength(uint8_t* out, size_t len) {
+    size_t n = 0;
+    do {
+        uint8_t b = len % 128;
+        len /= 128;
+        out[n++] = len > 0 ? b | 0x80 : b;
+    } while (len > 0 && n < 4);
+    return n;
+}
+
+static size_t putString(uint8_t* out, const char* s) {
+    size_t len = strlen(s);
+    out[0] = len >> 8;
+    out[1] = len & 0xFF;
+    memcpy(out + 2, s, len);
+    return len + 2;
+}
+
+MqttTransport::MqttTransport(unsigned long timeoutMs) : timeout(timeoutMs) {}
+
+void MqttTransport::configure(const MqttSettings& settings) {
+    if (memcmp(&settings, &cfg, sizeof(cfg)) == 0) return;
+    stop();
+    cfg = settings;
+    snprintf(topic, sizeof(topic), "%s/%s", cfg.topic, cfg.clientId);
+    if (strlen(topic) > MQTT_TOPIC_MAX) {
+        LOG_E("MQTT", "Topic %s too long (max %u)", topic, (unsigned)MQTT_TOPIC_MAX);
+        topic[0] = '\0';
+    }
+}
+
+bool MqttTransport::isConnected() {
+    return client != nullptr && client->connected();
+}
+
+void MqttTransport::stop() {
+    if (client != nullptr) {
+        if (client->connected()) {
+            uint8_t disconnect[2] = { MQTT_DISCONNECT, 0 };
+            client->write(disconnect, sizeof(disconnect));
+        }
+        client->stop();
+    }
+    client = nullptr;
+    pingSentAt = 0;
+}
+
+uint16_t MqttTransport::nextPacketId() {
+    if (++packetId == 0) packetId = 1;
+    return packetId;
+}
+
+bool MqttTransport::writePacket(const uint8_t* data, size_t len) {
+    if (client->write(data, len) != len) {
+        stop();
+        return false;
+    }
+    lastTx = millis();
+    return true;
+}
+
+int MqttTransport::readByte(unsigned long deadline) {
+    while (!client->available()) {
+        if (!client->connected()) return -1;
+        if ((long)(millis() - deadline) >= 0) return -1;
+        delay(1);
+    }
+    return client->read();
+}
+
+// Reads one control packet. Returns its first header byte (or -1),
+// with up to `cap` bytes of the variable part in `buf`.
+int MqttTransport::readPacket(uint8_t* buf, size_t cap, size_t& len, unsigned long deadline) {
+    int header = readByte(deadline);
+    if (header < 0) return -1;
+
+    size_t remaining = 0;
+    for (int shift = 0; shift < 28; shift += 7) {
+        int b = readByte(deadline);
+        if (b < 0) return -1;
+        remaining |= (size_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) break;
+    }
+
+    len = 0;
+    while (remaining-- > 0) {
+        int b = readByte(deadline);
+        if (b < 0) return -1;
+        if (len < cap) buf[len++] = b;
+    }
+    return header;
+}
+
+bool MqttTransport::ensureConnected() {
+    if (isConnected()) return true;
+    stop();
+
+    if (WiFi.status() != WL_CONNECTED || cfg.url[0] == '\0') return false;
+
+    bool secure;
+    const char* hostStart;
+    uint16_t port;
+    if (strncasecmp(cfg.url, "mqtts://", 8) == 0) {
+        secure = true;
+        port = 8883;
+        hostStart = cfg.url + 8;
+    } else if (strncasecmp(cfg.url, "mqtt://", 7) == 0) {
+        secure = false;
+        port = 1883;
+        hostStart = cfg.url + 7;
+    } else {
+        LOG_E("MQTT", "Bad broker URL");
+        return false;
+    }
+
+    char host[64];
+    size_t hostLen = strcspn(hostStart, ":/");
+    if (hostLen == 0 || hostLen >= sizeof(host)) return false;
+    memcpy(host, hostStart, hostLen);
+    host[hostLen] = '\0';
+    if (hostStart[hostLen] == ':') port = atoi(hostStart + hostLen + 1);
+
+    if (secure) {
+        secureClient.setInsecure();
+        secureClient.setHandshakeTimeout(timeout / 1000);
+        client = &secureClient;
+    } else {
+        client = &plainClient;
+    }
+
+    int64_t start = esp_timer_get_time();
+    if (!client->connect(host, port)) {
+        LOG_E("MQTT", "Connect to %s:%u failed", host, port);
+        client = nullptr;
+        return false;
+    }
+    if (secure) metricSince(METRIC_TLS_CONNECT, start);
+    if (secure && !tlsCheckPins(secureClient, cfg.pins)) {
+        LOG_E("MQTT", "%s: server key does not match the pins", host);
+        metricCount(COUNT_TLS_PIN_FAIL);
+        secureClient.stop();
+        client = nullptr;
+        return false;
+    }
+
+    // CONNECT: protocol "MQTT" level 4, persistent session
+    uint8_t pkt[MQTT_PACKET_MAX];
+    uint8_t var[MQTT_PACKET_MAX];
+    size_t v = 0;
+    v += putString(var + v, "MQTT");
+    var[v++] = 4;
+    uint8_t flags = 0;
+    if (cfg.user[0]) flags |= 0x80;
+    if (cfg.pass[0]) flags |= 0x40;
+    var[v++] = flags;
+    var[v++] = MQTT_KEEPALIVE_S >> 8;
+    var[v++] = MQTT_KEEPALIVE_S & 0xFF;
+    v += putString(var + v, cfg.clientId);
+    if (cfg.user[0]) v += putString(var + v, cfg.user);
+    if (cfg.pass[0]) v += putString(var + v, cfg.pass);
+
+    size_t n = 0;
+    pkt[n++] = MQTT_CONNECT;
+    n += putLength(pkt + n, v);
+    memcpy(pkt + n, var, v);
+    n += v;
+    if (!writePacket(pkt, n)) return false;
+
+    uint8_t ack[4];
+    size_t ackLen;
+    int type = readPacket(ack, sizeof(ack), ackLen, millis() + timeout);
+    if (type != MQTT_CONNACK || ackLen < 2 || ack[1] != 0) {
+        LOG_E("MQTT", "CONNACK refused (%d, rc %d)", type, ackLen >= 2 ? ack[1] : -1);
+        stop();
+        return false;
+    }
+
+    connects++;
+    LOG_I("MQTT", "Connected to %s:%u (#%lu, session %s)", host, port, connects,
+          (ack[0] & 0x01) ? "resumed" : "new");
+    return true;
+}
+
+size_t MqttTransport::buildPublish(uint8_t* out, size_t cap, const Sample& sample, uint16_t id) {
+    FixedPayload<MQTT_BODY_MAX> body;
+    body.append("{\"ts\":").appendUInt(sample.timestamp);
+    body.append(",\"tv\":").appendUInt(sample.flags & SAMPLE_TIME_VALID ? 1 : 0);
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(sample, i)) continue;
+        body.append(",\"f").appendUInt(i + 1).append("\":");
+        body.appendFixed(sample.regs[i], sampleDecimals(sample, i));
+    }
+    appendWindowStats(body, sample, STATS_JSON);
+    appendEventInfo(body, sample, STATS_JSON);
+    body.append('}');
+
+    size_t topicLen = strlen(topic);
+    size_t remaining = 2 + topicLen + 2 + body.length();
+    if (body.overflowed() || 1 + 4 + remaining > cap) return 0;
+
+    size_t n = 0;
+    out[n++] = MQTT_PUBLISH | MQTT_QOS1;
+    n += putLength(out + n, remaining);
+    n += putString(out + n, topic);
+    out[n++] = id >> 8;
+    out[n++] = id & 0xFF;
+    memcpy(out + n, body.c_str(), body.length());
+    return n + body.length();
+}
+
+size_t MqttTransport::upload(const Sample* samples, size_t n) {
+    if (topic[0] == '\0' || !ensureConnected()) return 0;   // Refused by configure()
+    n = min(n, MQTT_BATCH_MAX);
+
+    uint16_t ids[MQTT_BATCH_MAX];
+    bool acked[MQTT_BATCH_MAX] = {};
+    size_t sent = 0;
+    size_t inflight = 0;
+    uint8_t pkt[MQTT_PACKET_MAX];
+
+    while (sent < n || inflight > 0) {
+        // Keep the window full
+        while (sent < n && inflight < MQTT_INFLIGHT_MAX) {
+            ids[sent] = nextPacketId();
+            size_t len = buildPublish(pkt, sizeof(pkt), samples[sent], ids[sent]);
+            if (len == 0) {
+                // Cannot be encoded: acknowledge locally so it does not block the queue
+                LOG_W("MQTT", "Reading at %lu too big to publish, dropped",
+                      (unsigned long)samples[sent].timestamp);
+                metricCount(COUNT_MQTT_DROP);
+                acked[sent++] = true;
+                continue;
+            }
+            if (!writePacket(pkt, len)) break;
+            sent++;
+            inflight++;
+        }
+        if (!isConnected() || inflight == 0) break;
+
+        uint8_t resp[4];
+        size_t respLen;
+        int type = readPacket(resp, sizeof(resp), respLen, millis() + timeout);
+        if (type < 0) {
+            LOG_W("MQTT", "%u PUBACKs outstanding, dropping session", (unsigned)inflight);
+            stop();
+            break;
+        }
+        if ((type & 0xF0) == MQTT_PINGRESP) {
+            pingSentAt = 0;
+        } else if ((type & 0xF0) == MQTT_PUBACK && respLen >= 2) {
+            uint16_t id = (resp[0] << 8) | resp[1];
+            for (size_t i = 0; i < sent; i++) {
+                if (!acked[i] && ids[i] == id) {
+                    acked[i] = true;
+                    inflight--;
+                    break;
+                }
+            }
+        }
+    }
+
+    size_t done = 0;
+    while (done < n && acked[done]) done++;
+    return done;
+}
+
+void MqttTransport::service() {
+    if (!isConnected()) return;
+
+    // Anything unsolicited (late PUBACK, PINGRESP) is just drained
+    while (client->available()) {
+        uint8_t buf[4];
+        size_t len;
+        int type = readPacket(buf, sizeof(buf), len, millis() + timeout);
+        if (type < 0) {
+            stop();
+            return;
+        }
+        if ((type & 0xF0) == MQTT_PINGRESP) pingSentAt = 0;
+    }
+
+    if (pingSentAt != 0 && millis() - pingSentAt > timeout) {
+        LOG_W("MQTT", "No PINGRESP, dropping session");
+        stop();
+        return;
+    }
+
+    if (pingSentAt == 0 && millis() - lastTx > MQTT_KEEPALIVE_S * 1000UL / 2) {
+        uint8_t ping[2] = { MQTT_PINGREQ, 0 };
+        if (writePacket(ping, sizeof(ping))) pingSentAt = millis();
+    }
+}
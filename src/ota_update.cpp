@@ -0,0 +1,472 @@
+// ================================================================
+// OTA UPDATE
+// ================================================================
+
+#include "ota_update.h"
+
+#include <esp_heap_caps.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#if __has_include(<esp32s3/rom/miniz.h>)
+#include <esp32s3/rom/miniz.h>
+#else
+#include <rom/miniz.h>
+#endif
+
+#include "logger.h"
+
+static const uint8_t ESP_IMAGE_MAGIC = 0xE9;
+static const uint8_t OTA_CONTAINER_VERSION = 1;
+static const unsigned long OTA_LOG_FLUSH_MS = 200;
+
+enum PatchOp : uint8_t {
+    PATCH_END  = 0x00,
+    PATCH_COPY = 0x01,
+    PATCH_DATA = 0x02
+};
+
+// Arduino marks the running image valid before setup() unless this
+// says otherwise; confirm() does it once the image has proven itself
+extern "C" bool verifyRollbackLater() {
+    return true;
+}
+
+static void* otaAlloc(size_t size, bool preferPsram) {
+    void* p = nullptr;
+    if (preferPsram && psramFound()) p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (p == nullptr) p = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    return p;
+}
+
+void OtaUpdate::request(const char* newUrl) {
+    portENTER_CRITICAL(&requestLock);
+    strlcpy(requestUrl, newUrl, sizeof(requestUrl));
+    pending = true;
+    portEXIT_CRITICAL(&requestLock);
+}
+
+// ================================================================
+// DOWNLOAD
+// ================================================================
+
+// Firmware only comes from a server whose key is pinned
+static bool otaTrusted(const char* url, const Uplink& uplink) {
+    return strncmp(url, "https://", 8) == 0 && uplink.pinned();
+}
+
+bool OtaUpdate::service(Uplink& uplink) {
+    if (pending) {
+        portENTER_CRITICAL(&requestLock);
+        char next[OTA_URL_MAX];
+        memcpy(next, requestUrl, sizeof(next));
+        pending = false;
+        portEXIT_CRITICAL(&requestLock);
+
+        if (state == OTA_RUNNING) {
+            LOG_W("OTA", "Update cancelled");
+            release();
+            state = OTA_IDLE;
+        }
+        if (next[0] != '\0' && state != OTA_READY) {
+            memcpy(url, next, sizeof(url));
+            if (!otaTrusted(url, uplink)) {
+                LOG_E("OTA", "Refused: needs an https URL and server pins");
+                fail(OTA_ERR_INSECURE);
+                return true;
+            }
+            if (!begin()) return true;
+        }
+    }
+    if (state != OTA_RUNNING) return true;
+    if (!otaTrusted(url, uplink)) {
+        LOG_E("OTA", "Server pins cleared, update stopped");
+        fail(OTA_ERR_INSECURE);
+        return true;
+    }
+
+    uint32_t from = fetched;
+    uint32_t to = from + OTA_RANGE_BYTES - 1;
+    if (total > 0 && to >= (uint32_t)total) to = total - 1;
+
+    int code = uplink.getStream(url, *this, from, to);
+    if (state != OTA_RUNNING) return true;   // The sink failed it
+
+    if (code == 200 && from > 0) {
+        LOG_E("OTA", "Server does not support Range requests");
+        fail(OTA_ERR_HTTP);
+        return true;
+    }
+    if (code == 200 || code == 206) {
+        retries = 0;
+        if (total < 0) total = uplink.contentTotal();
+        LOG_I("OTA", "%lu / %ld KB", (unsigned long)(fetched / 1024), total / 1024);
+        // A 200 carries the whole file; so does a 206 without a total,
+        // once a range comes back short
+        bool short206 = code == 206 && fetched - from < to - from + 1;
+        if (code == 200 || (total > 0 && fetched >= (uint32_t)total) || (total < 0 && short206)) finish();
+        return true;
+    }
+    if (code == 416 && total < 0 && from > 0) {
+        finish();   // Past the end of a file of unknown size
+        return true;
+    }
+    if (code > 0) {
+        LOG_E("OTA", "HTTP %d", code);
+        fail(OTA_ERR_HTTP);
+        return true;
+    }
+
+    // Network error: a later pass resumes at `fetched`
+    if (++retries >= OTA_MAX_RETRIES) fail(OTA_ERR_NETWORK);
+    return false;
+}
+
+bool OtaUpdate::begin() {
+    target = esp_ota_get_next_update_partition(nullptr);
+    if (target == nullptr) {
+        LOG_E("OTA", "No OTA partition");
+        return fail(OTA_ERR_FLASH);
+    }
+    out = (uint8_t*)otaAlloc(OTA_WRITE_BYTES, false);
+    if (out == nullptr) return fail(OTA_ERR_NO_MEMORY);
+
+    // Erased sector by sector as the image comes in
+    esp_err_t err = esp_ota_begin(target, OTA_WITH_SEQUENTIAL_WRITES, &handle);
+    if (err != ESP_OK) {
+        LOG_E("OTA", "Begin failed: %s", esp_err_to_name(err));
+        return fail(OTA_ERR_FLASH);
+    }
+    flashOpen = true;
+
+    state = OTA_RUNNING;
+    lastError = OTA_ERR_NONE;
+    fetched = 0;
+    total = -1;
+    retries = 0;
+    headerLen = 0;
+    headerDone = false;
+    flags = 0;
+    written = 0;
+    windowPos = 0;
+    inflated = false;
+    op = PATCH_END;
+    argCount = 0;
+    argShift = 0;
+    literal = 0;
+    patched = false;
+    outLen = 0;
+    LOG_I("OTA", "Downloading %s into %s", url, target->label);
+    return true;
+}
+
+void OtaUpdate::finish() {
+    if (!flush()) return;
+
+    bool complete = headerDone && written > 0;
+    if (flags & OTA_FLAG_DEFLATE) complete = complete && inflated;
+    if (flags & OTA_FLAG_DELTA) complete = complete && patched;
+    if (headerLen > 0) complete = complete && written == header.imageSize;
+    if (!complete) {
+        LOG_E("OTA", "Image incomplete (%lu bytes)", (unsigned long)written);
+        fail(OTA_ERR_FORMAT);
+        return;
+    }
+
+    esp_err_t err = esp_ota_end(handle);
+    flashOpen = false;
+    if (err != ESP_OK) {
+        LOG_E("OTA", "Image rejected: %s", esp_err_to_name(err));
+        fail(OTA_ERR_VERIFY);
+        return;
+    }
+    err = esp_ota_set_boot_partition(target);
+    if (err != ESP_OK) {
+        LOG_E("OTA", "Cannot boot %s: %s", target->label, esp_err_to_name(err));
+        fail(OTA_ERR_FLASH);
+        return;
+    }
+
+    trial.active = 1;
+    trial.boots = 0;
+    strlcpy(trial.previous, esp_ota_get_running_partition()->label, sizeof(trial.previous));
+    storeTrial();
+
+    release();
+    state = OTA_READY;
+    LOG_I("OTA", "%lu byte image in %s, runs after restart", (unsigned long)written, target->label);
+}
+
+bool OtaUpdate::fail(OtaError err) {
+    LOG_E("OTA", "Update failed (%u)", err);
+    release();
+    state = OTA_FAILED;
+    lastError = err;
+    return false;
+}
+
+void OtaUpdate::release() {
+    if (flashOpen) esp_ota_abort(handle);
+    flashOpen = false;
+    heap_caps_free(out);
+    heap_caps_free(window);
+    heap_caps_free(inflator);
+    out = nullptr;
+    window = nullptr;
+    inflator = nullptr;
+}
+
+// ================================================================
+// DECODING
+// ================================================================
+
+bool OtaUpdate::write(const uint8_t* data, size_t len) {
+    if (state != OTA_RUNNING) return false;
+    fetched += len;
+
+    if (!headerDone) {
+        if (headerLen == 0 && data[0] == ESP_IMAGE_MAGIC) {
+            headerDone = true;   // Plain image
+        } else {
+            size_t n = min(len, sizeof(OtaHeader) - headerLen);
+            memcpy((uint8_t*)&header + headerLen, data, n);
+            headerLen += n;
+            data += n;
+            len -= n;
+            if (headerLen < sizeof(OtaHeader)) return true;
+            if (!checkHeader()) return false;
+            headerDone = true;
+        }
+    }
+
+    return (flags & OTA_FLAG_DEFLATE) ? inflate(data, len) : decode(data, len);
+}
+
+bool OtaUpdate::checkHeader() {
+    if (memcmp(header.magic, "EOTA", 4) != 0 || header.version != OTA_CONTAINER_VERSION ||
+        (header.flags & ~(OTA_FLAG_DEFLATE | OTA_FLAG_DELTA)) != 0) {
+        LOG_E("OTA", "Not a firmware image");
+        return fail(OTA_ERR_FORMAT);
+    }
+    if (header.imageSize == 0 || header.imageSize > target->size) {
+        LOG_E("OTA", "Image of %lu bytes does not fit %s", (unsigned long)header.imageSize, target->label);
+        return fail(OTA_ERR_FORMAT);
+    }
+    if ((header.flags & OTA_FLAG_DELTA) &&
+        memcmp(header.base, esp_ota_get_app_description()->app_elf_sha256, sizeof(header.base)) != 0) {
+        LOG_E("OTA", "Delta is for other firmware");
+        return fail(OTA_ERR_BASE);
+    }
+
+    flags = header.flags;
+    if (flags & OTA_FLAG_DEFLATE) {
+        inflator = (tinfl_decompressor*)otaAlloc(sizeof(tinfl_decompressor), true);
+        window = (uint8_t*)otaAlloc(TINFL_LZ_DICT_SIZE, true);
+        if (inflator == nullptr || window == nullptr) return fail(OTA_ERR_NO_MEMORY);
+        tinfl_init(inflator);
+    }
+    return true;
+}
+
+// zlib stream through the wrapping window; whatever tinfl produces goes
+// on to decode() before the window wraps over it
+bool OtaUpdate::inflate(const uint8_t* data, size_t len) {
+    if (inflated) return true;   // Trailing bytes after the stream
+
+    tinfl_status status;
+    do {
+        size_t inBytes = len;
+        size_t outBytes = TINFL_LZ_DICT_SIZE - windowPos;
+        status = tinfl_decompress(inflator, data, &inBytes, window, window + windowPos, &outBytes,
+                                  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+        data += inBytes;
+        len -= inBytes;
+        if (outBytes > 0 && !decode(window + windowPos, outBytes)) return false;
+        windowPos = (windowPos + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (status < TINFL_STATUS_DONE) {
+            LOG_E("OTA", "Inflate failed (%d)", status);
+            return fail(OTA_ERR_INFLATE);
+        }
+        if (status == TINFL_STATUS_DONE) {
+            inflated = true;
+            return true;
+        }
+    } while (len > 0 || status == TINFL_STATUS_HAS_MORE_OUTPUT);
+    return true;
+}
+
+bool OtaUpdate::decode(const uint8_t* data, size_t len) {
+    return (flags & OTA_FLAG_DELTA) ? patch(data, len) : emit(data, len);
+}
+
+bool OtaUpdate::patch(const uint8_t* data, size_t len) {
+    while (len > 0) {
+        if (patched) return true;   // Padding after the end op
+
+        if (literal > 0) {
+            size_t n = min((size_t)literal, len);
+            if (!emit(data, n)) return false;
+            literal -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        uint8_t b = *data++;
+        len--;
+
+        if (op == PATCH_END) {
+            op = b;
+            argCount = 0;
+            argShift = 0;
+            args[0] = args[1] = 0;
+            if (op == PATCH_END) {
+                patched = true;
+            } else if (op != PATCH_COPY && op != PATCH_DATA) {
+                LOG_E("OTA", "Bad patch op 0x%02x", op);
+                return fail(OTA_ERR_FORMAT);
+            }
+            continue;
+        }
+
+        // LEB128 argument
+        if (argShift > 28) return fail(OTA_ERR_FORMAT);
+        args[argCount] |= (uint32_t)(b & 0x7F) << argShift;
+        argShift += 7;
+        if (b & 0x80) continue;
+        argCount++;
+        argShift = 0;
+
+        if (op == PATCH_COPY && argCount == 2) {
+            if (!copyFromBase(args[0], args[1])) return false;
+            op = PATCH_END;
+        } else if (op == PATCH_DATA) {
+            literal = args[0];
+            op = PATCH_END;
+        }
+    }
+    return true;
+}
+
+// Reads straight into the write buffer, a block at a time
+bool OtaUpdate::copyFromBase(uint32_t offset, uint32_t len) {
+    const esp_partition_t* base = esp_ota_get_running_partition();
+    if (offset > base->size || len > base->size - offset) {
+        LOG_E("OTA", "Patch copies past the running image");
+        return fail(OTA_ERR_FORMAT);
+    }
+
+    while (len > 0) {
+        size_t n = min((size_t)len, OTA_WRITE_BYTES - outLen);
+        if (written + n > target->size) return fail(OTA_ERR_FORMAT);
+        if (esp_partition_read(base, offset, out + outLen, n) != ESP_OK) return fail(OTA_ERR_FLASH);
+        outLen += n;
+        written += n;
+        offset += n;
+        len -= n;
+        if (outLen == OTA_WRITE_BYTES && !flush()) return false;
+    }
+    return true;
+}
+
+bool OtaUpdate::emit(const uint8_t* data, size_t len) {
+    if (written + len > target->size) {
+        LOG_E("OTA", "Image larger than %s", target->label);
+        return fail(OTA_ERR_FORMAT);
+    }
+    written += len;
+
+    while (len > 0) {
+        size_t n = min(len, OTA_WRITE_BYTES - outLen);
+        memcpy(out + outLen, data, n);
+        outLen += n;
+        data += n;
+        len -= n;
+        if (outLen == OTA_WRITE_BYTES && !flush()) return false;
+    }
+    return true;
+}
+
+bool OtaUpdate::flush() {
+    if (outLen == 0) return true;
+    esp_err_t err = esp_ota_write(handle, out, outLen);
+    outLen = 0;
+    if (err != ESP_OK) {
+        LOG_E("OTA", "Write failed: %s", esp_err_to_name(err));
+        return fail(OTA_ERR_FLASH);
+    }
+    return true;
+}
+
+// ================================================================
+// TRIAL AND ROLLBACK
+// ================================================================
+
+void OtaUpdate::storeTrial() {
+    nvs.begin("ota", false);
+    if (trial.active) {
+        nvs.putBytes("trial", &trial, sizeof(trial));
+    } else {
+        nvs.remove("trial");
+    }
+    nvs.end();
+}
+
+void OtaUpdate::bootCheck() {
+    nvs.begin("ota", false);   // Read-only would log a missing namespace
+    bool found = nvs.getBytes("trial", &trial, sizeof(trial)) == sizeof(trial);
+    nvs.end();
+    if (!found || !trial.active) {
+        memset(&trial, 0, sizeof(trial));
+        return;
+    }
+
+    const esp_partition_t* running = esp_ota_get_running_partition();
+    if (strncmp(running->label, trial.previous, sizeof(trial.previous)) == 0) {
+        // The bootloader has gone back already
+        LOG_W("OTA", "New firmware did not start, back on %s", running->label);
+        memset(&trial, 0, sizeof(trial));
+        storeTrial();
+        return;
+    }
+    if (esp_reset_reason() == ESP_RST_DEEPSLEEP) return;
+
+    trial.boots++;
+    storeTrial();
+    if (trial.boots > OTA_TRIAL_BOOTS) {
+        LOG_E("OTA", "New firmware reset %u times", trial.boots - 1);
+        rollback();
+        return;
+    }
+    LOG_I("OTA", "New firmware on trial (boot %u)", trial.boots);
+}
+
+void OtaUpdate::confirm() {
+    if (confirmed) return;
+    confirmed = true;
+    esp_ota_mark_app_valid_cancel_rollback();
+    if (!onTrial()) return;
+
+    memset(&trial, 0, sizeof(trial));
+    storeTrial();
+    LOG_I("OTA", "New firmware confirmed");
+}
+
+bool OtaUpdate::trialExpired(uint32_t uptimeS) const {
+    return onTrial() && !confirmed && uptimeS > OTA_HEALTH_TIMEOUT_S;
+}
+
+void OtaUpdate::rollback() {
+    const esp_partition_t* previous =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, trial.previous);
+    memset(&trial, 0, sizeof(trial));
+    storeTrial();
+
+    if (previous == nullptr || esp_ota_set_boot_partition(previous) != ESP_OK) {
+        LOG_E("OTA", "Previous firmware is gone, keeping this one");
+        return;
+    }
+    LOG_W("OTA", "Going back to the firmware in %s", previous->label);
+    loggerFlush(OTA_LOG_FLUSH_MS);
+    esp_restart();
+}
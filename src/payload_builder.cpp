@@ -0,0 +1,143 @@
+// ================================================================
+// PAYLOAD BUILDER
+// ================================================================
+
+#include "payload_builder.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+static const uint32_t POW10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+static const uint8_t MAX_DECIMALS = 6;
+
+PayloadBuilder::PayloadBuilder(char* buf, size_t cap) : buf(buf), cap(cap) {
+    buf[0] = '\0';
+}
+
+void PayloadBuilder::clear() {
+    len = 0;
+    overflow = false;
+    buf[0] = '\0';
+}
+
+void PayloadBuilder::truncate(size_t newLen) {
+    if (newLen >= len) return;
+    len = newLen;
+    overflow = false;
+    buf[len] = '\0';
+}
+
+PayloadBuilder& PayloadBuilder::append(const char* s, size_t n) {
+    size_t room = cap - 1 - len;
+    if (n > room) {
+        n = room;
+        overflow = true;
+    }
+    memcpy(buf + len, s, n);
+    len += n;
+    buf[len] = '\0';
+    return *this;
+}
+
+PayloadBuilder& PayloadBuilder::append(const char* s) {
+    return append(s, strlen(s));
+}
+
+PayloadBuilder& PayloadBuilder::append(char c) {
+    return append(&c, 1);
+}
+
+PayloadBuilder& PayloadBuilder::appendEncoded(const char* s) {
+    static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+    for (; *s; s++) {
+        char c = *s;
+        if (isalnum((unsigned char)c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            append(c);
+        } else {
+            char esc[3] = { '%', HEX_DIGITS[(uint8_t)c >> 4], HEX_DIGITS[(uint8_t)c & 0xF] };
+            append(esc, sizeof(esc));
+        }
+        if (overflow) break;
+    }
+    return *this;
+}
+
+PayloadBuilder& PayloadBuilder::appendJsonString(const char* s) {
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+
+    append('"');
+    for (; *s && !overflow; s++) {
+        uint8_t c = *s;
+        if (c == '"' || c == '\\') {
+            char esc[2] = { '\\', (char)c };
+            append(esc, sizeof(esc));
+        } else if (c < 0x20) {
+            char esc[6] = { '\\', 'u', '0', '0', HEX_DIGITS[c >> 4], HEX_DIGITS[c & 0xF] };
+            append(esc, sizeof(esc));
+        } else {
+            append((char)c);
+        }
+    }
+    return append('"');
+}
+
+void PayloadBuilder::appendDigits(uint64_t v, uint8_t minDigits) {
+    char digits[20];
+    uint8_t n = 0;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0 && n < sizeof(digits));
+    while (n < minDigits && n < sizeof(digits)) digits[n++] = '0';
+
+    char out[20];
+    for (uint8_t i = 0; i < n; i++) out[i] = digits[n - 1 - i];
+    append(out, n);
+}
+
+PayloadBuilder& PayloadBuilder::appendUInt(uint32_t v) {
+    appendDigits(v, 1);
+    return *this;
+}
+
+PayloadBuilder& PayloadBuilder::appendInt(int32_t v) {
+    if (v < 0) append('-');
+    appendDigits(v < 0 ? -(int64_t)v : v, 1);
+    return *this;
+}
+
+PayloadBuilder& PayloadBuilder::appendFixed(int32_t raw, uint8_t decimals, uint8_t minDecimals) {
+    decimals = std::min(decimals, MAX_DECIMALS);
+
+    uint64_t mag = raw < 0 ? -(int64_t)raw : raw;
+    if (raw < 0) append('-');
+    appendDigits(mag / POW10[decimals], 1);
+
+    if (decimals > 0 || minDecimals > 0) {
+        append('.');
+        if (decimals > 0) appendDigits(mag % POW10[decimals], decimals);
+        for (uint8_t i = decimals; i < minDecimals; i++) append('0');
+    }
+    return *this;
+}
+
+PayloadBuilder& PayloadBuilder::appendFloat(float v, uint8_t decimals) {
+    decimals = std::min(decimals, MAX_DECIMALS);
+
+    if (isnan(v) || isinf(v)) return append("0");
+
+    double scaled = (double)v * POW10[decimals];
+    bool negative = scaled < 0;
+    uint64_t mag = (uint64_t)((negative ? -scaled : scaled) + 0.5);
+
+    if (negative && mag > 0) append('-');
+    appendDigits(mag / POW10[decimals], 1);
+    if (decimals > 0) {
+        append('.');
+        appendDigits(mag % POW10[decimals], decimals);
+    }
+    return *this;
+}
@@ -0,0 +1,214 @@
+// ================================================================
+// SAMPLE BLOCK CODEC
+// ================================================================
+
+#include "sample_codec.h"
+
+#include <string.h>
+
+const size_t RECORD_MAX_BYTES = 1 + 5 + 2 + 3 + SAMPLE_MAX_FIELDS * 3 +
+                                3 + 3 + SAMPLE_MAX_FIELDS * (3 * 3 + 2) + 2;
+
+uint32_t blockCrc32(const void* data, size_t len, uint32_t crc) {
+    const uint8_t* p = (const uint8_t*)data;
+    crc = ~crc;
+    while (len--) {
+        crc ^= *p++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static size_t putVarint(uint8_t* out, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    out[n++] = v;
+    return n;
+}
+
+// Bounds-checked reader over a block payload
+struct VarintReader {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool bad = false;
+
+    uint8_t byte() {
+        if (p >= end) { bad = true; return 0; }
+        return *p++;
+    }
+
+    uint32_t varint() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            uint8_t b = byte();
+            v |= (uint32_t)(b & 0x7F) << shift;
+            if (!(b & 0x80)) return v;
+        }
+        bad = true;
+        return 0;
+    }
+
+    int32_t svarint() { return unzigzag(varint()); }
+};
+
+// Delta state shared by the encoder and decoder
+struct CodecState {
+    uint32_t ts = 0;
+    int32_t delta = 0;
+    uint8_t flags = 0;
+    uint8_t mask = 0;
+    uint16_t decimals = 0;
+    uint16_t regs[SAMPLE_MAX_FIELDS] = {};
+    bool started = false;
+};
+
+static size_t encodeRecord(const Sample& s, CodecState& st, uint8_t* out) {
+    size_t n = 0;
+    uint8_t tag = 0;
+    if (!st.started || s.flags != st.flags || s.fieldMask != st.mask || s.decimals != st.decimals) {
+        tag |= SAMPLE_TAG_META;
+    }
+    if (sampleIsWindow(s)) tag |= SAMPLE_TAG_WINDOW;
+    if (s.ms != 0) tag |= SAMPLE_TAG_MS;
+    out[n++] = tag;
+
+    int32_t delta = (int32_t)(s.timestamp - st.ts);
+    n += putVarint(out + n, zigzag(delta - st.delta));
+    st.delta = st.started ? delta : 0;
+    st.ts = s.timestamp;
+    st.started = true;
+
+    if (tag & SAMPLE_TAG_META) {
+        out[n++] = s.flags;
+        out[n++] = s.fieldMask;
+        n += putVarint(out + n, s.decimals);
+        st.flags = s.flags;
+        st.mask = s.fieldMask;
+        st.decimals = s.decimals;
+    }
+
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(s, i)) continue;
+        n += putVarint(out + n, zigzag((int32_t)s.regs[i] - st.regs[i]));
+        st.regs[i] = s.regs[i];
+    }
+
+    if (tag & SAMPLE_TAG_WINDOW) {
+        const SampleWindow& w = s.window;
+        n += putVarint(out + n, w.count);
+        n += putVarint(out + n, w.seconds);
+        for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+            if (!sampleHasField(s, i)) continue;
+            n += putVarint(out + n, zigzag((int32_t)w.min[i] - s.regs[i]));
+            n += putVarint(out + n, zigzag((int32_t)w.max[i] - s.regs[i]));
+            n += putVarint(out + n, zigzag((int32_t)w.mean[i] - s.regs[i]));
+            n += putVarint(out + n, w.transitions[i]);
+        }
+    }
+    if (tag & SAMPLE_TAG_MS) n += putVarint(out + n, s.ms);
+    return n;
+}
+
+static bool decodeRecord(VarintReader& in, CodecState& st, Sample& s) {
+    s = {};
+    uint8_t tag = in.byte();
+    if (!st.started && !(tag & SAMPLE_TAG_META)) return false;
+
+    int32_t delta = in.svarint() + st.delta;
+    s.timestamp = st.ts + delta;
+    st.delta = st.started ? delta : 0;
+    st.ts = s.timestamp;
+    st.started = true;
+
+    if (tag & SAMPLE_TAG_META) {
+        st.flags = in.byte();
+        st.mask = in.byte();
+        st.decimals = in.varint();
+    }
+    s.flags = st.flags;
+    s.fieldMask = st.mask;
+    s.decimals = st.decimals;
+
+    for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+        if (!sampleHasField(s, i)) continue;
+        st.regs[i] += in.svarint();
+        s.regs[i] = st.regs[i];
+    }
+
+    if (tag & SAMPLE_TAG_WINDOW) {
+        SampleWindow& w = s.window;
+        w.count = in.varint();
+        w.seconds = in.varint();
+        for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+            if (!sampleHasField(s, i)) continue;
+            w.min[i] = s.regs[i] + in.svarint();
+            w.max[i] = s.regs[i] + in.svarint();
+            w.mean[i] = s.regs[i] + in.svarint();
+            w.transitions[i] = in.varint();
+        }
+    }
+    if (tag & SAMPLE_TAG_MS) s.ms = in.varint();
+    return !in.bad;
+}
+
+size_t encodeSampleBlock(const Sample* samples, size_t n, uint32_t first,
+                         uint8_t* out, size_t cap, size_t& taken) {
+    taken = 0;
+    if (cap < sizeof(SampleBlockHeader)) return 0;
+
+    CodecState st;
+    size_t len = sizeof(SampleBlockHeader);
+    uint8_t rec[RECORD_MAX_BYTES];
+
+    while (taken < n && taken < SAMPLE_BLOCK_MAX) {
+        CodecState next = st;
+        size_t recLen = encodeRecord(samples[taken], next, rec);
+        if (len + recLen > cap || len + recLen - sizeof(SampleBlockHeader) > 0xFFFF) break;
+        memcpy(out + len, rec, recLen);
+        len += recLen;
+        st = next;
+        taken++;
+    }
+    if (taken == 0) return 0;
+
+    SampleBlockHeader hdr;
+    hdr.magic = SAMPLE_BLOCK_MAGIC;
+    hdr.count = taken;
+    hdr.version = SAMPLE_BLOCK_VERSION;
+    hdr.first = first;
+    hdr.length = len - sizeof(SampleBlockHeader);
+    hdr.crc = blockCrc32(out + sizeof(hdr), hdr.length,
+                         blockCrc32(&hdr, offsetof(SampleBlockHeader, crc)));
+    memcpy(out, &hdr, sizeof(hdr));
+    return len;
+}
+
+bool checkSampleBlock(const SampleBlockHeader& hdr, const uint8_t* payload, size_t maxPayload) {
+    if (hdr.magic != SAMPLE_BLOCK_MAGIC || hdr.version != SAMPLE_BLOCK_VERSION) return false;
+    if (hdr.count == 0 || hdr.count > SAMPLE_BLOCK_MAX || hdr.length > maxPayload) return false;
+    if (payload == nullptr) return true;
+    return hdr.crc == blockCrc32(payload, hdr.length,
+                                 blockCrc32(&hdr, offsetof(SampleBlockHeader, crc)));
+}
+
+bool decodeSampleBlock(const SampleBlockHeader& hdr, const uint8_t* payload, Sample* out) {
+    VarintReader in = { payload, payload + hdr.length };
+    CodecState st;
+    for (uint8_t i = 0; i < hdr.count; i++) {
+        if (!decodeRecord(in, st, out[i])) return false;
+    }
+    return in.p == in.end;
+}
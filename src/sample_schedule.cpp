@@ -0,0 +1,88 @@
+// ================================================================
+// SAMPLE SCHEDULE
+// ================================================================
+
+#include "sample_schedule.h"
+
+#include <sys/time.h>
+#include <algorithm>
+
+static const int64_t US_PER_S = 1000000;
+static const int64_t US_PER_DAY = 86400 * US_PER_S;
+static const int64_t CLOCK_SET_UNIX = 1600000000;   // Same test as readSensor()
+
+int64_t SampleSchedule::wallNowUs() {
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    if (tv.tv_sec < CLOCK_SET_UNIX) return 0;
+    return (int64_t)tv.tv_sec * US_PER_S + tv.tv_usec;
+}
+
+int64_t SampleSchedule::alignedAfter(int64_t wallUs, int64_t stepUs, int32_t utcOffsetS) {
+    int64_t local = wallUs + (int64_t)utcOffsetS * US_PER_S;
+    int64_t midnight = local - local % US_PER_DAY;
+    int64_t slot = midnight + (local - midnight) / stepUs * stepUs + stepUs;
+    if (slot > midnight + US_PER_DAY) slot = midnight + US_PER_DAY;   // Short last slot of the day
+    return slot - (int64_t)utcOffsetS * US_PER_S;
+}
+
+void SampleSchedule::configure(ScheduleMode mode, uint32_t intervalMs, int32_t utcOffsetS,
+                               SchedulePolicy latePolicy, uint8_t catchUp, int64_t nowUs) {
+    schedMode = mode;
+    step = (int64_t)std::max(intervalMs, (uint32_t)1) * 1000;
+    utcOffset = utcOffsetS;
+    policy = latePolicy;
+    maxCatchUp = catchUp;
+    slotUnix = 0;
+    late = 0;
+    missed = 0;
+
+    int64_t wall = wallNowUs();
+    onWall = mode == SCHEDULE_ALIGNED && wall != 0;
+    next = onWall ? nowUs + (alignedAfter(wall, step, utcOffset) - wall) : nowUs + step;
+}
+
+// Sets the deadline after the slot just taken. Aligning from half a
+// step on keeps a slot whose wall time came out a little early (clock
+// slewed) from being followed by the same grid point again.
+void SampleSchedule::place(int64_t slotUs, int64_t slotWallUs) {
+    onWall = schedMode == SCHEDULE_ALIGNED && slotWallUs != 0;
+    if (onWall) {
+        next = slotUs + (alignedAfter(slotWallUs + step / 2, step, utcOffset) - slotWallUs);
+    } else {
+        next = slotUs + step;
+    }
+}
+
+bool SampleSchedule::due(int64_t nowUs) {
+    // The clock has just been set: move to the aligned grid at once
+    // rather than after the next unaligned slot
+    if (schedMode == SCHEDULE_ALIGNED && !onWall) {
+        int64_t wall = wallNowUs();
+        if (wall != 0) {
+            next = nowUs + (alignedAfter(wall, step, utcOffset) - wall);
+            onWall = true;
+        }
+    }
+    if (nowUs < next) return false;
+
+    int64_t behind = (nowUs - next) / step;   // Whole slots missed
+    int64_t keep = policy == SCHEDULE_CATCH_UP ? std::min(behind, (int64_t)maxCatchUp) : 0;
+    int64_t slot = next + (behind - keep) * step;
+    missed = (uint32_t)(behind - keep);
+    late = (uint32_t)std::min(nowUs - slot, (int64_t)UINT32_MAX);
+
+    // Nominal wall time of the slot, through the clock offset of now
+    int64_t wall = wallNowUs();
+    int64_t slotWall = wall != 0 ? wall - (nowUs - slot) : 0;
+    slotUnix = slotWall != 0 ? (uint32_t)((slotWall + US_PER_S / 2) / US_PER_S) : 0;
+
+    // Catching up walks the missed slots on the plain step; alignment
+    // resumes from the first slot taken on time
+    if (keep > 0) {
+        next = slot + step;
+    } else {
+        place(slot, slotWall);
+    }
+    return true;
+}
@@ -0,0 +1,224 @@
+// ================================================================
+// SD CARD
+// ================================================================
+
+#include "sd_card.h"
+
+#include <SD.h>
+#include <SD_MMC.h>
+#include <esp_heap_caps.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+
+#include "logger.h"
+
+// Fastest first. SPI mode tops out at 25 MHz on any card.
+static const uint32_t SD_SPI_CLOCKS_KHZ[] = { 25000, 20000, 16000, 10000, 4000, 1000 };
+static const uint32_t SD_MMC_CLOCKS_KHZ[] = { 40000, 20000, 10000, 5000, 400 };
+
+static const uint8_t SPI_STEPS = sizeof(SD_SPI_CLOCKS_KHZ) / sizeof(SD_SPI_CLOCKS_KHZ[0]);
+static const uint8_t MMC_STEPS = sizeof(SD_MMC_CLOCKS_KHZ) / sizeof(SD_MMC_CLOCKS_KHZ[0]);
+
+// Differs per byte, per sector and per probe, so neither stuck data
+// lines nor a previous probe's file can pass for a good read
+static inline uint8_t patternByte(uint32_t seed, uint32_t sector, size_t i) {
+    return (uint8_t)((seed >> ((i & 3) * 8)) + i * 37 + sector * 101);
+}
+
+SdCard::SdCard(SPIClass& spi, int8_t sck, int8_t miso, int8_t mosi, int8_t cs)
+    : spi(spi), sckPin(sck), misoPin(miso), mosiPin(mosi), csPin(cs) {}
+
+void SdCard::useSdmmc(bool fourBit, int8_t d1, int8_t d2) {
+    busMode = fourBit ? SD_BUS_SDMMC_4BIT : SD_BUS_SDMMC_1BIT;
+    d1Pin = d1;
+    d2Pin = d2;
+    firstStep = 0;
+}
+
+fs::FS& SdCard::fs() {
+    if (busMode == SD_BUS_SPI) return SD;
+    return SD_MMC;
+}
+
+const char* SdCard::busName() const {
+    switch (busMode) {
+        case SD_BUS_SDMMC_1BIT: return "SDMMC 1-bit";
+        case SD_BUS_SDMMC_4BIT: return "SDMMC 4-bit";
+        default:                return "SPI";
+    }
+}
+
+void SdCard::fillPattern(uint8_t* buf, uint32_t seed, uint32_t sector) {
+    for (size_t i = 0; i < SD_SECTOR_BYTES; i++) buf[i] = patternByte(seed, sector, i);
+}
+
+bool SdCard::begin(uint32_t khz) {
+    bool ok;
+    if (busMode == SD_BUS_SPI) {
+        ok = SD.begin(csPin, spi, khz * 1000) && SD.cardType() != CARD_NONE;
+    } else {
+        if (busMode == SD_BUS_SDMMC_4BIT) {
+            SD_MMC.setPins(sckPin, mosiPin, misoPin, d1Pin, d2Pin, csPin);
+        } else {
+            // D3 high keeps the card in SD mode
+            pinMode(csPin, OUTPUT);
+            digitalWrite(csPin, HIGH);
+            SD_MMC.setPins(sckPin, mosiPin, misoPin);
+        }
+        ok = SD_MMC.begin("/sdcard", busMode == SD_BUS_SDMMC_1BIT, false, khz) &&
+             SD_MMC.cardType() != CARD_NONE;
+    }
+    if (!ok) end();
+    return ok;
+}
+
+void SdCard::end() {
+    if (busMode == SD_BUS_SPI) {
+        SD.end();
+    } else {
+        SD_MMC.end();
+    }
+}
+
+// Writes the probe file and reads it back through a fresh handle
+bool SdCard::probe(uint32_t seed) {
+    fs::FS& card = fs();
+    int64_t start = esp_timer_get_time();
+
+    File file = card.open(SD_PROBE_PATH, FILE_WRITE);
+    if (!file) return false;
+    bool ok = true;
+    for (uint32_t s = 0; s < SD_PROBE_SECTORS && ok; s++) {
+        fillPattern(sector, seed, s);
+        ok = file.write(sector, sizeof(sector)) == sizeof(sector);
+    }
+    file.close();
+    if (!ok) return false;
+
+    file = card.open(SD_PROBE_PATH, FILE_READ);
+    if (!file) return false;
+    for (uint32_t s = 0; s < SD_PROBE_SECTORS && ok; s++) {
+        ok = file.read(sector, sizeof(sector)) == sizeof(sector);
+        for (size_t i = 0; ok && i < sizeof(sector); i++) {
+            ok = sector[i] == patternByte(seed, s, i);
+        }
+    }
+    file.close();
+    if (!ok) return false;
+
+    int64_t us = esp_timer_get_time() - start;
+    uint64_t bytes = 2ull * SD_PROBE_SECTORS * SD_SECTOR_BYTES;
+    probeRate = us > 0 ? (uint32_t)(bytes * 1000000 / 1024 / us) : 0;
+    return true;
+}
+
+bool SdCard::benchmark(uint32_t kb, uint32_t& writeKBps, uint32_t& readKBps) {
+    writeKBps = 0;
+    readKBps = 0;
+    if (!isMounted) return false;
+
+    uint8_t* buf = (uint8_t*)heap_caps_malloc(SD_BENCH_CHUNK, MALLOC_CAP_DMA);
+    if (buf == nullptr) return false;
+
+    fs::FS& card = fs();
+    uint32_t seed = esp_random();
+    uint32_t chunks = max((uint32_t)(kb * 1024 / SD_BENCH_CHUNK), (uint32_t)1);
+    const uint32_t perChunk = SD_BENCH_CHUNK / SD_SECTOR_BYTES;
+    bool ok = true;
+
+    // Pattern generation is left out of the timing
+    int64_t spent = 0;
+    File file = card.open(SD_BENCH_PATH, FILE_WRITE);
+    ok = (bool)file;
+    for (uint32_t c = 0; c < chunks && ok; c++) {
+        for (uint32_t s = 0; s < perChunk; s++) {
+            fillPattern(buf + s * SD_SECTOR_BYTES, seed, c * perChunk + s);
+        }
+        int64_t start = esp_timer_get_time();
+        ok = file.write(buf, SD_BENCH_CHUNK) == SD_BENCH_CHUNK;
+        if (ok && c + 1 == chunks) file.flush();
+        spent += esp_timer_get_time() - start;
+    }
+    if (file) file.close();
+    uint64_t bytes = (uint64_t)chunks * SD_BENCH_CHUNK;
+    if (ok && spent > 0) writeKBps = (uint32_t)(bytes * 1000000 / 1024 / spent);
+
+    spent = 0;
+    if (ok) {
+        file = card.open(SD_BENCH_PATH, FILE_READ);
+        ok = (bool)file;
+    }
+    for (uint32_t c = 0; c < chunks && ok; c++) {
+        int64_t start = esp_timer_get_time();
+        ok = file.read(buf, SD_BENCH_CHUNK) == SD_BENCH_CHUNK;
+        spent += esp_timer_get_time() - start;
+        for (size_t i = 0; ok && i < SD_BENCH_CHUNK; i++) {
+            ok = buf[i] == patternByte(seed, c * perChunk + i / SD_SECTOR_BYTES, i % SD_SECTOR_BYTES);
+        }
+    }
+    if (file) file.close();
+    if (ok && spent > 0) readKBps = (uint32_t)(bytes * 1000000 / 1024 / spent);
+
+    card.remove(SD_BENCH_PATH);
+    heap_caps_free(buf);
+    if (!ok) {
+        writeKBps = 0;
+        readKBps = 0;
+        LOG_W("SD", "Benchmark failed");
+    }
+    return ok;
+}
+
+bool SdCard::mount() {
+    if (isMounted) return true;
+
+    bool spiBus = busMode == SD_BUS_SPI;
+    const uint32_t* clocks = spiBus ? SD_SPI_CLOCKS_KHZ : SD_MMC_CLOCKS_KHZ;
+    uint8_t steps = spiBus ? SPI_STEPS : MMC_STEPS;
+
+    if (spiBus) spi.begin(sckPin, misoPin, mosiPin, csPin);
+
+    for (step = firstStep; step < steps; step++) {
+        if (!begin(clocks[step])) continue;
+
+        uint32_t seed = esp_random();
+        if (probe(seed)) {
+            probeSeed = seed;
+            clockK = clocks[step];
+            isMounted = true;
+            mounts++;
+            LOG_I("SD", "%s at %lu kHz, probe %lu KB/s", busName(),
+                  (unsigned long)clockK, (unsigned long)probeRate);
+            return true;
+        }
+
+        LOG_W("SD", "Probe failed at %lu kHz", (unsigned long)clocks[step]);
+        end();
+    }
+
+    clockK = 0;
+    return false;
+}
+
+void SdCard::unmount(bool degrade) {
+    if (!isMounted) return;
+    end();
+    isMounted = false;
+
+    uint8_t steps = busMode == SD_BUS_SPI ? SPI_STEPS : MMC_STEPS;
+    if (degrade && step + 1 < steps) firstStep = step + 1;
+}
+
+bool SdCard::check() {
+    if (!isMounted) return false;
+
+    File file = fs().open(SD_PROBE_PATH, FILE_READ);
+    if (!file) return false;
+    bool ok = file.read(sector, sizeof(sector)) == sizeof(sector);
+    file.close();
+
+    for (size_t i = 0; ok && i < sizeof(sector); i++) {
+        ok = sector[i] == patternByte(probeSeed, 0, i);
+    }
+    return ok;
+}
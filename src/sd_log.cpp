@@ -0,0 +1,406 @@
+// ================================================================
+// SD SEGMENTED RING LOG
+// ================================================================
+
+#include "sd_log.h"
+
+#include <esp_timer.h>
+
+#include "logger.h"
+#include "metrics.h"
+
+static const char* SDLOG_DIR = "/log";
+static const char* SDLOG_INDEX = "/log/index.bin";
+static const uint32_t SEGMENT_MAGIC = 0x344C4453; // "SDL4" (sample blocks)
+static const uint32_t INDEX_MAGIC = 0x58444C53;   // "SLDX"
+static const size_t BLOCK_PAYLOAD_MAX = SDLOG_BLOCK_BYTES - sizeof(SampleBlockHeader);
+
+static uint16_t recordCrc(const SdLogRecord& rec) {
+    return (uint16_t)blockCrc32(&rec, offsetof(SdLogRecord, crc));
+}
+
+bool SdLog::valid(const SdLogRecord& rec) {
+    return rec.crc == recordCrc(rec);
+}
+
+File SdLog::openFile(const String& path, const char* mode) {
+    int64_t start = esp_timer_get_time();
+    File file = fs->open(path, mode);
+    metricSince(METRIC_SD_OPEN, start);
+    return file;
+}
+
+String SdLog::segmentPath(uint32_t lap) {
+    char path[20];
+    snprintf(path, sizeof(path), "%s/seg%03lu.bin", SDLOG_DIR,
+             (unsigned long)(lap % SDLOG_SEGMENTS));
+    return String(path);
+}
+
+bool SdLog::loadIndex() {
+    if (!fs->exists(SDLOG_INDEX)) return false;
+
+    File file = openFile(SDLOG_INDEX, FILE_READ);
+    if (!file) return false;
+
+    IndexSlot slots[2];
+    size_t got = file.read((uint8_t*)slots, sizeof(slots));
+    file.close();
+
+    const IndexSlot* best = nullptr;
+    for (size_t i = 0; i < got / sizeof(IndexSlot); i++) {
+        const IndexSlot& s = slots[i];
+        if (s.magic != INDEX_MAGIC) continue;
+        if (s.crc != blockCrc32(&s, offsetof(IndexSlot, crc))) continue;
+        if (s.writeIdx - s.readIdx > SDLOG_CAPACITY) continue;
+        if (best == nullptr || (int32_t)(s.generation - best->generation) > 0) best = &s;
+    }
+    if (best == nullptr) return false;
+
+    generation = best->generation;
+    readIdx = best->readIdx;
+    writeIdx = best->writeIdx;
+    return true;
+}
+
+bool SdLog::saveIndex() {
+    IndexSlot slot;
+    slot.magic = INDEX_MAGIC;
+    slot.generation = ++generation;
+    slot.readIdx = readIdx;
+    slot.writeIdx = writeIdx;
+    slot.crc = blockCrc32(&slot, offsetof(IndexSlot, crc));
+
+    bool exists = fs->exists(SDLOG_INDEX);
+    File file = openFile(SDLOG_INDEX, exists ? "r+" : "w+");
+    if (!file) return false;
+
+    if (!exists) {
+        IndexSlot blank = {};
+        file.write((const uint8_t*)&blank, sizeof(blank));
+        file.write((const uint8_t*)&blank, sizeof(blank));
+    }
+
+    // Alternate slots so a torn write leaves the previous one intact
+    file.seek((generation & 1) * sizeof(IndexSlot));
+    bool ok = file.write((const uint8_t*)&slot, sizeof(slot)) == sizeof(slot);
+    file.close();
+    return ok;
+}
+
+bool SdLog::segmentMatches(File& file, uint32_t lap) {
+    SegmentHeader hdr;
+    file.seek(0);
+    if (file.read((uint8_t*)&hdr, sizeof(hdr)) != sizeof(hdr)) return false;
+    return hdr.magic == SEGMENT_MAGIC && hdr.lap == lap &&
+           hdr.crc == blockCrc32(&hdr, offsetof(SegmentHeader, crc));
+}
+
+bool SdLog::openWriteSegment(bool create) {
+    uint32_t lap = writeIdx / SDLOG_SEGMENT_RECORDS;
+    String path = segmentPath(lap);
+
+    if (writeFile) writeFile.close();
+    writeLap = lap;
+
+    if (!create && fs->exists(path)) {
+        writeFile = openFile(path, "r+");
+        if (writeFile && segmentMatches(writeFile, lap)) {
+            // The blocks on the card are authoritative: the index is
+            // only written on segment roll and consume, not on every
+            // append. Walk them, checking each CRC, and resume after
+            // the last intact one so a torn block gets overwritten.
+            uint32_t pos = sizeof(SegmentHeader);
+            uint32_t idx = lap * SDLOG_SEGMENT_RECORDS;
+            SampleBlockHeader hdr;
+            while (idx < (lap + 1) * SDLOG_SEGMENT_RECORDS &&
+                   readBlockHeader(writeFile, pos, idx, hdr) &&
+                   writeFile.read(blockBuf, hdr.length) == hdr.length &&
+                   checkSampleBlock(hdr, blockBuf, BLOCK_PAYLOAD_MAX)) {
+                pos += sizeof(hdr) + hdr.length;
+                idx += hdr.count;
+            }
+
+            writeIdx = idx;
+            if ((int32_t)(readIdx - writeIdx) > 0) readIdx = writeIdx;
+            writeFile.seek(pos);
+            return true;
+        }
+        if (writeFile) writeFile.close();
+    }
+
+    writeFile = openFile(path, "w+");
+    if (!writeFile) return false;
+
+    SegmentHeader hdr;
+    hdr.magic = SEGMENT_MAGIC;
+    hdr.lap = lap;
+    hdr.crc = blockCrc32(&hdr, offsetof(SegmentHeader, crc));
+    if (writeFile.write((const uint8_t*)&hdr, sizeof(hdr)) != sizeof(hdr)) {
+        writeFile.close();
+        return false;
+    }
+    writeFile.flush();
+    return true;
+}
+
+bool SdLog::begin(fs::FS& card) {
+    fs = &card;
+
+    if (!fs->exists(SDLOG_DIR) && !fs->mkdir(SDLOG_DIR)) {
+        fs = nullptr;
+        return false;
+    }
+
+    if (!loadIndex()) {
+        readIdx = writeIdx = 0;
+        generation = 0;
+    }
+    scanLap = UINT32_MAX;
+    cachedCount = 0;
+
+    if (!openWriteSegment(false)) {
+        fs = nullptr;
+        return false;
+    }
+
+    LOG_I("SDLOG", "%lu pending (read %lu, write %lu)",
+          (unsigned long)pending(), (unsigned long)readIdx, (unsigned long)writeIdx);
+    return true;
+}
+
+void SdLog::end() {
+    if (writeFile) writeFile.close();
+    fs = nullptr;
+}
+
+bool SdLog::append(const Sample& sample) {
+    return append(&sample, 1) == 1;
+}
+
+size_t SdLog::append(const Sample* samples, size_t n) {
+    if (fs == nullptr) return 0;
+
+    size_t stored = 0;
+    while (stored < n) {
+        if (writeIdx % SDLOG_SEGMENT_RECORDS == 0) {
+            // Rolling into a new segment. If the ring is full the oldest
+            // segment is given up to make room.
+            while (writeIdx + SDLOG_SEGMENT_RECORDS - readIdx > SDLOG_CAPACITY) {
+                uint32_t next = (readIdx / SDLOG_SEGMENT_RECORDS + 1) * SDLOG_SEGMENT_RECORDS;
+                droppedRecords += next - readIdx;
+                readIdx = next;
+            }
+            // Persist the cursor before truncating the slot file, so a crash
+            // in between cannot resurrect the previous lap's records.
+            if (!saveIndex() || !openWriteSegment(true)) {
+                metricCount(COUNT_SD_ERROR);
+                break;
+            }
+        }
+
+        // Blocks never straddle a segment
+        size_t room = SDLOG_SEGMENT_RECORDS - writeIdx % SDLOG_SEGMENT_RECORDS;
+        size_t taken;
+        size_t len = encodeSampleBlock(samples + stored, min(n - stored, room), writeIdx,
+                                       blockBuf, sizeof(blockBuf), taken);
+        if (len == 0) break;
+
+        size_t at = writeFile.position();
+        int64_t start = esp_timer_get_time();
+        if (writeFile.write(blockBuf, len) != len) {
+            // Leave the write position on the block boundary
+            writeFile.seek(at);
+            metricCount(COUNT_SD_ERROR);
+            break;
+        }
+        writeFile.flush();
+        metricSince(METRIC_SD_WRITE, start);
+        writeIdx += taken;
+        stored += taken;
+    }
+    return stored;
+}
+
+bool SdLog::readBlockHeader(File& file, uint32_t pos, uint32_t first, SampleBlockHeader& hdr) {
+    if (!file.seek(pos)) return false;
+    if (file.read((uint8_t*)&hdr, sizeof(hdr)) != sizeof(hdr)) return false;
+    return hdr.first == first && checkSampleBlock(hdr, nullptr, BLOCK_PAYLOAD_MAX);
+}
+
+// Opens segment `lap` for reading. The write segment shares the
+// append handle rather than opening the file twice; releaseSegment()
+// puts its position back.
+File* SdLog::acquireSegment(uint32_t lap, File& own) {
+    if (lap == writeLap) {
+        writeEnd = writeFile.position();
+        return &writeFile;
+    }
+    own = openFile(segmentPath(lap), FILE_READ);
+    if (own && segmentMatches(own, lap)) return &own;
+    if (own) own.close();
+    return nullptr;
+}
+
+void SdLog::releaseSegment(File* file) {
+    if (file == &writeFile) {
+        writeFile.seek(writeEnd);
+    } else if (file != nullptr) {
+        file->close();
+    }
+}
+
+// Walks block headers from the cached scan position (or the segment
+// start) to the block holding record `idx`, leaving the file at its
+// payload. The caller updates the scan position once the payload
+// checks out.
+bool SdLog::findBlock(File& file, uint32_t idx, uint32_t& pos, SampleBlockHeader& hdr) {
+    uint32_t lap = idx / SDLOG_SEGMENT_RECORDS;
+    pos = sizeof(SegmentHeader);
+    uint32_t first = lap * SDLOG_SEGMENT_RECORDS;
+    if (scanLap == lap && scanFirst <= idx) {
+        pos = scanPos;
+        first = scanFirst;
+    }
+
+    while (readBlockHeader(file, pos, first, hdr)) {
+        if (idx - first < hdr.count) return true;
+        pos += sizeof(hdr) + hdr.length;
+        first += hdr.count;
+    }
+    return false;
+}
+
+// Decodes the block holding record `idx` into `cached`.
+bool SdLog::loadBlock(uint32_t idx) {
+    if (cachedCount > 0 && idx - cachedFirst < cachedCount) return true;
+    cachedCount = 0;
+
+    uint32_t lap = idx / SDLOG_SEGMENT_RECORDS;
+    File own;
+    File* file = acquireSegment(lap, own);
+    if (file == nullptr) return false;
+
+    uint32_t pos;
+    SampleBlockHeader hdr;
+    bool ok = findBlock(*file, idx, pos, hdr) &&
+              file->read(blockBuf, hdr.length) == hdr.length &&
+              checkSampleBlock(hdr, blockBuf, BLOCK_PAYLOAD_MAX) &&
+              decodeSampleBlock(hdr, blockBuf, cached);
+
+    if (ok) {
+        scanLap = lap;
+        scanPos = pos;
+        scanFirst = hdr.first;
+        cachedFirst = hdr.first;
+        cachedCount = hdr.count;
+    }
+
+    releaseSegment(file);
+    return ok;
+}
+
+size_t SdLog::read(SdLogRecord* out, size_t max, uint32_t skip) {
+    if (fs == nullptr || skip >= pending()) return 0;
+
+    size_t n = 0;
+    uint32_t idx = readIdx + skip;
+
+    while (n < max && idx != writeIdx) {
+        if (loadBlock(idx)) {
+            uint32_t blockEnd = cachedFirst + cachedCount;
+            size_t want = min((size_t)(min(blockEnd, writeIdx) - idx), max - n);
+            for (size_t i = 0; i < want; i++) {
+                SdLogRecord& rec = out[n + i];
+                rec.sample = cached[idx - cachedFirst + i];
+                rec.reserved = 0;
+                rec.crc = recordCrc(rec);
+            }
+            n += want;
+            idx += want;
+        } else {
+            // Past a damaged block the rest of the segment cannot be
+            // located. It comes back as invalid records so the caller
+            // can consume past it instead of stalling the drain.
+            uint32_t segEnd = min(writeIdx, (idx / SDLOG_SEGMENT_RECORDS + 1) * SDLOG_SEGMENT_RECORDS);
+            size_t want = min((size_t)(segEnd - idx), max - n);
+            memset(out + n, 0xFF, want * sizeof(SdLogRecord));
+            n += want;
+            idx += want;
+        }
+    }
+
+    return n;
+}
+
+size_t SdLog::readBlocks(uint32_t skip, uint8_t* buf, size_t cap, uint32_t& records) {
+    records = 0;
+    if (fs == nullptr || skip >= pending()) return 0;
+
+    uint32_t idx = readIdx + skip;
+    uint32_t lap = idx / SDLOG_SEGMENT_RECORDS;
+    uint32_t segEnd = min(writeIdx, (lap + 1) * SDLOG_SEGMENT_RECORDS);
+
+    File own;
+    File* file = acquireSegment(lap, own);
+    uint32_t pos;
+    SampleBlockHeader hdr;
+    bool found = file != nullptr && findBlock(*file, idx, pos, hdr);
+
+    if (found && hdr.first != idx) {
+        // Part of this block is already acknowledged
+        releaseSegment(file);
+        if (loadBlock(idx)) {
+            size_t taken;
+            size_t len = encodeSampleBlock(cached + (idx - cachedFirst), cachedFirst + cachedCount - idx,
+                                           idx, buf, cap, taken);
+            records = taken;
+            return len;
+        }
+        records = segEnd - idx;
+        return 0;
+    }
+
+    size_t len = 0;
+    while (found) {
+        size_t size = sizeof(hdr) + hdr.length;
+        if (len + size > cap) break;
+
+        // The payload goes straight from the card into the caller's buffer
+        uint8_t* payload = buf + len + sizeof(hdr);
+        if (file->read(payload, hdr.length) != hdr.length ||
+            !checkSampleBlock(hdr, payload, BLOCK_PAYLOAD_MAX)) {
+            found = false;
+            break;
+        }
+        memcpy(buf + len, &hdr, sizeof(hdr));
+        scanLap = lap;
+        scanPos = pos;
+        scanFirst = idx;
+
+        len += size;
+        idx += hdr.count;
+        records += hdr.count;
+        pos += size;
+        if (idx == segEnd) break;
+        // A header that does not check out is found again, and
+        // skipped, by the next call
+        found = readBlockHeader(*file, pos, idx, hdr);
+    }
+
+    releaseSegment(file);
+
+    if (len == 0 && !found) {
+        // As in read(), the rest of a damaged segment is given up
+        records = segEnd - idx;
+    }
+    return len;
+}
+
+bool SdLog::consume(size_t count) {
+    if (fs == nullptr) return false;
+    readIdx += min((uint32_t)count, pending());
+    if (saveIndex()) return true;
+    metricCount(COUNT_SD_ERROR);
+    return false;
+}
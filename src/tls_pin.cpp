@@ -0,0 +1,90 @@
+// ================================================================
+// TLS PINNING
+// ================================================================
+
+#include "tls_pin.h"
+
+#include <esp_heap_caps.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/platform.h>
+#include <mbedtls/sha256.h>
+#include <mbedtls/version.h>
+#include <mbedtls/x509_crt.h>
+
+static const size_t SPKI_DER_MAX = 800;   // RSA-4096 SubjectPublicKeyInfo is ~550
+static const size_t PIN_TEXT_MAX = 48;    // One base64 SHA-256 is 44
+
+bool tlsParsePins(const char* text, TlsPins& out) {
+    TlsPins parsed = {};
+    const char* p = text;
+
+    while (*p != '\0') {
+        const char* end = strchr(p, ',');
+        size_t len = end != nullptr ? (size_t)(end - p) : strlen(p);
+        if (parsed.count >= TLS_PIN_MAX || len == 0 || len >= PIN_TEXT_MAX) return false;
+
+        uint8_t hash[PIN_TEXT_MAX];
+        size_t hashLen = 0;
+        if (mbedtls_base64_decode(hash, sizeof(hash), &hashLen, (const uint8_t*)p, len) != 0 ||
+            hashLen != TLS_PIN_BYTES) {
+            return false;
+        }
+        memcpy(parsed.sha256[parsed.count++], hash, TLS_PIN_BYTES);
+
+        p += len;
+        if (*p == ',') p++;
+    }
+
+    out = parsed;
+    return true;
+}
+
+bool tlsCheckPins(WiFiClientSecure& client, const TlsPins& pins) {
+    if (pins.count == 0) return true;
+
+    const mbedtls_x509_crt* cert = client.getPeerCertificate();
+    if (cert == nullptr) return false;
+
+    // The DER is written at the end of the buffer
+    uint8_t der[SPKI_DER_MAX];
+    int len = mbedtls_pk_write_pubkey_der((mbedtls_pk_context*)&cert->pk, der, sizeof(der));
+    if (len <= 0) return false;
+
+    uint8_t hash[TLS_PIN_BYTES];
+#if MBEDTLS_VERSION_MAJOR >= 3
+    mbedtls_sha256(der + sizeof(der) - len, len, hash, 0);
+#else
+    mbedtls_sha256_ret(der + sizeof(der) - len, len, hash, 0);
+#endif
+    for (uint8_t i = 0; i < pins.count; i++) {
+        if (memcmp(hash, pins.sha256[i], TLS_PIN_BYTES) == 0) return true;
+    }
+    return false;
+}
+
+#if defined(MBEDTLS_PLATFORM_MEMORY) && !defined(MBEDTLS_PLATFORM_CALLOC_MACRO)
+static void* tlsCalloc(size_t n, size_t size) {
+    if (size != 0 && n > SIZE_MAX / size) return nullptr;
+    if (n * size >= TLS_PSRAM_MIN_BYTES) {
+        void* p = heap_caps_calloc(n, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (p != nullptr) return p;
+    }
+    return heap_caps_calloc(n, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+}
+
+// Also takes blocks handed out before the switch: heap_caps_free()
+// frees from any heap
+static void tlsFree(void* p) {
+    heap_caps_free(p);
+}
+
+bool tlsUsePsram() {
+    if (!psramFound()) return false;
+    return mbedtls_platform_set_calloc_free(tlsCalloc, tlsFree) == 0;
+}
+#else
+bool tlsUsePsram() {
+    return false;
+}
+#endif
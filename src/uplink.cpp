@@ -0,0 +1,406 @@
+// ================================================================
+// UPLINK CONNECTION
+// ================================================================
+
+#include "uplink.h"
+
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+
+#include "logger.h"
+#include "metrics.h"
+#include "payload_builder.h"
+
+const size_t UPLINK_LINE_MAX = 256;   // Status line / header line buffer
+const size_t UPLINK_HEADER_MAX = 1024; // Request line + headers
+// Fixed-width chunk-size line in front of the data ("000FA0\r\n"),
+// sized so the data that follows stays 4-byte aligned for SD DMA
+const size_t UPLINK_CHUNK_PREFIX = 8;
+const size_t UPLINK_SINK_BYTES = 1024;  // Block handed to a body sink
+const size_t UPLINK_UNTIL_CLOSE = SIZE_MAX;
+
+Uplink::Uplink(unsigned long timeoutMs) : timeout(timeoutMs) {}
+
+bool Uplink::isConnected() {
+    return client != nullptr && client->connected();
+}
+
+void Uplink::stop() {
+    if (client != nullptr) {
+        client->stop();
+    }
+    client = nullptr;
+    keepAlive = false;
+}
+
+void Uplink::setPins(const TlsPins& serverPins) {
+    if (memcmp(&serverPins, &pins, sizeof(pins)) == 0) return;
+    pins = serverPins;
+    stop();
+}
+
+bool Uplink::parseUrl(const char* url, UrlParts& parts) {
+    const char* hostStart;
+    if (strncasecmp(url, "https://", 8) == 0) {
+        parts.secure = true;
+        parts.port = 443;
+        hostStart = url + 8;
+    } else if (strncasecmp(url, "http://", 7) == 0) {
+        parts.secure = false;
+        parts.port = 80;
+        hostStart = url + 7;
+    } else {
+        return false;
+    }
+
+    const char* hostEnd = hostStart + strcspn(hostStart, ":/?");
+    size_t hostLen = hostEnd - hostStart;
+    if (hostLen == 0 || hostLen >= sizeof(parts.host)) return false;
+    memcpy(parts.host, hostStart, hostLen);
+    parts.host[hostLen] = '\0';
+
+    parts.path = hostEnd;
+    if (*hostEnd == ':') {
+        char* portEnd;
+        unsigned long port = strtoul(hostEnd + 1, &portEnd, 10);
+        if (port == 0 || port > 0xFFFF) return false;
+        parts.port = port;
+        parts.path = portEnd;
+    }
+    return true;
+}
+
+bool Uplink::ensureConnected(const UrlParts& parts) {
+    if (isConnected() && keepAlive && parts.secure == curSecure &&
+        parts.port == curPort && strcmp(parts.host, curHost) == 0) {
+        return true;
+    }
+
+    stop();
+
+    if (parts.secure) {
+        secureClient.setInsecure();
+        secureClient.setHandshakeTimeout(timeout / 1000);
+        client = &secureClient;
+    } else {
+        client = &plainClient;
+    }
+
+    int64_t start = esp_timer_get_time();
+    if (!client->connect(parts.host, parts.port)) {
+        LOG_E("UPLINK", "Connect to %s:%u failed", parts.host, parts.port);
+        client = nullptr;
+        return false;
+    }
+    lastConnectUs = (uint32_t)(esp_timer_get_time() - start);
+    if (parts.secure) metricSince(METRIC_TLS_CONNECT, start);
+    if (parts.secure && !tlsCheckPins(secureClient, pins)) {
+        LOG_E("UPLINK", "%s: server key does not match the pins", parts.host);
+        metricCount(COUNT_TLS_PIN_FAIL);
+        secureClient.stop();
+        client = nullptr;
+        return false;
+    }
+
+    strcpy(curHost, parts.host);
+    curPort = parts.port;
+    curSecure = parts.secure;
+    keepAlive = true;
+    handshakes++;
+    LOG_I("UPLINK", "Connected to %s:%u (#%lu)", curHost, curPort, handshakes);
+    return true;
+}
+
+int Uplink::readByte(unsigned long deadline) {
+    while (!client->available()) {
+        if (!client->connected()) return UPLINK_ERR_CLOSED;
+        if ((long)(millis() - deadline) >= 0) return UPLINK_ERR_TIMEOUT;
+        delay(1);
+    }
+    return client->read();
+}
+
+bool Uplink::readLine(char* buf, size_t cap, unsigned long deadline) {
+    size_t len = 0;
+    while (true) {
+        int c = readByte(deadline);
+        if (c < 0) return false;
+        if (c == '\n') break;
+        if (c != '\r' && len < cap - 1) buf[len++] = (char)c;
+    }
+    buf[len] = '\0';
+    return true;
+}
+
+void Uplink::keepBody(char c) {
+    if (bodyLen + 1 < bodyCap) {
+        bodyBuf[bodyLen++] = c;
+        bodyBuf[bodyLen] = '\0';
+    }
+}
+
+bool Uplink::readBody(size_t len, unsigned long& deadline) {
+    if (sinking) return sinkBody(len, deadline);
+    while (len > 0) {
+        int c = readByte(deadline);
+        if (c < 0) return false;
+        keepBody((char)c);
+        len--;
+    }
+    return true;
+}
+
+// `len` bytes, or UPLINK_UNTIL_CLOSE, in blocks to the sink. Each
+// block moves the deadline on, so only a stalled transfer times out.
+bool Uplink::sinkBody(size_t len, unsigned long& deadline) {
+    uint8_t buf[UPLINK_SINK_BYTES];
+    bool untilClose = len == UPLINK_UNTIL_CLOSE;
+
+    while (len > 0) {
+        int avail = client->available();
+        if (avail <= 0) {
+            if (!client->connected()) return untilClose;
+            if ((long)(millis() - deadline) >= 0) return false;
+            delay(1);
+            continue;
+        }
+        size_t n = min(min((size_t)avail, sizeof(buf)), len);
+        int got = client->read(buf, n);
+        if (got <= 0 || !bodySink->write(buf, got)) return false;
+        if (!untilClose) len -= got;
+        deadline = millis() + timeout;
+    }
+    return true;
+}
+
+int Uplink::readResponse() {
+    unsigned long deadline = millis() + timeout;
+    char line[UPLINK_LINE_MAX];
+
+    // Status line. A closed socket here on a reused connection means
+    // the server dropped the idle keep-alive before we wrote.
+    int first = readByte(deadline);
+    if (first < 0) return first;
+    line[0] = (char)first;
+    if (!readLine(line + 1, sizeof(line) - 1, deadline)) return UPLINK_ERR_TIMEOUT;
+
+    int status = 0;
+    if (strncmp(line, "HTTP/1.", 7) != 0 || sscanf(line + 9, "%d", &status) != 1) {
+        return UPLINK_ERR_PROTOCOL;
+    }
+    if (line[7] == '0') keepAlive = false; // HTTP/1.0 defaults to close
+
+    long contentLength = -1;
+    bool chunked = false;
+    total = -1;
+    sinking = false;
+
+    while (true) {
+        if (!readLine(line, sizeof(line), deadline)) return UPLINK_ERR_TIMEOUT;
+        if (line[0] == '\0') break;
+
+        // Header names and the tokens we look for are case-insensitive
+        for (char* p = line; *p; p++) *p = tolower(*p);
+
+        if (strncmp(line, "content-length:", 15) == 0) {
+            contentLength = atol(line + 15);
+        } else if (strncmp(line, "content-range:", 14) == 0) {
+            // "bytes 0-65535/1234567"; the total may be '*'
+            const char* slash = strrchr(line, '/');
+            if (slash != nullptr && slash[1] != '*') total = atol(slash + 1);
+        } else if (strncmp(line, "transfer-encoding:", 18) == 0) {
+            chunked = strstr(line + 18, "chunked") != nullptr;
+        } else if (strncmp(line, "connection:", 11) == 0) {
+            if (strstr(line + 11, "close") != nullptr) keepAlive = false;
+            if (strstr(line + 11, "keep-alive") != nullptr) keepAlive = true;
+        }
+    }
+    if (headRequest) return status;
+    if (status == 200 && total < 0) total = contentLength;
+    sinking = bodySink != nullptr && status >= 200 && status < 300;
+
+    if (chunked) {
+        while (true) {
+            if (!readLine(line, sizeof(line), deadline)) return UPLINK_ERR_TIMEOUT;
+            size_t size = strtoul(line, nullptr, 16);
+            if (size == 0) break;
+            if (!readBody(size, deadline)) return UPLINK_ERR_TIMEOUT;
+            if (!readLine(line, sizeof(line), deadline)) return UPLINK_ERR_TIMEOUT;
+        }
+        // Trailers (normally none) end with an empty line
+        do {
+            if (!readLine(line, sizeof(line), deadline)) return UPLINK_ERR_TIMEOUT;
+        } while (line[0] != '\0');
+    } else if (contentLength >= 0) {
+        if (!readBody(contentLength, deadline)) return UPLINK_ERR_TIMEOUT;
+    } else {
+        // No framing: body runs until the server closes
+        keepAlive = false;
+        if (sinking) return sinkBody(UPLINK_UNTIL_CLOSE, deadline) ? status : UPLINK_ERR_TIMEOUT;
+        while (true) {
+            int c = readByte(deadline);
+            if (c == UPLINK_ERR_CLOSED) break;
+            if (c < 0) return c;
+            keepBody((char)c);
+        }
+    }
+
+    return status;
+}
+
+// Writes the body of `source` as chunks, each a single socket write
+// (size line, data and CRLF together), ending with the zero chunk.
+int Uplink::sendChunks(UplinkBodySource& source) {
+    if (!source.rewind()) return UPLINK_ERR_SEND;
+
+    uint8_t* data = chunkBuf + UPLINK_CHUNK_PREFIX;
+    while (true) {
+        size_t n = source.read(data, UPLINK_CHUNK_BYTES);
+
+        static const char hex[] = "0123456789ABCDEF";
+        for (int i = 0; i < 6; i++) chunkBuf[i] = hex[(n >> (4 * (5 - i))) & 0xF];
+        chunkBuf[6] = '\r';
+        chunkBuf[7] = '\n';
+        data[n] = '\r';
+        data[n + 1] = '\n';
+
+        size_t frame = UPLINK_CHUNK_PREFIX + n + 2;
+        if (client->write(chunkBuf, frame) != frame) return UPLINK_ERR_SEND;
+        if (n == 0) return 0;
+    }
+}
+
+int Uplink::sendRequest(const char* method, const char* path, const char* contentType,
+                        const char* contentEncoding, const uint8_t* payload, size_t len,
+                        UplinkBodySource* source) {
+    FixedPayload<UPLINK_HEADER_MAX> req;
+    req.append(method).append(' ');
+    if (*path != '/') req.append('/');
+    req.append(path);
+    req.append(" HTTP/1.1\r\nHost: ").append(curHost);
+    req.append("\r\nUser-Agent: ESP32\r\nConnection: keep-alive\r\n");
+    if (bodySink != nullptr) {
+        req.append("Range: bytes=").appendUInt(rangeFrom).append('-').appendUInt(rangeTo).append("\r\n");
+    }
+    if (payload != nullptr || source != nullptr) {
+        req.append("Content-Type: ").append(contentType);
+        if (contentEncoding != nullptr) req.append("\r\nContent-Encoding: ").append(contentEncoding);
+        if (source != nullptr) {
+            req.append("\r\nTransfer-Encoding: chunked\r\n");
+        } else {
+            req.append("\r\nContent-Length: ").appendUInt(len).append("\r\n");
+        }
+    }
+    req.append("\r\n");
+    if (req.overflowed()) return UPLINK_ERR_BAD_URL;
+
+    size_t sent = client->write(req.bytes(), req.length());
+    requestSent = sent > 0;
+    if (sent != req.length()) return UPLINK_ERR_SEND;
+    if (payload != nullptr && len > 0 && client->write(payload, len) != len) {
+        return UPLINK_ERR_SEND;
+    }
+    if (source != nullptr) {
+        int err = sendChunks(*source);
+        if (err < 0) return err;
+    }
+
+    return readResponse();
+}
+
+int Uplink::request(const char* method, const char* url, const char* contentType,
+                    const char* contentEncoding, const uint8_t* payload, size_t len,
+                    UplinkBodySource* source, char* out, size_t outCap) {
+    bodyBuf = out;
+    bodyCap = outCap;
+    bodyLen = 0;
+    if (bodyCap > 0) bodyBuf[0] = '\0';
+    headRequest = strcmp(method, "HEAD") == 0;
+
+    if (WiFi.status() != WL_CONNECTED) {
+        stop();
+        return UPLINK_ERR_NO_WIFI;
+    }
+
+    UrlParts parts;
+    if (!parseUrl(url, parts)) return UPLINK_ERR_BAD_URL;
+
+    // One retry covers the server having closed an idle keep-alive
+    // socket; a fresh connection gets no second chance. A POST is only
+    // resent if none of it went out: the server may have taken the
+    // first one before the socket died, and the caller's backoff
+    // handles the rest.
+    bool idempotent = strcmp(method, "GET") == 0 || headRequest;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = isConnected() && keepAlive;
+        if (!ensureConnected(parts)) return UPLINK_ERR_CONNECT;
+
+        requests++;
+        bodyLen = 0;
+        if (bodyCap > 0) bodyBuf[0] = '\0';
+        requestSent = false;
+        int64_t start = esp_timer_get_time();
+        int code = sendRequest(method, parts.path, contentType, contentEncoding, payload, len, source);
+
+        if (code > 0) {
+            metricSince(METRIC_HTTP, start);
+            if (!keepAlive) stop();
+            return code;
+        }
+
+        stop();
+        bool stale = reused && (code == UPLINK_ERR_CLOSED || code == UPLINK_ERR_SEND) &&
+                     (idempotent || !requestSent);
+        if (!stale) return code;
+        LOG_W("UPLINK", "Keep-alive socket was closed, reconnecting");
+    }
+
+    return UPLINK_ERR_CLOSED;
+}
+
+// Counts failed requests, returning `code` unchanged
+static int countResult(int code) {
+    if (code < 0) {
+        metricCount(COUNT_HTTP_ERROR);
+    } else if (code < 200 || code >= 300) {
+        metricCount(COUNT_HTTP_STATUS);
+    }
+    return code;
+}
+
+int Uplink::get(const char* url, char* body, size_t bodyCap) {
+    return countResult(request("GET", url, nullptr, nullptr, nullptr, 0, nullptr, body, bodyCap));
+}
+
+int Uplink::getStream(const char* url, UplinkBodySink& sink, uint32_t from, uint32_t to) {
+    bodySink = &sink;
+    rangeFrom = from;
+    rangeTo = to;
+    int code = countResult(request("GET", url, nullptr, nullptr, nullptr, 0, nullptr, nullptr, 0));
+    bodySink = nullptr;
+    sinking = false;
+    return code;
+}
+
+int Uplink::head(const char* url) {
+    return request("HEAD", url, nullptr, nullptr, nullptr, 0, nullptr, nullptr, 0);
+}
+
+int Uplink::post(const char* url, const char* contentType,
+                 const uint8_t* payload, size_t len, char* body, size_t bodyCap,
+                 const char* contentEncoding) {
+    return countResult(request("POST", url, contentType, contentEncoding, payload, len, nullptr, body, bodyCap));
+}
+
+int Uplink::postStream(const char* url, const char* contentType, UplinkBodySource& source,
+                       char* body, size_t bodyCap, const char* contentEncoding) {
+    if (chunkBuf == nullptr) {
+        chunkBuf = (uint8_t*)heap_caps_malloc(UPLINK_CHUNK_PREFIX + UPLINK_CHUNK_BYTES + 2,
+                                              MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (chunkBuf == nullptr) {
+            if (bodyCap > 0) body[0] = '\0';
+            return countResult(UPLINK_ERR_NO_MEMORY);
+        }
+    }
+    return countResult(request("POST", url, contentType, contentEncoding, nullptr, 0, &source, body, bodyCap));
+}
@@ -0,0 +1,328 @@
+// ================================================================
+// WI-FI CONNECTION MANAGER
+// ================================================================
+
+#include "wifi_manager.h"
+
+#include <ArduinoJson.h>
+#include <Preferences.h>
+
+#include "config_store.h"
+#include "json_arena.h"
+#include "logger.h"
+
+// WiFi.begin() can report the previous association going away; a
+// disconnect this soon after starting an attempt is not its failure.
+const unsigned long WIFI_EVENT_SETTLE_MS = 100;
+
+static Preferences wifiPrefs;
+static ConfigRecord<WifiNetList> netStore("wifi_db", "list", 1);
+
+void WifiManager::begin(ConnectedCallback onConnected) {
+    connectedCb = onConnected;
+    load();
+
+    // Reconnects are ours to schedule, and the driver should not
+    // rewrite its own NVS copy of the config on every begin()
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    WiFi.onEvent([this](arduino_event_id_t event, arduino_event_info_t info) {
+        onEvent(event, info);
+    });
+
+    LOG_I("WIFI", "%u saved networks", count);
+}
+
+void WifiManager::onEvent(arduino_event_id_t event, arduino_event_info_t info) {
+    switch (event) {
+        case ARDUINO_EVENT_WIFI_STA_CONNECTED:
+            memcpy(evBssid, info.wifi_sta_connected.bssid, sizeof(evBssid));
+            evChannel = info.wifi_sta_connected.channel;
+            break;
+        case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+            evGotIp = true;
+            break;
+        case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+            evReason = info.wifi_sta_disconnected.reason;
+            evDisconnectAt = millis();
+            evDisconnected = true;
+            break;
+        default:
+            break;
+    }
+}
+
+void WifiManager::load() {
+    count = 0;
+    successSeq = 0;
+
+    WifiNetList list;
+    if (netStore.load(list)) {
+        count = min(list.count, (uint32_t)WIFI_MAX_SAVED);
+        memcpy(nets, list.nets, count * sizeof(WifiNetwork));
+        for (uint8_t i = 0; i < count; i++) successSeq = max(successSeq, nets[i].lastSuccess);
+        return;
+    }
+
+    if (loadLegacy()) {
+        save();
+        wifiPrefs.begin("wifi_db", false);
+        wifiPrefs.remove("nets");
+        wifiPrefs.end();
+        LOG_I("WIFI", "Imported %u networks from the JSON list", count);
+    }
+}
+
+// The JSON list of older firmware. Returns false if there is none.
+bool WifiManager::loadLegacy() {
+    wifiPrefs.begin("wifi_db", true);
+    bool found = wifiPrefs.isKey("nets");
+    String data = found ? wifiPrefs.getString("nets", "[]") : String();
+    wifiPrefs.end();
+    if (!found) return false;
+
+    JsonDocument doc(&jsonArena);
+    if (deserializeJson(doc, data)) return false;
+
+    for (JsonObject obj : doc.as<JsonArray>()) {
+        if (count >= WIFI_MAX_SAVED) break;
+        const char* ssid = obj["s"] | "";
+        if (ssid[0] == '\0') continue;
+
+        WifiNetwork& n = nets[count];
+        memset(&n, 0, sizeof(n));
+        strlcpy(n.ssid, ssid, sizeof(n.ssid));
+        strlcpy(n.pass, obj["p"] | "", sizeof(n.pass));
+
+        const char* b = obj["b"] | "";
+        if (strlen(b) == 12) {
+            for (int i = 0; i < 6; i++) {
+                char hex[3] = { b[2 * i], b[2 * i + 1], '\0' };
+                n.bssid[i] = strtoul(hex, nullptr, 16);
+            }
+            n.channel = obj["c"] | 0;
+        }
+        n.rssi = obj["r"] | 0;
+        n.lastSuccess = obj["n"] | 0;
+        successSeq = max(successSeq, n.lastSuccess);
+        count++;
+    }
+    return true;
+}
+
+void WifiManager::save() {
+    WifiNetList list;
+    memset(&list, 0, sizeof(list));
+    list.count = count;
+    memcpy(list.nets, nets, count * sizeof(WifiNetwork));
+
+    if (!netStore.store(list)) LOG_E("NVS", "Failed to save Wi-Fi list.");
+}
+
+// Ranks saved networks (last success, then RSSI) into the attempt
+// list; each gets a fast attempt first if it has a cached AP.
+void WifiManager::buildPlan() {
+    uint8_t order[WIFI_MAX_SAVED];
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t pos = i;
+        while (pos > 0) {
+            const WifiNetwork& a = nets[i];
+            const WifiNetwork& b = nets[order[pos - 1]];
+            bool better = a.lastSuccess > b.lastSuccess ||
+                          (a.lastSuccess == b.lastSuccess && a.rssi > b.rssi);
+            if (!better) break;
+            order[pos] = order[pos - 1];
+            pos--;
+        }
+        order[pos] = i;
+    }
+
+    planLen = 0;
+    planPos = 0;
+    if (hasRequest) plan[planLen++] = { -1, false };
+    for (uint8_t i = 0; i < count; i++) {
+        if (nets[order[i]].channel != 0) plan[planLen++] = { (int8_t)order[i], true };
+        plan[planLen++] = { (int8_t)order[i], false };
+    }
+}
+
+void WifiManager::startNext() {
+    if (planPos >= planLen) {
+        if (hasRequest) finishRequest(false);
+        if (count == 0) {
+            state = WM_IDLE;
+            return;
+        }
+        failures = min(failures + 1, 16);
+        unsigned long wait = min(WIFI_BACKOFF_MIN_MS << min((int)failures - 1, 6), WIFI_BACKOFF_MAX_MS);
+        backoffUntil = millis() + wait;
+        state = WM_BACKOFF;
+        LOG_W("WIFI", "No network reachable, retry in %lus", wait / 1000);
+        return;
+    }
+
+    current = plan[planPos++];
+    WifiNetwork& n = attemptNet(current);
+
+    LOG_I("WIFI", "Connecting to [%s]%s", n.ssid, current.fast ? " (cached AP)" : "");
+    evDisconnected = false;
+    evGotIp = false;
+    if (current.fast) {
+        WiFi.begin(n.ssid, n.pass, n.channel, n.bssid);
+    } else {
+        WiFi.begin(n.ssid, n.pass);
+    }
+    attemptStart = millis();
+    state = WM_CONNECTING;
+}
+
+void WifiManager::finishRequest(bool ok) {
+    hasRequest = false;
+    ResultCallback cb = requestCb;
+    requestCb = nullptr;
+    if (cb != nullptr) cb(ok);
+}
+
+void WifiManager::succeeded() {
+    WifiNetwork& n = attemptNet(current);
+    bool dirty = false;
+
+    if (current.net < 0) {
+        // Explicit request: save it, replacing the same SSID or the
+        // least recently successful entry
+        int slot = -1;
+        for (uint8_t i = 0; i < count; i++) {
+            if (strcmp(nets[i].ssid, n.ssid) == 0) slot = i;
+        }
+        if (slot < 0 && count < WIFI_MAX_SAVED) slot = count++;
+        if (slot < 0) {
+            slot = 0;
+            for (uint8_t i = 1; i < count; i++) {
+                if (nets[i].lastSuccess < nets[slot].lastSuccess) slot = i;
+            }
+        }
+        nets[slot] = n;
+        current.net = slot;
+        dirty = true;
+    }
+
+    WifiNetwork& saved = nets[current.net];
+    int8_t rssi = WiFi.RSSI();
+    if (memcmp(saved.bssid, evBssid, sizeof(evBssid)) != 0 || saved.channel != evChannel) {
+        memcpy(saved.bssid, evBssid, sizeof(evBssid));
+        saved.channel = evChannel;
+        dirty = true;
+    }
+    // Only bump the sequence when the ranking actually changes
+    if (saved.lastSuccess != successSeq || saved.lastSuccess == 0) {
+        saved.lastSuccess = ++successSeq;
+        dirty = true;
+    }
+    saved.rssi = rssi;
+
+    if (dirty) save();
+
+    state = WM_CONNECTED;
+    failures = 0;
+    LOG_I("WIFI", "Connected to [%s] ch %u, %d dBm in %lums",
+          saved.ssid, saved.channel, rssi, millis() - attemptStart);
+
+    if (hasRequest) finishRequest(true);
+    if (connectedCb != nullptr) connectedCb();
+}
+
+void WifiManager::loop() {
+    if (held) return;
+
+    if (evGotIp) {
+        evGotIp = false;
+        if (state == WM_CONNECTING) succeeded();
+    }
+
+    if (evDisconnected) {
+        evDisconnected = false;
+
+        if (state == WM_CONNECTED) {
+            // A blip: straight back to the AP we just lost
+            LOG_W("WIFI", "Link lost (reason %u)", evReason);
+            buildPlan();
+            startNext();
+            return;
+        }
+        if (state == WM_CONNECTING && evDisconnectAt - attemptStart > WIFI_EVENT_SETTLE_MS) {
+            startNext();
+            return;
+        }
+    }
+
+    switch (state) {
+        case WM_CONNECTING: {
+            unsigned long limit = current.fast ? WIFI_FAST_TIMEOUT_MS : WIFI_FULL_TIMEOUT_MS;
+            if (millis() - attemptStart > limit) startNext();
+            break;
+        }
+        case WM_BACKOFF:
+            if ((long)(millis() - backoffUntil) >= 0) {
+                buildPlan();
+                startNext();
+            }
+            break;
+        case WM_IDLE:
+            if (count > 0 || hasRequest) {
+                buildPlan();
+                startNext();
+            }
+            break;
+        case WM_CONNECTED:
+            break;
+    }
+}
+
+void WifiManager::connectTo(const String& ssid, const String& pass, ResultCallback onResult) {
+    if (hasRequest) finishRequest(false);
+
+    memset(&request, 0, sizeof(request));
+    strlcpy(request.ssid, ssid.c_str(), sizeof(request.ssid));
+    strlcpy(request.pass, pass.c_str(), sizeof(request.pass));
+    for (uint8_t i = 0; i < count; i++) {
+        // Known network with new credentials: keep its cached AP
+        if (strcmp(nets[i].ssid, request.ssid) == 0) {
+            memcpy(request.bssid, nets[i].bssid, sizeof(request.bssid));
+            request.channel = nets[i].channel;
+        }
+    }
+    hasRequest = true;
+    requestCb = onResult;
+
+    // Only the request is tried; the saved list follows if it fails
+    planLen = 0;
+    planPos = 0;
+    plan[planLen++] = { -1, false };
+    state = WM_IDLE;
+    startNext();
+}
+
+void WifiManager::forget() {
+    wifiPrefs.begin("wifi_db", false);
+    if (wifiPrefs.clear()) {
+        LOG_I("NVS", "Wi-Fi credentials cleared.");
+    } else {
+        LOG_E("NVS", "Failed to clear Wi-Fi.");
+    }
+    wifiPrefs.end();
+    netStore.invalidate();
+
+    count = 0;
+    successSeq = 0;
+    if (hasRequest) finishRequest(false);
+    state = WM_IDLE;
+
+    // Also clear standard ESP32 WiFi NVS (just in case)
+    WiFi.disconnect(true, true);
+}
+
+void WifiManager::noteRssi(const char* ssid, int8_t rssi) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (strcmp(nets[i].ssid, ssid) == 0) nets[i].rssi = rssi;
+    }
+}
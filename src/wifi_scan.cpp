@@ -0,0 +1,74 @@
+// ================================================================
+// WI-FI SCAN
+// ================================================================
+
+#include "wifi_scan.h"
+
+bool WifiScan::start() {
+    if (busy) return true;
+
+    n = 0;
+    error = false;
+    int16_t r = WiFi.scanNetworks(true, false, false, WIFI_SCAN_DWELL_MS);
+    busy = r == WIFI_SCAN_RUNNING;
+    return busy;
+}
+
+bool WifiScan::poll() {
+    if (!busy) return false;
+
+    int16_t found = WiFi.scanComplete();
+    if (found == WIFI_SCAN_RUNNING) return false;
+
+    busy = false;
+    if (found < 0) {
+        error = true;
+    } else {
+        collect(found);
+    }
+    WiFi.scanDelete();
+    return true;
+}
+
+void WifiScan::collect(int16_t found) {
+    n = 0;
+    for (int16_t i = 0; i < found; i++) {
+        String ssid = WiFi.SSID(i);
+        if (ssid.length() == 0) continue;   // Hidden
+        int8_t rssi = WiFi.RSSI(i);
+
+        // Same SSID from another AP: keep the stronger one
+        int8_t dup = -1;
+        for (uint8_t k = 0; k < n; k++) {
+            if (strcmp(records[k].ssid, ssid.c_str()) == 0) {
+                dup = k;
+                break;
+            }
+        }
+        if (dup >= 0 && records[dup].rssi >= rssi) continue;
+
+        ScanRecord rec;
+        strlcpy(rec.ssid, ssid.c_str(), sizeof(rec.ssid));
+        rec.rssi = rssi;
+        rec.channel = WiFi.channel(i);
+        rec.auth = WiFi.encryptionType(i);
+
+        // Insertion into the RSSI-sorted list, dropping the weakest
+        // once full
+        uint8_t pos;
+        if (dup >= 0) {
+            pos = dup;
+        } else if (n < cap) {
+            pos = n++;
+        } else if (rssi > records[n - 1].rssi) {
+            pos = n - 1;
+        } else {
+            continue;
+        }
+        while (pos > 0 && records[pos - 1].rssi < rssi) {
+            records[pos] = records[pos - 1];
+            pos--;
+        }
+        records[pos] = rec;
+    }
+}
@@ -0,0 +1,191 @@
+// ================================================================
+// LOSSY UPLINK FAKES
+// ================================================================
+// Host stand-ins for the HTTP and MQTT transports behind the
+// Transport interface, over a link that drops what a LossProfile
+// says it should. The fake server keeps every reading it accepted, so
+// a suite can check the uplink contract end to end: each reading gets
+// through, in order, at least once, and repeats only follow a lost
+// acknowledgement.
+//
+//   FakeHttpTransport  one x-sample-delta POST per upload(), built and
+//                      checked with the real codec, all or nothing as
+//                      postEncodedBatch() is
+//   FakeMqttTransport  one QoS1 PUBLISH per reading with a window in
+//                      flight; the acknowledged prefix counts, as in
+//                      MqttTransport::upload()
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "payload_builder.h"
+#include "sample_codec.h"
+#include "transport.h"
+
+struct LossProfile {
+    double connectFail;    // No connection: nothing goes out
+    double requestLost;    // Lost on the way: the server never sees it
+    double responseLost;   // The server took it, the reply never came
+    double corrupt;        // One byte flipped on the way (HTTP body)
+};
+
+// Deterministic coin flips, so a failing run can be replayed
+class LossyLink {
+public:
+    LossyLink(const LossProfile& profile, uint32_t seed) : loss(profile), state(seed | 1) {}
+
+    bool roll(double p) { return p > 0 && next() < p; }
+    uint32_t pick(uint32_t n) { return (uint32_t)(next() * n); }
+
+    const LossProfile loss;
+
+private:
+    double next() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state / 4294967296.0;
+    }
+
+    uint32_t state;
+};
+
+struct FakeServer {
+    std::vector<Sample> accepted;
+    uint32_t requests = 0;
+    uint32_t rejected = 0;    // Bodies that failed the block checks
+    uint32_t bytes = 0;       // Payload bytes that reached the server
+};
+
+class FakeHttpTransport : public Transport {
+public:
+    FakeHttpTransport(LossyLink& link, FakeServer& server, size_t maxBytes = 8192, size_t maxRecords = 100)
+        : link(link), server(server), body(maxBytes), maxRecords(maxRecords) {}
+
+    size_t upload(const Sample* samples, size_t n) override {
+        size_t len = 0;
+        size_t taken = 0;
+        while (taken < n) {
+            size_t t;
+            size_t blockLen = encodeSampleBlock(samples + taken, n - taken, taken,
+                                                body.data() + len, body.size() - len, t);
+            if (blockLen == 0) break;
+            len += blockLen;
+            taken += t;
+        }
+        if (taken == 0 || link.roll(link.loss.connectFail)) return 0;
+
+        sent += len;
+        if (link.roll(link.loss.requestLost)) return 0;
+        if (link.roll(link.loss.corrupt)) body[link.pick(len)] ^= 0x20;
+
+        server.requests++;
+        server.bytes += len;
+        if (!receive(body.data(), len)) {
+            server.rejected++;
+            return 0;
+        }
+        return link.roll(link.loss.responseLost) ? 0 : taken;
+    }
+
+    size_t batchLimit() const override { return maxRecords; }
+    void stop() override {}
+    const char* name() const override { return "fake-http"; }
+
+    uint32_t bytesSent() const { return sent; }
+
+private:
+    // Server side: every block must check out before any is kept
+    bool receive(const uint8_t* data, size_t len) {
+        std::vector<Sample> rows;
+        size_t pos = 0;
+        while (pos < len) {
+            SampleBlockHeader hdr;
+            if (len - pos < sizeof(hdr)) return false;
+            memcpy(&hdr, data + pos, sizeof(hdr));
+            pos += sizeof(hdr);
+            if (!checkSampleBlock(hdr, data + pos, len - pos)) return false;
+
+            Sample decoded[SAMPLE_BLOCK_MAX];
+            if (!decodeSampleBlock(hdr, data + pos, decoded)) return false;
+            rows.insert(rows.end(), decoded, decoded + hdr.count);
+            pos += hdr.length;
+        }
+        server.accepted.insert(server.accepted.end(), rows.begin(), rows.end());
+        return true;
+    }
+
+    LossyLink& link;
+    FakeServer& server;
+    std::vector<uint8_t> body;
+    size_t maxRecords;
+    uint32_t sent = 0;
+};
+
+class FakeMqttTransport : public Transport {
+public:
+    FakeMqttTransport(LossyLink& link, FakeServer& server, size_t window = 8, size_t maxRecords = 64)
+        : link(link), server(server), window(window), maxRecords(maxRecords) {}
+
+    size_t upload(const Sample* samples, size_t n) override {
+        if (link.roll(link.loss.connectFail)) return 0;
+        n = std::min(n, maxRecords);
+
+        // After the first missing PUBACK the rest of the window is
+        // already on the wire; the session then drops
+        size_t done = 0;
+        size_t end = n;
+        bool broken = false;
+        for (size_t i = 0; i < end; i++) {
+            size_t len = publishSize(samples[i]);
+            sent += len;
+            bool lost = link.roll(link.loss.requestLost);
+            if (!lost) {
+                server.requests++;
+                server.bytes += len;
+                server.accepted.push_back(samples[i]);
+            }
+            bool unacked = lost || link.roll(link.loss.responseLost);
+            if (unacked && !broken) {
+                broken = true;
+                end = std::min(n, i + window);
+            }
+            if (!broken) done++;
+        }
+        return done;
+    }
+
+    size_t batchLimit() const override { return maxRecords; }
+    void stop() override {}
+    const char* name() const override { return "fake-mqtt"; }
+
+    uint32_t bytesSent() const { return sent; }
+
+private:
+    // PUBLISH as MqttTransport::buildPublish() sizes it, for a reading
+    // without window stats: fixed header, topic, packet id, JSON body
+    static size_t publishSize(const Sample& sample) {
+        static const size_t TOPIC_LEN = sizeof("sensors/device-0001") - 1;
+        FixedPayload<160> json;
+        json.append("{\"ts\":").appendUInt(sample.timestamp);
+        json.append(",\"tv\":").appendUInt(sample.flags & SAMPLE_TIME_VALID ? 1 : 0);
+        for (uint8_t i = 0; i < SAMPLE_MAX_FIELDS; i++) {
+            if (!sampleHasField(sample, i)) continue;
+            json.append(",\"f").appendUInt(i + 1).append("\":");
+            json.appendFixed(sample.regs[i], sampleDecimals(sample, i));
+        }
+        json.append('}');
+        size_t remaining = 2 + TOPIC_LEN + 2 + json.length();
+        return 1 + (remaining < 128 ? 1 : 2) + remaining;
+    }
+
+    LossyLink& link;
+    FakeServer& server;
+    size_t window;
+    size_t maxRecords;
+    uint32_t sent = 0;
+};
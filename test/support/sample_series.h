@@ -0,0 +1,41 @@
+// ================================================================
+// SYNTHETIC READINGS
+// ================================================================
+// Reading series for the host suites: slowly drifting process values
+// on a steady interval, the shape a real site logs most of the time.
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sample.h"
+
+const uint32_t SERIES_START = 1760000000;   // Unix time of the first reading
+
+// `fields` fields (two decimals), one reading per `intervalS`, each value
+// stepping by at most `drift` raw counts from one reading to the next
+inline void makeSeries(Sample* out, size_t n, uint8_t fields, uint32_t intervalS,
+                       uint16_t drift, uint32_t seed) {
+    uint32_t rng = seed | 1;
+    uint16_t value[SAMPLE_MAX_FIELDS];
+    for (uint8_t f = 0; f < SAMPLE_MAX_FIELDS; f++) value[f] = 2000 + 500 * f;
+
+    for (size_t i = 0; i < n; i++) {
+        Sample& s = out[i];
+        memset(&s, 0, sizeof(s));
+        s.timestamp = SERIES_START + i * intervalS;
+        s.flags = SAMPLE_TIME_VALID;
+        for (uint8_t f = 0; f < fields && f < SAMPLE_MAX_FIELDS; f++) {
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            if (drift > 0) value[f] += (int)(rng % (2 * drift + 1)) - drift;
+            sampleSetField(s, f, value[f], 2);
+        }
+    }
+}
+
+inline bool sameSample(const Sample& a, const Sample& b) {
+    return memcmp(&a, &b, sizeof(Sample)) == 0;
+}
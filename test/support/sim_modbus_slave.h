@@ -0,0 +1,107 @@
+// ================================================================
+// SIMULATED MODBUS SLAVES
+// ================================================================
+// Host stand-in for ModbusRtu: a register map per slave and function
+// code, answered with the engine's status codes. readRegisters() has
+// the engine's signature, so the sampler's read loop (runPollReads()
+// in main.cpp) runs against it as it is.
+//
+// Every transaction is also costed on the wire, so poll plans can be
+// compared by bus time: RTU characters are 11 bits, each frame is
+// followed by the t3.5 gap, and a read that times out holds the bus
+// for the full response timeout, as it does on the device.
+
+#pragma once
+
+#include <stdint.h>
+#include <map>
+
+#include "modbus_types.h"
+
+const uint8_t SIM_ILLEGAL_ADDRESS = 0x02;   // Modbus exception
+
+class SimModbusSlaves {
+public:
+    explicit SimModbusSlaves(uint32_t baud = 9600, uint16_t timeoutMs = MODBUS_DEFAULT_TIMEOUT_MS)
+        : charUs(11000000.0 / baud),
+          gapUs(baud > 19200 ? 1750 : 3.5 * charUs),
+          timeoutUs((uint32_t)timeoutMs * 1000) {}
+
+    void setRegister(uint8_t slave, uint8_t fc, uint16_t addr, uint16_t value) {
+        regs[key(slave, fc, addr)] = value;
+    }
+
+    // A slave that is offline never answers (MODBUS_TIMEOUT)
+    void setOffline(uint8_t slave, bool offline) { down[slave] = offline; }
+
+    // The next `count` reads from `slave` complete with `status`
+    void failNext(uint8_t slave, uint8_t status, uint32_t count = 1) {
+        failStatus[slave] = status;
+        failCount[slave] = count;
+    }
+
+    // Registers the slave was not given read as an illegal address,
+    // as a real device answers
+    uint8_t readRegisters(uint8_t slave, uint8_t fc, uint16_t addr, uint16_t count, uint16_t* out) {
+        frames++;
+        wire(8);   // slave, fc, addr, count, crc
+
+        if (down[slave]) {
+            busUs += timeoutUs;
+            return MODBUS_TIMEOUT;
+        }
+        if (failCount[slave] > 0) {
+            failCount[slave]--;
+            uint8_t status = failStatus[slave];
+            if (status == MODBUS_TIMEOUT) busUs += timeoutUs;
+            else wire(5);
+            return status;
+        }
+        if ((fc != 3 && fc != 4) || count == 0 || count > MODBUS_MAX_REGS) {
+            wire(5);
+            return SIM_ILLEGAL_ADDRESS;
+        }
+        for (uint16_t i = 0; i < count; i++) {
+            auto it = regs.find(key(slave, fc, addr + i));
+            if (it == regs.end()) {
+                wire(5);
+                return SIM_ILLEGAL_ADDRESS;
+            }
+            out[i] = it->second;
+        }
+        wire(5 + 2 * count);
+        registersRead += count;
+        return MODBUS_OK;
+    }
+
+    void resetCounters() {
+        frames = 0;
+        registersRead = 0;
+        wireBytes = 0;
+        busUs = 0;
+    }
+
+    uint32_t frames = 0;
+    uint32_t registersRead = 0;
+    uint32_t wireBytes = 0;
+    double busUs = 0;
+
+private:
+    static uint32_t key(uint8_t slave, uint8_t fc, uint16_t addr) {
+        return ((uint32_t)slave << 24) | ((uint32_t)fc << 16) | addr;
+    }
+
+    void wire(uint32_t bytes) {
+        wireBytes += bytes;
+        busUs += bytes * charUs + gapUs;
+    }
+
+    double charUs;
+    double gapUs;
+    uint32_t timeoutUs;
+
+    std::map<uint32_t, uint16_t> regs;
+    bool down[248] = {};
+    uint8_t failStatus[248] = {};
+    uint32_t failCount[248] = {};
+};
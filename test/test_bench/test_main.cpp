@@ -0,0 +1,267 @@
+// ================================================================
+// DATA PATH BENCHMARKS
+// ================================================================
+// Host CPU time, heap allocations and wire bytes per reading for the
+// sampler -> ring -> uplink path: poll planning against simulated
+// slaves, the ring, CSV formatting and the x-sample-delta codec.
+// Results are printed; the checks catch regressions:
+//
+//   allocations  none on any path (the firmware never touches the heap
+//                per reading); counted on glibc hosts only
+//   bytes        codec and CSV bytes per record against fixed
+//                ceilings, which are deterministic for the series here
+//   CPU time     only checked when built with -D BENCH_MAX_NS=<ns>,
+//                since host speed varies; the ceiling applies to
+//                every path per reading
+//
+// Host timings are for comparing builds, not a prediction of the
+// ESP32-S3's.
+
+#include <unity.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+
+#include "modbus_poll.h"
+#include "payload_builder.h"
+#include "sample_codec.h"
+#include "sample_ring.h"
+#include "../support/sample_series.h"
+#include "../support/sim_modbus_slave.h"
+
+#ifndef BENCH_MAX_NS
+#define BENCH_MAX_NS 0
+#endif
+
+static const size_t BENCH_READINGS = 50000;
+static const double CODEC_MAX_BYTES = 5.5;   // 3 fields, steady interval, small drift
+static const double CSV_MAX_BYTES = 30.0;
+
+// ================================================================
+// ALLOCATION COUNTING
+// ================================================================
+
+static volatile size_t allocations = 0;
+
+#if defined(__GLIBC__)
+#define BENCH_COUNTS_MALLOC 1
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+
+extern "C" void* malloc(size_t n) { allocations++; return __libc_malloc(n); }
+extern "C" void* calloc(size_t n, size_t m) { allocations++; return __libc_calloc(n, m); }
+extern "C" void* realloc(void* p, size_t n) { allocations++; return __libc_realloc(p, n); }
+#else
+#define BENCH_COUNTS_MALLOC 0
+#endif
+
+void* operator new(size_t n) {
+#if !BENCH_COUNTS_MALLOC
+    allocations++;
+#endif
+    void* p = malloc(n);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+// ================================================================
+// HARNESS
+// ================================================================
+
+struct BenchResult {
+    double nsPerReading;
+    size_t allocations;
+};
+
+class BenchTimer {
+public:
+    BenchTimer() : allocsAtStart(allocations), start(std::chrono::steady_clock::now()) {}
+
+    BenchResult stop(size_t readings) const {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        return { (double)ns / readings, allocations - allocsAtStart };
+    }
+
+private:
+    size_t allocsAtStart;
+    std::chrono::steady_clock::time_point start;
+};
+
+static void report(const char* name, const BenchResult& r, double bytes) {
+    char line[160];
+    if (bytes > 0) {
+        snprintf(line, sizeof(line), "%-14s %8.1f ns/reading  %6.2f B/record  %u allocs",
+                 name, r.nsPerReading, bytes, (unsigned)r.allocations);
+    } else {
+        snprintf(line, sizeof(line), "%-14s %8.1f ns/reading  %u allocs",
+                 name, r.nsPerReading, (unsigned)r.allocations);
+    }
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_EQUAL_MESSAGE(0, r.allocations, "heap allocation on the reading path");
+    if (BENCH_MAX_NS > 0) TEST_ASSERT_TRUE_MESSAGE(r.nsPerReading <= BENCH_MAX_NS, name);
+}
+
+static Sample* series;
+static volatile uint32_t sink;   // Keeps results live
+
+void setUp() {}
+void tearDown() {}
+
+// ================================================================
+// BENCHMARKS
+// ================================================================
+
+static void bench_poll_cycle() {
+    if (!BENCH_COUNTS_MALLOC) TEST_MESSAGE("malloc is not counted on this host, only operator new");
+
+    static const PollEntry table[] = {
+        { 1, 3, 0, 2, 0, 1, 0, 200, 1 },
+        { 1, 3, 4, 1, 2, 2, 0, 200, 1 },
+        { 2, 4, 10, 3, 3, 0, 0, 200, 1 },
+    };
+    ModbusPollTable poll;
+    poll.setEntries(table, 3);
+    SimModbusSlaves slaves;
+    for (uint16_t r = 0; r < 8; r++) slaves.setRegister(1, 3, r, 100 + r);
+    for (uint16_t r = 10; r < 13; r++) slaves.setRegister(2, 4, r, 200 + r);
+
+    BenchTimer t;
+    for (size_t i = 0; i < BENCH_READINGS; i++) {
+        PollRead reads[POLL_MAX_ENTRIES];
+        size_t n = poll.plan(i * 1000, true, reads, POLL_MAX_ENTRIES);
+        for (size_t k = 0; k < n; k++) {
+            uint16_t regs[POLL_MAX_READ];
+            uint8_t status = slaves.readRegisters(reads[k].slave, reads[k].fc, reads[k].start, reads[k].count, regs);
+            poll.complete(reads[k], regs, status == MODBUS_OK);
+        }
+        Sample s = {};
+        poll.snapshot(s);
+        sink += s.regs[0];
+    }
+    BenchResult r = t.stop(BENCH_READINGS);
+    report("poll cycle", r, 0);
+
+    char line[120];
+    snprintf(line, sizeof(line), "%-14s %8.2f frames  %6.1f ms bus at 9600 baud, per reading", "",
+             (double)slaves.frames / BENCH_READINGS, slaves.busUs / 1000 / BENCH_READINGS);
+    TEST_MESSAGE(line);
+}
+
+static void bench_ring() {
+    SpscRing<Sample> ring;
+    TEST_ASSERT_TRUE(ring.begin(1024, 1024));
+    Sample batch[64];
+
+    BenchTimer t;
+    for (size_t i = 0; i < BENCH_READINGS; i++) {
+        ring.push(series[i]);
+        if (ring.size() == 64) {
+            size_t n = ring.peek(batch, 64);
+            ring.pop(n);
+            sink += batch[n - 1].timestamp;
+        }
+    }
+    report("ring", t.stop(BENCH_READINGS), 0);
+}
+
+// One line per reading as formatCsvLine() writes it (timestamp as
+// digits here; the date formatting there is libc's strftime)
+static void bench_csv() {
+    static char body[8192 + 1];
+    PayloadBuilder out(body, sizeof(body));
+    size_t bytes = 0;
+
+    auto line = [&out](const Sample& s) {
+        out.appendUInt(s.timestamp);
+        for (uint8_t f = 0; f < SAMPLE_MAX_FIELDS; f++) {
+            if (!sampleHasField(s, f)) break;
+            out.append(',').appendFixed(s.regs[f], sampleDecimals(s, f), 2);
+        }
+        out.append('\n');
+    };
+
+    // Full bodies go out as batches and the next one starts empty
+    BenchTimer t;
+    for (size_t i = 0; i < BENCH_READINGS; i++) {
+        size_t before = out.length();
+        line(series[i]);
+        if (out.overflowed()) {
+            out.truncate(before);
+            bytes += out.length();
+            out.clear();
+            line(series[i]);
+        }
+    }
+    bytes += out.length();
+    report("csv format", t.stop(BENCH_READINGS), (double)bytes / BENCH_READINGS);
+    TEST_ASSERT_TRUE_MESSAGE((double)bytes / BENCH_READINGS <= CSV_MAX_BYTES, "CSV bytes per record");
+}
+
+static void bench_codec() {
+    static uint8_t body[8192];
+    size_t blocks = BENCH_READINGS / SAMPLE_BLOCK_MAX + 1;
+    size_t bytes = 0;
+    uint8_t* encoded = (uint8_t*)malloc(blocks * 512);
+    size_t* offsets = (size_t*)malloc(blocks * sizeof(size_t));
+    size_t nBlocks = 0;
+
+    BenchTimer enc;
+    for (size_t done = 0; done < BENCH_READINGS; ) {
+        size_t taken;
+        size_t len = encodeSampleBlock(series + done, BENCH_READINGS - done, done, body, sizeof(body), taken);
+        TEST_ASSERT_GREATER_THAN(0, len);
+        TEST_ASSERT_LESS_OR_EQUAL(512, len);
+        memcpy(encoded + bytes, body, len);
+        offsets[nBlocks++] = bytes;
+        bytes += len;
+        done += taken;
+    }
+    report("codec encode", enc.stop(BENCH_READINGS), (double)bytes / BENCH_READINGS);
+
+    Sample decoded[SAMPLE_BLOCK_MAX];
+    size_t rows = 0;
+    BenchTimer dec;
+    for (size_t b = 0; b < nBlocks; b++) {
+        SampleBlockHeader hdr;
+        memcpy(&hdr, encoded + offsets[b], sizeof(hdr));
+        const uint8_t* payload = encoded + offsets[b] + sizeof(hdr);
+        TEST_ASSERT_TRUE(checkSampleBlock(hdr, payload, hdr.length));
+        TEST_ASSERT_TRUE(decodeSampleBlock(hdr, payload, decoded));
+        rows += hdr.count;
+        sink += decoded[0].regs[0];
+    }
+    report("codec decode", dec.stop(BENCH_READINGS), 0);
+
+    free(offsets);
+    free(encoded);
+    TEST_ASSERT_EQUAL(BENCH_READINGS, rows);
+    TEST_ASSERT_TRUE_MESSAGE((double)bytes / BENCH_READINGS <= CODEC_MAX_BYTES, "codec bytes per record");
+
+    char line[120];
+    snprintf(line, sizeof(line), "%-14s %6.2f B/record as stored (sizeof(Sample))", "", (double)sizeof(Sample));
+    TEST_MESSAGE(line);
+}
+
+int main() {
+    series = (Sample*)malloc(BENCH_READINGS * sizeof(Sample));
+    makeSeries(series, BENCH_READINGS, 3, 60, 3, 21);
+
+    UNITY_BEGIN();
+    RUN_TEST(bench_poll_cycle);
+    RUN_TEST(bench_ring);
+    RUN_TEST(bench_csv);
+    RUN_TEST(bench_codec);
+    int failures = UNITY_END();
+    free(series);
+    return failures;
+}
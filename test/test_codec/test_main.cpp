@@ -0,0 +1,183 @@
+// ================================================================
+// SAMPLE BLOCK CODEC
+// ================================================================
+
+#include <unity.h>
+
+#include "sample_codec.h"
+#include "../support/sample_series.h"
+
+static uint8_t block[8192];
+
+void setUp() {}
+void tearDown() {}
+
+static void checkRoundTrip(const Sample* samples, size_t n) {
+    size_t taken;
+    size_t len = encodeSampleBlock(samples, n, 0, block, sizeof(block), taken);
+    TEST_ASSERT_GREATER_THAN(0, len);
+    TEST_ASSERT_EQUAL(n, taken);
+
+    SampleBlockHeader hdr;
+    memcpy(&hdr, block, sizeof(hdr));
+    TEST_ASSERT_EQUAL(len - sizeof(hdr), hdr.length);
+    TEST_ASSERT_TRUE(checkSampleBlock(hdr, block + sizeof(hdr), sizeof(block)));
+
+    Sample decoded[SAMPLE_BLOCK_MAX];
+    TEST_ASSERT_TRUE(decodeSampleBlock(hdr, block + sizeof(hdr), decoded));
+    for (size_t i = 0; i < n; i++) TEST_ASSERT_TRUE(sameSample(samples[i], decoded[i]));
+}
+
+static void test_crc32_check_value() {
+    TEST_ASSERT_EQUAL_UINT32(0xCBF43926, blockCrc32("123456789", 9));
+    TEST_ASSERT_EQUAL_UINT32(blockCrc32("123456789", 9), blockCrc32("6789", 4, blockCrc32("12345", 5)));
+}
+
+static void test_round_trip_steady_series() {
+    Sample samples[SAMPLE_BLOCK_MAX];
+    makeSeries(samples, SAMPLE_BLOCK_MAX, 3, 60, 4, 1);
+    checkRoundTrip(samples, SAMPLE_BLOCK_MAX);
+}
+
+static void test_round_trip_mixed_records() {
+    Sample samples[6];
+    makeSeries(samples, 6, 2, 60, 50, 2);
+
+    // Field set and decimals change mid-block
+    sampleSetField(samples[1], 4, 65535, 3);
+    samples[2].fieldMask = 0x01;
+    samples[2].regs[1] = 0;
+
+    // Aggregate window
+    SampleWindow& w = samples[3].window;
+    w.count = 15;
+    w.seconds = 900;
+    w.min[0] = samples[3].regs[0] - 40;
+    w.max[0] = samples[3].regs[0] + 300;
+    w.mean[0] = samples[3].regs[0] + 7;
+    w.transitions[1] = 4;
+    w.min[1] = 0;
+    w.max[1] = 1;
+    w.mean[1] = 0;
+
+    // Off-grid alarm event, ahead of the last slot
+    samples[4].flags = SAMPLE_TIME_VALID | SAMPLE_ALARM_EVENT;
+    samples[4].timestamp = samples[3].timestamp - 17;
+    samples[4].ms = 999;
+
+    // Still on the uptime clock
+    samples[5].flags = SAMPLE_TIME_UPTIME;
+    samples[5].timestamp = 42;
+
+    checkRoundTrip(samples, 6);
+}
+
+static void test_steady_interval_costs_a_byte_per_value() {
+    const size_t n = 40;
+    const uint8_t fields = 3;
+    Sample samples[n];
+    makeSeries(samples, n, fields, 15, 0, 3);
+
+    size_t taken;
+    size_t first = encodeSampleBlock(samples, 1, 0, block, sizeof(block), taken);
+    size_t all = encodeSampleBlock(samples, n, 0, block, sizeof(block), taken);
+    TEST_ASSERT_EQUAL(n, taken);
+
+    // Tag, timestamp delta-of-delta, one byte per unchanged field
+    TEST_ASSERT_EQUAL((n - 1) * (2 + fields), all - first);
+}
+
+static void test_splits_at_block_max() {
+    const size_t n = 150;
+    Sample samples[n];
+    makeSeries(samples, n, 2, 60, 3, 4);
+
+    size_t pos = 0;
+    size_t done = 0;
+    size_t blocks = 0;
+    while (done < n) {
+        size_t taken;
+        size_t len = encodeSampleBlock(samples + done, n - done, done, block + pos, sizeof(block) - pos, taken);
+        TEST_ASSERT_GREATER_THAN(0, len);
+        TEST_ASSERT_LESS_OR_EQUAL(SAMPLE_BLOCK_MAX, taken);
+
+        SampleBlockHeader hdr;
+        memcpy(&hdr, block + pos, sizeof(hdr));
+        TEST_ASSERT_EQUAL_UINT32(done, hdr.first);
+
+        // Each block decodes on its own
+        Sample decoded[SAMPLE_BLOCK_MAX];
+        TEST_ASSERT_TRUE(checkSampleBlock(hdr, block + pos + sizeof(hdr), sizeof(block)));
+        TEST_ASSERT_TRUE(decodeSampleBlock(hdr, block + pos + sizeof(hdr), decoded));
+        for (size_t i = 0; i < taken; i++) TEST_ASSERT_TRUE(sameSample(samples[done + i], decoded[i]));
+
+        pos += len;
+        done += taken;
+        blocks++;
+    }
+    TEST_ASSERT_EQUAL(3, blocks);
+}
+
+static void test_stops_at_capacity() {
+    Sample samples[SAMPLE_BLOCK_MAX];
+    makeSeries(samples, SAMPLE_BLOCK_MAX, 6, 60, 1000, 5);
+
+    size_t taken;
+    size_t cap = sizeof(SampleBlockHeader) + 100;
+    size_t len = encodeSampleBlock(samples, SAMPLE_BLOCK_MAX, 0, block, cap, taken);
+    TEST_ASSERT_GREATER_THAN(0, taken);
+    TEST_ASSERT_LESS_OR_EQUAL(cap, len);
+    TEST_ASSERT_TRUE(taken < SAMPLE_BLOCK_MAX);
+    checkRoundTrip(samples, taken);
+
+    TEST_ASSERT_EQUAL(0, encodeSampleBlock(samples, 1, 0, block, sizeof(SampleBlockHeader) + 2, taken));
+    TEST_ASSERT_EQUAL(0, taken);
+    TEST_ASSERT_EQUAL(0, encodeSampleBlock(samples, 1, 0, block, sizeof(SampleBlockHeader) - 1, taken));
+}
+
+static void test_rejects_damaged_blocks() {
+    Sample samples[10];
+    makeSeries(samples, 10, 2, 60, 3, 6);
+    size_t taken;
+    size_t len = encodeSampleBlock(samples, 10, 0, block, sizeof(block), taken);
+
+    SampleBlockHeader hdr;
+    memcpy(&hdr, block, sizeof(hdr));
+    uint8_t* payload = block + sizeof(hdr);
+
+    payload[3] ^= 0x01;
+    TEST_ASSERT_FALSE(checkSampleBlock(hdr, payload, sizeof(block)));
+    payload[3] ^= 0x01;
+    TEST_ASSERT_TRUE(checkSampleBlock(hdr, payload, sizeof(block)));
+
+    // Length past what the caller has
+    TEST_ASSERT_FALSE(checkSampleBlock(hdr, payload, len - sizeof(hdr) - 1));
+
+    SampleBlockHeader bad = hdr;
+    bad.magic ^= 1;
+    TEST_ASSERT_FALSE(checkSampleBlock(bad, nullptr, sizeof(block)));
+    bad = hdr;
+    bad.version++;
+    TEST_ASSERT_FALSE(checkSampleBlock(bad, nullptr, sizeof(block)));
+
+    // Truncated payload, or one with bytes left over
+    Sample decoded[SAMPLE_BLOCK_MAX];
+    bad = hdr;
+    bad.length--;
+    TEST_ASSERT_FALSE(decodeSampleBlock(bad, payload, decoded));
+    bad = hdr;
+    bad.count--;
+    TEST_ASSERT_FALSE(decodeSampleBlock(bad, payload, decoded));
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_crc32_check_value);
+    RUN_TEST(test_round_trip_steady_series);
+    RUN_TEST(test_round_trip_mixed_records);
+    RUN_TEST(test_steady_interval_costs_a_byte_per_value);
+    RUN_TEST(test_splits_at_block_max);
+    RUN_TEST(test_stops_at_capacity);
+    RUN_TEST(test_rejects_damaged_blocks);
+    return UNITY_END();
+}
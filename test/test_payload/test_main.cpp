@@ -0,0 +1,99 @@
+// ================================================================
+// PAYLOAD BUILDER
+// ================================================================
+
+#include <unity.h>
+
+#include <math.h>
+#include <stdint.h>
+
+#include "payload_builder.h"
+
+void setUp() {}
+void tearDown() {}
+
+static void test_fixed_point() {
+    FixedPayload<64> p;
+    p.appendFixed(2150, 2).append(' ');
+    p.appendFixed(-5, 1).append(' ');
+    p.appendFixed(7, 0, 2).append(' ');
+    p.appendFixed(1234, 1, 2).append(' ');
+    p.appendFixed(0, 3).append(' ');
+    p.appendFixed(INT32_MIN, 0).append(' ');
+    p.appendFixed(65535, 9);   // Capped at 6 places
+    TEST_ASSERT_EQUAL_STRING("21.50 -0.5 7.00 123.40 0.000 -2147483648 0.065535", p.c_str());
+    TEST_ASSERT_FALSE(p.overflowed());
+}
+
+static void test_integers() {
+    FixedPayload<64> p;
+    p.appendUInt(0).append(',').appendUInt(UINT32_MAX).append(',');
+    p.appendInt(-42).append(',').appendInt(INT32_MIN);
+    TEST_ASSERT_EQUAL_STRING("0,4294967295,-42,-2147483648", p.c_str());
+}
+
+static void test_float_rounding() {
+    FixedPayload<64> p;
+    p.appendFloat(3.14159f, 2).append(' ');
+    p.appendFloat(-0.004f, 2).append(' ');
+    p.appendFloat(2.5f, 0).append(' ');
+    p.appendFloat(NAN, 2).append(' ');
+    p.appendFloat(-1.25f, 1);
+    TEST_ASSERT_EQUAL_STRING("3.14 0.00 3 0 -1.3", p.c_str());
+}
+
+static void test_percent_encoding() {
+    FixedPayload<64> p;
+    p.appendEncoded("a b&c=\xC3\xBC~_.-");
+    TEST_ASSERT_EQUAL_STRING("a%20b%26c%3D%C3%BC~_.-", p.c_str());
+}
+
+static void test_json_string() {
+    FixedPayload<64> p;
+    p.appendJsonString("q\"\\\n\x01");
+    TEST_ASSERT_EQUAL_STRING("\"q\\\"\\\\\\u000a\\u0001\"", p.c_str());
+}
+
+static void test_overflow_cuts_short() {
+    FixedPayload<8> p;
+    TEST_ASSERT_EQUAL(7, p.capacity());
+    p.append("1234567890");
+    TEST_ASSERT_TRUE(p.overflowed());
+    TEST_ASSERT_EQUAL(7, p.length());
+    TEST_ASSERT_EQUAL_STRING("1234567", p.c_str());
+
+    p.truncate(3);
+    TEST_ASSERT_FALSE(p.overflowed());
+    TEST_ASSERT_EQUAL_STRING("123", p.c_str());
+
+    // Escapes are cut short like any other append
+    p.appendEncoded("ab ");
+    TEST_ASSERT_TRUE(p.overflowed());
+    TEST_ASSERT_EQUAL_STRING("123ab%2", p.c_str());
+
+    p.clear();
+    TEST_ASSERT_EQUAL(0, p.length());
+    TEST_ASSERT_FALSE(p.overflowed());
+    TEST_ASSERT_EQUAL_STRING("", p.c_str());
+}
+
+static void test_caller_buffer() {
+    char buf[16];
+    PayloadBuilder p(buf, sizeof(buf));
+    p.append("f1=").appendFixed(-1999, 1);
+    TEST_ASSERT_EQUAL_STRING("f1=-199.9", buf);
+    TEST_ASSERT_EQUAL(9, p.length());
+    TEST_ASSERT_EQUAL_MEMORY(buf, p.bytes(), p.length());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_fixed_point);
+    RUN_TEST(test_integers);
+    RUN_TEST(test_float_rounding);
+    RUN_TEST(test_percent_encoding);
+    RUN_TEST(test_json_string);
+    RUN_TEST(test_overflow_cuts_short);
+    RUN_TEST(test_caller_buffer);
+    return UNITY_END();
+}
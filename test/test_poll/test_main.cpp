@@ -0,0 +1,222 @@
+// ================================================================
+// MODBUS POLL TABLE
+// ================================================================
+// Plans run against simulated slaves through the same read loop as
+// the sampler's runPollReads().
+
+#include <unity.h>
+
+#include "modbus_poll.h"
+#include "../support/sim_modbus_slave.h"
+
+//                        s  fc  start n  field dp period   timeout retries
+static const PollEntry TABLE[] = {
+    { 1, 3, 0,  1, 0, 1, 0,     200, 1 },   // f1
+    { 1, 3, 1,  1, 1, 2, 0,     200, 1 },   // f2, next register: merged
+    { 1, 3, 20, 2, 2, 0, 0,     200, 1 },   // f3-f4, not contiguous: own read
+    { 2, 4, 100, 1, 4, 1, 10000, 200, 1 },  // f5, every 10 s
+};
+static const uint8_t TABLE_SIZE = sizeof(TABLE) / sizeof(TABLE[0]);
+
+static ModbusPollTable table;
+static SimModbusSlaves slaves;
+
+void setUp() {
+    table.setEntries(TABLE, TABLE_SIZE);
+    slaves = SimModbusSlaves();
+    for (uint16_t r = 0; r < 32; r++) slaves.setRegister(1, 3, r, 1000 + r);
+    slaves.setRegister(2, 4, 100, 555);
+}
+
+void tearDown() {}
+
+static void runReads(const PollRead* reads, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        const PollRead& r = reads[i];
+        uint16_t regs[POLL_MAX_READ];
+        uint8_t result = slaves.readRegisters(r.slave, r.fc, r.start, r.count, regs);
+        table.complete(r, regs, result == MODBUS_OK);
+    }
+}
+
+static size_t poll(uint32_t nowMs, bool tick) {
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.plan(nowMs, tick, reads, POLL_MAX_ENTRIES);
+    runReads(reads, n);
+    return n;
+}
+
+static void test_set_entries() {
+    TEST_ASSERT_EQUAL(TABLE_SIZE, table.size());
+    TEST_ASSERT_EQUAL(20, table.entry(2).start);
+    TEST_ASSERT_FALSE(table.setEntries(TABLE, 0));
+    TEST_ASSERT_FALSE(table.setEntries(TABLE, POLL_MAX_ENTRIES + 1));
+    TEST_ASSERT_EQUAL(TABLE_SIZE, table.size());
+
+    table.setDefault();
+    TEST_ASSERT_EQUAL(1, table.size());
+    TEST_ASSERT_EQUAL(1, table.entry(0).slave);
+}
+
+static void test_plan_coalesces_neighbours() {
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.plan(0, true, reads, POLL_MAX_ENTRIES);
+    TEST_ASSERT_EQUAL(3, n);
+
+    TEST_ASSERT_EQUAL(1, reads[0].slave);
+    TEST_ASSERT_EQUAL(0, reads[0].start);
+    TEST_ASSERT_EQUAL(2, reads[0].count);
+    TEST_ASSERT_EQUAL(20, reads[1].start);
+    TEST_ASSERT_EQUAL(2, reads[1].count);
+    TEST_ASSERT_EQUAL(2, reads[2].slave);
+    TEST_ASSERT_EQUAL(4, reads[2].fc);
+}
+
+static void test_only_contiguous_ranges_merge() {
+    PollEntry pair[] = { TABLE[0], TABLE[0] };
+    pair[1].field = 1;
+    PollRead reads[POLL_MAX_ENTRIES];
+
+    // Overlapping
+    pair[0].count = 2;
+    table.setEntries(pair, 2);
+    TEST_ASSERT_EQUAL(1, table.plan(0, true, reads, POLL_MAX_ENTRIES));
+    TEST_ASSERT_EQUAL(2, reads[0].count);
+
+    // One register between them: two reads
+    pair[0].count = 1;
+    pair[1].start = 2;
+    table.setEntries(pair, 2);
+    TEST_ASSERT_EQUAL(2, table.plan(0, true, reads, POLL_MAX_ENTRIES));
+
+    // Other function code, same registers: never merged
+    pair[1].start = 0;
+    pair[1].fc = 4;
+    table.setEntries(pair, 2);
+    TEST_ASSERT_EQUAL(2, table.plan(0, true, reads, POLL_MAX_ENTRIES));
+}
+
+static void test_values_land_in_fields() {
+    TEST_ASSERT_EQUAL(3, poll(0, true));
+
+    Sample s = {};
+    TEST_ASSERT_TRUE(table.snapshot(s));
+    TEST_ASSERT_EQUAL_UINT8(0x1F, s.fieldMask);
+    TEST_ASSERT_EQUAL(1000, s.regs[0]);
+    TEST_ASSERT_EQUAL(1001, s.regs[1]);
+    TEST_ASSERT_EQUAL(1020, s.regs[2]);
+    TEST_ASSERT_EQUAL(1021, s.regs[3]);
+    TEST_ASSERT_EQUAL(555, s.regs[4]);
+    TEST_ASSERT_EQUAL(1, sampleDecimals(s, 0));
+    TEST_ASSERT_EQUAL(2, sampleDecimals(s, 1));
+    TEST_ASSERT_EQUAL(1, sampleDecimals(s, 4));
+}
+
+static void test_periods() {
+    TEST_ASSERT_EQUAL(3, poll(0, true));
+    TEST_ASSERT_EQUAL(2, poll(1000, true));    // Slave 2 not due for 10 s
+    TEST_ASSERT_EQUAL(0, poll(2000, false));   // Period 0 waits for the sample tick
+    TEST_ASSERT_EQUAL(1, poll(10000, false));
+    TEST_ASSERT_EQUAL(2, poll(11000, true));
+
+    // Not due, but still holding its last value
+    Sample s = {};
+    table.snapshot(s);
+    TEST_ASSERT_TRUE(sampleHasField(s, 4));
+}
+
+static void test_failed_reads_clear_fields() {
+    poll(0, true);
+
+    slaves.setOffline(2, true);
+    slaves.setRegister(1, 3, 20, 7);
+    slaves.failNext(1, MODBUS_BAD_CRC);   // First read of the pass, f1-f2
+    poll(10000, true);
+
+    Sample s = {};
+    TEST_ASSERT_TRUE(table.snapshot(s));
+    TEST_ASSERT_EQUAL_UINT8(0x0C, s.fieldMask);
+    TEST_ASSERT_EQUAL(7, s.regs[2]);
+    TEST_ASSERT_EQUAL(0, s.regs[0]);
+
+    // A register the slave does not have: exception, field left empty
+    PollEntry missing = TABLE[0];
+    missing.start = 40;
+    table.setEntries(&missing, 1);
+    poll(0, true);
+    TEST_ASSERT_FALSE(table.snapshot(s));
+}
+
+// A hole in the slave's register map between two entries: each side
+// is read on its own, and the entry on the hole loses only its field
+static void test_hole_is_not_read_across() {
+    static const PollEntry holed[] = {
+        { 1, 3, 0, 2, 0, 0, 0, 200, 1 },
+        { 1, 3, 3, 1, 2, 0, 0, 200, 1 },   // Register the slave does not have
+        { 1, 3, 5, 2, 3, 0, 0, 200, 1 },
+    };
+    table.setEntries(holed, 3);
+    slaves = SimModbusSlaves();
+    for (uint16_t r = 0; r < 2; r++) slaves.setRegister(1, 3, r, 10 + r);
+    for (uint16_t r = 5; r < 7; r++) slaves.setRegister(1, 3, r, 50 + r);
+
+    TEST_ASSERT_EQUAL(3, poll(0, true));
+    TEST_ASSERT_EQUAL(3, slaves.frames);
+
+    Sample s = {};
+    TEST_ASSERT_TRUE(table.snapshot(s));
+    TEST_ASSERT_EQUAL_UINT8(0x1B, s.fieldMask);
+    TEST_ASSERT_EQUAL(10, s.regs[0]);
+    TEST_ASSERT_EQUAL(11, s.regs[1]);
+    TEST_ASSERT_EQUAL(55, s.regs[3]);
+    TEST_ASSERT_EQUAL(56, s.regs[4]);
+}
+
+static void test_plan_fields() {
+    PollRead reads[POLL_MAX_ENTRIES];
+    size_t n = table.planFields(1 << 4, reads, POLL_MAX_ENTRIES);
+    TEST_ASSERT_EQUAL(1, n);
+    TEST_ASSERT_EQUAL(2, reads[0].slave);
+
+    // Covers f2 and f4, from two reads on slave 1
+    n = table.planFields((1 << 1) | (1 << 3), reads, POLL_MAX_ENTRIES);
+    TEST_ASSERT_EQUAL(2, n);
+
+    // Due times stay as they were
+    TEST_ASSERT_EQUAL(3, poll(0, true));
+}
+
+static void test_max_reads() {
+    PollRead reads[POLL_MAX_ENTRIES];
+    TEST_ASSERT_EQUAL(2, table.plan(0, true, reads, 2));
+}
+
+// Merging saves frames, and bus time with them
+static void test_coalescing_saves_bus_time() {
+    poll(0, true);
+    double merged = slaves.busUs;
+
+    slaves.resetCounters();
+    for (uint8_t i = 0; i < TABLE_SIZE; i++) {
+        const PollEntry& e = TABLE[i];
+        PollRead single = { e.slave, e.fc, e.start, e.count };
+        runReads(&single, 1);
+    }
+    TEST_ASSERT_EQUAL(TABLE_SIZE, slaves.frames);
+    TEST_ASSERT_TRUE(merged < slaves.busUs);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_set_entries);
+    RUN_TEST(test_plan_coalesces_neighbours);
+    RUN_TEST(test_only_contiguous_ranges_merge);
+    RUN_TEST(test_values_land_in_fields);
+    RUN_TEST(test_periods);
+    RUN_TEST(test_failed_reads_clear_fields);
+    RUN_TEST(test_hole_is_not_read_across);
+    RUN_TEST(test_plan_fields);
+    RUN_TEST(test_max_reads);
+    RUN_TEST(test_coalescing_saves_bus_time);
+    return UNITY_END();
+}
@@ -0,0 +1,131 @@
+// ================================================================
+// SPSC SAMPLE RING
+// ================================================================
+
+#include <unity.h>
+
+#include <thread>
+
+#include "sample_ring.h"
+#include "../support/sample_series.h"
+
+void setUp() {}
+void tearDown() {}
+
+static void test_fills_and_counts_overruns() {
+    SpscRing<uint32_t> ring;
+    TEST_ASSERT_TRUE(ring.begin(8, 4));
+    TEST_ASSERT_EQUAL(8, ring.capacity());
+    TEST_ASSERT_FALSE(ring.inPsram());
+
+    for (uint32_t i = 0; i < 8; i++) TEST_ASSERT_TRUE(ring.push(i));
+    TEST_ASSERT_FALSE(ring.push(8));
+    TEST_ASSERT_FALSE(ring.push(9));
+    TEST_ASSERT_EQUAL(8, ring.size());
+    TEST_ASSERT_EQUAL(2, ring.overrunCount());
+}
+
+// Before begin() (or after it failed) there is nowhere to write
+static void test_unallocated_ring_refuses_records() {
+    SpscRing<uint32_t> ring;
+    uint32_t out[4];
+    TEST_ASSERT_FALSE(ring.push(1));
+    TEST_ASSERT_EQUAL(1, ring.overrunCount());
+    TEST_ASSERT_EQUAL(0, ring.peek(out, 4));
+    TEST_ASSERT_EQUAL(0, ring.size());
+    TEST_ASSERT_EQUAL(0, ring.capacity());
+    TEST_ASSERT_FALSE(ring.ready());
+}
+
+static void test_peek_leaves_records_until_pop() {
+    SpscRing<uint32_t> ring;
+    ring.begin(8, 8);
+    for (uint32_t i = 0; i < 6; i++) ring.push(i);
+
+    uint32_t out[8];
+    TEST_ASSERT_EQUAL(3, ring.peek(out, 3));
+    TEST_ASSERT_EQUAL(0, out[0]);
+    TEST_ASSERT_EQUAL(2, out[2]);
+    TEST_ASSERT_EQUAL(6, ring.size());
+
+    // A failed upload pops nothing and sends the same records again
+    ring.pop(0);
+    TEST_ASSERT_EQUAL(3, ring.peek(out, 3));
+    TEST_ASSERT_EQUAL(0, out[0]);
+
+    ring.pop(2);
+    TEST_ASSERT_EQUAL(4, ring.size());
+    TEST_ASSERT_EQUAL(4, ring.peek(out, 8));
+    TEST_ASSERT_EQUAL(2, out[0]);
+    TEST_ASSERT_EQUAL(5, out[3]);
+
+    ring.pop(100);   // Clamped to what is there
+    TEST_ASSERT_EQUAL(0, ring.size());
+    TEST_ASSERT_EQUAL(0, ring.peek(out, 8));
+}
+
+static void test_wraps_around() {
+    SpscRing<Sample> ring;
+    ring.begin(4, 4);
+    Sample series[11];
+    makeSeries(series, 11, 2, 60, 5, 7);
+
+    Sample out[4];
+    size_t next = 0;
+    for (size_t i = 0; i < 11; i++) {
+        TEST_ASSERT_TRUE(ring.push(series[i]));
+        if (ring.size() == 3) {
+            size_t n = ring.peek(out, 4);
+            for (size_t k = 0; k < n; k++) TEST_ASSERT_TRUE(sameSample(series[next + k], out[k]));
+            ring.pop(n);
+            next += n;
+        }
+    }
+    size_t n = ring.peek(out, 4);
+    TEST_ASSERT_EQUAL(11 - next, n);
+    for (size_t k = 0; k < n; k++) TEST_ASSERT_TRUE(sameSample(series[next + k], out[k]));
+}
+
+// The producer and consumer on their own threads, as the sampler and
+// uplink tasks are: nothing lost, duplicated or reordered
+static void test_concurrent_producer_consumer() {
+    const uint32_t COUNT = 200000;
+    SpscRing<uint32_t> ring;
+    ring.begin(64, 64);
+
+    std::thread producer([&ring] {
+        for (uint32_t i = 0; i < COUNT; ) {
+            if (ring.push(i)) i++;
+            else std::this_thread::yield();
+        }
+    });
+
+    uint32_t expect = 0;
+    bool inOrder = true;
+    uint32_t batch[16];
+    while (expect < COUNT) {
+        size_t n = ring.peek(batch, 16);
+        if (n == 0) {
+            std::this_thread::yield();
+            continue;
+        }
+        for (size_t k = 0; k < n; k++) inOrder = inOrder && batch[k] == expect + k;
+        ring.pop(n);
+        expect += n;
+    }
+    producer.join();
+
+    TEST_ASSERT_TRUE(inOrder);
+    TEST_ASSERT_EQUAL_UINT32(COUNT, expect);
+    TEST_ASSERT_EQUAL(0, ring.size());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_fills_and_counts_overruns);
+    RUN_TEST(test_unallocated_ring_refuses_records);
+    RUN_TEST(test_peek_leaves_records_until_pop);
+    RUN_TEST(test_wraps_around);
+    RUN_TEST(test_concurrent_producer_consumer);
+    return UNITY_END();
+}
@@ -0,0 +1,116 @@
+// ================================================================
+// SAMPLE SCHEDULE
+// ================================================================
+// Interval mode on a simulated esp_timer clock. Aligned mode reads
+// the host's wall clock, so it is checked through alignedAfter() and
+// for where the first slot lands.
+
+#include <unity.h>
+
+#include "sample_schedule.h"
+
+static const int64_t S = 1000000;
+static const int64_t DAY_S = 86400;
+static const int64_t MIDNIGHT = 20000 * DAY_S * S;   // A UTC midnight, in us
+
+void setUp() {}
+void tearDown() {}
+
+static void test_interval_slots_on_time() {
+    SampleSchedule sched;
+    sched.configure(SCHEDULE_INTERVAL, 1000, 0, SCHEDULE_SKIP, 0, 0);
+    TEST_ASSERT_EQUAL_INT64(1 * S, sched.deadlineUs());
+    TEST_ASSERT_EQUAL_UINT32(1000, sched.intervalMs());
+
+    TEST_ASSERT_FALSE(sched.due(S - 1));
+    TEST_ASSERT_TRUE(sched.due(S));
+    TEST_ASSERT_EQUAL_UINT32(0, sched.lateUs());
+    TEST_ASSERT_EQUAL_UINT32(0, sched.skipped());
+    TEST_ASSERT_FALSE(sched.due(S));
+
+    // A slow reading does not push the grid back
+    TEST_ASSERT_TRUE(sched.due(2 * S + 300000));
+    TEST_ASSERT_EQUAL_UINT32(300000, sched.lateUs());
+    TEST_ASSERT_EQUAL_INT64(3 * S, sched.deadlineUs());
+}
+
+static void test_skip_takes_latest_slot() {
+    SampleSchedule sched;
+    sched.configure(SCHEDULE_INTERVAL, 1000, 0, SCHEDULE_SKIP, 0, 0);
+    TEST_ASSERT_TRUE(sched.due(4 * S + S / 2));
+    TEST_ASSERT_EQUAL_UINT32(3, sched.skipped());
+    TEST_ASSERT_EQUAL_UINT32(S / 2, sched.lateUs());
+    TEST_ASSERT_EQUAL_INT64(5 * S, sched.deadlineUs());
+    TEST_ASSERT_FALSE(sched.due(4 * S + S / 2));
+}
+
+static void test_catch_up_runs_missed_slots() {
+    SampleSchedule sched;
+    sched.configure(SCHEDULE_INTERVAL, 1000, 0, SCHEDULE_CATCH_UP, 2, 0);
+    int64_t now = 5 * S + S / 2;   // Slots at 1..5 s are due
+
+    // 3, 4 and 5 s run back to back; 1 and 2 s are dropped
+    TEST_ASSERT_TRUE(sched.due(now));
+    TEST_ASSERT_EQUAL_UINT32(2, sched.skipped());
+    TEST_ASSERT_EQUAL_UINT32(2 * S + S / 2, sched.lateUs());
+    TEST_ASSERT_TRUE(sched.due(now));
+    TEST_ASSERT_EQUAL_UINT32(0, sched.skipped());
+    TEST_ASSERT_TRUE(sched.due(now));
+    TEST_ASSERT_EQUAL_UINT32(S / 2, sched.lateUs());
+    TEST_ASSERT_FALSE(sched.due(now));
+    TEST_ASSERT_EQUAL_INT64(6 * S, sched.deadlineUs());
+}
+
+static void test_zero_interval_is_clamped() {
+    SampleSchedule sched;
+    sched.configure(SCHEDULE_INTERVAL, 0, 0, SCHEDULE_SKIP, 0, 100);
+    TEST_ASSERT_EQUAL_UINT32(1, sched.intervalMs());
+    TEST_ASSERT_EQUAL_INT64(1100, sched.deadlineUs());
+}
+
+static void test_aligned_after() {
+    int64_t q = 900 * S;
+
+    // 00:07 UTC -> 00:15
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT + q, SampleSchedule::alignedAfter(MIDNIGHT + 420 * S, q, 0));
+    // Exactly on a slot moves to the next one
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT + 2 * q, SampleSchedule::alignedAfter(MIDNIGHT + q, q, 0));
+
+    // Hourly slots in a UTC+0:30 zone fall on half past, UTC
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT + 1800 * S,
+                            SampleSchedule::alignedAfter(MIDNIGHT + 420 * S, 3600 * S, 1800));
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT - 1800 * S,
+                            SampleSchedule::alignedAfter(MIDNIGHT - 2000 * S, 3600 * S, -1800));
+
+    // 7 h does not divide a day: the last slot is short and the grid
+    // restarts at midnight
+    int64_t seven = 7 * 3600 * S;
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT + DAY_S * S,
+                            SampleSchedule::alignedAfter(MIDNIGHT + 22 * 3600 * S, seven, 0));
+    TEST_ASSERT_EQUAL_INT64(MIDNIGHT + DAY_S * S + seven,
+                            SampleSchedule::alignedAfter(MIDNIGHT + DAY_S * S, seven, 0));
+}
+
+static void test_aligned_first_slot() {
+    if (SampleSchedule::wallNowUs() == 0) return;   // Host clock not set
+
+    SampleSchedule sched;
+    int64_t now = 50 * S;
+    sched.configure(SCHEDULE_ALIGNED, 10000, 0, SCHEDULE_SKIP, 0, now);
+    TEST_ASSERT_GREATER_THAN(now, sched.deadlineUs());
+    TEST_ASSERT_LESS_OR_EQUAL(now + 10 * S, sched.deadlineUs());
+
+    TEST_ASSERT_TRUE(sched.due(sched.deadlineUs() + 10 * S));
+    TEST_ASSERT_GREATER_THAN(0, sched.slotTime());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_interval_slots_on_time);
+    RUN_TEST(test_skip_takes_latest_slot);
+    RUN_TEST(test_catch_up_runs_missed_slots);
+    RUN_TEST(test_zero_interval_is_clamped);
+    RUN_TEST(test_aligned_after);
+    RUN_TEST(test_aligned_first_slot);
+    return UNITY_END();
+}
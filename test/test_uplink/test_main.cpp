@@ -0,0 +1,152 @@
+// ================================================================
+// UPLINK DELIVERY
+// ================================================================
+// The uplink task's drain (peek a batch, upload, pop what was
+// acknowledged) over the lossy HTTP and MQTT fakes. However the link
+// loses requests and replies, the server must end up with every
+// reading, with repeats only where an acknowledgement was lost.
+
+#include <unity.h>
+
+#include "sample_ring.h"
+#include "../support/lossy_transport.h"
+#include "../support/sample_series.h"
+
+static const size_t READINGS = 2000;
+static const size_t PASSES_MAX = 20000;
+
+static Sample series[READINGS];
+static Sample batch[128];
+
+void setUp() {
+    makeSeries(series, READINGS, 3, 60, 6, 11);
+}
+
+void tearDown() {}
+
+// Runs the drain until the ring is empty; false if it never gets there
+static bool drain(Transport& transport, SpscRing<Sample>& ring, size_t& passes) {
+    for (passes = 0; ring.size() > 0 && passes < PASSES_MAX; passes++) {
+        size_t n = ring.peek(batch, std::min(transport.batchLimit(), sizeof(batch) / sizeof(batch[0])));
+        ring.pop(transport.upload(batch, n));
+    }
+    return ring.size() == 0;
+}
+
+// Every reading at least once. With `ordered`, first deliveries come
+// in order and every repeat is of one already delivered (HTTP batches
+// are all or nothing); MQTT may deliver the rest of a window ahead of
+// a lost PUBLISH. Returns the number of repeats.
+static size_t checkDelivery(const FakeServer& server, bool ordered) {
+    static uint16_t seen[READINGS];
+    memset(seen, 0, sizeof(seen));
+    size_t next = 0;
+    for (const Sample& s : server.accepted) {
+        uint32_t i = (s.timestamp - SERIES_START) / 60;
+        TEST_ASSERT_TRUE(i < READINGS && sameSample(s, series[i]));
+        if (ordered) TEST_ASSERT_TRUE(i <= next);
+        if (i == next) next++;
+        seen[i]++;
+    }
+    size_t repeats = 0;
+    for (size_t i = 0; i < READINGS; i++) {
+        TEST_ASSERT_GREATER_THAN(0, seen[i]);
+        repeats += seen[i] - 1;
+    }
+    return repeats;
+}
+
+static void fill(SpscRing<Sample>& ring) {
+    ring.begin(4096, 4096);
+    for (size_t i = 0; i < READINGS; i++) ring.push(series[i]);
+}
+
+static void test_http_clean_link() {
+    LossyLink link({ 0, 0, 0, 0 }, 1);
+    FakeServer server;
+    FakeHttpTransport http(link, server);
+    SpscRing<Sample> ring;
+    fill(ring);
+
+    size_t passes;
+    TEST_ASSERT_TRUE(drain(http, ring, passes));
+    TEST_ASSERT_EQUAL(READINGS / 100, passes);
+    TEST_ASSERT_EQUAL(0, checkDelivery(server, true));
+    TEST_ASSERT_EQUAL(0, server.rejected);
+}
+
+static void test_http_lossy_link() {
+    LossyLink link({ 0.1, 0.1, 0.15, 0.05 }, 2);
+    FakeServer server;
+    FakeHttpTransport http(link, server);
+    SpscRing<Sample> ring;
+    fill(ring);
+
+    size_t passes;
+    TEST_ASSERT_TRUE(drain(http, ring, passes));
+    size_t repeats = checkDelivery(server, true);
+    TEST_ASSERT_GREATER_THAN(0, repeats);   // Lost replies do cost something
+    TEST_ASSERT_EQUAL(READINGS + repeats, server.accepted.size());
+}
+
+static void test_http_corrupt_body_is_not_acked() {
+    LossyLink link({ 0, 0, 0, 1 }, 6);
+    FakeServer server;
+    FakeHttpTransport http(link, server);
+
+    TEST_ASSERT_EQUAL(0, http.upload(series, 100));
+    TEST_ASSERT_EQUAL(1, server.rejected);
+    TEST_ASSERT_EQUAL(0, server.accepted.size());
+}
+
+static void test_http_small_bodies() {
+    // A body cap that splits batches well short of the record limit
+    LossyLink link({ 0, 0.2, 0.2, 0 }, 3);
+    FakeServer server;
+    FakeHttpTransport http(link, server, 300, 100);
+    SpscRing<Sample> ring;
+    fill(ring);
+
+    size_t passes;
+    TEST_ASSERT_TRUE(drain(http, ring, passes));
+    checkDelivery(server, true);
+    TEST_ASSERT_LESS_OR_EQUAL(300 * server.requests, server.bytes);
+}
+
+static void test_mqtt_clean_link() {
+    LossyLink link({ 0, 0, 0, 0 }, 4);
+    FakeServer server;
+    FakeMqttTransport mqtt(link, server);
+    SpscRing<Sample> ring;
+    fill(ring);
+
+    size_t passes;
+    TEST_ASSERT_TRUE(drain(mqtt, ring, passes));
+    TEST_ASSERT_EQUAL(0, checkDelivery(server, true));
+    TEST_ASSERT_EQUAL(READINGS, server.requests);
+}
+
+static void test_mqtt_lossy_link() {
+    LossyLink link({ 0.1, 0.02, 0.02, 0 }, 5);
+    FakeServer server;
+    FakeMqttTransport mqtt(link, server);
+    SpscRing<Sample> ring;
+    fill(ring);
+
+    size_t passes;
+    TEST_ASSERT_TRUE(drain(mqtt, ring, passes));
+    size_t repeats = checkDelivery(server, false);
+    TEST_ASSERT_GREATER_THAN(0, repeats);
+    TEST_ASSERT_EQUAL(READINGS + repeats, server.accepted.size());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_http_clean_link);
+    RUN_TEST(test_http_lossy_link);
+    RUN_TEST(test_http_corrupt_body_is_not_acked);
+    RUN_TEST(test_http_small_bodies);
+    RUN_TEST(test_mqtt_clean_link);
+    RUN_TEST(test_mqtt_lossy_link);
+    return UNITY_END();
+}